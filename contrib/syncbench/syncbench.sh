@@ -0,0 +1,73 @@
+#!/bin/bash
+# Times a fresh node syncing a chain from a local node, with the legacy
+# getblocks download and with the headers-first download.
+#
+# Usage: syncbench.sh <netcoind> <blocks.dat> [extra netcoind args]
+#
+# <blocks.dat> is a block file (blk0001.dat format) holding the chain to
+# sync, e.g. one written by a testnet node that mined a chain on its own.
+# The source node imports it with -loadblock, then a new node with an empty
+# data directory connects to it, once for each download mode.
+
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <netcoind> <blocks.dat> [extra netcoind args]"
+    exit 1
+fi
+
+NETCOIND=$(readlink -f "$1")
+BLOCKS=$(readlink -f "$2")
+shift 2
+EXTRA="$@"
+
+WORKDIR=$(mktemp -d)
+SRCPORT=19611
+SRCRPC=19612
+DSTPORT=19621
+DSTRPC=19622
+RPCARGS="-rpcuser=syncbench -rpcpassword=syncbench"
+
+cleanup()
+{
+    $NETCOIND -testnet -datadir=$WORKDIR/src $RPCARGS -rpcport=$SRCRPC stop >/dev/null 2>&1 || true
+    $NETCOIND -testnet -datadir=$WORKDIR/dst $RPCARGS -rpcport=$DSTRPC stop >/dev/null 2>&1 || true
+    sleep 2
+    rm -rf $WORKDIR
+}
+trap cleanup EXIT
+
+blockcount()
+{
+    $NETCOIND -testnet -datadir=$1 $RPCARGS -rpcport=$2 getblockcount 2>/dev/null || echo -1
+}
+
+# Source node: import the chain and wait until it is connected
+mkdir -p $WORKDIR/src
+$NETCOIND -testnet -daemon -datadir=$WORKDIR/src $RPCARGS -port=$SRCPORT -rpcport=$SRCRPC \
+    -listen -connect=0 -loadblock=$BLOCKS $EXTRA
+LAST=-1
+while true; do
+    sleep 5
+    HEIGHT=$(blockcount $WORKDIR/src $SRCRPC)
+    if [ "$HEIGHT" -ge 0 ] && [ "$HEIGHT" = "$LAST" ]; then break; fi
+    LAST=$HEIGHT
+done
+echo "source node at height $HEIGHT"
+
+for MODE in 0 1; do
+    rm -rf $WORKDIR/dst
+    mkdir -p $WORKDIR/dst
+    START=$(date +%s.%N)
+    $NETCOIND -testnet -daemon -datadir=$WORKDIR/dst $RPCARGS -port=$DSTPORT -rpcport=$DSTRPC \
+        -listen=0 -connect=127.0.0.1:$SRCPORT -headersfirst=$MODE $EXTRA
+    while [ "$(blockcount $WORKDIR/dst $DSTRPC)" -lt "$HEIGHT" ]; do
+        sleep 0.2
+    done
+    END=$(date +%s.%N)
+    echo "headersfirst=$MODE: synced $HEIGHT blocks in $(echo "$END - $START" | bc) s"
+    $NETCOIND -testnet -datadir=$WORKDIR/dst $RPCARGS -rpcport=$DSTRPC stop >/dev/null
+    while $NETCOIND -testnet -datadir=$WORKDIR/dst $RPCARGS -rpcport=$DSTRPC getblockcount >/dev/null 2>&1; do
+        sleep 1
+    done
+done
@@ -91,6 +91,14 @@ contains(USE_UPNP, -) {
     win32:LIBS += -liphlpapi
 }
 
+# use: qmake "USE_LEVELDB=1" (transaction index in LevelDB instead of blkindex.dat)
+contains(USE_LEVELDB, 1) {
+    message(Building with LevelDB transaction index)
+    DEFINES += USE_LEVELDB
+    INCLUDEPATH += $$LEVELDB_INCLUDE_PATH
+    LIBS += $$join(LEVELDB_LIB_PATH,,-L,) -lleveldb
+}
+
 # use: qmake "USE_DBUS=1"
 contains(USE_DBUS, 1) {
     message(Building with DBUS (Freedesktop notifications) support)
@@ -213,6 +221,7 @@ HEADERS += src/qt/bitcoingui.h \
     src/base58.h \
     src/bignum.h \
     src/checkpoints.h \
+    src/checkqueue.h \
     src/compat.h \
     src/coincontrol.h \
     src/sync.h \
@@ -0,0 +1,26 @@
+#ifndef BITCOIN_BENCH_H
+#define BITCOIN_BENCH_H
+
+#include <string>
+
+/** A benchmark reports what it measured and checks nothing; correctness
+ * belongs in test_netcoin.
+ */
+typedef void (*BenchFunction)();
+
+class CBenchRegistration
+{
+public:
+    CBenchRegistration(const char* pszName, BenchFunction fn);
+};
+
+/** Defines a benchmark that bench_netcoin runs by name */
+#define BENCHMARK(name) \
+    static void name(); \
+    static CBenchRegistration name##_registration(#name, name); \
+    static void name()
+
+/** Ends the running benchmark when its setup fails */
+void BenchFail(const std::string& strReason);
+
+#endif
@@ -0,0 +1,87 @@
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+#include "bench.h"
+#include "main.h"
+#include "wallet.h"
+
+using namespace std;
+
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+
+extern bool fPrintToConsole;
+extern void noui_connect();
+
+static map<string, BenchFunction>& GetBenchmarks()
+{
+    static map<string, BenchFunction> mapBenchmarks;
+    return mapBenchmarks;
+}
+
+CBenchRegistration::CBenchRegistration(const char* pszName, BenchFunction fn)
+{
+    GetBenchmarks()[pszName] = fn;
+}
+
+void BenchFail(const string& strReason)
+{
+    throw runtime_error(strReason);
+}
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+void StartShutdown()
+{
+    exit(0);
+}
+
+// Usage: bench_netcoin [name ...]
+// Runs the benchmarks named, or all of them
+int main(int argc, char* argv[])
+{
+    fPrintToConsole = true;
+    noui_connect();
+    pwalletMain = new CWallet();
+    RegisterWallet(pwalletMain);
+
+    map<string, BenchFunction>& mapBenchmarks = GetBenchmarks();
+    for (int i = 1; i < argc; i++)
+    {
+        if (!mapBenchmarks.count(argv[i]))
+        {
+            fprintf(stderr, "bench_netcoin: no benchmark %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    int nFailed = 0;
+    for (map<string, BenchFunction>::iterator mi = mapBenchmarks.begin(); mi != mapBenchmarks.end(); ++mi)
+    {
+        bool fRun = (argc == 1);
+        for (int i = 1; i < argc; i++)
+            fRun |= ((*mi).first == argv[i]);
+        if (!fRun)
+            continue;
+
+        printf("%s\n", (*mi).first.c_str());
+        try
+        {
+            (*mi).second();
+        }
+        catch (std::exception& e)
+        {
+            printf("  FAILED: %s\n", e.what());
+            nFailed++;
+        }
+    }
+
+    UnregisterWallet(pwalletMain);
+    delete pwalletMain;
+    return nFailed ? 1 : 0;
+}
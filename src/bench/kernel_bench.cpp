@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <vector>
+#include <boost/foreach.hpp>
+
+#include "bench.h"
+#include "kernel.h"
+#include "util.h"
+
+using namespace std;
+
+// Synthetic main chain: one block a minute, a new stake modifier every 10 minutes
+class CBenchChain
+{
+public:
+    vector<CBlockIndex*> vIndex;
+
+    CBenchChain(int nBlocks)
+    {
+        int64_t nTimeStart = GetAdjustedTime() - (int64_t)nBlocks * 60 - 30 * 24 * 60 * 60;
+        for (int i = 0; i < nBlocks; i++)
+        {
+            CBlockIndex* pindex = new CBlockIndex();
+            pindex->nHeight = i;
+            pindex->nTime = nTimeStart + i * 60;
+            pindex->SetStakeModifier(i, i % 10 == 0);
+            if (i > 0)
+            {
+                pindex->pprev = vIndex.back();
+                vIndex.back()->pnext = pindex;
+            }
+            uint256 hash = i + 1;
+            pindex->phashBlock = &(mapBlockIndex.insert(make_pair(hash, pindex)).first->first);
+            vIndex.push_back(pindex);
+        }
+        pindexBest = vIndex.back();
+        nBestHeight = pindexBest->nHeight;
+    }
+
+    ~CBenchChain()
+    {
+        InvalidateKernelModifierCache(-1);
+        BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+        {
+            mapBlockIndex.erase(pindex->GetBlockHash());
+            delete pindex;
+        }
+        pindexBest = NULL;
+        nBestHeight = -1;
+    }
+
+    // Walk pnext as GetKernelStakeModifier did before the cache
+    const CBlockIndex* Walk(const CBlockIndex* pindexFrom) const
+    {
+        int64_t nSelectionInterval = 0;
+        for (int nSection=0; nSection<64; nSection++)
+            nSelectionInterval += nModifierInterval * 63 / (63 + ((63 - nSection) * (MODIFIER_INTERVAL_RATIO - 1)));
+        int64_t nStakeModifierTime = pindexFrom->GetBlockTime();
+        const CBlockIndex* pindex = pindexFrom;
+        while (nStakeModifierTime < pindexFrom->GetBlockTime() + nSelectionInterval)
+        {
+            if (!pindex->pnext)
+                return NULL;
+            pindex = pindex->pnext;
+            if (pindex->GeneratedStakeModifier())
+                nStakeModifierTime = pindex->GetBlockTime();
+        }
+        return pindex;
+    }
+};
+
+// Stake modifier lookups for every block of a million-block index: the
+// pnext walk, then GetKernelStakeModifier filling and hitting its cache
+BENCHMARK(kernel_modifier_lookup)
+{
+    static const int nBlocks = 1000000;
+    CBenchChain chain(nBlocks);
+
+    int64_t nStart = GetTimeMicros();
+    int nFound = 0;
+    for (int i = 0; i < nBlocks; i++)
+        nFound += (chain.Walk(chain.vIndex[i]) != NULL);
+    printf("  walk: %d blocks, %"PRI64d" us\n", nBlocks, GetTimeMicros() - nStart);
+
+    for (int nPass = 0; nPass < 2; nPass++)
+    {
+        nStart = GetTimeMicros();
+        int nCached = 0;
+        for (int i = 0; i < nBlocks; i++)
+        {
+            uint64_t nStakeModifier = 0;
+            const CBlockIndex* pindexModifier = NULL;
+            nCached += GetKernelStakeModifier(chain.vIndex[i]->GetBlockHash(), nStakeModifier, pindexModifier);
+        }
+        if (nCached != nFound)
+            BenchFail("GetKernelStakeModifier disagrees with the walk");
+        printf("  %s: %d blocks, %"PRI64d" us\n", nPass == 0 ? "cache fill" : "cached", nBlocks, GetTimeMicros() - nStart);
+    }
+}
+
+// One CheckStakeKernelHash per second, as the wallet searched before
+// ScanStakeKernelHash
+static bool WalkStakeKernelHash(unsigned int nBits, uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, const COutPoint& prevout, int64_t nValueIn, unsigned int nTimeTxFrom, unsigned int nCount, unsigned int& nTimeTxRet, uint256& hashProofOfStake, uint256& targetProofOfStake)
+{
+    for (unsigned int n = 0; n < nCount; n++)
+    {
+        if (CheckStakeKernelHash(nBits, nStakeModifier, nTimeBlockFrom, nTxPrevOffset, prevout, nValueIn, nTimeTxFrom - n, hashProofOfStake, targetProofOfStake))
+        {
+            nTimeTxRet = nTimeTxFrom - n;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Kernels hashed per second against a target nothing meets, so every
+// timestamp is hashed
+BENCHMARK(kernel_scan)
+{
+    static const unsigned int nScan = 1000000;
+    static const unsigned int nWalk = 100000;
+    unsigned int nBits = 0x03000001;
+    unsigned int nTimeTxFrom = 1400000000;
+    unsigned int nTimeBlockFrom = nTimeTxFrom - nStakeMinAge - nScan;
+    COutPoint prevout(GetRandHash(), 0);
+    unsigned int nTime = 0;
+    uint256 hash = 0, target = 0;
+
+    int64_t nStart = GetTimeMicros();
+    if (WalkStakeKernelHash(nBits, 0x0123456789abcdefULL, nTimeBlockFrom, 1000, prevout, 1000 * COIN, nTimeTxFrom, nWalk, nTime, hash, target))
+        BenchFail("kernel met an unreachable target");
+    int64_t nElapsed = std::max(GetTimeMicros() - nStart, (int64_t)1);
+    printf("  CheckStakeKernelHash: %u kernels, %"PRI64d" us, %"PRI64d" kernels/s\n",
+           nWalk, nElapsed, (int64_t)nWalk * 1000000 / nElapsed);
+
+    nStart = GetTimeMicros();
+    if (ScanStakeKernelHash(nBits, 0x0123456789abcdefULL, nTimeBlockFrom, 1000, prevout, 1000 * COIN, nTimeTxFrom, nScan, nTime, hash, target))
+        BenchFail("kernel met an unreachable target");
+    nElapsed = std::max(GetTimeMicros() - nStart, (int64_t)1);
+    printf("  ScanStakeKernelHash: %u kernels, %"PRI64d" us, %"PRI64d" kernels/s\n",
+           nScan, nElapsed, (int64_t)nScan * 1000000 / nElapsed);
+}
@@ -0,0 +1,72 @@
+#include <openssl/rand.h>
+#include <algorithm>
+#include <vector>
+
+#include "bench.h"
+#include "keystore.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+// Exposes the encryption calls CWallet makes around its master key
+class CBenchCryptoKeyStore : public CCryptoKeyStore
+{
+public:
+    bool EncryptKeys(CKeyingMaterial& vMasterKeyIn) { return CCryptoKeyStore::EncryptKeys(vMasterKeyIn); }
+    bool Unlock(const CKeyingMaterial& vMasterKeyIn) { return CCryptoKeyStore::Unlock(vMasterKeyIn); }
+};
+
+static void MakeKeyStore(CBenchCryptoKeyStore& keystore, vector<CKeyID>& vKeyIDs, unsigned int nKeys, bool fEncrypt)
+{
+    vKeyIDs.clear();
+    for (unsigned int i = 0; i < nKeys; i++)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        if (!keystore.AddKey(key))
+            BenchFail("AddKey failed");
+        vKeyIDs.push_back(key.GetPubKey().GetID());
+    }
+    if (fEncrypt)
+    {
+        CKeyingMaterial vMasterKey(32);
+        RAND_bytes(&vMasterKey[0], 32);
+        if (!keystore.EncryptKeys(vMasterKey) || !keystore.Unlock(vMasterKey))
+            BenchFail("encrypting the key store failed");
+    }
+}
+
+// Signs 10k inputs spread over a handful of keys, as staking and batch
+// sends do, with and without encryption and the key cache
+BENCHMARK(keystore_sign)
+{
+    static const unsigned int nInputs = 10000;
+    static const unsigned int nKeys = 10;
+
+    uint256 hash = GetRandHash();
+    for (int nEncrypt = 0; nEncrypt < 2; nEncrypt++)
+    {
+        CBenchCryptoKeyStore keystore;
+        vector<CKeyID> vKeyIDs;
+        MakeKeyStore(keystore, vKeyIDs, nKeys, nEncrypt == 1);
+
+        for (int nCache = 0; nCache < 2; nCache++)
+        {
+            keystore.SetKeyCacheSize(nCache ? DEFAULT_KEY_CACHE_SIZE : 0);
+
+            int64_t nStart = GetTimeMillis();
+            for (unsigned int i = 0; i < nInputs; i++)
+            {
+                CKey key;
+                vector<unsigned char> vchSig;
+                if (!keystore.GetKey(vKeyIDs[i % nKeys], key) || !key.Sign(hash, vchSig))
+                    BenchFail("signing failed");
+            }
+            int64_t nElapsed = std::max(GetTimeMillis() - nStart, (int64_t)1);
+            printf("  %u signatures, %s wallet, key cache %s: %"PRI64d"ms, %"PRI64d" signatures/s\n",
+                   nInputs, nEncrypt ? "encrypted" : "unencrypted", nCache ? "on" : "off",
+                   nElapsed, (int64_t)nInputs * 1000 / nElapsed);
+        }
+    }
+}
@@ -0,0 +1,68 @@
+#include <algorithm>
+#include <vector>
+
+#include "bench.h"
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+#ifndef WIN32
+// Pushes 1 MB blocks from one peer to another over a loopback connection
+BENCHMARK(net_block_throughput)
+{
+    static const int nBlocks = 64;
+    static const unsigned int nBlockSize = 1000000;
+
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (hListen == INVALID_SOCKET)
+        BenchFail("socket failed");
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sockaddr);
+    if (bind(hListen, (struct sockaddr*)&sockaddr, len) != 0 || listen(hListen, 1) != 0 ||
+        getsockname(hListen, (struct sockaddr*)&sockaddr, &len) != 0)
+        BenchFail("loopback listen failed");
+    SOCKET hConnect = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (hConnect == INVALID_SOCKET || connect(hConnect, (struct sockaddr*)&sockaddr, len) != 0)
+        BenchFail("loopback connect failed");
+    SOCKET hAccept = accept(hListen, NULL, NULL);
+    if (hAccept == INVALID_SOCKET)
+        BenchFail("loopback accept failed");
+    closesocket(hListen);
+
+    CNode nodeFrom(hConnect, CAddress(), "", true);
+    CNode nodeTo(hAccept, CAddress(), "", true);
+
+    vector<char> vBlock(nBlockSize);
+    for (unsigned int i = 0; i < nBlockSize; i++)
+        vBlock[i] = (char)(i * 7);
+
+    int64_t nStart = GetTimeMillis();
+    for (int i = 0; i < nBlocks; i++)
+        nodeFrom.PushMessage("block", vBlock);
+
+    int nReceived = 0;
+    while (nReceived < nBlocks && GetTimeMillis() - nStart < 60000)
+    {
+        {
+            LOCK(nodeFrom.cs_vSend);
+            SocketSendData(&nodeFrom);
+        }
+        LOCK(nodeTo.cs_vRecv);
+        bool fMore;
+        SocketRecvData(&nodeTo, fMore);
+        while (!nodeTo.vRecvMsg.empty() && nodeTo.vRecvMsg.front().IsComplete())
+        {
+            nodeTo.PopRecvMessage();
+            nReceived++;
+        }
+    }
+    int64_t nElapsed = std::max(GetTimeMillis() - nStart, (int64_t)1);
+
+    printf("  %d of %d x 1 MB blocks over loopback: %"PRI64d"ms, %"PRI64d" MB/s\n",
+           nReceived, nBlocks, nElapsed, nReceived * (int64_t)1000 / nElapsed);
+}
+#endif
@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <vector>
+#include <time.h>
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
+#include "bench.h"
+#include "netbase.h"
+#include "util.h"
+
+using namespace std;
+
+#ifndef WIN32
+static void ConnectLoopbackPeers(SOCKET hListen, const struct sockaddr_in& addrListen, int nPeers, CSocketEvents& events, vector<SOCKET>& vLocal, vector<SOCKET>& vRemote)
+{
+    while ((int)vLocal.size() < nPeers)
+    {
+        SOCKET hRemote = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (hRemote == INVALID_SOCKET || connect(hRemote, (const struct sockaddr*)&addrListen, sizeof(addrListen)) != 0)
+            BenchFail("loopback connect failed");
+        SOCKET hLocal = accept(hListen, NULL, NULL);
+        if (hLocal == INVALID_SOCKET || !events.Add(hLocal))
+            BenchFail("loopback accept failed");
+        vLocal.push_back(hLocal);
+        vRemote.push_back(hRemote);
+    }
+}
+
+// CPU time the socket handler's wait takes to wake up for one active peer
+// with more and more idle loopback peers registered next to it
+BENCHMARK(socketevents_idle_peers)
+{
+    static const int nPeerCounts[] = { 250, 1000, 4000 };
+    static const int nRounds = 2000;
+
+    // Every peer takes two descriptors in this process
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        BenchFail("getrlimit failed");
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < 2 * 4000 + 64)
+    {
+        limit.rlim_cur = (limit.rlim_max == RLIM_INFINITY) ? 2 * 4000 + 64 : std::min(limit.rlim_max, (rlim_t)(2 * 4000 + 64));
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    int nMaxPeers = (limit.rlim_cur == RLIM_INFINITY) ? 4000 : ((int)limit.rlim_cur - 64) / 2;
+
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (hListen == INVALID_SOCKET)
+        BenchFail("socket failed");
+    struct sockaddr_in addrListen;
+    memset(&addrListen, 0, sizeof(addrListen));
+    addrListen.sin_family = AF_INET;
+    addrListen.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addrListen.sin_port = 0;
+    socklen_t len = sizeof(addrListen);
+    if (bind(hListen, (struct sockaddr*)&addrListen, sizeof(addrListen)) != 0 ||
+        listen(hListen, SOMAXCONN) != 0 ||
+        getsockname(hListen, (struct sockaddr*)&addrListen, &len) != 0)
+        BenchFail("loopback listen failed");
+
+    CSocketEvents events;
+    if (!events.Init())
+        BenchFail("CSocketEvents::Init failed");
+    vector<SOCKET> vLocal, vRemote;
+    vector<CSocketEvents::CEvent> vEvents;
+    for (unsigned int n = 0; n < sizeof(nPeerCounts) / sizeof(nPeerCounts[0]); n++)
+    {
+        int nPeers = nPeerCounts[n];
+        if (nPeers > nMaxPeers)
+        {
+            printf("  skipping %d loopback peers, only %d descriptors\n", nPeers, (int)limit.rlim_cur);
+            break;
+        }
+        ConnectLoopbackPeers(hListen, addrListen, nPeers, events, vLocal, vRemote);
+
+        // Drain the initial writability reports
+        do {
+            events.Wait(0, vEvents);
+        } while (!vEvents.empty());
+
+        int nMissed = 0;
+        clock_t nStart = clock();
+        for (int i = 0; i < nRounds; i++)
+        {
+            int nActive = (i * 7919) % nPeers;
+            send(vRemote[nActive], "x", 1, 0);
+            if (!events.Wait(1000, vEvents) || vEvents.size() != 1 || vEvents[0].hSocket != vLocal[nActive])
+                nMissed++;
+            char c;
+            recv(vLocal[nActive], &c, 1, 0);
+        }
+        clock_t nCpu = clock() - nStart;
+        printf("  %d loopback peers: %.1fms CPU for %d wakeups%s\n", nPeers, 1000.0 * nCpu / CLOCKS_PER_SEC, nRounds,
+               nMissed ? strprintf(", %d without the one event expected", nMissed).c_str() : "");
+    }
+
+    for (unsigned int i = 0; i < vLocal.size(); i++)
+    {
+        events.Remove(vLocal[i]);
+        closesocket(vLocal[i]);
+        closesocket(vRemote[i]);
+    }
+    closesocket(hListen);
+}
+#endif
@@ -28,6 +28,7 @@
 #include <boost/asio/ssl.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
 #include <list>
 
 #define printf OutputDebugStringF
@@ -43,7 +44,12 @@ static std::string strRPCUserColonPass;
 
 const Object emptyobj;
 
-void ThreadRPCServer3(void* parg);
+void ThreadRPCWorker(void* parg);
+
+static const int DEFAULT_RPC_THREADS = 4;
+static const int DEFAULT_RPC_WORKQUEUE = 16;
+static const size_t MAX_RPC_HEADER_SIZE = 65536;
+static const int RPC_SHUTDOWN_TIMEOUT = 5;  // seconds to write the replies still due at shutdown
 
 static inline unsigned short GetDefaultRPCPort()
 {
@@ -247,10 +253,13 @@ static const CRPCCommand vRPCCommands[] =
     { "getblockcount",          &getblockcount,          true,   false },
     { "getconnectioncount",     &getconnectioncount,     true,   false },
     { "getpeerinfo",            &getpeerinfo,            true,   false },
+    { "getrpcinfo",             &getrpcinfo,             true,   true },
+    { "getcompactblockinfo",    &getcompactblockinfo,    true,   false },
     { "getdifficulty",          &getdifficulty,          true,   false },
     { "getinfo",                &getinfo,                true,   false },
     { "getmininginfo",          &getmininginfo,          true,   false },
     { "getstakinginfo",         &getstakinginfo,         true,   false },
+    { "gettemplatecacheinfo",   &gettemplatecacheinfo,   true,   false },
     { "getnewaddress",          &getnewaddress,          true,   false },
     { "getnewpubkey",           &getnewpubkey,           true,   false },
     { "getaccountaddress",      &getaccountaddress,      true,   false },
@@ -277,6 +286,10 @@ static const CRPCCommand vRPCCommands[] =
     { "addmultisigaddress",     &addmultisigaddress,     false,  false },
     { "addredeemscript",        &addredeemscript,        false,  false },
     { "getrawmempool",          &getrawmempool,          true,   false },
+    { "getmempoolinfo",         &getmempoolinfo,         true,   false },
+    { "getsigcacheinfo",        &getsigcacheinfo,        true,   false },
+    { "gettxdbcacheinfo",       &gettxdbcacheinfo,       true,   false },
+    { "getsyncinfo",            &getsyncinfo,            true,   false },
     { "getblock",               &getblock,               false,  false },
     { "getblockbynumber",       &getblockbynumber,       false,  false },
     { "getblockhash",           &getblockhash,           false,  false },
@@ -395,6 +408,7 @@ static string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
     else if (nStatus == HTTP_FORBIDDEN) cStatus = "Forbidden";
     else if (nStatus == HTTP_NOT_FOUND) cStatus = "Not Found";
     else if (nStatus == HTTP_INTERNAL_SERVER_ERROR) cStatus = "Internal Server Error";
+    else if (nStatus == HTTP_SERVICE_UNAVAILABLE) cStatus = "Service Unavailable";
     else cStatus = "";
     return strprintf(
             "HTTP/1.1 %d %s\r\n"
@@ -454,6 +468,20 @@ int ReadHTTPHeader(std::basic_istream<char>& stream, map<string, string>& mapHea
     return nLen;
 }
 
+// Without an explicit Connection header, HTTP/1.1 keeps the connection alive
+static void SetHTTPConnectionDefault(map<string, string>& mapHeaders, int nProto)
+{
+    string sConHdr = mapHeaders["connection"];
+
+    if ((sConHdr != "close") && (sConHdr != "keep-alive"))
+    {
+        if (nProto >= 1)
+            mapHeaders["connection"] = "keep-alive";
+        else
+            mapHeaders["connection"] = "close";
+    }
+}
+
 int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet)
 {
     mapHeadersRet.clear();
@@ -476,15 +504,7 @@ int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRe
         strMessageRet = string(vch.begin(), vch.end());
     }
 
-    string sConHdr = mapHeadersRet["connection"];
-
-    if ((sConHdr != "close") && (sConHdr != "keep-alive"))
-    {
-        if (nProto >= 1)
-            mapHeadersRet["connection"] = "keep-alive";
-        else
-            mapHeadersRet["connection"] = "close";
-    }
+    SetHTTPConnectionDefault(mapHeadersRet, nProto);
 
     return nStatus;
 }
@@ -536,15 +556,20 @@ string JSONRPCReply(const Value& result, const Value& error, const Value& id)
     return write_string(Value(reply), false) + "\n";
 }
 
-void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
+static string HTTPErrorReply(const Object& objError, const Value& id)
 {
-    // Send error reply from json-rpc error object
+    // Error reply from json-rpc error object
     int nStatus = HTTP_INTERNAL_SERVER_ERROR;
     int code = find_value(objError, "code").get_int();
     if (code == RPC_INVALID_REQUEST) nStatus = HTTP_BAD_REQUEST;
     else if (code == RPC_METHOD_NOT_FOUND) nStatus = HTTP_NOT_FOUND;
     string strReply = JSONRPCReply(Value::null, objError, id);
-    stream << HTTPReply(nStatus, strReply, false) << std::flush;
+    return HTTPReply(nStatus, strReply, false);
+}
+
+void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
+{
+    stream << HTTPErrorReply(objError, id) << std::flush;
 }
 
 bool ClientAllowed(const boost::asio::ip::address& address)
@@ -623,51 +648,196 @@ private:
     asio::ssl::stream<typename Protocol::socket>& stream;
 };
 
-class AcceptedConnection
-{
-public:
-    virtual ~AcceptedConnection() {}
+class CRPCConnection;
+static bool QueueRPCRequest(const boost::shared_ptr<CRPCConnection>& conn);
 
-    virtual std::iostream& stream() = 0;
-    virtual std::string peer_address_to_string() const = 0;
-    virtual void close() = 0;
-};
+// Requests read off the wire waiting for a worker, at most -rpcworkqueue
+static deque<boost::shared_ptr<CRPCConnection> > vRPCWorkQueue;
+static CWaitableCriticalSection csRPCWorkQueue;
+static boost::condition_variable condRPCWorkQueue;
+static size_t nRPCWorkQueueMax = DEFAULT_RPC_WORKQUEUE;
+static int nRPCThreads = 0;
+static int nRPCActive = 0;
+static uint64_t nRPCRejected = 0;
+static int nRPCWritesPending = 0;          // listener thread only
 
-template <typename Protocol>
-class AcceptedConnectionImpl : public AcceptedConnection
+/**
+ * A JSON-RPC client connection.  Requests are read and replies written
+ * asynchronously by the listener thread; in between, a request waits in the
+ * work queue and runs on a worker, so an idle keep-alive connection costs no
+ * thread.
+ */
+class CRPCConnection : public boost::enable_shared_from_this<CRPCConnection>
 {
 public:
-    AcceptedConnectionImpl(
-            asio::io_service& io_service,
-            ssl::context &context,
-            bool fUseSSL) :
+    asio::ssl::stream<ip::tcp::socket> sslStream;
+    ip::tcp::endpoint peer;
+
+    // request being handled, written by the listener and read by one worker
+    map<string, string> mapHeaders;
+    string strRequest;
+
+    CRPCConnection(asio::io_service& io_service, ssl::context& context, bool fUseSSLIn) :
         sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
-        _stream(_d)
+        bufRead(MAX_RPC_HEADER_SIZE),
+        timerAuth(io_service)
     {
+        fUseSSL = fUseSSLIn;
+        fKeepAlive = false;
     }
 
-    virtual std::iostream& stream()
+    void Start()
     {
-        return _stream;
+        if (fUseSSL)
+            sslStream.async_handshake(ssl::stream_base::server,
+                boost::bind(&CRPCConnection::HandleHandshake, shared_from_this(), asio::placeholders::error));
+        else
+            ReadHeader();
     }
 
-    virtual std::string peer_address_to_string() const
+    // Called from a worker, the reply is sent by the listener thread
+    void Reply(const string& strReplyIn, bool fKeepAliveIn)
     {
-        return peer.address().to_string();
+        sslStream.get_io_service().post(
+            boost::bind(&CRPCConnection::WriteReply, shared_from_this(), strReplyIn, fKeepAliveIn));
     }
 
-    virtual void close()
+    void WriteReply(const string& strReplyIn, bool fKeepAliveIn)
     {
-        _stream.close();
+        strReply = strReplyIn;
+        fKeepAlive = fKeepAliveIn;
+        nRPCWritesPending++;
+        if (fUseSSL)
+            asio::async_write(sslStream, asio::buffer(strReply),
+                boost::bind(&CRPCConnection::HandleWrite, shared_from_this(), asio::placeholders::error));
+        else
+            asio::async_write(sslStream.next_layer(), asio::buffer(strReply),
+                boost::bind(&CRPCConnection::HandleWrite, shared_from_this(), asio::placeholders::error));
     }
 
-    typename Protocol::endpoint peer;
-    asio::ssl::stream<typename Protocol::socket> sslStream;
+    void Close()
+    {
+        boost::system::error_code error;
+        sslStream.lowest_layer().close(error);
+    }
 
 private:
-    SSLIOStreamDevice<Protocol> _d;
-    iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
+    asio::streambuf bufRead;
+    asio::deadline_timer timerAuth;
+    vector<char> vchBody;
+    string strReply;
+    bool fUseSSL;
+    bool fKeepAlive;
+
+    void HandleHandshake(const boost::system::error_code& error)
+    {
+        if (error)
+            Close();
+        else
+            ReadHeader();
+    }
+
+    void ReadHeader()
+    {
+        mapHeaders.clear();
+        strRequest.clear();
+        if (fUseSSL)
+            asio::async_read_until(sslStream, bufRead, "\r\n\r\n",
+                boost::bind(&CRPCConnection::HandleHeader, shared_from_this(), asio::placeholders::error));
+        else
+            asio::async_read_until(sslStream.next_layer(), bufRead, "\r\n\r\n",
+                boost::bind(&CRPCConnection::HandleHeader, shared_from_this(), asio::placeholders::error));
+    }
+
+    void HandleHeader(const boost::system::error_code& error)
+    {
+        if (error || fShutdown)
+        {
+            Close();
+            return;
+        }
+
+        std::istream stream(&bufRead);
+        int nProto = 0;
+        ReadHTTPStatus(stream, nProto);
+        int nLen = ReadHTTPHeader(stream, mapHeaders);
+        if (nLen < 0 || nLen > (int)MAX_SIZE)
+        {
+            Close();
+            return;
+        }
+        SetHTTPConnectionDefault(mapHeaders, nProto);
+
+        // Some or all of the body came in with the header
+        vchBody.resize(nLen);
+        size_t nHave = std::min(bufRead.size(), (size_t)nLen);
+        if (nHave > 0)
+            stream.read(&vchBody[0], nHave);
+        if (nHave == (size_t)nLen)
+            HandleBody(boost::system::error_code());
+        else if (fUseSSL)
+            asio::async_read(sslStream, asio::buffer(&vchBody[nHave], nLen - nHave),
+                boost::bind(&CRPCConnection::HandleBody, shared_from_this(), asio::placeholders::error));
+        else
+            asio::async_read(sslStream.next_layer(), asio::buffer(&vchBody[nHave], nLen - nHave),
+                boost::bind(&CRPCConnection::HandleBody, shared_from_this(), asio::placeholders::error));
+    }
+
+    void HandleBody(const boost::system::error_code& error)
+    {
+        if (error || fShutdown)
+        {
+            Close();
+            return;
+        }
+        strRequest.assign(vchBody.begin(), vchBody.end());
+        vector<char>().swap(vchBody);
+
+        // Check authorization before the request may take a place in the
+        // work queue
+        if (mapHeaders.count("authorization") == 0)
+        {
+            WriteReply(HTTPReply(HTTP_UNAUTHORIZED, "", false), false);
+            return;
+        }
+        if (!HTTPAuthorized(mapHeaders))
+        {
+            printf("ThreadRPCServer incorrect password attempt from %s\n", peer.address().to_string().c_str());
+            /* Deter brute-forcing short passwords.
+               If this results in a DOS the user really
+               shouldn't have their RPC port exposed.*/
+            if (mapArgs["-rpcpassword"].size() < 20)
+            {
+                timerAuth.expires_from_now(boost::posix_time::milliseconds(250));
+                timerAuth.async_wait(
+                    boost::bind(&CRPCConnection::HandleAuthDelay, shared_from_this(), asio::placeholders::error));
+            }
+            else
+                WriteReply(HTTPReply(HTTP_UNAUTHORIZED, "", false), false);
+            return;
+        }
+
+        if (!QueueRPCRequest(shared_from_this()))
+            WriteReply(HTTPReply(HTTP_SERVICE_UNAVAILABLE, "Work queue depth exceeded", false), false);
+    }
+
+    void HandleAuthDelay(const boost::system::error_code& error)
+    {
+        if (error || fShutdown)
+            Close();
+        else
+            WriteReply(HTTPReply(HTTP_UNAUTHORIZED, "", false), false);
+    }
+
+    void HandleWrite(const boost::system::error_code& error)
+    {
+        nRPCWritesPending--;
+        strReply.clear();
+        if (error || !fKeepAlive || fShutdown)
+            Close();
+        else
+            ReadHeader();
+    }
 };
 
 void ThreadRPCServer(void* parg)
@@ -698,7 +868,7 @@ template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
                              ssl::context& context,
                              bool fUseSSL,
-                             AcceptedConnection* conn,
+                             boost::shared_ptr<CRPCConnection> conn,
                              const boost::system::error_code& error);
 
 /**
@@ -710,7 +880,7 @@ static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketA
                    const bool fUseSSL)
 {
     // Accept connection
-    AcceptedConnectionImpl<Protocol>* conn = new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL);
+    boost::shared_ptr<CRPCConnection> conn(new CRPCConnection(acceptor->get_io_service(), context, fUseSSL));
 
     acceptor->async_accept(
             conn->sslStream.lowest_layer(),
@@ -730,7 +900,7 @@ template <typename Protocol, typename SocketAcceptorService>
 static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
                              ssl::context& context,
                              const bool fUseSSL,
-                             AcceptedConnection* conn,
+                             boost::shared_ptr<CRPCConnection> conn,
                              const boost::system::error_code& error)
 {
     vnThreadsRunning[THREAD_RPCLISTENER]++;
@@ -740,35 +910,42 @@ static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol,
      && acceptor->is_open())
         RPCListen(acceptor, context, fUseSSL);
 
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn);
-
     // TODO: Actually handle errors
     if (error)
     {
-        delete conn;
+        // The connection goes with its last reference
     }
 
     // Restrict callers by IP.  It is important to
-    // do this before starting client thread, to filter out
+    // do this before reading the request, to filter out
     // certain DoS and misbehaving clients.
-    else if (tcp_conn
-          && !ClientAllowed(tcp_conn->peer.address()))
+    else if (!ClientAllowed(conn->peer.address()))
     {
         // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
         if (!fUseSSL)
-            conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
-        delete conn;
+        {
+            boost::system::error_code errorWrite;
+            asio::write(conn->sslStream.next_layer(), asio::buffer(HTTPReply(HTTP_FORBIDDEN, "", false)), errorWrite);
+        }
+        conn->Close();
     }
 
-    // start HTTP client thread
-    else if (!NewThread(ThreadRPCServer3, conn)) {
-        printf("Failed to create RPC server client thread\n");
-        delete conn;
-    }
+    // start reading requests
+    else
+        conn->Start();
 
     vnThreadsRunning[THREAD_RPCLISTENER]--;
 }
 
+// Wakes the listener every so often to notice a shutdown
+static void RPCShutdownCheck(asio::deadline_timer& timer, const boost::system::error_code& error)
+{
+    if (error || fShutdown)
+        return;
+    timer.expires_from_now(boost::posix_time::milliseconds(500));
+    timer.async_wait(boost::bind(&RPCShutdownCheck, boost::ref(timer), asio::placeholders::error));
+}
+
 void ThreadRPCServer2(void* parg)
 {
     printf("ThreadRPCServer started\n");
@@ -895,11 +1072,43 @@ void ThreadRPCServer2(void* parg)
         return;
     }
 
+    // Requests run on a fixed pool of workers
+    nRPCWorkQueueMax = std::max((int)GetArg("-rpcworkqueue", DEFAULT_RPC_WORKQUEUE), 1);
+    nRPCThreads = std::max((int)GetArg("-rpcthreads", DEFAULT_RPC_THREADS), 1);
+    for (int i = 0; i < nRPCThreads; i++)
+        if (!NewThread(ThreadRPCWorker, NULL))
+            printf("Failed to create RPC worker thread\n");
+
+    asio::deadline_timer timerShutdown(io_service);
+    RPCShutdownCheck(timerShutdown, boost::system::error_code());
+
     vnThreadsRunning[THREAD_RPCLISTENER]--;
     while (!fShutdown)
         io_service.run_one();
     vnThreadsRunning[THREAD_RPCLISTENER]++;
     StopRequests();
+
+    // Write the replies still due, the one to "stop" among them, before the
+    // io_service goes: requests being handled post theirs when they finish,
+    // those still queued are dropped
+    {
+        boost::unique_lock<boost::mutex> lock(csRPCWorkQueue);
+        vRPCWorkQueue.clear();
+    }
+    int64_t nStart = GetTimeMillis();
+    while (GetTimeMillis() - nStart < RPC_SHUTDOWN_TIMEOUT * 1000)
+    {
+        bool fActive;
+        {
+            boost::unique_lock<boost::mutex> lock(csRPCWorkQueue);
+            fActive = nRPCActive > 0;
+        }
+        io_service.reset();
+        io_service.poll();
+        if (!fActive && nRPCWritesPending == 0)
+            break;
+        MilliSleep(10);
+    }
 }
 
 class JSONRequest
@@ -978,104 +1187,214 @@ static string JSONRPCExecBatch(const Array& vReq)
 
 static CCriticalSection cs_THREAD_RPCHANDLER;
 
-void ThreadRPCServer3(void* parg)
+static bool QueueRPCRequest(const boost::shared_ptr<CRPCConnection>& conn)
 {
-    IMPLEMENT_RANDOMIZE_STACK(ThreadRPCServer3(parg));
-
-    // Make this thread recognisable as the RPC handler
-    RenameThread("netcoin-rpchand");
-
+    boost::unique_lock<boost::mutex> lock(csRPCWorkQueue);
+    if (vRPCWorkQueue.size() >= nRPCWorkQueueMax)
     {
-        LOCK(cs_THREAD_RPCHANDLER);
-        vnThreadsRunning[THREAD_RPCHANDLER]++;
+        nRPCRejected++;
+        printf("ThreadRPCServer work queue full, rejecting request from %s\n", conn->peer.address().to_string().c_str());
+        return false;
     }
-    AcceptedConnection *conn = (AcceptedConnection *) parg;
-
-    bool fRun = true;
-    while (true)
-    {
-        if (fShutdown || !fRun)
-        {
-            conn->close();
-            delete conn;
-            {
-                LOCK(cs_THREAD_RPCHANDLER);
-                --vnThreadsRunning[THREAD_RPCHANDLER];
-            }
-            return;
-        }
-        map<string, string> mapHeaders;
-        string strRequest;
+    vRPCWorkQueue.push_back(conn);
+    condRPCWorkQueue.notify_one();
+    return true;
+}
 
-        ReadHTTP(conn->stream(), mapHeaders, strRequest);
+static void HandleRPCRequest(const boost::shared_ptr<CRPCConnection>& conn)
+{
+    // Authorization was checked by the listener before queueing
+    map<string, string>& mapHeaders = conn->mapHeaders;
+    bool fKeepAlive = (mapHeaders["connection"] != "close");
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
-        {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (!HTTPAuthorized(mapHeaders))
-        {
-            printf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string().c_str());
-            /* Deter brute-forcing short passwords.
-               If this results in a DOS the user really
-               shouldn't have their RPC port exposed.*/
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
+    JSONRequest jreq;
+    try
+    {
+        // Parse request
+        Value valRequest;
+        if (!read_string(conn->strRequest, valRequest))
+            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
 
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+        string strReply;
 
-        JSONRequest jreq;
-        try
-        {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+        // singleton request
+        if (valRequest.type() == obj_type) {
+            jreq.parse(valRequest);
 
-            string strReply;
+            Value result = tableRPC.execute(jreq.strMethod, jreq.params);
 
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
+            // Send reply
+            strReply = JSONRPCReply(result, Value::null, jreq.id);
 
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+        // array of requests
+        } else if (valRequest.type() == array_type)
+            strReply = JSONRPCExecBatch(valRequest.get_array());
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
 
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
+        conn->Reply(HTTPReply(HTTP_OK, strReply, fKeepAlive), fKeepAlive);
+    }
+    catch (Object& objError)
+    {
+        conn->Reply(HTTPErrorReply(objError, jreq.id), false);
+    }
+    catch (std::exception& e)
+    {
+        conn->Reply(HTTPErrorReply(JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id), false);
+    }
+}
 
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
-                
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
-        }
-        catch (Object& objError)
+static void RPCWorker()
+{
+    while (!fShutdown)
+    {
+        boost::shared_ptr<CRPCConnection> conn;
         {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
+            boost::unique_lock<boost::mutex> lock(csRPCWorkQueue);
+            while (vRPCWorkQueue.empty() && !fShutdown)
+                condRPCWorkQueue.timed_wait(lock, boost::posix_time::milliseconds(500));
+            if (fShutdown)
+                break;
+            conn = vRPCWorkQueue.front();
+            vRPCWorkQueue.pop_front();
+            nRPCActive++;
         }
-        catch (std::exception& e)
+        HandleRPCRequest(conn);
         {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
+            boost::unique_lock<boost::mutex> lock(csRPCWorkQueue);
+            nRPCActive--;
         }
     }
+}
+
+void ThreadRPCWorker(void* parg)
+{
+    // Make this thread recognisable as an RPC worker
+    RenameThread("netcoin-rpcwork");
 
-    delete conn;
+    {
+        LOCK(cs_THREAD_RPCHANDLER);
+        vnThreadsRunning[THREAD_RPCHANDLER]++;
+    }
+    try
+    {
+        RPCWorker();
+    }
+    catch (std::exception& e) {
+        PrintException(&e, "ThreadRPCWorker()");
+    } catch (...) {
+        PrintException(NULL, "ThreadRPCWorker()");
+    }
     {
         LOCK(cs_THREAD_RPCHANDLER);
         vnThreadsRunning[THREAD_RPCHANDLER]--;
     }
 }
 
+// Per-method call counts and latency histograms; a call is counted in the
+// first bucket whose bound, in microseconds, it stays under
+static const int64_t RPC_LATENCY_BUCKETS[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000
+};
+static const unsigned int RPC_LATENCY_BUCKET_COUNT = ARRAYLEN(RPC_LATENCY_BUCKETS) + 1;
+
+struct CRPCMethodStats
+{
+    uint64_t nCalls;
+    uint64_t nErrors;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    uint64_t vBuckets[RPC_LATENCY_BUCKET_COUNT];
+
+    CRPCMethodStats()
+    {
+        nCalls = nErrors = 0;
+        nTotalMicros = nMaxMicros = 0;
+        memset(vBuckets, 0, sizeof(vBuckets));
+    }
+};
+
+static CCriticalSection cs_mapRPCMethodStats;
+static map<string, CRPCMethodStats> mapRPCMethodStats;
+
+// Times one call of an RPC method, an error unless told it succeeded
+class CRPCCallTimer
+{
+public:
+    CRPCCallTimer(const string& strMethodIn) : strMethod(strMethodIn)
+    {
+        nStart = GetTimeMicros();
+        fSuccess = false;
+    }
+
+    ~CRPCCallTimer()
+    {
+        int64_t nMicros = GetTimeMicros() - nStart;
+        unsigned int nBucket = 0;
+        while (nBucket < RPC_LATENCY_BUCKET_COUNT - 1 && nMicros >= RPC_LATENCY_BUCKETS[nBucket])
+            nBucket++;
+
+        LOCK(cs_mapRPCMethodStats);
+        CRPCMethodStats& stats = mapRPCMethodStats[strMethod];
+        stats.nCalls++;
+        if (!fSuccess)
+            stats.nErrors++;
+        stats.nTotalMicros += nMicros;
+        stats.nMaxMicros = std::max(stats.nMaxMicros, nMicros);
+        stats.vBuckets[nBucket]++;
+    }
+
+    bool fSuccess;
+
+private:
+    string strMethod;
+    int64_t nStart;
+};
+
+Value getrpcinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getrpcinfo\n"
+            "Returns the state of the RPC work queue and, for each method called so far,\n"
+            "its call count, errors and latency histogram in microseconds.");
+
+    Object obj;
+    {
+        boost::unique_lock<boost::mutex> lock(csRPCWorkQueue);
+        obj.push_back(Pair("threads",    nRPCThreads));
+        obj.push_back(Pair("active",     nRPCActive));
+        obj.push_back(Pair("queued",     (boost::uint64_t)vRPCWorkQueue.size()));
+        obj.push_back(Pair("workqueue",  (boost::uint64_t)nRPCWorkQueueMax));
+        obj.push_back(Pair("rejected",   (boost::uint64_t)nRPCRejected));
+    }
+
+    Object objMethods;
+    LOCK(cs_mapRPCMethodStats);
+    BOOST_FOREACH(const PAIRTYPE(string, CRPCMethodStats)& item, mapRPCMethodStats)
+    {
+        const CRPCMethodStats& stats = item.second;
+        Object objMethod;
+        objMethod.push_back(Pair("calls",      (boost::uint64_t)stats.nCalls));
+        objMethod.push_back(Pair("errors",     (boost::uint64_t)stats.nErrors));
+        objMethod.push_back(Pair("avg_us",     (boost::int64_t)(stats.nCalls ? stats.nTotalMicros / (int64_t)stats.nCalls : 0)));
+        objMethod.push_back(Pair("max_us",     (boost::int64_t)stats.nMaxMicros));
+
+        Object objHistogram;
+        for (unsigned int i = 0; i < RPC_LATENCY_BUCKET_COUNT; i++)
+        {
+            if (stats.vBuckets[i] == 0)
+                continue;
+            string strBucket = (i < RPC_LATENCY_BUCKET_COUNT - 1) ? strprintf("<%"PRI64d, RPC_LATENCY_BUCKETS[i]) : strprintf(">=%"PRI64d, RPC_LATENCY_BUCKETS[i - 1]);
+            objHistogram.push_back(Pair(strBucket, (boost::uint64_t)stats.vBuckets[i]));
+        }
+        objMethod.push_back(Pair("histogram", objHistogram));
+        objMethods.push_back(Pair(item.first, objMethod));
+    }
+    obj.push_back(Pair("methods", objMethods));
+    return obj;
+}
+
 json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
 {
     // Find method
@@ -1089,6 +1408,7 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
 
+    CRPCCallTimer timer(pcmd->name);
     try
     {
         // Execute
@@ -1102,6 +1422,7 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
                 result = pcmd->actor(params, false);
             }
         }
+        timer.fSuccess = true;
         return result;
     }
     catch (std::exception& e)
@@ -90,7 +90,16 @@ void Shutdown(void* parg)
         nTransactionsUpdated++;
         bitdb.Flush(false);
         StopNode();
+        {
+            LOCK(cs_main);
+            CTxDB txdb;
+            txdb.FlushCache();
+        }
         bitdb.Flush(true);
+#ifdef USE_LEVELDB
+        CTxDB::CloseDatabase();
+#endif
+        CloseBlockFileMappings();
         boost::filesystem::remove(GetPidFile());
         UnregisterWallet(pwalletMain);
         delete pwalletMain;
@@ -241,6 +250,10 @@ std::string HelpMessage()
         "  -datadir=<dir>         " + _("Specify data directory") + "\n" +
         "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n" +
         "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n" +
+        "  -maxsigcachemb=<n>     " + _("Set memory used by the valid signature cache in megabytes (default: 10)") + "\n" +
+        "  -par=<n>               " + _("Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)") + "\n" +
+        "  -mapblockfiles         " + _("Read blocks and transactions from memory-mapped block files (default: 1)") + "\n" +
+        "  -syncinterval=<n>      " + _("During initial block download, sync block data to disk only every <n> blocks (default: 500)") + "\n" +
         "  -timeout=<n>           " + _("Specify connection timeout (in milliseconds)") + "\n" +
         "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n" +
         "  -socks=<n>             " + _("Select the version of socks proxy to use (4-5, default: 5)") + "\n" +
@@ -265,6 +278,9 @@ std::string HelpMessage()
         "  -bantime=<n>           " + _("Number of seconds to keep misbehaving peers from reconnecting (default: 86400)") + "\n" +
         "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n" +
         "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n" +
+        "  -msghandlerthreads=<n> " + _("Number of threads handling peer messages (default: 4)") + "\n" +
+        "  -headersfirst          " + _("Download and check block headers first, then fetch blocks from several peers at once (default: 0)") + "\n" +
+        "  -compactblocks         " + _("Ask peers for new blocks as compact blocks rebuilt from the memory pool (default: 1)") + "\n" +
 #ifdef USE_UPNP
 #if USE_UPNP
         "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n" +
@@ -294,14 +310,24 @@ std::string HelpMessage()
         "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n" +
         "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 11311 or testnet 21311)") + "\n" +
         "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n" +
+        "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n" +
+        "  -rpcworkqueue=<n>      " + _("Set the depth of the work queue to service RPC calls (default: 16)") + "\n" +
         "  -rpcconnect=<ip>       " + _("Send commands to node running on <ip> (default: 127.0.0.1)") + "\n" +
         "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n" +
         "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n" +
         "  -confchange            " + _("Require a confirmations for change (default: 0)") + "\n" +
         "  -enforcecanonical      " + _("Enforce transaction scripts to use canonical PUSH operators (default: 1)") + "\n" +
+        "  -maxmempool=<n>        " + _("Keep the transaction memory pool below <n> megabytes (default: 300)") + "\n" +
+        "  -maxorphanblocksize=<n> " + _("Keep at most <n> megabytes of orphan blocks (default: 40)") + "\n" +
+        "  -maxblockcache=<n>     " + _("Keep up to <n> megabytes of recently served blocks ready to send (default: 32)") + "\n" +
+        "  -limitancestorcount=<n>   " + _("Do not accept transactions with more than <n> unconfirmed ancestors in the pool (default: 25)") + "\n" +
+        "  -limitancestorsize=<n>    " + _("Do not accept transactions whose unconfirmed ancestors exceed <n> kilobytes (default: 101)") + "\n" +
+        "  -limitdescendantcount=<n> " + _("Do not accept transactions that give an unconfirmed ancestor more than <n> descendants (default: 25)") + "\n" +
+        "  -limitdescendantsize=<n>  " + _("Do not accept transactions that give an unconfirmed ancestor more than <n> kilobytes of descendants (default: 101)") + "\n" +
         "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received (%s in cmd is replaced by message)") + "\n" +
         "  -upgradewallet         " + _("Upgrade wallet to latest format") + "\n" +
         "  -keypool=<n>           " + _("Set key pool size to <n> (default: 100)") + "\n" +
+        "  -keycache=<n>          " + _("Keep up to <n> keys ready for signing while the wallet is unlocked, 0 to disable (default: 100)") + "\n" +
         "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + "\n" +
         "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + "\n" +
         "  -checkblocks=<n>       " + _("How many blocks to check at startup (default: 2500, 0 = all)") + "\n" +
@@ -431,6 +457,20 @@ bool AppInit2()
 
     // ********************************************************* Step 3: parameter-to-internal-flags
 
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+
+    fMapBlockFiles = GetBoolArg("-mapblockfiles", true);
+    nSyncInterval = GetArg("-syncinterval", 500);
+    fHeadersFirst = GetBoolArg("-headersfirst", false);
+    fCompactBlocks = GetBoolArg("-compactblocks", true);
+
     fDebug = GetBoolArg("-debug");
 
     // -debug implies fDebug*
@@ -544,6 +584,13 @@ bool AppInit2()
     if (fDaemon)
         fprintf(stdout, "NetCoin server starting\n");
 
+    if (nScriptCheckThreads) {
+        printf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            if (!NewThread(ThreadScriptCheck, NULL))
+                printf("Error: NewThread(ThreadScriptCheck) failed\n");
+    }
+
     int64_t nStart;
 
     // ********************************************************* Step 5: verify database integrity
@@ -746,7 +793,7 @@ bool AppInit2()
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -782,6 +829,7 @@ bool AppInit2()
     nStart = GetTimeMillis();
     bool fFirstRun = true;
     pwalletMain = new CWallet(strWalletFileName);
+    pwalletMain->SetKeyCacheSize(std::max((int)GetArg("-keycache", DEFAULT_KEY_CACHE_SIZE), 0));
     DBErrors nLoadWalletRet = pwalletMain->LoadWallet(fFirstRun);
     if (nLoadWalletRet != DB_LOAD_OK)
     {
@@ -4,6 +4,10 @@
 
 #include <boost/assign/list_of.hpp>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "kernel.h"
 #include "txdb.h"
 
@@ -208,14 +212,59 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     return true;
 }
 
+// Kernel stake modifier cache: the block carrying the stake modifier for
+// kernels from each main chain block, indexed by the height of that block
+static CCriticalSection cs_vKernelModifier;
+static vector<const CBlockIndex*> vKernelModifier;
+
+static const CBlockIndex* GetCachedKernelModifier(const CBlockIndex* pindexFrom)
+{
+    LOCK(cs_vKernelModifier);
+    if (pindexFrom->nHeight >= (int)vKernelModifier.size())
+        return NULL;
+    const CBlockIndex* pindex = vKernelModifier[pindexFrom->nHeight];
+    // while both blocks are on the main chain, so is every block between them
+    if (!pindex || !pindex->IsInMainChain() || !pindexFrom->IsInMainChain())
+        return NULL;
+    return pindex;
+}
+
+static void CacheKernelModifier(const CBlockIndex* pindexFrom, const CBlockIndex* pindex)
+{
+    LOCK(cs_vKernelModifier);
+    if (pindexFrom->nHeight >= (int)vKernelModifier.size())
+        vKernelModifier.resize(max(pindexFrom->nHeight, nBestHeight) + 1, NULL);
+    vKernelModifier[pindexFrom->nHeight] = pindex;
+}
+
+// Forget cached modifiers that were found walking past the fork height
+void InvalidateKernelModifierCache(int nForkHeight)
+{
+    LOCK(cs_vKernelModifier);
+    if (nForkHeight + 1 < (int)vKernelModifier.size())
+        vKernelModifier.resize(max(nForkHeight + 1, 0));
+    BOOST_FOREACH(const CBlockIndex*& pindex, vKernelModifier)
+        if (pindex && pindex->nHeight > nForkHeight)
+            pindex = NULL;
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
-static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
+static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, const CBlockIndex*& pindexModifier, bool fPrintProofOfStake)
 {
     nStakeModifier = 0;
     if (!mapBlockIndex.count(hashBlockFrom))
         return error("GetKernelStakeModifier() : block not indexed");
     const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
+    const CBlockIndex* pindexCached = GetCachedKernelModifier(pindexFrom);
+    if (pindexCached)
+    {
+        nStakeModifierHeight = pindexCached->nHeight;
+        nStakeModifierTime = pindexCached->GetBlockTime();
+        nStakeModifier = pindexCached->nStakeModifier;
+        pindexModifier = pindexCached;
+        return true;
+    }
     nStakeModifierHeight = pindexFrom->nHeight;
     nStakeModifierTime = pindexFrom->GetBlockTime();
     int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
@@ -239,9 +288,19 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifi
         }
     }
     nStakeModifier = pindex->nStakeModifier;
+    pindexModifier = pindex;
+    if (pindexFrom->IsInMainChain())
+        CacheKernelModifier(pindexFrom, pindex);
     return true;
 }
 
+bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, const CBlockIndex*& pindexModifier)
+{
+    int nStakeModifierHeight = 0;
+    int64_t nStakeModifierTime = 0;
+    return GetKernelStakeModifier(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, pindexModifier, false);
+}
+
 // ppcoin kernel protocol
 // coinstake must meet hash target according to the protocol:
 // kernel (input 0) must meet the formula
@@ -284,7 +343,8 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     int nStakeModifierHeight = 0;
     int64_t nStakeModifierTime = 0;
 
-    if (!GetKernelStakeModifier(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake))
+    const CBlockIndex* pindexModifier = NULL;
+    if (!GetKernelStakeModifier(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, pindexModifier, fPrintProofOfStake))
         return false;
     ss << nStakeModifier;
 
@@ -321,6 +381,282 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     return true;
 }
 
+// Check whether a stake kernel meets hash target, using an already resolved
+// stake modifier and txPrev position instead of the block and transaction.
+// Hashes exactly the same fields as the CheckStakeKernelHash above.
+bool CheckStakeKernelHash(unsigned int nBits, uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, const COutPoint& prevout, int64_t nValueIn, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake)
+{
+    if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
+        return error("CheckStakeKernelHash() : min age violation");
+
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+
+    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetWeight((int64_t)nTimeBlockFrom, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
+    targetProofOfStake = (bnCoinDayWeight * bnTargetPerCoinDay).getuint256();
+
+    // Calculate hash
+    CDataStream ss(SER_GETHASH, 0);
+    ss << nStakeModifier;
+    ss << nTimeBlockFrom << nTxPrevOffset << nTimeBlockFrom << prevout.n << nTimeTx;
+    hashProofOfStake = Hash(ss.begin(), ss.end());
+
+    // Now check if proof-of-stake hash meets target protocol
+    if (CBigNum(hashProofOfStake) > bnCoinDayWeight * bnTargetPerCoinDay)
+        return false;
+    if (fDebug)
+        printf("CheckStakeKernelHash() : pass modifier=0x%016"PRI64x" nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
+            nStakeModifier,
+            nTimeBlockFrom, nTxPrevOffset, nTimeBlockFrom, prevout.n, nTimeTx,
+            hashProofOfStake.ToString().c_str());
+    return true;
+}
+
+// Kernel search
+//
+// A kernel is 28 bytes, so its first SHA-256 is one block and its second
+// hashes the 32-byte digest, also one block.  Across a search window only
+// nTimeTx, message word 6, changes: rounds 0-5 and message words 16-20 are
+// the same for every timestamp and are computed once per coin.  The rest is
+// done for several timestamps at a time, four to an SSE2 register where the
+// compiler targets it.
+
+static const uint32_t pKernelSHA256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t pKernelSHA256Init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// 32-bit lane operations: one lane in a plain word
+struct CKernelLanesScalar
+{
+    typedef uint32_t word;
+    static const unsigned int WIDTH = 1;
+    static word Set(uint32_t x) { return x; }
+    static word Load(const uint32_t* p) { return p[0]; }
+    static void Store(uint32_t* p, word a) { p[0] = a; }
+    static word Add(word a, word b) { return a + b; }
+    static word Xor(word a, word b) { return a ^ b; }
+    static word And(word a, word b) { return a & b; }
+    static word Or(word a, word b) { return a | b; }
+    static word AndNot(word a, word b) { return ~a & b; }
+    static word Shr(word a, int n) { return a >> n; }
+    static word Shl(word a, int n) { return a << n; }
+};
+
+#ifdef __SSE2__
+// four lanes in an SSE2 register
+struct CKernelLanesSSE2
+{
+    typedef __m128i word;
+    static const unsigned int WIDTH = 4;
+    static word Set(uint32_t x) { return _mm_set1_epi32(x); }
+    static word Load(const uint32_t* p) { return _mm_loadu_si128((const __m128i*)p); }
+    static void Store(uint32_t* p, word a) { _mm_storeu_si128((__m128i*)p, a); }
+    static word Add(word a, word b) { return _mm_add_epi32(a, b); }
+    static word Xor(word a, word b) { return _mm_xor_si128(a, b); }
+    static word And(word a, word b) { return _mm_and_si128(a, b); }
+    static word Or(word a, word b) { return _mm_or_si128(a, b); }
+    static word AndNot(word a, word b) { return _mm_andnot_si128(a, b); }
+    static word Shr(word a, int n) { return _mm_srli_epi32(a, n); }
+    static word Shl(word a, int n) { return _mm_slli_epi32(a, n); }
+};
+#endif
+
+// The parts of the kernel hash that are the same for every timestamp
+struct CKernelHashPrefix
+{
+    uint32_t w[21];     // message words 0-20, word 6 left as 0
+    uint32_t state[8];  // after round 5
+};
+
+template <typename L> static inline typename L::word KernelRotr(typename L::word x, int n)
+{
+    return L::Or(L::Shr(x, n), L::Shl(x, 32 - n));
+}
+
+// Runs rounds nRoundStart to 63 over state s with message words w and adds
+// pInit, giving the digest in s
+template <typename L> static inline void KernelSHA256Rounds(typename L::word s[8], const typename L::word w[64], int nRoundStart, const uint32_t pInit[8])
+{
+    typedef typename L::word word;
+    word a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+    for (int i = nRoundStart; i < 64; i++)
+    {
+        word S1 = L::Xor(L::Xor(KernelRotr<L>(e, 6), KernelRotr<L>(e, 11)), KernelRotr<L>(e, 25));
+        word ch = L::Xor(L::And(e, f), L::AndNot(e, g));
+        word t1 = L::Add(L::Add(L::Add(h, S1), L::Add(ch, L::Set(pKernelSHA256K[i]))), w[i]);
+        word S0 = L::Xor(L::Xor(KernelRotr<L>(a, 2), KernelRotr<L>(a, 13)), KernelRotr<L>(a, 22));
+        word maj = L::Or(L::And(a, b), L::And(c, L::Or(a, b)));
+        word t2 = L::Add(S0, maj);
+        h = g; g = f; f = e; e = L::Add(d, t1);
+        d = c; c = b; b = a; a = L::Add(t1, t2);
+    }
+    s[0] = L::Add(a, L::Set(pInit[0])); s[1] = L::Add(b, L::Set(pInit[1]));
+    s[2] = L::Add(c, L::Set(pInit[2])); s[3] = L::Add(d, L::Set(pInit[3]));
+    s[4] = L::Add(e, L::Set(pInit[4])); s[5] = L::Add(f, L::Set(pInit[5]));
+    s[6] = L::Add(g, L::Set(pInit[6])); s[7] = L::Add(h, L::Set(pInit[7]));
+}
+
+template <typename L> static inline void KernelSHA256Schedule(typename L::word w[64], int nStart)
+{
+    typedef typename L::word word;
+    for (int i = nStart; i < 64; i++)
+    {
+        word s0 = L::Xor(L::Xor(KernelRotr<L>(w[i-15], 7), KernelRotr<L>(w[i-15], 18)), L::Shr(w[i-15], 3));
+        word s1 = L::Xor(L::Xor(KernelRotr<L>(w[i-2], 17), KernelRotr<L>(w[i-2], 19)), L::Shr(w[i-2], 10));
+        w[i] = L::Add(L::Add(w[i-16], s0), L::Add(w[i-7], s1));
+    }
+}
+
+static void KernelHashPrefix(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, unsigned int nPrevout, CKernelHashPrefix& prefix)
+{
+    // The kernel serializes little-endian, SHA-256 reads big-endian words
+    uint32_t* w = prefix.w;
+    w[0] = ByteReverse((uint32_t)nStakeModifier);
+    w[1] = ByteReverse((uint32_t)(nStakeModifier >> 32));
+    w[2] = ByteReverse(nTimeBlockFrom);
+    w[3] = ByteReverse(nTxPrevOffset);
+    w[4] = ByteReverse(nTimeBlockFrom);
+    w[5] = ByteReverse(nPrevout);
+    w[6] = 0;
+    w[7] = 0x80000000;
+    for (int i = 8; i < 15; i++)
+        w[i] = 0;
+    w[15] = 28 * 8;
+
+    // Words 16-20 do not reach back to word 6
+    uint32_t wFull[64];
+    memcpy(wFull, w, 16 * sizeof(uint32_t));
+    KernelSHA256Schedule<CKernelLanesScalar>(wFull, 16);
+    memcpy(&w[16], &wFull[16], 5 * sizeof(uint32_t));
+
+    // Rounds 0-5 only use words 0-5
+    uint32_t a = pKernelSHA256Init[0], b = pKernelSHA256Init[1], c = pKernelSHA256Init[2], d = pKernelSHA256Init[3];
+    uint32_t e = pKernelSHA256Init[4], f = pKernelSHA256Init[5], g = pKernelSHA256Init[6], h = pKernelSHA256Init[7];
+    for (int i = 0; i < 6; i++)
+    {
+        uint32_t S1 = KernelRotr<CKernelLanesScalar>(e, 6) ^ KernelRotr<CKernelLanesScalar>(e, 11) ^ KernelRotr<CKernelLanesScalar>(e, 25);
+        uint32_t t1 = h + S1 + ((e & f) ^ (~e & g)) + pKernelSHA256K[i] + w[i];
+        uint32_t S0 = KernelRotr<CKernelLanesScalar>(a, 2) ^ KernelRotr<CKernelLanesScalar>(a, 13) ^ KernelRotr<CKernelLanesScalar>(a, 22);
+        uint32_t t2 = S0 + ((a & b) | (c & (a | b)));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    prefix.state[0] = a; prefix.state[1] = b; prefix.state[2] = c; prefix.state[3] = d;
+    prefix.state[4] = e; prefix.state[5] = f; prefix.state[6] = g; prefix.state[7] = h;
+}
+
+// Double SHA-256 of the kernels for L::WIDTH timestamps, as Hash() would
+// give them; pnTimeTx and phash hold one entry per lane
+template <typename L> static void KernelHashLanes(const CKernelHashPrefix& prefix, const uint32_t* pnTimeTx, uint256* phash)
+{
+    typedef typename L::word word;
+    word w[64];
+    word s[8];
+
+    // First hash: continue from round 6 with this lane's timestamp
+    uint32_t pTime[L::WIDTH];
+    for (unsigned int i = 0; i < L::WIDTH; i++)
+        pTime[i] = ByteReverse(pnTimeTx[i]);
+    for (int i = 0; i < 21; i++)
+        w[i] = L::Set(prefix.w[i]);
+    w[6] = L::Load(pTime);
+    KernelSHA256Schedule<L>(w, 21);
+    for (int i = 0; i < 8; i++)
+        s[i] = L::Set(prefix.state[i]);
+    KernelSHA256Rounds<L>(s, w, 6, pKernelSHA256Init);
+
+    // Second hash: the 32-byte digest, padded
+    for (int i = 0; i < 8; i++)
+        w[i] = s[i];
+    w[8] = L::Set(0x80000000);
+    for (int i = 9; i < 15; i++)
+        w[i] = L::Set(0);
+    w[15] = L::Set(32 * 8);
+    KernelSHA256Schedule<L>(w, 16);
+    for (int i = 0; i < 8; i++)
+        s[i] = L::Set(pKernelSHA256Init[i]);
+    KernelSHA256Rounds<L>(s, w, 0, pKernelSHA256Init);
+
+    // uint256 holds the digest bytes in order, as little-endian words
+    uint32_t pOut[8][L::WIDTH];
+    for (int i = 0; i < 8; i++)
+        L::Store(pOut[i], s[i]);
+    for (unsigned int j = 0; j < L::WIDTH; j++)
+    {
+        uint32_t* pn = (uint32_t*)phash[j].begin();
+        for (int i = 0; i < 8; i++)
+            pn[i] = ByteReverse(pOut[i][j]);
+    }
+}
+
+// Hashes nCount kernels with the given timestamps
+static void KernelHashBatch(const CKernelHashPrefix& prefix, const uint32_t* pnTimeTx, unsigned int nCount, uint256* phash)
+{
+    unsigned int i = 0;
+#ifdef __SSE2__
+    for (; i + CKernelLanesSSE2::WIDTH <= nCount; i += CKernelLanesSSE2::WIDTH)
+        KernelHashLanes<CKernelLanesSSE2>(prefix, &pnTimeTx[i], &phash[i]);
+#endif
+    for (; i < nCount; i++)
+        KernelHashLanes<CKernelLanesScalar>(prefix, &pnTimeTx[i], &phash[i]);
+}
+
+// Search nTimeTxFrom, nTimeTxFrom - 1, ... for nCount seconds for a stake
+// kernel meeting the hash target.  The coin day weight only grows with
+// nTimeTx, so the target at nTimeTxFrom bounds every target in the window
+// and hashes are compared against it as uint256; a hash under it is checked
+// exactly by CheckStakeKernelHash, which also fills in the results.
+bool ScanStakeKernelHash(unsigned int nBits, uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, const COutPoint& prevout, int64_t nValueIn, unsigned int nTimeTxFrom, unsigned int nCount, unsigned int& nTimeTxRet, uint256& hashProofOfStake, uint256& targetProofOfStake)
+{
+    // Min age requirement, from the latest timestamp down
+    if (nTimeBlockFrom + nStakeMinAge > nTimeTxFrom)
+        return false;
+    nCount = min(nCount, nTimeTxFrom - (nTimeBlockFrom + nStakeMinAge) + 1);
+
+    CBigNum bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
+    CBigNum bnTargetMax = CBigNum(nValueIn) * GetWeight((int64_t)nTimeBlockFrom, (int64_t)nTimeTxFrom) / COIN / (24 * 60 * 60) * bnTargetPerCoinDay;
+    bool fAnyHash = (bnTargetMax.bitSize() > 256);
+    uint256 targetMax = fAnyHash ? ~uint256(0) : bnTargetMax.getuint256();
+
+    CKernelHashPrefix prefix;
+    KernelHashPrefix(nStakeModifier, nTimeBlockFrom, nTxPrevOffset, prevout.n, prefix);
+
+    static const unsigned int nBatchSize = 64;
+    uint32_t pnTimeTx[nBatchSize];
+    uint256 phash[nBatchSize];
+    for (unsigned int nDone = 0; nDone < nCount; )
+    {
+        unsigned int nBatch = min(nCount - nDone, nBatchSize);
+        for (unsigned int i = 0; i < nBatch; i++)
+            pnTimeTx[i] = nTimeTxFrom - nDone - i;
+        KernelHashBatch(prefix, pnTimeTx, nBatch, phash);
+        for (unsigned int i = 0; i < nBatch; i++)
+        {
+            if (phash[i] > targetMax)
+                continue;
+            if (CheckStakeKernelHash(nBits, nStakeModifier, nTimeBlockFrom, nTxPrevOffset, prevout, nValueIn, pnTimeTx[i], hashProofOfStake, targetProofOfStake))
+            {
+                nTimeTxRet = pnTimeTx[i];
+                return true;
+            }
+        }
+        nDone += nBatch;
+    }
+    return false;
+}
+
 // Check kernel hash target and coinstake signature
 bool CheckProofOfStake(const CTransaction& tx, unsigned int txTime, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake)
 {
@@ -20,6 +20,22 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
 // Sets hashProofOfStake on success return
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake=false);
 
+// Check whether stake kernel meets hash target, from a resolved stake modifier
+// and txPrev position (used by the wallet's kernel candidate table)
+bool CheckStakeKernelHash(unsigned int nBits, uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, const COutPoint& prevout, int64_t nValueIn, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake);
+
+// Search nCount seconds back from nTimeTxFrom for a stake kernel meeting the
+// hash target, hashing several timestamps at once
+// Sets nTimeTxRet and hashProofOfStake on success return
+bool ScanStakeKernelHash(unsigned int nBits, uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, const COutPoint& prevout, int64_t nValueIn, unsigned int nTimeTxFrom, unsigned int nCount, unsigned int& nTimeTxRet, uint256& hashProofOfStake, uint256& targetProofOfStake);
+
+// Get the stake modifier used to hash a kernel from the given block
+// Sets pindexModifier to the block that generated the modifier
+bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, const CBlockIndex*& pindexModifier);
+
+// Drop cached kernel stake modifiers past a reorganization fork
+void InvalidateKernelModifierCache(int nForkHeight);
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(const CTransaction& tx, unsigned int nTxTime, unsigned int nBits, uint256& hashProofOfStake, uint256& targetProofOfStake);
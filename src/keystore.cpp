@@ -82,6 +82,8 @@ bool CCryptoKeyStore::Lock()
     {
         LOCK(cs_KeyStore);
         vMasterKey.clear();
+        // CKey frees its EC_KEY with the secret cleared
+        LimitKeyCache(0);
     }
 
     NotifyStatusChanged(this);
@@ -113,6 +115,7 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
             return false;
         }
         vMasterKey = vMasterKeyIn;
+        LimitKeyCache(0);
     }
     NotifyStatusChanged(this);
     return true;
@@ -157,8 +160,21 @@ bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
 {
     {
         LOCK(cs_KeyStore);
+        KeyCacheMap::iterator mc = mapKeyCache.find(address);
+        if (mc != mapKeyCache.end())
+        {
+            listKeyCacheLRU.splice(listKeyCacheLRU.begin(), listKeyCacheLRU, (*mc).second.second);
+            keyOut = (*mc).second.first;
+            return true;
+        }
+
         if (!IsCrypted())
-            return CBasicKeyStore::GetKey(address, keyOut);
+        {
+            if (!CBasicKeyStore::GetKey(address, keyOut))
+                return false;
+            CacheKey(address, keyOut);
+            return true;
+        }
 
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.find(address);
         if (mi != mapCryptedKeys.end())
@@ -172,6 +188,7 @@ bool CCryptoKeyStore::GetKey(const CKeyID &address, CKey& keyOut) const
                 return false;
             keyOut.SetPubKey(vchPubKey);
             keyOut.SetSecret(vchSecret);
+            CacheKey(address, keyOut);
             return true;
         }
     }
@@ -217,6 +234,25 @@ bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn)
                 return false;
         }
         mapKeys.clear();
+        LimitKeyCache(0);
     }
     return true;
 }
+
+void CCryptoKeyStore::CacheKey(const CKeyID &address, const CKey& key) const
+{
+    if (nKeyCacheSize == 0)
+        return;
+    LimitKeyCache(nKeyCacheSize - 1);
+    listKeyCacheLRU.push_front(address);
+    mapKeyCache.insert(make_pair(address, make_pair(key, listKeyCacheLRU.begin())));
+}
+
+void CCryptoKeyStore::LimitKeyCache(unsigned int nSize) const
+{
+    while (mapKeyCache.size() > nSize)
+    {
+        mapKeyCache.erase(listKeyCacheLRU.back());
+        listKeyCacheLRU.pop_back();
+    }
+}
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_KEYSTORE_H
 #define BITCOIN_KEYSTORE_H
 #include <stdint.h>
+#include <list>
 #include "crypter.h"
 #include "sync.h"
 #include <boost/signals2/signal.hpp>
@@ -100,6 +101,8 @@ public:
 
 typedef std::map<CKeyID, std::pair<CPubKey, std::vector<unsigned char> > > CryptedKeyMap;
 
+static const unsigned int DEFAULT_KEY_CACHE_SIZE = 100;
+
 /** Keystore which keeps the private keys encrypted.
  * It derives from the basic key store, which is used if no encryption is active.
  */
@@ -115,6 +118,15 @@ private:
     bool fUseCrypto;
 
 protected:
+    // Keys handed out by GetKey, ready to sign with, so staking and sends
+    // need not decrypt and derive the same key again; at most nKeyCacheSize
+    // of them, the least recently used going first, and wiped when the
+    // wallet locks
+    typedef std::map<CKeyID, std::pair<CKey, std::list<CKeyID>::iterator> > KeyCacheMap;
+    mutable KeyCacheMap mapKeyCache;
+    mutable std::list<CKeyID> listKeyCacheLRU;  // most recently used first
+    unsigned int nKeyCacheSize;
+
     bool SetCrypted();
 
     // will encrypt previously unencrypted keys
@@ -122,9 +134,21 @@ protected:
 
     bool Unlock(const CKeyingMaterial& vMasterKeyIn);
 
+    // requires cs_KeyStore
+    void CacheKey(const CKeyID &address, const CKey& key) const;
+    void LimitKeyCache(unsigned int nSize) const;
+
 public:
-    CCryptoKeyStore() : fUseCrypto(false)
+    CCryptoKeyStore() : fUseCrypto(false), nKeyCacheSize(DEFAULT_KEY_CACHE_SIZE)
+    {
+    }
+
+    // 0 turns the key cache off
+    void SetKeyCacheSize(unsigned int nSize)
     {
+        LOCK(cs_KeyStore);
+        nKeyCacheSize = nSize;
+        LimitKeyCache(nKeyCacheSize);
     }
 
     bool IsCrypted() const
@@ -10,6 +10,7 @@
 
 #include "alert.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "db.h"
 #include "txdb.h"
 #include "net.h"
@@ -18,11 +19,19 @@
 #include "kernel.h"
 #include "zerocoin/Zerocoin.h"
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int.hpp>
 #include <cmath>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
 using namespace std;
 using namespace boost;
 
@@ -38,7 +47,7 @@ CCriticalSection cs_main;
 CTxMemPool mempool;
 unsigned int nTransactionsUpdated = 0;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 libzerocoin::Params* ZCParams;
 
@@ -70,10 +79,50 @@ int64_t nTimeBestReceived = 0;
 
 CMedianFilter<int> cPeerBlockCounts(5, 0); // Amount of blocks that other nodes claim to have
 
-map<uint256, CBlock*> mapOrphanBlocks;
-multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
+int nScriptCheckThreads = 0;
+bool fMapBlockFiles = true;
+int nSyncInterval = 500;
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+map<uint256, COrphanBlock*> mapOrphanBlocks;
+multimap<uint256, COrphanBlock*> mapOrphanBlocksByPrev;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 
+// Headers-first download: the header chain above pindexHeadersBase and the
+// blocks asked for along it
+struct CSyncHeader
+{
+    uint256 hash;
+    unsigned int nTime;
+    unsigned int nBits;
+    bool fProofOfStake;
+    uint256 nChainTrust;
+};
+
+struct CBlockInFlight
+{
+    CNode* pnode;
+    int64_t nTime;
+};
+
+bool fHeadersFirst = false;
+static CBlockIndex* pindexHeadersBase = NULL;
+static deque<CSyncHeader> vSyncHeaders;
+static map<uint256, int> mapSyncHeaders;            // hash -> height of vSyncHeaders entries
+CNode* pnodeHeadersSync = NULL;                     // peer we download headers from
+static int64_t nHeadersRequestTime = 0;             // 0 while no getheaders is outstanding
+static bool fHeadersMore = false;                   // the sync peer has more headers for us
+static map<uint256, CBlockInFlight> mapBlocksInFlight;
+static uint64_t nBlockStalls = 0;
+static int64_t nHeadersSyncStart = 0;
+static int64_t nHeadersSyncDone = 0;
+
+// Compact block relay: blocks being rebuilt from the memory pool while we
+// wait for the transactions it lacked
+bool fCompactBlocks = true;
+static map<uint256, CPartialBlock> mapPartialBlocks;
+static CCompactBlockStats compactStats;
+
 map<uint256, CTransaction> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 
@@ -168,6 +217,13 @@ void static SetBestChain(const CBlockLocator& loc)
         pwallet->SetBestChain(loc);
 }
 
+// ppcoin: notify wallets about a new best block, once pindexBest points to it
+void static UpdateStakeCandidates()
+{
+    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+        pwallet->UpdateStakeCandidates();
+}
+
 // notify wallets about an updated transaction
 void static UpdatedTransaction(const uint256& hashTx)
 {
@@ -483,7 +539,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     }
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -640,7 +696,7 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
             return false;
 
     // Check for conflicts with in-memory transactions
-    CTransaction* ptxOld = NULL;
+    const CTransaction* ptxOld = NULL;
     for (unsigned int i = 0; i < tx.vin.size(); i++)
     {
         COutPoint outpoint = tx.vin[i].prevout;
@@ -667,19 +723,41 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         }
     }
 
-    if (fCheckInputs)
+    int64_t nFees = 0;
+    double dPriority = 0;
+    int64_t nInChainInputValue = 0;
+    MapPrevTx mapInputs;
+    map<uint256, CTxIndex> mapUnused;
+    bool fInvalid = false;
+    bool fHaveInputs = tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid);
+    if (fCheckInputs && !fHaveInputs)
     {
-        MapPrevTx mapInputs;
-        map<uint256, CTxIndex> mapUnused;
-        bool fInvalid = false;
-        if (!tx.FetchInputs(txdb, mapUnused, false, false, mapInputs, fInvalid))
-        {
-            if (fInvalid)
-                return error("CTxMemPool::accept() : FetchInputs found invalid tx %s", hash.ToString().substr(0,10).c_str());
-            if (pfMissingInputs)
-                *pfMissingInputs = true;
-            return false;
+        if (fInvalid)
+            return error("CTxMemPool::accept() : FetchInputs found invalid tx %s", hash.ToString().substr(0,10).c_str());
+        if (pfMissingInputs)
+            *pfMissingInputs = true;
+        return false;
+    }
+    unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    if (fHaveInputs)
+    {
+        // Fee and priority are kept with the entry so block templates need
+        // not look the inputs up again; priority is sum(valuein * age) / txsize
+        nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            const CTxIndex& txindex = mapInputs[txin.prevout.hash].first;
+            if (txindex.pos.IsNull() || txindex.pos == CDiskTxPos(1,1,1))
+                continue;
+            int64_t nValueIn = mapInputs[txin.prevout.hash].second.vout[txin.prevout.n].nValue;
+            dPriority += (double)nValueIn * txindex.GetDepthInMainChain();
+            nInChainInputValue += nValueIn;
         }
+        dPriority /= nSize;
+    }
+
+    if (fCheckInputs)
+    {
 
         // Check for non-standard pay-to-script-hash in inputs
         if (!tx.AreInputsStandard(mapInputs) && !fTestNet)
@@ -689,9 +767,6 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
         // you should add code here to check that the transaction does a
         // reasonable number of ECDSA signature verifications.
 
-        int64_t nFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-        unsigned int nSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-
         // Don't accept it if it can't get into a block
         int64_t txMinFee = tx.GetMinFee(1000, GMF_RELAY, nSize, true);
         if (nFees < txMinFee)
@@ -699,6 +774,13 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
                          hash.ToString().c_str(),
                          nFees, txMinFee);
 
+        // Nor if it pays less than what was evicted from a full pool lately
+        int64_t nPoolMinFee = GetMinFee(GetMaxMempoolSize()) * nSize / 1000;
+        if (nFees < nPoolMinFee)
+            return error("CTxMemPool::accept() : mempool min fee not met %s, %"PRI64d" < %"PRI64d,
+                         hash.ToString().c_str(),
+                         nFees, nPoolMinFee);
+
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make others' transactions take longer to confirm.
@@ -733,20 +815,48 @@ bool CTxMemPool::accept(CTxDB& txdb, CTransaction &tx, bool fCheckInputs,
     }
 
     // Store transaction in memory
+    uint256 hashOld = ptxOld ? ptxOld->GetHash() : 0;
+    bool fFull = false;
     {
         LOCK(cs);
+
+        // Check the limits while the old version is still in place, so a
+        // rejected replacement leaves the pool as it was.  The new version
+        // spends only the old one's inputs, so the old one is not among its
+        // ancestors and the collected iterators survive its removal.
+        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, nBestHeight, nInChainInputValue);
+        setEntries setAncestors;
+        string strError;
+        if (fCheckInputs && !CalculateMemPoolAncestors(entry, setAncestors,
+                GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT),
+                GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000,
+                GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT),
+                GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000,
+                strError))
+            return error("CTxMemPool::accept() : %s %s", strError.c_str(), hash.ToString().substr(0,10).c_str());
+        if (!fCheckInputs)
+            CalculateMemPoolAncestors(entry, setAncestors, -1, -1, -1, -1, strError);
+
         if (ptxOld)
         {
-            printf("CTxMemPool::accept() : replacing tx %s with new version\n", ptxOld->GetHash().ToString().c_str());
+            printf("CTxMemPool::accept() : replacing tx %s with new version\n", hashOld.ToString().c_str());
             remove(*ptxOld);
         }
-        addUnchecked(hash, tx);
+        addUnchecked(hash, entry, setAncestors);
+
+        // Resurrected transactions may go over the limit without complaint
+        TrimToSize(GetMaxMempoolSize());
+        fFull = fCheckInputs && !mapTx.count(hash);
     }
 
     ///// are we sure this is ok when loading transactions or restoring block txes
-    // If updated, erase old tx from wallet
+    // If updated, erase old tx from wallet; it has left the pool even if
+    // the new version was trimmed right away
     if (ptxOld)
-        EraseFromWallets(ptxOld->GetHash());
+        EraseFromWallets(hashOld);
+
+    if (fFull)
+        return error("CTxMemPool::accept() : mempool full %s", hash.ToString().substr(0,10).c_str());
 
     printf("CTxMemPool::accept() : accepted %s (poolsz %"PRIszu")\n",
            hash.ToString().substr(0,10).c_str(),
@@ -759,39 +869,328 @@ bool CTransaction::AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs, bool* pfMi
     return mempool.accept(txdb, *this, fCheckInputs, pfMissingInputs);
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+// Rough memory held by a transaction's vectors and scripts
+static size_t GetTxDynamicUsage(const CTransaction& tx)
+{
+    size_t nUsage = tx.vin.capacity() * sizeof(CTxIn) + tx.vout.capacity() * sizeof(CTxOut);
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += txin.scriptSig.capacity();
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += txout.scriptPubKey.capacity();
+    return nUsage;
+}
+
+// Estimated size of a node of a std::map or std::set holding T
+template<typename T>
+static inline size_t TreeNodeUsage()
+{
+    return sizeof(T) + 4 * sizeof(void*);
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, int64_t nTimeIn,
+                                 double dEntryPriorityIn, int nEntryHeightIn, int64_t nInChainInputValueIn) :
+    tx(txIn), nFee(nFeeIn), nTime(nTimeIn), dEntryPriority(dEntryPriorityIn),
+    nEntryHeight(nEntryHeightIn), nInChainInputValue(nInChainInputValueIn), nSequence(0)
+{
+    if (!tx.fHashCached)
+        tx.UpdateHash();
+    hash = tx.GetHash();
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nUsageSize = GetTxDynamicUsage(tx);
+
+    nCountWithAncestors = nCountWithDescendants = 1;
+    nSizeWithAncestors = nSizeWithDescendants = nTxSize;
+    nFeesWithAncestors = nFeesWithDescendants = nFee;
+}
+
+size_t GetMaxMempoolSize()
+{
+    return (size_t)GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+}
+
+CTxMemPool::CTxMemPool()
+{
+    nTotalTxSize = 0;
+    nCachedInnerUsage = 0;
+    nEvicted = 0;
+    dRollingMinFeeRate = 0;
+    nLastRollingFeeUpdate = GetTime();
+    nSequence = 0;
+    nRemovals = 0;
+}
+
+void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool fAdd)
+{
+    setEntries& parents = mapLinks[entry].parents;
+    if (fAdd && parents.insert(parent).second)
+        nCachedInnerUsage += TreeNodeUsage<txiter>();
+    else if (!fAdd && parents.erase(parent))
+        nCachedInnerUsage -= TreeNodeUsage<txiter>();
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool fAdd)
+{
+    setEntries& children = mapLinks[entry].children;
+    if (fAdd && children.insert(child).second)
+        nCachedInnerUsage += TreeNodeUsage<txiter>();
+    else if (!fAdd && children.erase(child))
+        nCachedInnerUsage -= TreeNodeUsage<txiter>();
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolParents(txiter entry) const
+{
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.parents;
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolChildren(txiter entry) const
+{
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.children;
+}
+
+bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors,
+                                           uint64_t nLimitAncestorCount, uint64_t nLimitAncestorSize,
+                                           uint64_t nLimitDescendantCount, uint64_t nLimitDescendantSize,
+                                           string& strError) const
+{
+    LOCK(cs);
+    setEntries parentHashes;
+    txiter it = mapTx.find(entry.GetHash());
+    if (it != mapTx.end())
+        parentHashes = GetMemPoolParents(it);
+    else
+    {
+        BOOST_FOREACH(const CTxIn& txin, entry.GetTx().vin)
+        {
+            txiter piter = mapTx.find(txin.prevout.hash);
+            if (piter != mapTx.end())
+            {
+                parentHashes.insert(piter);
+                if (parentHashes.size() + 1 > nLimitAncestorCount)
+                {
+                    strError = strprintf("too many unconfirmed parents [limit: %"PRI64u"]", nLimitAncestorCount);
+                    return false;
+                }
+            }
+        }
+    }
+
+    uint64_t nTotalSize = entry.GetTxSize();
+    while (!parentHashes.empty())
+    {
+        txiter stageit = *parentHashes.begin();
+        setAncestors.insert(stageit);
+        parentHashes.erase(stageit);
+        nTotalSize += stageit->GetTxSize();
+
+        if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > nLimitDescendantSize)
+        {
+            strError = strprintf("exceeds descendant size limit for tx %s [limit: %"PRI64u"]", stageit->GetHash().ToString().substr(0,10).c_str(), nLimitDescendantSize);
+            return false;
+        }
+        if (stageit->GetCountWithDescendants() + 1 > nLimitDescendantCount)
+        {
+            strError = strprintf("too many descendants for tx %s [limit: %"PRI64u"]", stageit->GetHash().ToString().substr(0,10).c_str(), nLimitDescendantCount);
+            return false;
+        }
+        if (nTotalSize > nLimitAncestorSize)
+        {
+            strError = strprintf("exceeds ancestor size limit [limit: %"PRI64u"]", nLimitAncestorSize);
+            return false;
+        }
+
+        BOOST_FOREACH(txiter phash, GetMemPoolParents(stageit))
+        {
+            if (setAncestors.count(phash) == 0)
+                parentHashes.insert(phash);
+            if (parentHashes.size() + setAncestors.size() + 1 > nLimitAncestorCount)
+            {
+                strError = strprintf("too many unconfirmed ancestors [limit: %"PRI64u"]", nLimitAncestorCount);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void CTxMemPool::CalculateDescendants(txiter entryit, setEntries& setDescendants) const
+{
+    setEntries stage;
+    if (setDescendants.count(entryit) == 0)
+        stage.insert(entryit);
+    while (!stage.empty())
+    {
+        txiter it = *stage.begin();
+        setDescendants.insert(it);
+        stage.erase(it);
+        BOOST_FOREACH(txiter childiter, GetMemPoolChildren(it))
+            if (!setDescendants.count(childiter))
+                stage.insert(childiter);
+    }
+}
+
+void CTxMemPool::UpdateAncestorTotals(txiter entry)
+{
+    setEntries setAncestors;
+    string strDummy;
+    CalculateMemPoolAncestors(*entry, setAncestors, -1, -1, -1, -1, strDummy);
+    int64_t nCount = 1, nSize = entry->GetTxSize(), nFees = entry->GetFee();
+    BOOST_FOREACH(txiter ancestor, setAncestors)
+    {
+        nCount++;
+        nSize += ancestor->GetTxSize();
+        nFees += ancestor->GetFee();
+    }
+    mapTx.modify(entry, boost::bind(&CTxMemPoolEntry::UpdateAncestorState, _1,
+        nCount - (int64_t)entry->GetCountWithAncestors(), nSize - (int64_t)entry->GetSizeWithAncestors(), nFees - entry->GetFeesWithAncestors()));
+}
+
+void CTxMemPool::UpdateDescendantTotals(txiter entry)
+{
+    setEntries setDescendants;
+    CalculateDescendants(entry, setDescendants);
+    int64_t nCount = 0, nSize = 0, nFees = 0;
+    BOOST_FOREACH(txiter descendant, setDescendants)
+    {
+        nCount++;
+        nSize += descendant->GetTxSize();
+        nFees += descendant->GetFee();
+    }
+    mapTx.modify(entry, boost::bind(&CTxMemPoolEntry::UpdateDescendantState, _1,
+        nCount - (int64_t)entry->GetCountWithDescendants(), nSize - (int64_t)entry->GetSizeWithDescendants(), nFees - entry->GetFeesWithDescendants()));
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry, const setEntries& setAncestors)
 {
     // Add to memory pool without checking anything.  Don't call this directly,
     // call CTxMemPool::accept to properly check the transaction first.
+    LOCK(cs);
+    txiter newit = mapTx.insert(entry).first;
+    mapTx.modify(newit, boost::bind(&CTxMemPoolEntry::SetSequence, _1, ++nSequence));
+    mapLinks.insert(make_pair(newit, TxLinks()));
+    nCachedInnerUsage += TreeNodeUsage<txlinksMap::value_type>();
+
+    const CTransaction& tx = newit->GetTx();
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+        txiter parent = mapTx.find(tx.vin[i].prevout.hash);
+        if (parent != mapTx.end())
+        {
+            UpdateParent(newit, parent, true);
+            UpdateChild(parent, newit, true);
+        }
+    }
+
+    // A transaction back from a disconnected block can have children in
+    // the pool already
+    setEntries setDescendants;
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+        if (it == mapNextTx.end())
+            continue;
+        txiter child = mapTx.find(it->second.ptx->GetHash());
+        UpdateChild(newit, child, true);
+        UpdateParent(child, newit, true);
+        CalculateDescendants(child, setDescendants);
+    }
+
+    if (setDescendants.empty())
+    {
+        // Every ancestor gains this entry as a descendant
+        int64_t nSizeAncestors = 0, nFeesAncestors = 0;
+        BOOST_FOREACH(txiter ancestor, setAncestors)
+        {
+            mapTx.modify(ancestor, boost::bind(&CTxMemPoolEntry::UpdateDescendantState, _1, 1, (int64_t)entry.GetTxSize(), entry.GetFee()));
+            nSizeAncestors += ancestor->GetTxSize();
+            nFeesAncestors += ancestor->GetFee();
+        }
+        mapTx.modify(newit, boost::bind(&CTxMemPoolEntry::UpdateAncestorState, _1, (int64_t)setAncestors.size(), nSizeAncestors, nFeesAncestors));
+    }
+    else
     {
-        mapTx[hash] = tx;
-        for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
-        nTransactionsUpdated++;
+        // The entry joins two families, count them over
+        setDescendants.insert(newit);
+        BOOST_FOREACH(txiter descendant, setDescendants)
+            UpdateAncestorTotals(descendant);
+        UpdateDescendantTotals(newit);
+        BOOST_FOREACH(txiter ancestor, setAncestors)
+            UpdateDescendantTotals(ancestor);
     }
+
+    nTotalTxSize += entry.GetTxSize();
+    nCachedInnerUsage += entry.DynamicMemoryUsage() + tx.vin.size() * TreeNodeUsage<pair<const COutPoint, CInPoint> >();
+    nTransactionsUpdated++;
     return true;
 }
 
+// Removes the entries in stage and takes them out of the totals of the
+// relatives that stay
+void CTxMemPool::RemoveStaged(const setEntries& stage)
+{
+    // Take the entries out of their relatives' totals while the links are intact
+    BOOST_FOREACH(txiter it, stage)
+    {
+        setEntries setAncestors;
+        string strDummy;
+        CalculateMemPoolAncestors(*it, setAncestors, -1, -1, -1, -1, strDummy);
+        BOOST_FOREACH(txiter ancestor, setAncestors)
+            if (!stage.count(ancestor))
+                mapTx.modify(ancestor, boost::bind(&CTxMemPoolEntry::UpdateDescendantState, _1, -1, -(int64_t)it->GetTxSize(), -it->GetFee()));
+        setEntries setDescendants;
+        CalculateDescendants(it, setDescendants);
+        BOOST_FOREACH(txiter descendant, setDescendants)
+            if (!stage.count(descendant))
+                mapTx.modify(descendant, boost::bind(&CTxMemPoolEntry::UpdateAncestorState, _1, -1, -(int64_t)it->GetTxSize(), -it->GetFee()));
+    }
+
+    BOOST_FOREACH(txiter it, stage)
+    {
+        BOOST_FOREACH(txiter parent, GetMemPoolParents(it))
+            UpdateChild(parent, it, false);
+        BOOST_FOREACH(txiter child, GetMemPoolChildren(it))
+            UpdateParent(child, it, false);
+    }
+
+    BOOST_FOREACH(txiter it, stage)
+    {
+        const CTransaction& tx = it->GetTx();
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            mapNextTx.erase(txin.prevout);
+
+        txlinksMap::iterator linksiter = mapLinks.find(it);
+        nCachedInnerUsage -= (linksiter->second.parents.size() + linksiter->second.children.size()) * TreeNodeUsage<txiter>();
+        mapLinks.erase(linksiter);
+        nCachedInnerUsage -= TreeNodeUsage<txlinksMap::value_type>();
+
+        nTotalTxSize -= it->GetTxSize();
+        nCachedInnerUsage -= it->DynamicMemoryUsage() + tx.vin.size() * TreeNodeUsage<pair<const COutPoint, CInPoint> >();
+        mapTx.erase(it);
+    }
+    nRemovals++;
+    nTransactionsUpdated++;
+}
 
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
-        uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
+        txiter it = mapTx.find(tx.GetHash());
+        if (it != mapTx.end())
         {
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it != mapNextTx.end())
-                        remove(*it->second.ptx, true);
-                }
-            }
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+            // Children of a transaction confirmed in a block stay; their
+            // ancestor totals drop it
+            setEntries stage;
+            if (fRecursive)
+                CalculateDescendants(it, stage);
+            else
+                stage.insert(it);
+            RemoveStaged(stage);
         }
     }
     return true;
@@ -815,8 +1214,12 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
+    nTotalTxSize = 0;
+    nCachedInnerUsage = 0;
+    nRemovals++;
     ++nTransactionsUpdated;
 }
 
@@ -826,8 +1229,87 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (indexed_transaction_set::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetHash());
+}
+
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // Each entry sits in one hashed and two ordered indexes
+    return mapTx.size() * (sizeof(CTxMemPoolEntry) + 8 * sizeof(void*)) +
+           mapTx.bucket_count() * sizeof(void*) + nCachedInnerUsage;
+}
+
+void CTxMemPool::TrimToSize(size_t nSizeLimit)
+{
+    LOCK(cs);
+    double dMaxFeeRateRemoved = 0;
+    unsigned int nRemoved = 0;
+    while (!mapTx.empty() && DynamicMemoryUsage() > nSizeLimit)
+    {
+        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+
+        // The pool now asks for more than the package paid
+        double dFeeRate = (double)it->GetFeesWithDescendants() * 1000 / it->GetSizeWithDescendants() + MIN_RELAY_TX_FEE;
+        dMaxFeeRateRemoved = max(dMaxFeeRateRemoved, dFeeRate);
+
+        setEntries stage;
+        CalculateDescendants(mapTx.project<0>(it), stage);
+        nRemoved += stage.size();
+        RemoveStaged(stage);
+    }
+
+    if (nRemoved > 0)
+    {
+        if (dMaxFeeRateRemoved > dRollingMinFeeRate)
+        {
+            dRollingMinFeeRate = dMaxFeeRateRemoved;
+            nLastRollingFeeUpdate = GetTime();
+        }
+        nEvicted += nRemoved;
+        printf("CTxMemPool::TrimToSize() : evicted %u transactions, min fee now %.0f per kB\n", nRemoved, dRollingMinFeeRate);
+    }
+}
+
+int64_t CTxMemPool::GetMinFee(size_t nSizeLimit)
+{
+    LOCK(cs);
+    if (dRollingMinFeeRate == 0)
+        return 0;
+
+    int64_t nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate + 10)
+    {
+        // Decay faster while the pool has room to spare
+        double dHalflife = MEMPOOL_FEE_HALFLIFE;
+        size_t nUsage = DynamicMemoryUsage();
+        if (nUsage < nSizeLimit / 4)
+            dHalflife /= 4;
+        else if (nUsage < nSizeLimit / 2)
+            dHalflife /= 2;
+
+        dRollingMinFeeRate /= pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalflife);
+        nLastRollingFeeUpdate = nNow;
+
+        if (dRollingMinFeeRate < MIN_RELAY_TX_FEE / 2)
+        {
+            dRollingMinFeeRate = 0;
+            return 0;
+        }
+    }
+    return max((int64_t)dRollingMinFeeRate, MIN_RELAY_TX_FEE);
+}
+
+void CTxMemPool::GetStats(CTxMemPoolStats& stats, size_t nSizeLimit)
+{
+    LOCK(cs);
+    stats.nTx = mapTx.size();
+    stats.nBytes = nTotalTxSize;
+    stats.nUsage = DynamicMemoryUsage();
+    stats.nMaxUsage = nSizeLimit;
+    stats.nMinFeePerKb = GetMinFee(nSizeLimit);
+    stats.nEvicted = nEvicted;
 }
 
 
@@ -839,7 +1321,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
         return 0;
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -931,7 +1413,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -945,14 +1427,8 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 {
     {
         LOCK(cs_main);
-        {
-            LOCK(mempool.cs);
-            if (mempool.exists(hash))
-            {
-                tx = mempool.lookup(hash);
-                return true;
-            }
-        }
+        if (mempool.lookup(hash, tx))
+            return true;
         CTxDB txdb("r");
         CTxIndex txindex;
         if (tx.ReadFromDisk(txdb, COutPoint(hash, 0), txindex))
@@ -1571,6 +2047,15 @@ bool IsInitialBlockDownload()
             pindexBest->GetBlockTime() < GetTime() - 24 * 60 * 60);
 }
 
+// Block files and the transaction index are synced to disk for every block,
+// except during initial download where only every -syncinterval'th is
+bool IsBlockSyncPoint()
+{
+    if (nSyncInterval <= 1 || !IsInitialBlockDownload())
+        return true;
+    return (nBestHeight+1) % nSyncInterval == 0;
+}
+
 void static InvalidChainFound(CBlockIndex* pindexNew)
 {
     if (pindexNew->nChainTrust > nBestInvalidTrust)
@@ -1680,20 +2165,20 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
         if (!fFound || txindex.pos == CDiskTxPos(1,1,1))
         {
             // Get prev tx from single transactions in memory
-            {
-                LOCK(mempool.cs);
-                if (!mempool.exists(prevout.hash))
-                    return error("FetchInputs() : %s mempool Tx prev not found %s", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
-                txPrev = mempool.lookup(prevout.hash);
-            }
+            if (!mempool.lookup(prevout.hash, txPrev))
+                return error("FetchInputs() : %s mempool Tx prev not found %s", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
             if (!fFound)
                 txindex.vSpent.resize(txPrev.vout.size());
         }
         else
         {
-            // Get prev tx from disk
-            if (!txPrev.ReadFromDisk(txindex.pos))
-                return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
+            // Get prev tx from the transaction cache or from disk
+            if (!GetCachedTransaction(prevout.hash, txPrev))
+            {
+                if (!txPrev.ReadFromDisk(txindex.pos))
+                    return error("FetchInputs() : %s ReadFromDisk prev tx %s failed", GetHash().ToString().substr(0,10).c_str(),  prevout.hash.ToString().substr(0,10).c_str());
+                CacheTransaction(txPrev);
+            }
         }
     }
 
@@ -1759,8 +2244,85 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
     return nSigOps;
 }
 
+bool CScriptCheck::operator()() const
+{
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nHashType))
+        return error("CScriptCheck() : %s VerifySignature failed on input %u", ptxTo->GetHash().ToString().substr(0,10).c_str(), nIn);
+    return true;
+}
+
+void ThreadScriptCheck(void* parg)
+{
+    // Make this thread recognisable as a script verification thread
+    RenameThread("netcoin-scriptch");
+
+    try
+    {
+        vnThreadsRunning[THREAD_SCRIPTCHECK]++;
+        scriptcheckqueue.Thread();
+        vnThreadsRunning[THREAD_SCRIPTCHECK]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_SCRIPTCHECK]--;
+        PrintException(&e, "ThreadScriptCheck()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_SCRIPTCHECK]--;
+        PrintException(NULL, "ThreadScriptCheck()");
+    }
+    printf("ThreadScriptCheck exiting\n");
+}
+
+void StopScriptCheck()
+{
+    scriptcheckqueue.Quit();
+}
+
+struct CParallelForState
+{
+    boost::mutex mutex;
+    unsigned int nNext;
+    unsigned int nEnd;
+    boost::function<void (unsigned int)> fn;
+};
+
+static void ParallelForWorker(CParallelForState* state)
+{
+    static const unsigned int nBatchSize = 16;
+    while (true)
+    {
+        unsigned int nBegin, nStop;
+        {
+            boost::unique_lock<boost::mutex> lock(state->mutex);
+            if (state->nNext >= state->nEnd)
+                return;
+            nBegin = state->nNext;
+            nStop = min(state->nEnd, nBegin + nBatchSize);
+            state->nNext = nStop;
+        }
+        for (unsigned int i = nBegin; i < nStop; i++)
+            state->fn(i);
+    }
+}
+
+// Calls fn(0) ... fn(n-1) in no particular order, on as many threads as
+// script verification uses; the calling thread takes part as well
+void ParallelFor(unsigned int n, const boost::function<void (unsigned int)>& fn)
+{
+    CParallelForState state;
+    state.nNext = 0;
+    state.nEnd = n;
+    state.fn = fn;
+
+    boost::thread_group threads;
+    for (int i = 1; i < nScriptCheckThreads && (unsigned int)i < n; i++)
+        threads.create_thread(boost::bind(&ParallelForWorker, &state));
+    ParallelForWorker(&state);
+    threads.join_all();
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1815,8 +2377,14 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
-                // Verify signature
-                if (!VerifySignature(txPrev, *this, i, 0))
+                // Verify signature, or leave it to the caller's check queue
+                CScriptCheck check(txPrev, *this, i, 0);
+                if (pvChecks)
+                {
+                    pvChecks->push_back(CScriptCheck());
+                    check.swap(pvChecks->back());
+                }
+                else if (!check())
                 {
                     return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString().substr(0,10).c_str()));
                 }
@@ -1870,9 +2438,9 @@ bool CTransaction::ClientConnectInputs()
         {
             // Get prev tx from single transactions in memory
             COutPoint prevout = vin[i].prevout;
-            if (!mempool.exists(prevout.hash))
+            CTransaction txPrev;
+            if (!mempool.lookup(prevout.hash, txPrev))
                 return false;
-            CTransaction& txPrev = mempool.lookup(prevout.hash);
 
             if (prevout.n >= txPrev.vout.size())
                 return false;
@@ -1951,6 +2519,11 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     int64_t nValueOut = 0;
     int64_t nStakeReward = 0;
     unsigned int nSigOps = 0;
+
+    // Signature checks are handed to the script check threads as each
+    // transaction is connected, and collected before the block is accepted
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
     BOOST_FOREACH(CTransaction& tx, vtx)
     {
         uint256 hashTx = tx.GetHash();
@@ -2007,8 +2580,10 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (tx.IsCoinStake())
                 nStakeReward = nTxValueOut - nTxValueIn;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false))
+            vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
@@ -2043,6 +2618,9 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return DoS(100, error("ConnectBlock() : coinstake pays too much(actual=%"PRI64d" vs calculated=%"PRI64d")", nStakeReward, nCalculatedStakeReward));
     }
 
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : script verification failed"));
+
     // ppcoin: track money supply and mint amount info
     pindex->nMint = nValueOut - nValueIn + nFees;
     pindex->nMoneySupply = (pindex->pprev? pindex->pprev->nMoneySupply : 0) + nValueOut - nValueIn;
@@ -2069,6 +2647,11 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : WriteBlockIndex failed");
     }
 
+    // Outputs created by recent blocks are the most likely to be spent next
+    BOOST_FOREACH(CTransaction& tx, vtx)
+        if (!tx.IsCoinBase())
+            CacheTransaction(tx);
+
     // Watch for transactions paying to me
     BOOST_FOREACH(CTransaction& tx, vtx)
         SyncWithWallets(tx, this, true);
@@ -2153,6 +2736,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
         if (pindex->pprev)
             pindex->pprev->pnext = NULL;
+    InvalidateKernelModifierCache(pfork->nHeight);
 
     // Connect longer branch
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
@@ -2282,6 +2866,12 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
     nTimeBestReceived = GetTime();
     nTransactionsUpdated++;
 
+    // ppcoin: bring the stake candidates up to date with the new best block;
+    // skipped during the initial download, the stake miner refreshes them
+    // once when it ends
+    if (!IsInitialBlockDownload())
+        UpdateStakeCandidates();
+
     uint256 nBestBlockTrust = pindexBest->nHeight != 0 ? (pindexBest->nChainTrust - pindexBest->pprev->nChainTrust) : pindexBest->nChainTrust;
 
     printf("SetBestChain: new best=%s  height=%d  trust=%s  blocktrust=%"PRI64d"  date=%s\n",
@@ -2448,7 +3038,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     if (!pindexNew)
         return error("AddToBlockIndex() : new CBlockIndex failed");
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
@@ -2476,7 +3066,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=0x%016"PRI64x, pindexNew->nHeight, nStakeModifier);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
@@ -2486,7 +3076,9 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     if (!txdb.TxnBegin())
         return false;
     txdb.WriteBlockIndex(CDiskBlockIndex(pindexNew));
-    if (!txdb.TxnCommit())
+    // No need to sync here, the SetBestChain commit below or the next
+    // block's commit flushes the log this record is in
+    if (!txdb.TxnCommit(false))
         return false;
 
     // New best
@@ -2599,7 +3191,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2664,10 +3256,34 @@ bool CBlock::AcceptBlock()
     int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
     if (hashBestChain == hash)
     {
+        // Peers that asked for it get the block right away as a compact block
+        CInv inv(MSG_BLOCK, hash);
+        CCompactBlock cmpctblock;
+        bool fCompactBuilt = false;
         LOCK(cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
-            if (nBestHeight > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                pnode->PushInventory(CInv(MSG_BLOCK, hash));
+        {
+            if (nBestHeight <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                continue;
+            if (!pnode->fCompactAnnounce || IsInitialBlockDownload())
+            {
+                pnode->PushInventory(inv);
+                continue;
+            }
+            {
+                LOCK(pnode->cs_inventory);
+                if (pnode->setInventoryKnown.count(inv))
+                    continue;
+                pnode->setInventoryKnown.insert(inv);
+            }
+            if (!fCompactBuilt)
+            {
+                cmpctblock = CCompactBlock(*this);
+                fCompactBuilt = true;
+            }
+            pnode->PushMessage("cmpctblock", cmpctblock);
+            compactStats.nSent++;
+        }
     }
 
     // ppcoin: check pending sync-checkpoint
@@ -2699,34 +3315,207 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+// Orphan blocks wait in a pool of at most -maxorphanblocksize bytes.  They
+// pass CheckBlock() in full before they are pooled, so a block header copied
+// onto other transactions can't take the real block's place.  Once their
+// parent is accepted, the orphan stage thread connects them one by one,
+// taking cs_main for each, so the peer that delivered the parent is not held
+// up by the chain behind it.  The peer that sent an orphan is charged if it
+// fails there.
+static uint64_t nOrphanBlockBytes = 0;
+static deque<uint256> vOrphanParents;           // accepted blocks with orphan children
+static CWaitableCriticalSection csOrphanStage;
+static boost::condition_variable condOrphanStage;
+static bool fOrphanStageWork = false;
+
+static void EraseOrphanBlock(COrphanBlock* pblock)
 {
-    // Check for duplicate
     uint256 hash = pblock->GetHash();
-    if (mapBlockIndex.count(hash))
-        return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString().substr(0,20).c_str());
-    if (mapOrphanBlocks.count(hash))
-        return error("ProcessBlock() : already have block (orphan) %s", hash.ToString().substr(0,20).c_str());
-
-    // ppcoin: check proof-of-stake
-    // Limited duplicity on stake: prevents block flood attack
-    // Duplicate stake allowed only when there is orphan child block
-    if (pblock->IsProofOfStake() && setStakeSeen.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
-        return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString().c_str(), pblock->GetProofOfStake().second, hash.ToString().c_str());
-
-    // Preliminary checks
-    if (!pblock->CheckBlock())
-        return error("ProcessBlock() : CheckBlock FAILED");
-
-    CBlockIndex* pcheckpoint = Checkpoints::GetLastSyncCheckpoint();
-    if (pcheckpoint && pblock->hashPrevBlock != hashBestChain && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+    mapOrphanBlocks.erase(hash);
+    for (multimap<uint256, COrphanBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(pblock->hashPrevBlock);
+         mi != mapOrphanBlocksByPrev.upper_bound(pblock->hashPrevBlock); ++mi)
     {
-        // Extra checks to prevent "fill up memory by spamming with bogus blocks"
-        int64_t deltaTime = pblock->GetBlockTime() - pcheckpoint->nTime;
-        if (deltaTime < 0)
+        if ((*mi).second == pblock)
         {
-            if (pfrom)
-                pfrom->Misbehaving(100);
+            mapOrphanBlocksByPrev.erase(mi);
+            break;
+        }
+    }
+    if (pblock->IsProofOfStake())
+        setStakeSeenOrphan.erase(pblock->GetProofOfStake());
+    nOrphanBlockBytes -= pblock->nBytes;
+    delete pblock;
+}
+
+// Evicts orphans until they take at most nMaxBytes, those nobody asked us
+// for first, oldest first
+void LimitOrphanBlocks(uint64_t nMaxBytes)
+{
+    while (nOrphanBlockBytes > nMaxBytes)
+    {
+        COrphanBlock* pvictim = NULL;
+        for (map<uint256, COrphanBlock*>::iterator mi = mapOrphanBlocks.begin(); mi != mapOrphanBlocks.end(); ++mi)
+        {
+            COrphanBlock* pblock = (*mi).second;
+            if (pblock->fConnecting)
+                continue;
+            if (pvictim == NULL || (pvictim->fRequested && !pblock->fRequested) ||
+                (pvictim->fRequested == pblock->fRequested && pblock->nTimeReceived < pvictim->nTimeReceived))
+                pvictim = pblock;
+        }
+        if (pvictim == NULL)
+            break;
+        printf("LimitOrphanBlocks() : evicting orphan block %s\n", pvictim->GetHash().ToString().substr(0,20).c_str());
+        EraseOrphanBlock(pvictim);
+    }
+}
+
+void QueueOrphanChildren(const uint256& hash)
+{
+    if (!mapOrphanBlocksByPrev.count(hash))
+        return;
+    vOrphanParents.push_back(hash);
+    boost::unique_lock<boost::mutex> lock(csOrphanStage);
+    fOrphanStageWork = true;
+    condOrphanStage.notify_one();
+}
+
+static void PunishOrphanSender(const COrphanBlock* pblock)
+{
+    if (pblock->nDoS == 0 || !pblock->fFromPeer)
+        return;
+    CNode* pnode = NULL;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pn, vNodes)
+        {
+            if (pn->addr == pblock->addrFrom && !pn->fDisconnect)
+            {
+                pnode = pn->AddRef();
+                break;
+            }
+        }
+    }
+    if (pnode == NULL)
+        return;
+    pnode->Misbehaving(pblock->nDoS);
+    LOCK(cs_vNodes);
+    pnode->Release();
+}
+
+// Connects the orphans whose parents were queued since the last call
+void ConnectOrphanBlocks()
+{
+    // Take the orphans that can be connected now, parents before children
+    vector<COrphanBlock*> vReady;
+    {
+        LOCK(cs_main);
+        vector<uint256> vWorkQueue(vOrphanParents.begin(), vOrphanParents.end());
+        vOrphanParents.clear();
+        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        {
+            uint256 hashPrev = vWorkQueue[i];
+            for (multimap<uint256, COrphanBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
+                 mi != mapOrphanBlocksByPrev.upper_bound(hashPrev); ++mi)
+            {
+                COrphanBlock* pblock = (*mi).second;
+                if (pblock->fConnecting)
+                    continue;
+                pblock->fConnecting = true;
+                vReady.push_back(pblock);
+                vWorkQueue.push_back(pblock->GetHash());
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < vReady.size(); i++)
+    {
+        LOCK(cs_main);
+        COrphanBlock* pblock = vReady[i];
+        uint256 hash = pblock->GetHash();
+        if (fShutdown || !mapBlockIndex.count(pblock->hashPrevBlock))
+        {
+            // Its parent was rejected, it stays an orphan; at shutdown it is
+            // left for the next start to fetch again
+            pblock->fConnecting = false;
+            continue;
+        }
+        if (pblock->AcceptBlock())
+        {
+            printf("ProcessOrphanBlocks() : ACCEPTED orphan block %s\n", hash.ToString().substr(0,20).c_str());
+            QueueOrphanChildren(hash);
+        }
+        PunishOrphanSender(pblock);
+        EraseOrphanBlock(pblock);
+    }
+}
+
+static void ProcessOrphanBlocks()
+{
+    while (!fShutdown)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(csOrphanStage);
+            if (!fOrphanStageWork)
+                condOrphanStage.timed_wait(lock, boost::posix_time::milliseconds(500));
+            fOrphanStageWork = false;
+        }
+        ConnectOrphanBlocks();
+    }
+}
+
+void ThreadOrphanBlocks(void* parg)
+{
+    // Make this thread recognisable as the orphan block stage
+    RenameThread("netcoin-orphans");
+
+    try
+    {
+        vnThreadsRunning[THREAD_ORPHANBLOCKS]++;
+        ProcessOrphanBlocks();
+        vnThreadsRunning[THREAD_ORPHANBLOCKS]--;
+    }
+    catch (std::exception& e) {
+        vnThreadsRunning[THREAD_ORPHANBLOCKS]--;
+        PrintException(&e, "ThreadOrphanBlocks()");
+    } catch (...) {
+        vnThreadsRunning[THREAD_ORPHANBLOCKS]--;
+        PrintException(NULL, "ThreadOrphanBlocks()");
+    }
+    printf("ThreadOrphanBlocks exiting\n");
+}
+
+bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+{
+    // Check for duplicate
+    uint256 hash = pblock->GetHash();
+    if (mapBlockIndex.count(hash))
+        return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString().substr(0,20).c_str());
+    if (mapOrphanBlocks.count(hash))
+        return error("ProcessBlock() : already have block (orphan) %s", hash.ToString().substr(0,20).c_str());
+
+    // ppcoin: check proof-of-stake
+    // Limited duplicity on stake: prevents block flood attack
+    // Duplicate stake allowed only when there is orphan child block
+    if (pblock->IsProofOfStake() && setStakeSeen.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+        return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for block %s", pblock->GetProofOfStake().first.ToString().c_str(), pblock->GetProofOfStake().second, hash.ToString().c_str());
+
+    // Preliminary checks, in full for orphans too: the stake signature and
+    // the proof-of-work only cover the header, the merkle root ties the
+    // transactions to it before the block is pooled under its hash
+    bool fOrphan = !mapBlockIndex.count(pblock->hashPrevBlock);
+    if (!pblock->CheckBlock())
+        return error("ProcessBlock() : CheckBlock FAILED");
+
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastSyncCheckpoint();
+    if (pcheckpoint && pblock->hashPrevBlock != hashBestChain && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+    {
+        // Extra checks to prevent "fill up memory by spamming with bogus blocks"
+        int64_t deltaTime = pblock->GetBlockTime() - pcheckpoint->nTime;
+        if (deltaTime < 0)
+        {
+            if (pfrom)
+                pfrom->Misbehaving(100);
             return error("ProcessBlock() : block with timestamp before last checkpoint");
         }
         CBigNum bnNewBlock;
@@ -2751,25 +3540,36 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         Checkpoints::AskForPendingSyncCheckpoint(pfrom);
 
     // If don't already have its previous block, shunt it off to holding area until we get it
-    if (!mapBlockIndex.count(pblock->hashPrevBlock))
+    if (fOrphan)
     {
         printf("ProcessBlock: ORPHAN BLOCK, prev=%s\n", pblock->hashPrevBlock.ToString().substr(0,20).c_str());
-        CBlock* pblock2 = new CBlock(*pblock);
         // ppcoin: check proof-of-stake
-        if (pblock2->IsProofOfStake())
+        if (pblock->IsProofOfStake())
         {
             // Limited duplicity on stake: prevents block flood attack
             // Duplicate stake allowed only when there is orphan child block
-            if (setStakeSeenOrphan.count(pblock2->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
-                return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for orphan block %s", pblock2->GetProofOfStake().first.ToString().c_str(), pblock2->GetProofOfStake().second, hash.ToString().c_str());
+            if (setStakeSeenOrphan.count(pblock->GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hash) && !Checkpoints::WantedByPendingSyncCheckpoint(hash))
+                return error("ProcessBlock() : duplicate proof-of-stake (%s, %d) for orphan block %s", pblock->GetProofOfStake().first.ToString().c_str(), pblock->GetProofOfStake().second, hash.ToString().c_str());
             else
-                setStakeSeenOrphan.insert(pblock2->GetProofOfStake());
+                setStakeSeenOrphan.insert(pblock->GetProofOfStake());
+        }
+        bool fRequested = !pfrom || mapSyncHeaders.count(hash) || mapAlreadyAskedFor.count(CInv(MSG_BLOCK, hash));
+        COrphanBlock* pblock2 = new COrphanBlock(*pblock, ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION), fRequested);
+        if (pfrom)
+        {
+            pblock2->fFromPeer = true;
+            pblock2->addrFrom = pfrom->addr;
         }
         mapOrphanBlocks.insert(make_pair(hash, pblock2));
         mapOrphanBlocksByPrev.insert(make_pair(pblock2->hashPrevBlock, pblock2));
-
-        // Ask this guy to fill in what we're missing
-        if (pfrom)
+        nOrphanBlockBytes += pblock2->nBytes;
+        LimitOrphanBlocks(GetArg("-maxorphanblocksize", DEFAULT_MAX_ORPHAN_BLOCKS_SIZE) * 1000000);
+        if (!mapOrphanBlocks.count(hash))
+            return error("ProcessBlock() : orphan pool full, dropped orphan block %s", hash.ToString().substr(0,20).c_str());
+
+        // Ask this guy to fill in what we're missing, unless the block came
+        // in through the headers-first download window
+        if (pfrom && !mapSyncHeaders.count(hash))
         {
             pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
             // ppcoin: getblocks may not obtain the ancestor block rejected
@@ -2784,25 +3584,8 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
     if (!pblock->AcceptBlock())
         return error("ProcessBlock() : AcceptBlock FAILED");
 
-    // Recursively process any orphan blocks that depended on this one
-    vector<uint256> vWorkQueue;
-    vWorkQueue.push_back(hash);
-    for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-    {
-        uint256 hashPrev = vWorkQueue[i];
-        for (multimap<uint256, CBlock*>::iterator mi = mapOrphanBlocksByPrev.lower_bound(hashPrev);
-             mi != mapOrphanBlocksByPrev.upper_bound(hashPrev);
-             ++mi)
-        {
-            CBlock* pblockOrphan = (*mi).second;
-            if (pblockOrphan->AcceptBlock())
-                vWorkQueue.push_back(pblockOrphan->GetHash());
-            mapOrphanBlocks.erase(pblockOrphan->GetHash());
-            setStakeSeenOrphan.erase(pblockOrphan->GetProofOfStake());
-            delete pblockOrphan;
-        }
-        mapOrphanBlocksByPrev.erase(hashPrev);
-    }
+    // Orphan blocks that depended on this one are left to the orphan stage
+    QueueOrphanChildren(hash);
 
     printf("ProcessBlock: ACCEPTED\n");
 
@@ -2929,6 +3712,161 @@ FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszM
     return file;
 }
 
+//
+// Block files are kept mapped read-only so transaction and block reads
+// deserialize straight from the page cache instead of going through
+// fopen/fseek/fread.  Appends still go through stdio; the mapping of the
+// file being written is refreshed when a read runs past its end.
+//
+
+/** A read-only mapping of one blkNNNN.dat, unmapped when the last reader drops it */
+class CBlockFileMapping
+{
+public:
+    char* pData;
+    size_t nSize;
+
+    CBlockFileMapping() : pData(NULL), nSize(0) {}
+    ~CBlockFileMapping()
+    {
+#ifndef WIN32
+        if (pData)
+            munmap(pData, nSize);
+#endif
+    }
+};
+
+static const unsigned int MAX_BLOCKFILE_MAPPINGS = 8;
+
+static CCriticalSection cs_BlockFileMappings;
+static map<unsigned int, boost::shared_ptr<CBlockFileMapping> > mapBlockFileMappings;
+static list<unsigned int> listBlockFileMappingsLRU; // most recently used first
+
+static boost::shared_ptr<CBlockFileMapping> CreateBlockFileMapping(unsigned int nFile)
+{
+    boost::shared_ptr<CBlockFileMapping> mapping;
+#ifndef WIN32
+    int fd = open(BlockFilePath(nFile).string().c_str(), O_RDONLY);
+    if (fd < 0)
+        return mapping;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            mapping.reset(new CBlockFileMapping());
+            mapping->pData = (char*)p;
+            mapping->nSize = st.st_size;
+        }
+    }
+    close(fd);
+#endif
+    return mapping;
+}
+
+bool MapBlockFile(unsigned int nFile, unsigned int nPos, boost::shared_ptr<CBlockFileMapping>& mappingRet, const char*& pbeginRet, const char*& pendRet, bool fRefresh)
+{
+    // Mapping 2GB block files would exhaust a 32-bit address space
+    if (sizeof(void*) < 8 || !fMapBlockFiles)
+        return false;
+    if ((nFile < 1) || (nFile == (unsigned int) -1))
+        return false;
+
+    LOCK(cs_BlockFileMappings);
+    map<unsigned int, boost::shared_ptr<CBlockFileMapping> >::iterator mi = mapBlockFileMappings.find(nFile);
+    if (mi != mapBlockFileMappings.end() && (fRefresh || nPos >= mi->second->nSize))
+    {
+        // Readers still holding the old mapping keep it alive until they are done
+        mapBlockFileMappings.erase(mi);
+        listBlockFileMappingsLRU.remove(nFile);
+        mi = mapBlockFileMappings.end();
+    }
+    if (mi == mapBlockFileMappings.end())
+    {
+        boost::shared_ptr<CBlockFileMapping> mapping = CreateBlockFileMapping(nFile);
+        if (!mapping)
+            return false;
+        while (mapBlockFileMappings.size() >= MAX_BLOCKFILE_MAPPINGS)
+        {
+            mapBlockFileMappings.erase(listBlockFileMappingsLRU.back());
+            listBlockFileMappingsLRU.pop_back();
+        }
+        mi = mapBlockFileMappings.insert(make_pair(nFile, mapping)).first;
+    }
+    else
+        listBlockFileMappingsLRU.remove(nFile);
+    listBlockFileMappingsLRU.push_front(nFile);
+
+    mappingRet = mi->second;
+    if (nPos >= mappingRet->nSize)
+        return false;
+    pbeginRet = mappingRet->pData + nPos;
+    pendRet = mappingRet->pData + mappingRet->nSize;
+    return true;
+}
+
+// Appends the block at nBlockPos of block file nFile to ssRet as stored by
+// CBlock::WriteToDisk, which is also its network serialization
+bool ReadRawBlockFromDisk(unsigned int nFile, unsigned int nBlockPos, CDataStream& ssRet)
+{
+    unsigned int nSize = 0;
+    const unsigned int nPrefixSize = sizeof(pchMessageStart) + sizeof(nSize);
+    if (nBlockPos < nPrefixSize)
+        return error("ReadRawBlockFromDisk() : bad block position");
+    unsigned int nPos = nBlockPos - nPrefixSize;
+
+    for (int nTry = 0; nTry < 2; nTry++)
+    {
+        boost::shared_ptr<CBlockFileMapping> mapping;
+        const char* pbegin;
+        const char* pend;
+        if (!MapBlockFile(nFile, nPos, mapping, pbegin, pend, nTry > 0))
+            break;
+        if ((size_t)(pend - pbegin) < nPrefixSize)
+            continue;
+        if (memcmp(pbegin, pchMessageStart, sizeof(pchMessageStart)) != 0)
+            return error("ReadRawBlockFromDisk() : no block at %u:%u", nFile, nBlockPos);
+        memcpy(&nSize, pbegin + sizeof(pchMessageStart), sizeof(nSize));
+        if (nSize > MAX_BLOCK_SIZE)
+            return error("ReadRawBlockFromDisk() : block size %u too large", nSize);
+        if ((size_t)(pend - pbegin) - nPrefixSize < nSize)
+            continue;
+        ssRet.write(pbegin + nPrefixSize, nSize);
+        return true;
+    }
+
+    CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nPos, "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("ReadRawBlockFromDisk() : OpenBlockFile failed");
+    char pchMagic[sizeof(pchMessageStart)];
+    try {
+        filein >> FLATDATA(pchMagic) >> nSize;
+    }
+    catch (std::exception &e) {
+        return error("ReadRawBlockFromDisk() : I/O error");
+    }
+    if (memcmp(pchMagic, pchMessageStart, sizeof(pchMessageStart)) != 0)
+        return error("ReadRawBlockFromDisk() : no block at %u:%u", nFile, nBlockPos);
+    if (nSize > MAX_BLOCK_SIZE)
+        return error("ReadRawBlockFromDisk() : block size %u too large", nSize);
+    unsigned int nOldSize = ssRet.size();
+    ssRet.resize(nOldSize + nSize);
+    if (fread(&ssRet[nOldSize], 1, nSize, filein) != nSize)
+    {
+        ssRet.resize(nOldSize);
+        return error("ReadRawBlockFromDisk() : fread failed");
+    }
+    return true;
+}
+
+void CloseBlockFileMappings()
+{
+    LOCK(cs_BlockFileMappings);
+    mapBlockFileMappings.clear();
+    listBlockFileMappingsLRU.clear();
+}
+
 static unsigned int nCurrentBlockFile = 1;
 
 FILE* AppendBlockFile(unsigned int& nFileRet)
@@ -3088,7 +4026,7 @@ void PrintBlockTree()
 {
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -3242,95 +4180,969 @@ string GetWarnings(string strFor)
         strStatusBar = strMiscWarning;
     }
 
-    // if detected invalid checkpoint enter safe mode
-    if (Checkpoints::hashInvalidCheckpoint != 0)
+    // if detected invalid checkpoint enter safe mode
+    if (Checkpoints::hashInvalidCheckpoint != 0)
+    {
+        nPriority = 3000;
+        strStatusBar = strRPC = _("WARNING: Invalid checkpoint found! Displayed transactions may not be correct! You may need to upgrade, or notify developers.");
+    }
+
+    // Alerts
+    {
+        LOCK(cs_mapAlerts);
+        BOOST_FOREACH(PAIRTYPE(const uint256, CAlert)& item, mapAlerts)
+        {
+            const CAlert& alert = item.second;
+            if (alert.AppliesToMe() && alert.nPriority > nPriority)
+            {
+                nPriority = alert.nPriority;
+                strStatusBar = alert.strStatusBar;
+                if (nPriority > 1000)
+                    strRPC = strStatusBar;
+            }
+        }
+    }
+
+    if (strFor == "statusbar")
+        return strStatusBar;
+    else if (strFor == "rpc")
+        return strRPC;
+    assert(!"GetWarnings() : invalid parameter");
+    return "error";
+}
+
+
+
+
+
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Messages
+//
+
+
+bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
+{
+    switch (inv.type)
+    {
+    case MSG_TX:
+        {
+        bool txInMap = false;
+            {
+            LOCK(mempool.cs);
+            txInMap = (mempool.exists(inv.hash));
+            }
+        return txInMap ||
+               mapOrphanTransactions.count(inv.hash) ||
+               txdb.ContainsTx(inv.hash);
+        }
+
+    case MSG_BLOCK:
+        return mapBlockIndex.count(inv.hash) ||
+               mapOrphanBlocks.count(inv.hash);
+    }
+    // Don't know what it is, just say we already got one
+    return true;
+}
+
+
+
+
+// The message start string is designed to be unlikely to occur in normal data.
+// The characters are rarely used upper ASCII, not valid as UTF-8, and produce
+// a large 4-byte int at any alignment.
+unsigned char pchMessageStart[4] = { 0xfd, 0xb6, 0xa5, 0xdb }; 
+
+bool IsValidPeerVersion(int nVersion, string strSubVer)
+{
+    if (nVersion < PROTOCOL_VERSION)
+    {
+        // Since February 20, 2012, the protocol is initiated at version 209,
+        // and earlier versions are no longer supported
+        return false;
+    }
+
+    if (strSubVer.find("Netcoin Stake:2") != std::string::npos) return true;
+
+    return false;
+
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Headers-first download
+//
+
+// The header chain is checked as far as headers allow and runs ahead of the
+// block chain.  Blocks along it are asked from every peer that has them
+// through a window above the best block; blocks that arrive out of order
+// wait in mapOrphanBlocks for their parent.
+static const unsigned int MAX_HEADERS_RESULTS = 2000;   // answer to one getheaders
+static const int MAX_HEADERS_AHEAD = 100000;            // headers kept ahead of the best block
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+static const int64_t HEADERS_RESPONSE_TIMEOUT = 60;
+static const int64_t BLOCK_STALL_TIMEOUT = 60;          // no block delivered while some are asked for
+static const int64_t BLOCK_WINDOW_STALL_TIMEOUT = 10;   // holding up a full window
+
+static int GetHeadersTipHeight()
+{
+    if (pindexHeadersBase == NULL)
+        return nBestHeight;
+    return max(nBestHeight, pindexHeadersBase->nHeight + (int)vSyncHeaders.size());
+}
+
+static void ReleaseHeadersSyncPeer()
+{
+    if (pnodeHeadersSync == NULL)
+        return;
+    {
+        LOCK(cs_vNodes);
+        pnodeHeadersSync->Release();
+    }
+    pnodeHeadersSync = NULL;
+    nHeadersRequestTime = 0;
+    fHeadersMore = false;
+}
+
+// Forgets the header chain; requests already made stay until answered
+void ResetHeadersSync()
+{
+    ReleaseHeadersSyncPeer();
+    vSyncHeaders.clear();
+    mapSyncHeaders.clear();
+    pindexHeadersBase = NULL;
+}
+
+static void TruncateSyncHeaders(int nHeight)
+{
+    while (!vSyncHeaders.empty() && pindexHeadersBase->nHeight + (int)vSyncHeaders.size() > nHeight)
+    {
+        mapSyncHeaders.erase(vSyncHeaders.back().hash);
+        vSyncHeaders.pop_back();
+    }
+}
+
+// Drops the headers whose blocks have been accepted
+static void TrimSyncHeaders()
+{
+    while (!vSyncHeaders.empty())
+    {
+        BlockMap::iterator mi = mapBlockIndex.find(vSyncHeaders.front().hash);
+        if (mi == mapBlockIndex.end())
+            break;
+        pindexHeadersBase = (*mi).second;
+        mapSyncHeaders.erase(vSyncHeaders.front().hash);
+        vSyncHeaders.pop_front();
+    }
+}
+
+static int64_t GetSyncMedianTimePast()
+{
+    vector<int64_t> vTimes;
+    for (deque<CSyncHeader>::reverse_iterator it = vSyncHeaders.rbegin(); it != vSyncHeaders.rend() && vTimes.size() < CBlockIndex::nMedianTimeSpan; ++it)
+        vTimes.push_back((*it).nTime);
+    for (const CBlockIndex* pindex = pindexHeadersBase; pindex && vTimes.size() < CBlockIndex::nMedianTimeSpan; pindex = pindex->pprev)
+        vTimes.push_back(pindex->GetBlockTime());
+    sort(vTimes.begin(), vTimes.end());
+    return vTimes[vTimes.size() / 2];
+}
+
+static CBlockLocator GetHeadersLocator()
+{
+    vector<uint256> vHave;
+    int nStep = 1;
+    for (int i = (int)vSyncHeaders.size() - 1; i >= 0; i -= nStep)
+    {
+        vHave.push_back(vSyncHeaders[i].hash);
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    const CBlockIndex* pindex = pindexHeadersBase ? pindexHeadersBase : pindexBest;
+    while (pindex)
+    {
+        vHave.push_back(pindex->GetBlockHash());
+        for (int i = 0; pindex && i < nStep; i++)
+            pindex = pindex->pprev;
+        if (vHave.size() > 10)
+            nStep *= 2;
+    }
+    vHave.push_back((!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet));
+    return CBlockLocator(vHave);
+}
+
+static void HashSyncHeader(const vector<CBlock>& vHeaders, vector<uint256>& vHash, vector<char>& vProofOfWork, unsigned int i)
+{
+    const CBlock& header = vHeaders[i];
+    vHash[i] = header.GetHash();
+    CBigNum bnTarget;
+    bnTarget.SetCompact(header.nBits);
+    vProofOfWork[i] = (bnTarget > 0 && bnTarget <= bnProofOfWorkLimit && header.GetPoWHash() <= bnTarget.getuint256());
+}
+
+static uint256 GetSyncTipTrust()
+{
+    if (!vSyncHeaders.empty())
+        return vSyncHeaders.back().nChainTrust;
+    return pindexHeadersBase ? pindexHeadersBase->nChainTrust : 0;
+}
+
+// Target of the next proof-of-stake block on the header chain.  The same
+// GetNextWorkRequired() AcceptBlock() uses runs over stand-in index entries
+// for the headers back to the second last proof-of-stake one, which is as
+// far as the proof-of-stake retargets look.
+static unsigned int GetSyncNextStakeTarget()
+{
+    if (vSyncHeaders.empty())
+        return GetNextWorkRequired(pindexHeadersBase, NULL, true);
+
+    unsigned int nFirst = vSyncHeaders.size();
+    int nStake = 0;
+    while (nFirst > 0 && nStake < 2)
+        if (vSyncHeaders[--nFirst].fProofOfStake)
+            nStake++;
+
+    vector<CBlockIndex> vIndex(vSyncHeaders.size() - nFirst);
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+    {
+        const CSyncHeader& header = vSyncHeaders[nFirst + i];
+        CBlockIndex& index = vIndex[i];
+        index.phashBlock = &header.hash;
+        index.pprev = (i == 0) ? pindexHeadersBase : &vIndex[i - 1];
+        index.nHeight = pindexHeadersBase->nHeight + nFirst + i + 1;
+        index.nTime = header.nTime;
+        index.nBits = header.nBits;
+        if (header.fProofOfStake)
+            index.SetProofOfStake();
+    }
+    return GetNextWorkRequired(&vIndex.back(), NULL, true);
+}
+
+// Checks a header as far as that can be done without its block and adds it
+// to the header chain.  A header that misses its proof-of-work target has
+// to be proof-of-stake, whether its stake is valid only shows with the block.
+static bool AcceptSyncHeader(const CBlock& header, const uint256& hash, bool fProofOfWork)
+{
+    if (mapBlockIndex.count(hash) || mapSyncHeaders.count(hash))
+        return true;
+
+    // Find the parent; a header off an earlier one replaces the rest of
+    // the header chain, one off a block we have starts it over from there
+    int nHeight;
+    uint256 nParentTrust;
+    map<uint256, int>::iterator mi = mapSyncHeaders.find(header.hashPrevBlock);
+    if (mi != mapSyncHeaders.end())
+    {
+        TruncateSyncHeaders((*mi).second);
+        nHeight = (*mi).second + 1;
+        nParentTrust = vSyncHeaders.back().nChainTrust;
+    }
+    else
+    {
+        BlockMap::iterator mb = mapBlockIndex.find(header.hashPrevBlock);
+        if (mb == mapBlockIndex.end())
+            return error("AcceptSyncHeader() : prev block %s not found", header.hashPrevBlock.ToString().substr(0,20).c_str());
+        vSyncHeaders.clear();
+        mapSyncHeaders.clear();
+        pindexHeadersBase = (*mb).second;
+        nHeight = pindexHeadersBase->nHeight + 1;
+        nParentTrust = pindexHeadersBase->nChainTrust;
+    }
+
+    if (!Checkpoints::CheckHardened(nHeight, hash))
+        return error("AcceptSyncHeader() : rejected by hardened checkpoint lock-in at %d", nHeight);
+
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+        return error("AcceptSyncHeader() : block timestamp too far in the future");
+    if (header.GetBlockTime() <= GetSyncMedianTimePast())
+        return error("AcceptSyncHeader() : block's timestamp is too early");
+
+    CBigNum bnTarget;
+    bnTarget.SetCompact(header.nBits);
+    if (bnTarget <= 0 || bnTarget > (fProofOfWork ? bnProofOfWorkLimit : GetProofOfStakeLimit(nHeight, header.nTime)))
+        return error("AcceptSyncHeader() : nBits out of range");
+
+    // Nothing but the retarget bounds a proof-of-stake header's target, and
+    // with it the trust the header adds to its branch
+    if (!fProofOfWork && header.nBits != GetSyncNextStakeTarget())
+        return error("AcceptSyncHeader() : incorrect proof-of-stake target");
+
+    // The same bound ProcessBlock puts on blocks after the last sync-checkpoint
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastSyncCheckpoint();
+    if (pcheckpoint)
+    {
+        int64_t deltaTime = header.GetBlockTime() - pcheckpoint->nTime;
+        if (deltaTime < 0)
+            return error("AcceptSyncHeader() : block with timestamp before last checkpoint");
+        CBigNum bnRequired;
+        if (fProofOfWork)
+            bnRequired.SetCompact(ComputeMinWork(GetLastBlockIndex(pcheckpoint, false)->nBits, deltaTime));
+        else
+            bnRequired.SetCompact(ComputeMinStake(GetLastBlockIndex(pcheckpoint, true)->nBits, deltaTime, header.nTime));
+        if (bnTarget > bnRequired)
+            return error("AcceptSyncHeader() : block with too little %s", fProofOfWork ? "proof-of-work" : "proof-of-stake");
+    }
+
+    CSyncHeader entry;
+    entry.hash = hash;
+    entry.nTime = header.nTime;
+    entry.nBits = header.nBits;
+    entry.fProofOfStake = !fProofOfWork;
+    entry.nChainTrust = nParentTrust + ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+    vSyncHeaders.push_back(entry);
+    mapSyncHeaders[hash] = nHeight;
+    return true;
+}
+
+// Adds one headers message to the header chain.  A branch off the header
+// chain or off a block we have only replaces the headers it cuts off once it
+// carries more trust than they did; until then, or when a header fails its
+// checks, the chain is put back as it was.  Headers whose parent we don't
+// know are ignored, they can be the answer to a request made before a reset.
+bool AcceptSyncHeaders(const vector<CBlock>& vHeaders, const vector<uint256>& vHash, const vector<char>& vProofOfWork, int& nDoS)
+{
+    nDoS = 0;
+    if (vHeaders.empty())
+        return true;
+    if (!mapSyncHeaders.count(vHeaders[0].hashPrevBlock) && !mapBlockIndex.count(vHeaders[0].hashPrevBlock))
+    {
+        printf("AcceptSyncHeaders() : ignoring headers off unknown block %s\n", vHeaders[0].hashPrevBlock.ToString().substr(0,20).c_str());
+        return true;
+    }
+
+    CBlockIndex* pindexSavedBase = pindexHeadersBase;
+    unsigned int nSavedSize = vSyncHeaders.size();
+    uint256 nSavedTrust = GetSyncTipTrust();
+    bool fBranched = false;
+    deque<CSyncHeader> vSaved;
+    map<uint256, int> mapSaved;
+
+    for (unsigned int i = 0; i < vHeaders.size(); i++)
+    {
+        if (i > 0 && vHeaders[i].hashPrevBlock != vHash[i - 1])
+        {
+            nDoS = 20;
+            break;
+        }
+        if (!fBranched && !vSyncHeaders.empty() && vHeaders[i].hashPrevBlock != vSyncHeaders.back().hash &&
+            !mapBlockIndex.count(vHash[i]) && !mapSyncHeaders.count(vHash[i]))
+        {
+            fBranched = true;
+            vSaved = vSyncHeaders;
+            mapSaved = mapSyncHeaders;
+        }
+        if (!AcceptSyncHeader(vHeaders[i], vHash[i], vProofOfWork[i]))
+        {
+            nDoS = 20;
+            break;
+        }
+    }
+
+    if (nDoS == 0 && (!fBranched || GetSyncTipTrust() > nSavedTrust))
+        return true;
+
+    if (fBranched)
+    {
+        vSyncHeaders.swap(vSaved);
+        mapSyncHeaders.swap(mapSaved);
+        pindexHeadersBase = pindexSavedBase;
+        if (nDoS == 0)
+            printf("AcceptSyncHeaders() : branch with less trust than the header chain ignored\n");
+    }
+    else if (nSavedSize > 0)
+        TruncateSyncHeaders(pindexHeadersBase->nHeight + nSavedSize);
+    else
+    {
+        vSyncHeaders.clear();
+        mapSyncHeaders.clear();
+        pindexHeadersBase = pindexSavedBase;
+    }
+    return nDoS == 0;
+}
+
+void MarkBlockInFlight(CNode* pnode, const uint256& hash)
+{
+    CBlockInFlight& entry = mapBlocksInFlight[hash];
+    entry.pnode = pnode;
+    entry.nTime = GetTime();
+    if (pnode->nBlocksInFlight++ == 0)
+        pnode->nBlockStallTime = GetTime();
+    LOCK(cs_vNodes);
+    pnode->AddRef();
+}
+
+static void MarkBlockReceived(const uint256& hash, CNode* pfrom)
+{
+    map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi == mapBlocksInFlight.end())
+        return;
+    CNode* pnode = (*mi).second.pnode;
+    pnode->nBlocksInFlight--;
+    if (pnode == pfrom)
+        pnode->nBlockStallTime = GetTime();
+    mapBlocksInFlight.erase(mi);
+    LOCK(cs_vNodes);
+    pnode->Release();
+}
+
+// Frees the requests of peers that went away and disconnects peers that
+// stall the download, once a second
+void CheckBlockDownloads()
+{
+    static int64_t nLastCheck;
+    int64_t nNow = GetTime();
+    if (nNow == nLastCheck)
+        return;
+    nLastCheck = nNow;
+
+    for (map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end();)
+    {
+        CNode* pnode = (*mi).second.pnode;
+        if (pnode->fDisconnect)
+        {
+            pnode->nBlocksInFlight--;
+            mapBlocksInFlight.erase(mi++);
+            LOCK(cs_vNodes);
+            pnode->Release();
+        }
+        else
+            mi++;
+    }
+
+    if (pnodeHeadersSync && (pnodeHeadersSync->fDisconnect ||
+        (nHeadersRequestTime != 0 && nNow - nHeadersRequestTime > HEADERS_RESPONSE_TIMEOUT)))
+    {
+        printf("headers sync: no headers from %s, trying another peer\n", pnodeHeadersSync->addr.ToString().c_str());
+        ReleaseHeadersSyncPeer();
+    }
+
+    TrimSyncHeaders();
+
+    // A peer holding up the oldest block of a full window
+    bool fWindowFull = (vSyncHeaders.size() >= BLOCK_DOWNLOAD_WINDOW);
+    for (unsigned int i = 0; fWindowFull && i < BLOCK_DOWNLOAD_WINDOW; i++)
+        if (!mapBlocksInFlight.count(vSyncHeaders[i].hash) && !mapOrphanBlocks.count(vSyncHeaders[i].hash))
+            fWindowFull = false;
+    // The oldest block may already sit in mapOrphanBlocks waiting for the
+    // orphan stage, then nobody holds it up
+    CNode* pnodeWindowStall = NULL;
+    if (fWindowFull)
+    {
+        map<uint256, CBlockInFlight>::const_iterator mi = mapBlocksInFlight.find(vSyncHeaders.front().hash);
+        if (mi != mapBlocksInFlight.end() && nNow - (*mi).second.nTime > BLOCK_WINDOW_STALL_TIMEOUT)
+            pnodeWindowStall = (*mi).second.pnode;
+    }
+
+    // Only the sync peer vouches for the header chain and is disconnected,
+    // along with its headers, when it holds up the download.  Any other peer
+    // may simply not have blocks the header chain claims, it loses its
+    // requests for a while; without a sync peer left to serve them the
+    // header chain is dropped.
+    vector<CNode*> vStalled;
+    bool fSyncPeerStalled = false;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->fDisconnect || pnode->nBlocksInFlight == 0)
+                continue;
+            if (nNow - pnode->nBlockStallTime > BLOCK_STALL_TIMEOUT ||
+                (pnode == pnodeWindowStall && vNodes.size() > 1))
+            {
+                nBlockStalls++;
+                if (pnode == pnodeHeadersSync)
+                {
+                    printf("peer %s stalled the block download, disconnecting\n", pnode->addr.ToString().c_str());
+                    pnode->fDisconnect = true;
+                    fSyncPeerStalled = true;
+                }
+                else
+                    vStalled.push_back(pnode);
+            }
+        }
+    }
+    BOOST_FOREACH(CNode* pnode, vStalled)
+    {
+        printf("peer %s stalled the block download, asking others\n", pnode->addr.ToString().c_str());
+        pnode->nBlockStallUntil = nNow + BLOCK_STALL_TIMEOUT;
+        for (map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.begin(); mi != mapBlocksInFlight.end();)
+        {
+            if ((*mi).second.pnode == pnode)
+            {
+                pnode->nBlocksInFlight--;
+                mapBlocksInFlight.erase(mi++);
+                LOCK(cs_vNodes);
+                pnode->Release();
+            }
+            else
+                mi++;
+        }
+    }
+    if (fSyncPeerStalled || (!vStalled.empty() && pnodeHeadersSync == NULL && !vSyncHeaders.empty()))
+    {
+        printf("headers sync: blocks on the header chain not delivered, dropping it\n");
+        ResetHeadersSync();
+    }
+
+    if (nHeadersSyncStart != 0 && nHeadersSyncDone == 0 && vSyncHeaders.empty() && pnodeHeadersSync == NULL)
+    {
+        nHeadersSyncDone = nNow;
+        printf("headers sync: caught up at height %d in %"PRI64d"s\n", nBestHeight, nHeadersSyncDone - nHeadersSyncStart);
+    }
+}
+
+static void RequestSyncHeaders(CNode* pto)
+{
+    // Download headers from the first peer that has more blocks than we know of
+    if (pnodeHeadersSync == NULL)
+    {
+        if (!pto->fSuccessfullyConnected || pto->fDisconnect || pto->fClient || pto->fOneShot ||
+            !IsValidPeerVersion(pto->nVersion, pto->strSubVer) ||
+            pto->nStartingHeight <= GetHeadersTipHeight())
+            return;
+        {
+            LOCK(cs_vNodes);
+            pnodeHeadersSync = pto->AddRef();
+        }
+        fHeadersMore = true;
+        if (vSyncHeaders.empty() && (nHeadersSyncStart == 0 || nHeadersSyncDone != 0))
+        {
+            nHeadersSyncStart = GetTime();
+            nHeadersSyncDone = 0;
+        }
+        printf("headers sync: downloading headers from %s (height %d)\n", pto->addr.ToString().c_str(), pto->nStartingHeight);
+    }
+
+    if (pto != pnodeHeadersSync || !fHeadersMore || nHeadersRequestTime != 0)
+        return;
+
+    // Keep the header chain from running too far ahead of the blocks
+    if (GetHeadersTipHeight() - nBestHeight > MAX_HEADERS_AHEAD)
+        return;
+
+    pto->PushMessage("getheaders", GetHeadersLocator(), uint256(0));
+    nHeadersRequestTime = GetTime();
+}
+
+static void RequestSyncBlocks(CNode* pto, vector<CInv>& vGetData)
+{
+    TrimSyncHeaders();
+    if (vSyncHeaders.empty() || pto->fDisconnect || !pto->fSuccessfullyConnected || pto->fClient)
+        return;
+
+    int nHeight = pindexHeadersBase->nHeight;
+    unsigned int nWindow = min((unsigned int)vSyncHeaders.size(), BLOCK_DOWNLOAD_WINDOW);
+    if (pto->nBlockStallUntil > GetTime())
+        return;
+    for (unsigned int i = 0; i < nWindow && pto->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER; i++)
+    {
+        // Only the sync peer is known to have blocks above its starting height
+        if (nHeight + 1 + (int)i > pto->nStartingHeight && pto != pnodeHeadersSync)
+            break;
+        const uint256& hash = vSyncHeaders[i].hash;
+        if (mapBlocksInFlight.count(hash) || mapOrphanBlocks.count(hash) || mapBlockIndex.count(hash))
+            continue;
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+        MarkBlockInFlight(pto, hash);
+    }
+}
+
+void GetHeadersSyncStats(CHeadersSyncStats& stats)
+{
+    LOCK(cs_main);
+    stats.fEnabled = fHeadersFirst;
+    stats.nHeadersHeight = GetHeadersTipHeight();
+    stats.nBlocksInFlight = mapBlocksInFlight.size();
+    stats.strSyncPeer = pnodeHeadersSync ? pnodeHeadersSync->addr.ToString() : "";
+    stats.nStalls = nBlockStalls;
+    stats.nSyncStart = nHeadersSyncStart;
+    stats.nSyncDone = nHeadersSyncDone;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Compact block relay
+//
+
+// A new block goes out as its header, its coinbase and coinstake and a short
+// id for every other transaction; the receiver takes those from its memory
+// pool and asks with getblocktxn for the ones it doesn't have.
+static const int MAX_CMPCTBLOCK_DEPTH = 10;             // older blocks are sent in full
+static const int64_t PARTIAL_BLOCK_TIMEOUT = 30;        // seconds to wait for blocktxn
+static const unsigned int MAX_PARTIAL_BLOCK_ANNOUNCERS = 8;
+
+CCompactBlock::CCompactBlock(const CBlock& block)
+{
+    header.nVersion = block.nVersion;
+    header.hashPrevBlock = block.hashPrevBlock;
+    header.hashMerkleRoot = block.hashMerkleRoot;
+    header.nTime = block.nTime;
+    header.nBits = block.nBits;
+    header.nNonce = block.nNonce;
+    header.vchBlockSig = block.vchBlockSig;
+    nNonce = GetRand(std::numeric_limits<uint64_t>::max());
+    SetShortIdKeys();
+
+    // The coinbase and coinstake are never in anybody's memory pool
+    unsigned int nPrefill = block.IsProofOfStake() ? 2 : 1;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (i < nPrefill)
+        {
+            CPrefilledTransaction prefilled;
+            prefilled.nIndex = i;
+            prefilled.tx = block.vtx[i];
+            vPrefilled.push_back(prefilled);
+        }
+        else
+            vShortIds.push_back(CShortTxId(GetShortId(block.vtx[i].GetHash())));
+    }
+}
+
+void CCompactBlock::SetShortIdKeys()
+{
+    uint256 hashBlock = header.GetHash();
+    uint256 hashKey = Hash(BEGIN(hashBlock), END(hashBlock), BEGIN(nNonce), END(nNonce));
+    nKey0 = hashKey.Get64(0);
+    nKey1 = hashKey.Get64(1);
+}
+
+bool CPartialBlock::Init(const CCompactBlock& cmpctblock, CTxMemPool& pool)
+{
+    unsigned int nTx = cmpctblock.GetTxCount();
+    if (nTx == 0 || nTx > std::numeric_limits<unsigned short>::max())
+        return false;
+
+    block = cmpctblock.header;
+    block.vtx.assign(nTx, CTransaction());
+    vHave.assign(nTx, false);
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilled)
+    {
+        if (prefilled.nIndex >= nTx || vHave[prefilled.nIndex])
+            return false;
+        block.vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    }
+    nPrefilled = cmpctblock.vPrefilled.size();
+
+    // Short ids fill the remaining slots in order.  An id that two of the
+    // block's transactions share, or two pool transactions match, is left
+    // for getblocktxn.
+    map<uint64_t, int> mapShortIds;
+    unsigned int nSlot = 0;
+    BOOST_FOREACH(const CShortTxId& shortid, cmpctblock.vShortIds)
+    {
+        while (vHave[nSlot])
+            nSlot++;
+        pair<map<uint64_t, int>::iterator, bool> ret = mapShortIds.insert(make_pair(shortid.Get(), (int)nSlot));
+        if (!ret.second)
+            ret.first->second = -1;
+        nSlot++;
+    }
+
+    nFromPool = 0;
+    LOCK(pool.cs);
+    for (CTxMemPool::txiter it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it)
+    {
+        map<uint64_t, int>::iterator mi = mapShortIds.find(cmpctblock.GetShortId(it->GetHash()));
+        if (mi == mapShortIds.end() || mi->second < 0)
+            continue;
+        int nIndex = mi->second;
+        if (vHave[nIndex])
+        {
+            block.vtx[nIndex] = CTransaction();
+            vHave[nIndex] = false;
+            mi->second = -1;
+            nFromPool--;
+            continue;
+        }
+        block.vtx[nIndex] = it->GetTx();
+        vHave[nIndex] = true;
+        nFromPool++;
+    }
+    return true;
+}
+
+void CPartialBlock::GetMissing(vector<unsigned short>& vIndexes) const
+{
+    vIndexes.clear();
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vIndexes.push_back(i);
+}
+
+bool CPartialBlock::FillMissing(const vector<CTransaction>& vtxMissing)
+{
+    unsigned int nNext = 0;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        if (nNext >= vtxMissing.size())
+            return false;
+        block.vtx[i] = vtxMissing[nNext++];
+        vHave[i] = true;
+    }
+    return nNext == vtxMissing.size();
+}
+
+bool CPartialBlock::IsComplete() const
+{
+    return find(vHave.begin(), vHave.end(), false) == vHave.end();
+}
+
+static void ErasePartialBlock(map<uint256, CPartialBlock>::iterator mi)
+{
+    {
+        LOCK(cs_vNodes);
+        if ((*mi).second.pfrom)
+            (*mi).second.pfrom->Release();
+        BOOST_FOREACH(CNode* pnode, (*mi).second.vAnnouncers)
+            pnode->Release();
+    }
+    mapPartialBlocks.erase(mi);
+}
+
+static bool HasPartialBlock(CNode* pnode)
+{
+    for (map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.begin(); mi != mapPartialBlocks.end(); ++mi)
+        if ((*mi).second.pfrom == pnode)
+            return true;
+    return false;
+}
+
+// The checks ProcessBlock and AcceptBlock make on a block's header, as far
+// as the header and the prefilled coinbase and coinstake allow, so that a
+// compact block isn't rebuilt before we know it is somebody's real block
+static bool CheckCompactHeader(const CCompactBlock& cmpctblock, const uint256& hashBlock, CBlockIndex* pindexPrev, int& nDoS)
+{
+    nDoS = 0;
+    CBlock block = cmpctblock.header;
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.vPrefilled)
+        if (prefilled.nIndex == block.vtx.size() && block.vtx.size() < 2)
+            block.vtx.push_back(prefilled.tx);
+    if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
+    {
+        nDoS = 100;
+        return error("CheckCompactHeader() : first tx is not coinbase");
+    }
+
+    if (block.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+        return error("CheckCompactHeader() : block timestamp too far in the future");
+
+    if (block.IsProofOfStake())
+    {
+        if (setStakeSeen.count(block.GetProofOfStake()) && !mapOrphanBlocksByPrev.count(hashBlock) && !Checkpoints::WantedByPendingSyncCheckpoint(hashBlock))
+            return error("CheckCompactHeader() : duplicate proof-of-stake for block %s", hashBlock.ToString().substr(0,20).c_str());
+        if (block.nVersion == 1 || !block.CheckBlockSignature())
+        {
+            nDoS = 100;
+            return error("CheckCompactHeader() : bad proof-of-stake block signature");
+        }
+    }
+    else if (!CheckProofOfWork(block.GetPoWHash(), block.nBits))
+    {
+        nDoS = 50;
+        return error("CheckCompactHeader() : proof of work failed");
+    }
+
+    if (block.nBits != GetNextWorkRequired(pindexPrev, &block, block.IsProofOfStake()))
+    {
+        nDoS = 100;
+        return error("CheckCompactHeader() : incorrect proof of work");
+    }
+    if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return error("CheckCompactHeader() : block's timestamp is too early");
+    if (!Checkpoints::CheckHardened(pindexPrev->nHeight + 1, hashBlock))
+    {
+        nDoS = 100;
+        return error("CheckCompactHeader() : rejected by hardened checkpoint lock-in at %d", pindexPrev->nHeight + 1);
+    }
+    return true;
+}
+
+static void RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    compactStats.nFallbacks++;
+    vector<CInv> vGetData(1, CInv(MSG_BLOCK, hash));
+    pfrom->PushMessage("getdata", vGetData);
+}
+
+// A compact block that didn't rebuild is fetched whole from another peer
+// that announced it, if there is one; the peer whose short ids failed may
+// be the reason
+static void RequestFullBlockElsewhere(const CPartialBlock& partial, const uint256& hash)
+{
+    BOOST_FOREACH(CNode* pnode, partial.vAnnouncers)
     {
-        nPriority = 3000;
-        strStatusBar = strRPC = _("WARNING: Invalid checkpoint found! Displayed transactions may not be correct! You may need to upgrade, or notify developers.");
+        if (!pnode->fDisconnect)
+        {
+            RequestFullBlock(pnode, hash);
+            return;
+        }
     }
+    if (partial.pfrom && !partial.pfrom->fDisconnect)
+        RequestFullBlock(partial.pfrom, hash);
+}
 
-    // Alerts
+static void ExpirePartialBlocks()
+{
+    int64_t nNow = GetTime();
+    map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.begin();
+    while (mi != mapPartialBlocks.end())
     {
-        LOCK(cs_mapAlerts);
-        BOOST_FOREACH(PAIRTYPE(const uint256, CAlert)& item, mapAlerts)
+        if (nNow - (*mi).second.nTimeStarted <= PARTIAL_BLOCK_TIMEOUT)
         {
-            const CAlert& alert = item.second;
-            if (alert.AppliesToMe() && alert.nPriority > nPriority)
-            {
-                nPriority = alert.nPriority;
-                strStatusBar = alert.strStatusBar;
-                if (nPriority > 1000)
-                    strRPC = strStatusBar;
-            }
+            ++mi;
+            continue;
         }
+        printf("compact block %s timed out waiting for blocktxn\n", (*mi).first.ToString().substr(0,20).c_str());
+        RequestFullBlockElsewhere((*mi).second, (*mi).first);
+        ErasePartialBlock(mi++);
     }
-
-    if (strFor == "statusbar")
-        return strStatusBar;
-    else if (strFor == "rpc")
-        return strRPC;
-    assert(!"GetWarnings() : invalid parameter");
-    return "error";
 }
 
+// Hands a block from the network, sent in full or rebuilt, to ProcessBlock
+static void ProcessNetBlock(CNode* pfrom, CBlock& block)
+{
+    uint256 hashBlock = block.GetHash();
+    CInv inv(MSG_BLOCK, hashBlock);
+    pfrom->AddInventoryKnown(inv);
+    MarkBlockReceived(hashBlock, pfrom);
+
+    if (ProcessBlock(pfrom, &block))
+        mapAlreadyAskedFor.erase(inv);
+    else if (block.nDoS && mapSyncHeaders.count(hashBlock))
+    {
+        printf("headers sync: block %s on the header chain is invalid\n", hashBlock.ToString().substr(0,20).c_str());
+        ResetHeadersSync();
+    }
+    if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+}
 
+static void FinishPartialBlock(CNode* pfrom, map<uint256, CPartialBlock>::iterator mi)
+{
+    uint256 hashBlock = (*mi).first;
+    CBlock& blockPartial = (*mi).second.block;
+    vector<CTransaction> vtx;
+    vtx.swap(blockPartial.vtx);
+    CBlock block = blockPartial;
+    block.vtx.swap(vtx);
+
+    // A short id collision gives the wrong transaction, which is nobody's
+    // fault, but bogus short ids look the same
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+    {
+        printf("compact block %s did not rebuild, asking for the full block\n", hashBlock.ToString().substr(0,20).c_str());
+        RequestFullBlockElsewhere((*mi).second, hashBlock);
+        ErasePartialBlock(mi);
+        return;
+    }
+    ErasePartialBlock(mi);
+    printf("received block %s (compact)\n", hashBlock.ToString().substr(0,20).c_str());
+    ProcessNetBlock(pfrom, block);
+}
 
-
-
-
+void GetCompactBlockStats(CCompactBlockStats& stats)
+{
+    LOCK(cs_main);
+    stats = compactStats;
+}
 
 
 //////////////////////////////////////////////////////////////////////////////
 //
-// Messages
+// Block serving
 //
 
-
-bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
+// The "block" messages served last, header and checksum included, so a block
+// several peers ask for is read from disk once and never deserialized.  At
+// most -maxblockcache megabytes, least recently served evicted first.
+class CBlockMessageCache
 {
-    switch (inv.type)
+private:
+    typedef std::list<std::pair<uint256, boost::shared_ptr<CSerializeData> > > list_type;
+
+    CCriticalSection cs;
+    list_type listLRU;
+    std::map<uint256, list_type::iterator> mapEntries;
+    size_t nBytes;
+
+public:
+    CBlockMessageCache()
     {
-    case MSG_TX:
+        nBytes = 0;
+    }
+
+    boost::shared_ptr<CSerializeData> Get(const uint256& hash)
+    {
+        LOCK(cs);
+        std::map<uint256, list_type::iterator>::iterator mi = mapEntries.find(hash);
+        if (mi == mapEntries.end())
+            return boost::shared_ptr<CSerializeData>();
+        listLRU.splice(listLRU.begin(), listLRU, (*mi).second);
+        return (*(*mi).second).second;
+    }
+
+    void Put(const uint256& hash, const boost::shared_ptr<CSerializeData>& pmsg, size_t nMaxBytes)
+    {
+        LOCK(cs);
+        if (mapEntries.count(hash) || pmsg->size() > nMaxBytes)
+            return;
+        listLRU.push_front(std::make_pair(hash, pmsg));
+        mapEntries[hash] = listLRU.begin();
+        nBytes += pmsg->size();
+        while (nBytes > nMaxBytes)
         {
-        bool txInMap = false;
-            {
-            LOCK(mempool.cs);
-            txInMap = (mempool.exists(inv.hash));
-            }
-        return txInMap ||
-               mapOrphanTransactions.count(inv.hash) ||
-               txdb.ContainsTx(inv.hash);
+            nBytes -= listLRU.back().second->size();
+            mapEntries.erase(listLRU.back().first);
+            listLRU.pop_back();
         }
-
-    case MSG_BLOCK:
-        return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
     }
-    // Don't know what it is, just say we already got one
-    return true;
-}
+};
 
+static CBlockMessageCache blockMessageCache;
 
+// Builds the "block" message for pindex straight from the block file
+static bool BuildBlockMessage(const CBlockIndex* pindex, CSerializeData& vMsgRet)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader("block", 0);
+    if (!ReadRawBlockFromDisk(pindex->nFile, pindex->nBlockPos, ss))
+        return false;
 
+    // The header is the first 80 bytes, make sure we read the right block
+    const char* pblock = &ss[CMessageHeader::HEADER_SIZE];
+    const unsigned int nHeaderSize = 80;
+    if (ss.size() - CMessageHeader::HEADER_SIZE < nHeaderSize || Hash(pblock, pblock + nHeaderSize) != pindex->GetBlockHash())
+        return error("BuildBlockMessage() : block %s not found on disk", pindex->GetBlockHash().ToString().substr(0,20).c_str());
 
-// The message start string is designed to be unlikely to occur in normal data.
-// The characters are rarely used upper ASCII, not valid as UTF-8, and produce
-// a large 4-byte int at any alignment.
-unsigned char pchMessageStart[4] = { 0xfd, 0xb6, 0xa5, 0xdb }; 
+    FinishMessageHeader(ss);
+    ss.GetAndClear(vMsgRet);
+    return true;
+}
 
-bool IsValidPeerVersion(int nVersion, string strSubVer)
+static void PushBlockMessage(CNode* pfrom, const CBlockIndex* pindex)
 {
-    if (nVersion < PROTOCOL_VERSION)
+    uint256 hash = pindex->GetBlockHash();
+    boost::shared_ptr<CSerializeData> pmsg = blockMessageCache.Get(hash);
+    if (!pmsg)
     {
-        // Since February 20, 2012, the protocol is initiated at version 209,
-        // and earlier versions are no longer supported
-        return false;
+        pmsg.reset(new CSerializeData());
+        if (!BuildBlockMessage(pindex, *pmsg))
+        {
+            CBlock block;
+            block.ReadFromDisk(pindex);
+            pfrom->PushMessage("block", block);
+            return;
+        }
+        blockMessageCache.Put(hash, pmsg, GetArg("-maxblockcache", DEFAULT_MAX_BLOCK_CACHE) * 1000000);
     }
-
-    if (strSubVer.find("Netcoin Stake:2") != std::string::npos) return true;
-
-    return false;
-
+    pfrom->PushPreparedMessage(*pmsg);
 }
 
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
@@ -3406,7 +5218,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         // Change version
         pfrom->PushMessage("verack");
-        pfrom->vSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->ssSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
 
         if (!pfrom->fInbound)
         {
@@ -3435,7 +5247,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         // Ask the first connected node for block updates
         static int nAskedForBlocks = 0;
-        if (!pfrom->fClient && !pfrom->fOneShot &&
+        if (!fHeadersFirst && !pfrom->fClient && !pfrom->fOneShot &&
             IsValidPeerVersion(pfrom->nVersion, pfrom->strSubVer) &&
             (pfrom->nStartingHeight > (nBestHeight - 144)) &&
             (pfrom->nVersion < NOBLKS_VERSION_START ||
@@ -3482,7 +5294,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
     else if (strCommand == "verack")
     {
-        pfrom->vRecv.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+        // Offer compact blocks; peers that don't know the message ignore it
+        if (fCompactBlocks)
+            pfrom->PushMessage("sendcmpct", true, (uint64_t)1);
     }
 
 
@@ -3583,11 +5399,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (fDebug)
                 printf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
-            if (!fAlreadyHave)
-                pfrom->AskFor(inv);
-            else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
-                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
-            } else if (nInv == nLastBlock) {
+            if (!fAlreadyHave) {
+                // Blocks on the header chain are asked for by the download window
+                if (!(inv.type == MSG_BLOCK && mapBlocksInFlight.count(inv.hash)))
+                    pfrom->AskFor(inv);
+            } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
+                if (!mapSyncHeaders.count(inv.hash))
+                    pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
+            } else if (nInv == nLastBlock && !fHeadersFirst) {
                 // In case we are on a very long side-chain, it is possible that we already have
                 // the last block in an inv bundle sent in response to getblocks. Try to detect
                 // this situation and push another getblocks to continue.
@@ -3622,15 +5441,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             if (fDebugNet || (vInv.size() == 1))
                 printf("received getdata for: %s\n", inv.ToString().c_str());
 
-            if (inv.type == MSG_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+                LOCK(cs_main);
+                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
-                    pfrom->PushMessage("block", block);
+                    // Only peers near the tip still have the transactions in their pool
+                    if (inv.type == MSG_CMPCT_BLOCK && (*mi).second->nHeight >= nBestHeight - MAX_CMPCTBLOCK_DEPTH)
+                    {
+                        CBlock block;
+                        block.ReadFromDisk((*mi).second);
+                        pfrom->PushMessage("cmpctblock", CCompactBlock(block));
+                        compactStats.nSent++;
+                    }
+                    else
+                        PushBlockMessage(pfrom, (*mi).second);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3658,9 +5485,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                     }
                 }
                 if (!pushed && inv.type == MSG_TX) {
-                    LOCK(mempool.cs);
-                    if (mempool.exists(inv.hash)) {
-                        CTransaction tx = mempool.lookup(inv.hash);
+                    CTransaction tx;
+                    if (mempool.lookup(inv.hash, tx)) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
                         ss << tx;
@@ -3736,7 +5562,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3762,6 +5588,51 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "headers")
+    {
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %"PRIszu"", vHeaders.size());
+        }
+
+        // Only the peer we asked extends the header chain
+        {
+            LOCK(cs_main);
+            if (pfrom != pnodeHeadersSync)
+                return true;
+        }
+
+        // Hash before taking cs_main, the proof-of-work hash is scrypt
+        vector<uint256> vHash(vHeaders.size());
+        vector<char> vProofOfWork(vHeaders.size());
+        ParallelFor(vHeaders.size(), boost::bind(&HashSyncHeader, boost::cref(vHeaders), boost::ref(vHash), boost::ref(vProofOfWork), _1));
+
+        LOCK(cs_main);
+        if (pfrom != pnodeHeadersSync)
+            return true;
+        nHeadersRequestTime = 0;
+        int nDoS = 0;
+        if (!AcceptSyncHeaders(vHeaders, vHash, vProofOfWork, nDoS))
+        {
+            ReleaseHeadersSyncPeer();
+            pfrom->Misbehaving(nDoS);
+            return error("message headers : headers from %s rejected", pfrom->addr.ToString().c_str());
+        }
+
+        fHeadersMore = (vHeaders.size() == MAX_HEADERS_RESULTS);
+        if (!fHeadersMore)
+        {
+            printf("headers sync: header chain complete at height %d\n", GetHeadersTipHeight());
+            ReleaseHeadersSyncPeer();
+        }
+        if (fDebug)
+            printf("received %"PRIszu" headers, header chain at height %d\n", vHeaders.size(), GetHeadersTipHeight());
+    }
+
+
     else if (strCommand == "tx")
     {
         vector<uint256> vWorkQueue;
@@ -3849,12 +5720,144 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         printf("received block %s\n", hashBlock.ToString().substr(0,20).c_str());
         // block.print();
 
-        CInv inv(MSG_BLOCK, hashBlock);
-        pfrom->AddInventoryKnown(inv);
+        ProcessNetBlock(pfrom, block);
+    }
 
-        if (ProcessBlock(pfrom, &block))
-            mapAlreadyAskedFor.erase(inv);
-        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounce = false;
+        uint64_t nCompactVersion = 0;
+        vRecv >> fAnnounce >> nCompactVersion;
+        if (nCompactVersion == 1)
+        {
+            pfrom->fSupportsCompact = true;
+            pfrom->fCompactAnnounce = fAnnounce;
+        }
+    }
+
+
+    else if (strCommand == "cmpctblock")
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        if (fDebug)
+            printf("received compact block %s\n", hashBlock.ToString().substr(0,20).c_str());
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hashBlock));
+        compactStats.nReceived++;
+
+        ExpirePartialBlocks();
+        map<uint256, CPartialBlock>::iterator mp = mapPartialBlocks.find(hashBlock);
+        if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock))
+        {
+            // Already have it
+        }
+        else if (mp != mapPartialBlocks.end())
+        {
+            // Rebuilding it from another peer's; this one can send it whole
+            // if that fails
+            CPartialBlock& partial = (*mp).second;
+            if (partial.pfrom != pfrom && partial.vAnnouncers.size() < MAX_PARTIAL_BLOCK_ANNOUNCERS &&
+                find(partial.vAnnouncers.begin(), partial.vAnnouncers.end(), pfrom) == partial.vAnnouncers.end())
+            {
+                LOCK(cs_vNodes);
+                partial.vAnnouncers.push_back(pfrom->AddRef());
+            }
+        }
+        else if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock) || HasPartialBlock(pfrom))
+        {
+            // Not on top of our chain, it would be an orphan, or the peer
+            // has another block being rebuilt: fetch it whole
+            if (!IsInitialBlockDownload())
+                RequestFullBlock(pfrom, hashBlock);
+        }
+        else
+        {
+            int nDoS = 0;
+            if (!CheckCompactHeader(cmpctblock, hashBlock, mapBlockIndex[cmpctblock.header.hashPrevBlock], nDoS))
+            {
+                if (nDoS) pfrom->Misbehaving(nDoS);
+                return error("message cmpctblock : header of compact block %s rejected", hashBlock.ToString().substr(0,20).c_str());
+            }
+
+            map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.insert(make_pair(hashBlock, CPartialBlock())).first;
+            CPartialBlock& partial = (*mi).second;
+            {
+                LOCK(cs_vNodes);
+                partial.pfrom = pfrom->AddRef();
+            }
+            if (!partial.Init(cmpctblock, mempool))
+            {
+                ErasePartialBlock(mi);
+                pfrom->Misbehaving(100);
+                return error("message cmpctblock : malformed compact block %s", hashBlock.ToString().substr(0,20).c_str());
+            }
+            compactStats.nTxPrefilled += partial.nPrefilled;
+            compactStats.nTxFromPool += partial.nFromPool;
+            if (partial.IsComplete())
+            {
+                compactStats.nReconstructed++;
+                FinishPartialBlock(pfrom, mi);
+            }
+            else
+            {
+                partial.nTimeStarted = GetTime();
+                CBlockTransactionsRequest req;
+                req.hashBlock = hashBlock;
+                partial.GetMissing(req.vIndexes);
+                compactStats.nRoundTrips++;
+                compactStats.nTxRequested += req.vIndexes.size();
+                pfrom->PushMessage("getblocktxn", req);
+            }
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        BlockMap::iterator mi = mapBlockIndex.find(req.hashBlock);
+        if (mi != mapBlockIndex.end())
+        {
+            CBlock block;
+            block.ReadFromDisk((*mi).second);
+            CBlockTransactions resp;
+            resp.hashBlock = req.hashBlock;
+            BOOST_FOREACH(unsigned short nIndex, req.vIndexes)
+            {
+                if (nIndex >= block.vtx.size())
+                {
+                    pfrom->Misbehaving(100);
+                    return error("message getblocktxn : index %u out of range", nIndex);
+                }
+                resp.vtx.push_back(block.vtx[nIndex]);
+            }
+            pfrom->PushMessage("blocktxn", resp);
+        }
+    }
+
+
+    else if (strCommand == "blocktxn")
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.find(resp.hashBlock);
+        if (mi == mapPartialBlocks.end() || (*mi).second.pfrom != pfrom)
+        {
+            // Not asked for, or timed out
+        }
+        else if (!(*mi).second.FillMissing(resp.vtx))
+        {
+            RequestFullBlockElsewhere((*mi).second, resp.hashBlock);
+            ErasePartialBlock(mi);
+        }
+        else
+            FinishPartialBlock(pfrom, mi);
     }
 
 
@@ -3862,8 +5865,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     {
         // Don't return addresses older than nCutOff timestamp
         int64_t nCutOff = GetTime() - (nNodeLifespan * 24 * 60 * 60);
-        pfrom->vAddrToSend.clear();
         vector<CAddress> vAddr = addrman.GetAddr();
+        LOCK(pfrom->cs_vAddrToSend);
+        pfrom->vAddrToSend.clear();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             if(addr.nTime > nCutOff)
                 pfrom->PushAddress(addr);
@@ -4001,13 +6005,76 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
-bool ProcessMessages(CNode* pfrom)
+// Messages whose handlers only touch the peer, the address manager and the
+// relay memory, each guarded by its own lock, so they don't need cs_main.
+// headers takes cs_main itself once the headers are hashed.
+static bool IsMainFreeMessage(const string& strCommand)
+{
+    return (strCommand == "ping" || strCommand == "verack" || strCommand == "addr" ||
+            strCommand == "getaddr" || strCommand == "getdata" || strCommand == "headers");
+}
+
+static void ProcessMessageChecked(CNode* pfrom, CNetMessage& msg)
+{
+    CMessageHeader& hdr = msg.hdr;
+    string strCommand = hdr.GetCommand();
+    unsigned int nMessageSize = hdr.nMessageSize;
+
+    // Checksum
+    CDataStream& vRecv = msg.vRecv;
+    uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    if (nChecksum != hdr.nChecksum)
+    {
+        printf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
+           strCommand.c_str(), nMessageSize, nChecksum, hdr.nChecksum);
+        return;
+    }
+
+    // Process message
+    bool fRet = false;
+    try
+    {
+        fRet = ProcessMessage(pfrom, strCommand, vRecv);
+        if (fShutdown)
+            return;
+    }
+    catch (std::ios_base::failure& e)
+    {
+        if (strstr(e.what(), "end of data"))
+        {
+            // Allow exceptions from under-length message on vRecv
+            printf("ProcessMessages(%s, %u bytes) : Exception '%s' caught, normally caused by a message being shorter than its stated length\n", strCommand.c_str(), nMessageSize, e.what());
+        }
+        else if (strstr(e.what(), "size too large"))
+        {
+            // Allow exceptions from over-long size
+            printf("ProcessMessages(%s, %u bytes) : Exception '%s' caught\n", strCommand.c_str(), nMessageSize, e.what());
+        }
+        else
+        {
+            PrintExceptionContinue(&e, "ProcessMessages()");
+        }
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ProcessMessages()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ProcessMessages()");
+    }
+
+    if (!fRet)
+        printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
+}
+
+// fWaitForMain is false for helper threads: when the next message needs
+// cs_main and another thread holds it, the queue is left as it is for a
+// later pass, so the peer's messages are still handled in order.
+// fMoreRet is set when complete messages are left in the queue.
+bool ProcessMessages(CNode* pfrom, bool fWaitForMain, bool& fMoreRet)
 {
-    CDataStream& vRecv = pfrom->vRecv;
-    if (vRecv.empty())
-        return true;
     //if (fDebug)
-    //    printf("ProcessMessages(%u bytes)\n", vRecv.size());
+    //    printf("ProcessMessages(%"PRIszu" messages)\n", pfrom->vRecvMsg.size());
 
     //
     // Message format
@@ -4017,109 +6084,55 @@ bool ProcessMessages(CNode* pfrom)
     //  (4) checksum
     //  (x) data
     //
+    bool fOk = true;
 
-    while (true)
+    while (!pfrom->fDisconnect && !pfrom->vRecvMsg.empty())
     {
         // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->vSend.size() >= SendBufferSize())
+        if (pfrom->nSendSize >= SendBufferSize())
             break;
 
-        // Scan for message start
-        CDataStream::iterator pstart = search(vRecv.begin(), vRecv.end(), BEGIN(pchMessageStart), END(pchMessageStart));
-        int nHeaderSize = vRecv.GetSerializeSize(CMessageHeader());
-        if (vRecv.end() - pstart < nHeaderSize)
-        {
-            if ((int)vRecv.size() > nHeaderSize)
-            {
-                printf("\n\nPROCESSMESSAGE MESSAGESTART NOT FOUND\n\n");
-                vRecv.erase(vRecv.begin(), vRecv.end() - nHeaderSize);
-            }
+        // get next message, stop at the first incomplete one
+        CNetMessage& msg = pfrom->vRecvMsg.front();
+        if (!msg.IsComplete())
             break;
-        }
-        if (pstart - vRecv.begin() > 0)
-            printf("\n\nPROCESSMESSAGE SKIPPED %"PRIpdd" BYTES\n\n", pstart - vRecv.begin());
-        vRecv.erase(vRecv.begin(), pstart);
-
-        // Read header
-        vector<char> vHeaderSave(vRecv.begin(), vRecv.begin() + nHeaderSize);
-        CMessageHeader hdr;
-        vRecv >> hdr;
-        if (!hdr.IsValid())
-        {
-            printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", hdr.GetCommand().c_str());
-            continue;
-        }
-        string strCommand = hdr.GetCommand();
 
-        // Message size
-        unsigned int nMessageSize = hdr.nMessageSize;
-        if (nMessageSize > MAX_SIZE)
-        {
-            printf("ProcessMessages(%s, %u bytes) : nMessageSize > MAX_SIZE\n", strCommand.c_str(), nMessageSize);
-            continue;
-        }
-        if (nMessageSize > vRecv.size())
-        {
-            // Rewind and wait for rest of message
-            vRecv.insert(vRecv.begin(), vHeaderSave.begin(), vHeaderSave.end());
+        // Scan for message start
+        if (memcmp(msg.hdr.pchMessageStart, pchMessageStart, sizeof(pchMessageStart)) != 0) {
+            printf("\n\nPROCESSMESSAGE: INVALID MESSAGESTART\n\n");
+            fOk = false;
             break;
         }
 
-        // Checksum
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        if (nChecksum != hdr.nChecksum)
+        // Read header
+        if (!msg.hdr.IsValid())
         {
-            printf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
-               strCommand.c_str(), nMessageSize, nChecksum, hdr.nChecksum);
+            printf("\n\nPROCESSMESSAGE: ERRORS IN HEADER %s\n\n\n", msg.hdr.GetCommand().c_str());
+            pfrom->PopRecvMessage();
             continue;
         }
 
-        // Copy message to its own buffer
-        CDataStream vMsg(vRecv.begin(), vRecv.begin() + nMessageSize, vRecv.nType, vRecv.nVersion);
-        vRecv.ignore(nMessageSize);
-
-        // Process message
-        bool fRet = false;
-        try
-        {
-            {
-                LOCK(cs_main);
-                fRet = ProcessMessage(pfrom, strCommand, vMsg);
-            }
-            if (fShutdown)
-                return true;
-        }
-        catch (std::ios_base::failure& e)
+        if (IsMainFreeMessage(msg.hdr.GetCommand()))
+            ProcessMessageChecked(pfrom, msg);
+        else
         {
-            if (strstr(e.what(), "end of data"))
-            {
-                // Allow exceptions from under-length message on vRecv
-                printf("ProcessMessages(%s, %u bytes) : Exception '%s' caught, normally caused by a message being shorter than its stated length\n", strCommand.c_str(), nMessageSize, e.what());
-            }
-            else if (strstr(e.what(), "size too large"))
+            TRY_LOCK(cs_main, lockMain);
+            if (!lockMain)
             {
-                // Allow exceptions from over-long size
-                printf("ProcessMessages(%s, %u bytes) : Exception '%s' caught\n", strCommand.c_str(), nMessageSize, e.what());
-            }
-            else
-            {
-                PrintExceptionContinue(&e, "ProcessMessages()");
+                if (!fWaitForMain)
+                    break;
+                lockMain.Enter("cs_main", __FILE__, __LINE__);
             }
+            ProcessMessageChecked(pfrom, msg);
         }
-        catch (std::exception& e) {
-            PrintExceptionContinue(&e, "ProcessMessages()");
-        } catch (...) {
-            PrintExceptionContinue(NULL, "ProcessMessages()");
-        }
+        if (fShutdown)
+            return true;
 
-        if (!fRet)
-            printf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand.c_str(), nMessageSize);
+        pfrom->PopRecvMessage();
     }
 
-    vRecv.Compact();
-    return true;
+    fMoreRet = (!pfrom->vRecvMsg.empty() && pfrom->vRecvMsg.front().IsComplete());
+    return fOk;
 }
 
 
@@ -4133,7 +6146,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 
         // Keep-alive ping. We send a nonce of zero because we don't use it anywhere
         // right now.
-        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSend.empty()) {
+        if (pto->nLastSend && GetTime() - pto->nLastSend > 30 * 60 && pto->vSendMsg.empty()) {
             uint64_t nonce = 0;
             if (pto->nVersion > BIP0031_VERSION)
                 pto->PushMessage("ping", nonce);
@@ -4154,7 +6167,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_vAddrToSend);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -4173,12 +6189,22 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
+            vector<CAddress> vAddrToSend;
+            {
+                LOCK(pto->cs_vAddrToSend);
+                vAddrToSend.swap(pto->vAddrToSend);
+            }
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            vAddr.reserve(vAddrToSend.size());
+            BOOST_FOREACH(const CAddress& addr, vAddrToSend)
             {
                 // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                bool fNew;
+                {
+                    LOCK(pto->cs_vAddrToSend);
+                    fNew = pto->setAddrKnown.insert(addr).second;
+                }
+                if (fNew)
                 {
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
@@ -4189,7 +6215,6 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
             }
-            pto->vAddrToSend.clear();
             if (!vAddr.empty())
                 pto->PushMessage("addr", vAddr);
         }
@@ -4266,7 +6291,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 if (fDebugNet)
                     printf("sending getdata: %s\n", inv.ToString().c_str());
-                vGetData.push_back(inv);
+                // New blocks come as compact blocks from peers that offer them
+                if (inv.type == MSG_BLOCK && pto->fSupportsCompact && fCompactBlocks && !IsInitialBlockDownload())
+                    vGetData.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                else
+                    vGetData.push_back(inv);
                 if (vGetData.size() >= 1000)
                 {
                     pto->PushMessage("getdata", vGetData);
@@ -4276,6 +6305,13 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
+        ExpirePartialBlocks();
+        if (fHeadersFirst)
+        {
+            CheckBlockDownloads();
+            RequestSyncHeaders(pto);
+            RequestSyncBlocks(pto, vGetData);
+        }
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
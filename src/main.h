@@ -19,8 +19,19 @@
 
 #include <list>
 
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/mem_fun.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
 class CWallet;
 class CBlock;
+class COrphanBlock;
+class CTxMemPool;
 class CBlockIndex;
 class CKeyItem;
 class CReserveKey;
@@ -108,7 +119,14 @@ inline int64_t FutureDrift(int64_t nTime) { return nTime + 10 * 60; } // up to 1
 extern libzerocoin::Params* ZCParams;
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+/** Block hashes are uniformly distributed, so their low bits are used as the bucket hash */
+struct BlockHasher
+{
+    size_t operator()(const uint256& hash) const { return (size_t)hash.Get64(); }
+};
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern unsigned int nTargetSpacing;
@@ -136,7 +154,7 @@ extern int64_t nTimeBestReceived;
 extern CCriticalSection cs_setpwalletRegistered;
 extern std::set<CWallet*> setpwalletRegistered;
 extern unsigned char pchMessageStart[4];
-extern std::map<uint256, CBlock*> mapOrphanBlocks;
+extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
 
 // Settings
 extern int64_t nTransactionFee;
@@ -146,6 +164,19 @@ extern bool fUseFastIndex;
 extern unsigned int nDerivationMethodIndex;
 
 extern bool fEnforceCanonical;
+extern int nScriptCheckThreads;
+extern bool fMapBlockFiles;
+extern int nSyncInterval;
+
+// Default for -maxorphanblocksize, megabytes of orphan blocks kept
+static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS_SIZE = 40;
+/** Default for -maxblockcache, megabytes of block messages kept ready to serve */
+static const unsigned int DEFAULT_MAX_BLOCK_CACHE = 32;
+extern bool fHeadersFirst;
+extern bool fCompactBlocks;
+
+// Maximum number of script-checking threads allowed
+static const int MAX_SCRIPTCHECK_THREADS = 16;
 
 // Minimum disk space required - used in CheckDiskSpace()
 static const uint64_t nMinDiskSpace = 52428800;
@@ -153,19 +184,25 @@ static const uint64_t nMinDiskSpace = 52428800;
 class CReserveKey;
 class CTxDB;
 class CTxIndex;
+class CScriptCheck;
+class CBlockFileMapping;
 
 
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false, bool fConnect = true);
 bool ProcessBlock(CNode* pfrom, CBlock* pblock);
+void ThreadOrphanBlocks(void* parg);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
+bool MapBlockFile(unsigned int nFile, unsigned int nPos, boost::shared_ptr<CBlockFileMapping>& mappingRet, const char*& pbeginRet, const char*& pendRet, bool fRefresh=false);
+void CloseBlockFileMappings();
+bool ReadRawBlockFromDisk(unsigned int nFile, unsigned int nBlockPos, CDataStream& ssRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
-bool ProcessMessages(CNode* pfrom);
+bool ProcessMessages(CNode* pfrom, bool fWaitForMain, bool& fMoreRet);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 bool LoadExternalBlockFile(FILE* fileIn);
 void GenerateBitcoins(bool fGenerate, CWallet* pwallet);
@@ -182,13 +219,46 @@ unsigned int ComputeMinWork(unsigned int nBase, int64_t nTime);
 unsigned int ComputeMinStake(unsigned int nBase, int64_t nTime, unsigned int nBlockTime);
 int GetNumBlocksOfPeers();
 bool IsInitialBlockDownload();
+bool IsBlockSyncPoint();
 std::string GetWarnings(std::string strFor);
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock);
 uint256 WantedByOrphan(const CBlock* pblockOrphan);
 const CBlockIndex* GetLastBlockIndex(const CBlockIndex* pindex, bool fProofOfStake);
 void StakeMiner(CWallet *pwallet);
+void ThreadScriptCheck(void* parg);
+void StopScriptCheck();
+void ParallelFor(unsigned int n, const boost::function<void (unsigned int)>& fn);
 void ResendWalletTransactions(bool fForce = false);
 
+/** State of the headers-first block download */
+struct CHeadersSyncStats
+{
+    bool fEnabled;
+    int nHeadersHeight;
+    uint64_t nBlocksInFlight;
+    std::string strSyncPeer;
+    uint64_t nStalls;
+    int64_t nSyncStart;
+    int64_t nSyncDone;
+};
+
+void GetHeadersSyncStats(CHeadersSyncStats& stats);
+
+/** Compact block relay counters */
+struct CCompactBlockStats
+{
+    uint64_t nSent;
+    uint64_t nReceived;
+    uint64_t nReconstructed;    // rebuilt without a round trip
+    uint64_t nRoundTrips;       // needed a getblocktxn
+    uint64_t nFallbacks;        // fell back to the full block
+    uint64_t nTxPrefilled;
+    uint64_t nTxFromPool;
+    uint64_t nTxRequested;
+};
+
+void GetCompactBlockStats(CCompactBlockStats& stats);
+
 
 
 
@@ -200,6 +270,42 @@ void ResendWalletTransactions(bool fForce = false);
 
 bool GetWalletFile(CWallet* pwallet, std::string &strWalletFileOut);
 
+/** Deserialize obj from block file nFile at nPos.  Reads straight out of the
+ * memory-mapped file when possible and falls back to stdio otherwise.
+ */
+template<typename T>
+bool ReadFromBlockFile(unsigned int nFile, unsigned int nPos, T& obj, int nType=SER_DISK)
+{
+    // The mapping can be older than the last append to the file; if the
+    // object runs off its end, refresh it once before giving up on it
+    for (int nTry = 0; nTry < 2; nTry++)
+    {
+        boost::shared_ptr<CBlockFileMapping> mapping;
+        const char* pbegin;
+        const char* pend;
+        if (!MapBlockFile(nFile, nPos, mapping, pbegin, pend, nTry > 0))
+            break;
+        try {
+            CBufferReader reader(pbegin, pend, nType, CLIENT_VERSION);
+            reader >> obj;
+            return true;
+        }
+        catch (std::exception &e) {
+        }
+    }
+
+    CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nPos, "rb"), nType, CLIENT_VERSION);
+    if (!filein)
+        return error("ReadFromBlockFile() : OpenBlockFile failed");
+    try {
+        filein >> obj;
+    }
+    catch (std::exception &e) {
+        return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+    }
+    return true;
+}
+
 /** Position on disk for a particular transaction. */
 class CDiskTxPos
 {
@@ -257,11 +363,11 @@ public:
 class CInPoint
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     unsigned int n;
 
     CInPoint() { SetNull(); }
-    CInPoint(CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
+    CInPoint(const CTransaction* ptxIn, unsigned int nIn) { ptx = ptxIn; n = nIn; }
     void SetNull() { ptx = NULL; n = (unsigned int) -1; }
     bool IsNull() const { return (ptx == NULL && n == (unsigned int) -1); }
 };
@@ -508,6 +614,10 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+    // memory only
+    uint256 hashCached;
+    bool fHashCached;
+
     CTransaction()
     {
         SetNull();
@@ -524,6 +634,8 @@ public:
 		if(this->nVersion > LEGACY_VERSION_1) { 
         READWRITE(strTxComment); }
 
+        if (fRead)
+            const_cast<CTransaction*>(this)->UpdateHash();
     )
 
     void SetNull()
@@ -534,6 +646,7 @@ public:
         nLockTime = 0;
 		strTxComment.clear();
         nDoS = 0;  // Denial-of-service prevention
+        InvalidateHash();
     }
 
     bool IsNull() const
@@ -541,11 +654,30 @@ public:
         return (vin.empty() && vout.empty());
     }
 
+    // A transaction read from a stream, or one UpdateHash() was called on
+    // once it was complete, keeps its hash; any other is hashed on each call.
+    // GetHash() never writes, so a transaction shared between threads can be
+    // hashed from all of them.  Code that modifies vin, vout, nLockTime or
+    // strTxComment of a transaction with a kept hash must call
+    // InvalidateHash() afterwards.
     uint256 GetHash() const
     {
+        if (fHashCached)
+            return hashCached;
         return SerializeHash(*this);
     }
 
+    void UpdateHash()
+    {
+        hashCached = SerializeHash(*this);
+        fHashCached = true;
+    }
+
+    void InvalidateHash()
+    {
+        fHashCached = false;
+    }
+
     bool IsFinal(int nBlockHeight=0, int64_t nBlockTime=0) const
     {
         // Time based nLockTime implemented in 0.1.6
@@ -674,6 +806,13 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet)
+        {
+            if (!ReadFromBlockFile(pos.nFile, pos.nTxPos, *this))
+                return error("CTransaction::ReadFromDisk() : ReadFromBlockFile failed");
+            return true;
+        }
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -772,11 +911,12 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	if not NULL, signature checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, std::vector<CScriptCheck> *pvChecks = NULL);
     bool ClientConnectInputs();
     bool CheckTransaction() const;
     bool AcceptToMemoryPool(CTxDB& txdb, bool fCheckInputs=true, bool* pfMissingInputs=NULL);
@@ -787,6 +927,34 @@ protected:
 };
 
 
+/** Closure representing one script verification
+ *  Note that this stores a reference to the spending transaction */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    int nHashType;
+
+public:
+    CScriptCheck() {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, int nHashTypeIn) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nHashType(nHashTypeIn) { }
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check)
+    {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
+
 
 
 
@@ -937,6 +1105,8 @@ public:
 
     // memory only
     mutable std::vector<uint256> vMerkleTree;
+    uint256 hashCached;
+    unsigned char pchHeaderCached[80];
 
     // Denial-of-service detection:
     mutable int nDoS;
@@ -973,6 +1143,9 @@ public:
             if(nVersion >= 3)
                 const_cast<CBlock*>(this)->vchBlockSig.clear();
         }
+
+        if (fRead)
+            const_cast<CBlock*>(this)->UpdateHash();
     )
 
     void SetNull()
@@ -986,6 +1159,8 @@ public:
         vtx.clear();
         vchBlockSig.clear();
         vMerkleTree.clear();
+        hashCached = 0;
+        memset(pchHeaderCached, 0, sizeof(pchHeaderCached));
         nDoS = 0;
     }
 
@@ -994,11 +1169,24 @@ public:
         return (nBits == 0);
     }
 
+    // A block read from a stream keeps its hash.  Miners change the header
+    // fields in place, so rather than tracking writes the kept hash is keyed
+    // on a copy of the 80 header bytes; comparing them is far cheaper than
+    // the double SHA-256.  GetHash() itself never writes.
     uint256 GetHash() const
     {
+        if (hashCached != 0 && memcmp(pchHeaderCached, BEGIN(nVersion), sizeof(pchHeaderCached)) == 0)
+            return hashCached;
         return Hash(BEGIN(nVersion), END(nNonce));
     }
 
+    void UpdateHash()
+    {
+        assert(END(nNonce) - BEGIN(nVersion) == sizeof(pchHeaderCached));
+        hashCached = Hash(BEGIN(nVersion), END(nNonce));
+        memcpy(pchHeaderCached, BEGIN(nVersion), sizeof(pchHeaderCached));
+    }
+
     uint256 GetPoWHash() const
     {
         uint256 thash;
@@ -1121,7 +1309,7 @@ public:
 
         // Flush stdio buffers and commit to disk before returning
         fflush(fileout);
-        if (!IsInitialBlockDownload() || (nBestHeight+1) % 500 == 0)
+        if (IsBlockSyncPoint())
             FileCommit(fileout);
 
         return true;
@@ -1131,20 +1319,9 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
         // Read block
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
-        }
+        if (!ReadFromBlockFile(nFile, nBlockPos, *this, fReadTransactions ? SER_DISK : (SER_DISK | SER_BLOCKHEADERONLY)))
+            return error("CBlock::ReadFromDisk() : ReadFromBlockFile failed");
 
         // Check the header
         if (fReadTransactions && IsProofOfWork() && !CheckProofOfWork(GetPoWHash(), nBits))
@@ -1194,6 +1371,187 @@ private:
 };
 
 
+/** A block waiting in the orphan pool for its parent.  It takes over the
+ * transactions of the block it is made from rather than copying them.
+ */
+class COrphanBlock : public CBlock
+{
+public:
+    unsigned int nBytes;
+    int64_t nTimeReceived;
+    bool fRequested;        // we asked for it, rather than a peer pushing it
+    bool fConnecting;       // taken by the orphan stage, not to be evicted
+    bool fFromPeer;
+    CAddress addrFrom;      // charged if the orphan stage rejects the block
+
+    COrphanBlock(CBlock& block, unsigned int nBytesIn, bool fRequestedIn)
+    {
+        std::vector<CTransaction> vtxTaken;
+        std::vector<unsigned char> vchBlockSigTaken;
+        vtxTaken.swap(block.vtx);
+        vchBlockSigTaken.swap(block.vchBlockSig);
+        CBlock::operator=(block);
+        vtx.swap(vtxTaken);
+        vchBlockSig.swap(vchBlockSigTaken);
+
+        nBytes = nBytesIn;
+        nTimeReceived = GetTime();
+        fRequested = fRequestedIn;
+        fConnecting = false;
+        fFromPeer = false;
+    }
+};
+
+
+/** 48-bit short transaction id of a compact block */
+class CShortTxId
+{
+public:
+    unsigned int nLow;
+    unsigned short nHigh;
+
+    CShortTxId()
+    {
+        nLow = 0;
+        nHigh = 0;
+    }
+
+    explicit CShortTxId(uint64_t nId)
+    {
+        nLow = (unsigned int)nId;
+        nHigh = (unsigned short)(nId >> 32);
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nLow);
+        READWRITE(nHigh);
+    )
+
+    uint64_t Get() const
+    {
+        return nLow | ((uint64_t)nHigh << 32);
+    }
+};
+
+/** A transaction sent in full with a compact block */
+class CPrefilledTransaction
+{
+public:
+    unsigned short nIndex;
+    CTransaction tx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nIndex);
+        READWRITE(tx);
+    )
+};
+
+/** Compact block: the header and block signature, the transactions a peer
+ * can't have in its memory pool (coinbase and coinstake) and a short id for
+ * each of the others.  Short ids are SipHash of the txid keyed by the block
+ * hash and a nonce, so nobody can grind collisions ahead of time.
+ */
+class CCompactBlock
+{
+public:
+    CBlock header;          // without transactions
+    uint64_t nNonce;
+    std::vector<CShortTxId> vShortIds;
+    std::vector<CPrefilledTransaction> vPrefilled;
+
+    // memory only
+    uint64_t nKey0, nKey1;
+
+    CCompactBlock()
+    {
+        nNonce = 0;
+        nKey0 = nKey1 = 0;
+    }
+
+    CCompactBlock(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(nNonce);
+        READWRITE(vShortIds);
+        READWRITE(vPrefilled);
+        if (fRead)
+            const_cast<CCompactBlock*>(this)->SetShortIdKeys();
+    )
+
+    void SetShortIdKeys();
+
+    uint64_t GetShortId(const uint256& hashTx) const
+    {
+        return SipHashUint256(nKey0, nKey1, hashTx) & 0xffffffffffffULL;
+    }
+
+    unsigned int GetTxCount() const
+    {
+        return vShortIds.size() + vPrefilled.size();
+    }
+};
+
+/** getblocktxn: the transactions of a compact block we couldn't find */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 hashBlock;
+    std::vector<unsigned short> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vIndexes);
+    )
+};
+
+/** blocktxn: the answer to a getblocktxn */
+class CBlockTransactions
+{
+public:
+    uint256 hashBlock;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vtx);
+    )
+};
+
+/** A block being rebuilt from a compact block and the memory pool */
+class CPartialBlock
+{
+public:
+    CBlock block;
+    std::vector<bool> vHave;
+    unsigned int nPrefilled;
+    unsigned int nFromPool;
+    CNode* pfrom;           // holds a reference
+    std::vector<CNode*> vAnnouncers;    // other peers that sent it, hold references
+    int64_t nTimeStarted;
+
+    CPartialBlock()
+    {
+        nPrefilled = nFromPool = 0;
+        pfrom = NULL;
+        nTimeStarted = 0;
+    }
+
+    // Fills in what the compact block carries and what the pool has;
+    // false if the compact block is malformed
+    bool Init(const CCompactBlock& cmpctblock, CTxMemPool& pool);
+    void GetMissing(std::vector<unsigned short>& vIndexes) const;
+    // Fills the missing transactions in order; false if the count is wrong
+    bool FillMissing(const std::vector<CTransaction>& vtxMissing);
+    bool IsComplete() const;
+};
+
+
 
 
 
@@ -1578,7 +1936,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1629,7 +1987,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1648,7 +2006,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1664,7 +2022,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1691,21 +2049,251 @@ public:
 
 
 
+/** Default for -maxmempool, memory limit of the transaction memory pool in megabytes */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Defaults for -limitancestorcount and -limitancestorsize (in kilobytes) */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Defaults for -limitdescendantcount and -limitdescendantsize (in kilobytes) */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** The minimum fee-per-kilobyte of the pool decays by half in this many seconds */
+static const int64_t MEMPOOL_FEE_HALFLIFE = 60 * 60 * 12;
+
+/** A transaction in the memory pool with its fee, size and priority, and the
+ * totals over its in-pool ancestors and descendants, itself included.
+ */
+class CTxMemPoolEntry
+{
+private:
+    CTransaction tx;
+    uint256 hash;
+    int64_t nFee;
+    unsigned int nTxSize;
+    size_t nUsageSize;              // memory held by the transaction outside the entry
+    int64_t nTime;
+    double dEntryPriority;
+    int nEntryHeight;
+    int64_t nInChainInputValue;     // inputs confirmed when the entry was made
+    uint64_t nSequence;             // order in which entries were added
+
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    int64_t nFeesWithDescendants;
+
+public:
+    CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, int64_t nTimeIn,
+                    double dEntryPriorityIn, int nEntryHeightIn, int64_t nInChainInputValueIn);
+
+    const CTransaction& GetTx() const { return tx; }
+    const uint256& GetHash() const { return hash; }
+    int64_t GetFee() const { return nFee; }
+    unsigned int GetTxSize() const { return nTxSize; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+    int64_t GetTime() const { return nTime; }
+    int GetHeight() const { return nEntryHeight; }
+    uint64_t GetSequence() const { return nSequence; }
+    void SetSequence(uint64_t n) { nSequence = n; }
+
+    /** Priority at nHeight: the confirmed inputs age by one block per block */
+    double GetPriority(int nHeight) const
+    {
+        return dEntryPriority + (double)(nHeight - nEntryHeight) * nInChainInputValue / nTxSize;
+    }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    int64_t GetFeesWithAncestors() const { return nFeesWithAncestors; }
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    int64_t GetFeesWithDescendants() const { return nFeesWithDescendants; }
+
+    void UpdateAncestorState(int64_t nCount, int64_t nSize, int64_t nFees)
+    {
+        nCountWithAncestors += nCount;
+        nSizeWithAncestors += nSize;
+        nFeesWithAncestors += nFees;
+    }
+
+    void UpdateDescendantState(int64_t nCount, int64_t nSize, int64_t nFees)
+    {
+        nCountWithDescendants += nCount;
+        nSizeWithDescendants += nSize;
+        nFeesWithDescendants += nFees;
+    }
+};
+
+/** Eviction order: the lower of the entry's own fee rate and that of the
+ * entry with its descendants comes first, newer entries before older ones.
+ * A transaction paying well keeps the ancestors it needs in the pool.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = GetScore(a) * b.GetTxSize() * b.GetSizeWithDescendants();
+        double f2 = GetScore(b) * a.GetTxSize() * a.GetSizeWithDescendants();
+        if (f1 == f2)
+            return a.GetTime() > b.GetTime();
+        return f1 < f2;
+    }
+
+private:
+    // fee rate numerator over the denominator nTxSize * nSizeWithDescendants
+    static double GetScore(const CTxMemPoolEntry& e)
+    {
+        return std::max((double)e.GetFee() * e.GetSizeWithDescendants(),
+                        (double)e.GetFeesWithDescendants() * e.GetTxSize());
+    }
+};
+
+/** Mining order: the lower of the entry's own fee rate and that of the
+ * entry with its ancestors, best first.
+ */
+class CompareTxMemPoolEntryByAncestorScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double f1 = GetScore(a) * b.GetTxSize() * b.GetSizeWithAncestors();
+        double f2 = GetScore(b) * a.GetTxSize() * a.GetSizeWithAncestors();
+        if (f1 == f2)
+            return a.GetHash() < b.GetHash();
+        return f1 > f2;
+    }
+
+private:
+    static double GetScore(const CTxMemPoolEntry& e)
+    {
+        return std::min((double)e.GetFee() * e.GetSizeWithAncestors(),
+                        (double)e.GetFeesWithAncestors() * e.GetTxSize());
+    }
+};
+
+struct mempoolentry_txid
+{
+    typedef uint256 result_type;
+    result_type operator()(const CTxMemPoolEntry& entry) const { return entry.GetHash(); }
+};
+
+// index tags
+struct descendant_score {};
+struct ancestor_score {};
+struct entry_sequence {};
+
+typedef boost::multi_index_container<
+    CTxMemPoolEntry,
+    boost::multi_index::indexed_by<
+        // by txid
+        boost::multi_index::hashed_unique<mempoolentry_txid, BlockHasher>,
+        // by fee rate with descendants, for eviction
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<descendant_score>,
+            boost::multi_index::identity<CTxMemPoolEntry>,
+            CompareTxMemPoolEntryByDescendantScore>,
+        // by fee rate with ancestors, for block templates
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<ancestor_score>,
+            boost::multi_index::identity<CTxMemPoolEntry>,
+            CompareTxMemPoolEntryByAncestorScore>,
+        // by arrival, for keeping block templates up to date
+        boost::multi_index::ordered_non_unique<
+            boost::multi_index::tag<entry_sequence>,
+            boost::multi_index::const_mem_fun<CTxMemPoolEntry, uint64_t, &CTxMemPoolEntry::GetSequence> >
+    >
+> indexed_transaction_set;
+
+/** Statistics reported by getmempoolinfo */
+struct CTxMemPoolStats
+{
+    uint64_t nTx;
+    uint64_t nBytes;
+    uint64_t nUsage;
+    uint64_t nMaxUsage;
+    int64_t nMinFeePerKb;
+    uint64_t nEvicted;
+};
+
+/** The pool of transactions that could go into the next block, bounded by
+ * -maxmempool.  Every entry links to its in-pool parents and children so
+ * the ancestor and descendant totals stay current as entries come and go.
+ */
 class CTxMemPool
 {
 public:
+    typedef indexed_transaction_set::nth_index<0>::type::const_iterator txiter;
+    struct CompareIteratorByHash
+    {
+        bool operator()(const txiter& a, const txiter& b) const { return a->GetHash() < b->GetHash(); }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
 
+private:
+    struct TxLinks
+    {
+        setEntries parents;
+        setEntries children;
+    };
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    txlinksMap mapLinks;
+
+    uint64_t nTotalTxSize;          // sum of the serialized sizes of the entries
+    uint64_t nCachedInnerUsage;     // memory held by the entries and their links
+    uint64_t nEvicted;
+    double dRollingMinFeeRate;      // raised by evictions, decays over time
+    uint64_t nSequence;             // entries added so far
+    uint64_t nRemovals;             // times entries were taken out
+    int64_t nLastRollingFeeUpdate;
+
+    void UpdateParent(txiter entry, txiter parent, bool fAdd);
+    void UpdateChild(txiter entry, txiter child, bool fAdd);
+    void UpdateAncestorTotals(txiter entry);
+    void UpdateDescendantTotals(txiter entry);
+    void RemoveStaged(const setEntries& stage);
+
+public:
+    CTxMemPool();
+
     bool accept(CTxDB& txdb, CTransaction &tx,
                 bool fCheckInputs, bool* pfMissingInputs);
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry, const setEntries& setAncestors);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
 
+    /** Collects the in-pool ancestors of entry, which need not be in the
+     * pool itself, and fails if they break the given limits */
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors,
+                                   uint64_t nLimitAncestorCount, uint64_t nLimitAncestorSize,
+                                   uint64_t nLimitDescendantCount, uint64_t nLimitDescendantSize,
+                                   std::string& strError) const;
+    /** Adds entry and all its in-pool descendants to setDescendants */
+    void CalculateDescendants(txiter entry, setEntries& setDescendants) const;
+    const setEntries& GetMemPoolParents(txiter entry) const;
+    const setEntries& GetMemPoolChildren(txiter entry) const;
+
+    /** Evicts the packages with the lowest fee rates until the pool uses at
+     * most nSizeLimit bytes, and raises the pool's minimum fee above them */
+    void TrimToSize(size_t nSizeLimit);
+    /** Fee per kilobyte a transaction needs to get into a pool of nSizeLimit bytes */
+    int64_t GetMinFee(size_t nSizeLimit);
+    size_t DynamicMemoryUsage() const;
+    void GetStats(CTxMemPoolStats& stats, size_t nSizeLimit);
+
+    /** Entries with a sequence above GetSequence() were added since */
+    uint64_t GetSequence() const { return nSequence; }
+    /** Changes whenever an entry leaves the pool */
+    uint64_t GetRemovals() const { return nRemovals; }
+
     unsigned long size()
     {
         LOCK(cs);
@@ -1717,12 +2305,20 @@ public:
         return (mapTx.count(hash) != 0);
     }
 
-    CTransaction& lookup(uint256 hash)
+    bool lookup(uint256 hash, CTransaction& result)
     {
-        return mapTx[hash];
+        LOCK(cs);
+        txiter it = mapTx.find(hash);
+        if (it == mapTx.end())
+            return false;
+        result = it->GetTx();
+        return true;
     }
 };
 
+/** Memory limit of the pool in bytes, from -maxmempool */
+size_t GetMaxMempoolSize();
+
 extern CTxMemPool mempool;
 
 #endif
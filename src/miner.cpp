@@ -53,59 +53,249 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+int64_t nLastCoinStakeSearchInterval = 0;
+
+// Transactions for the priority part of a block, highest priority first
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+class TxCoinAgePriorityCompare
 {
 public:
-    CTransaction* ptx;
-    set<uint256> setDependsOn;
-    double dPriority;
-    double dFeePerKb;
-
-    COrphan(CTransaction* ptxIn)
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b) const
     {
-        ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
+        if (a.first == b.first)
+            return CTxMemPool::CompareIteratorByHash()(b.second, a.second);
+        return a.first < b.first;
     }
+};
 
-    void print() const
+// Parents before children
+class CompareByAncestorCount
+{
+public:
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
     {
-        printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString().substr(0,10).c_str(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            printf("   setDependsOn %s\n", hash.ToString().substr(0,10).c_str());
+        if (a->GetCountWithAncestors() == b->GetCountWithAncestors())
+            return CTxMemPool::CompareIteratorByHash()(a, b);
+        return a->GetCountWithAncestors() < b->GetCountWithAncestors();
     }
 };
 
-
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-int64_t nLastCoinStakeSearchInterval = 0;
- 
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
-class TxPriorityCompare
+// Builds the transaction list of a block on top of pindexPrev from the
+// memory pool.  The pool's sequence and removal count at the last update
+// tell whether the list is still current.
+class CBlockAssembler
 {
-    bool byFee;
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    CBlockIndex* pindexPrev;
+    vector<CTransaction> vtx;
+    map<uint256, CTxIndex> mapTestPool;
+    CTxMemPool::setEntries setInBlock;
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    int nBlockSigOps;
+    int64_t nFees;
+
+    uint64_t nMempoolSequence;
+    uint64_t nMempoolRemovals;
+    int64_t nTimeBuilt;
+
+    CBlockAssembler(CBlockIndex* pindexPrevIn) : pindexPrev(pindexPrevIn)
+    {
+        nBlockSize = 1000;
+        nBlockTx = 0;
+        nBlockSigOps = 100;
+        nFees = 0;
+        nMempoolSequence = mempool.GetSequence();
+        nMempoolRemovals = mempool.GetRemovals();
+        nTimeBuilt = GetTime();
+    }
+
+    // Adds the transaction if it fits and connects on top of the block so far
+    bool TestAndAdd(CTxDB& txdb, CTxMemPool::txiter it, unsigned int nBlockMaxSize)
     {
-        if (byFee)
+        CTransaction tx = it->GetTx();
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
+            return false;
+
+        // Size limits
+        unsigned int nTxSize = it->GetTxSize();
+        if (nBlockSize + nTxSize >= nBlockMaxSize)
+            return false;
+
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = tx.GetLegacySigOpCount();
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        // Transaction fee
+        int64_t nMinFee = tx.GetMinFee(nBlockSize, GMF_BLOCK, 0, true);
+        if (it->GetFee() < nMinFee)
+            return false;
+
+        // Connecting shouldn't fail due to dependency on other memory pool transactions
+        // because we're adding them in order of dependency
+        map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
+        MapPrevTx mapInputs;
+        bool fInvalid;
+        if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+            return false;
+
+        int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
+        if (nTxFees < nMinFee)
+            return false;
+
+        nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true))
+            return false;
+        mapTestPoolTmp[it->GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+        swap(mapTestPool, mapTestPoolTmp);
+
+        // Added
+        vtx.push_back(tx);
+        setInBlock.insert(it);
+        nBlockSize += nTxSize;
+        ++nBlockTx;
+        nBlockSigOps += nTxSigOps;
+        nFees += nTxFees;
+
+        if (fDebug && GetBoolArg("-printpriority"))
         {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+            printf("priority %.1f fee %"PRI64d" txid %s\n",
+                   it->GetPriority(pindexPrev->nHeight + 1), nTxFees, tx.GetHash().ToString().c_str());
         }
-        else
+        return true;
+    }
+
+    bool IsReady(CTxMemPool::txiter it) const
+    {
+        BOOST_FOREACH(CTxMemPool::txiter parent, mempool.GetMemPoolParents(it))
+            if (!setInBlock.count(parent))
+                return false;
+        return true;
+    }
+
+    // Fills the block with the highest priority transactions up to
+    // nBlockPrioritySize, regardless of the fees they pay
+    void AddPriorityTxs(CTxDB& txdb, unsigned int nBlockMaxSize, unsigned int nBlockPrioritySize)
+    {
+        int nHeight = pindexPrev->nHeight + 1;
+        TxCoinAgePriorityCompare comparer;
+        vector<TxCoinAgePriority> vecPriority;
+        vecPriority.reserve(mempool.mapTx.size());
+        for (indexed_transaction_set::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            if (mi->GetCountWithAncestors() == 1)
+                vecPriority.push_back(TxCoinAgePriority(mi->GetPriority(nHeight), mi));
+        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+
+        while (!vecPriority.empty() && nBlockSize < nBlockPrioritySize)
+        {
+            double dPriority = vecPriority.front().first;
+            CTxMemPool::txiter it = vecPriority.front().second;
+            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            vecPriority.pop_back();
+
+            if (dPriority < COIN * 144 / 250)
+                break;
+            if (nBlockSize + it->GetTxSize() >= nBlockPrioritySize)
+                continue;
+            if (!TestAndAdd(txdb, it, nBlockMaxSize))
+                continue;
+
+            // Children whose parents are all in now can follow
+            BOOST_FOREACH(CTxMemPool::txiter child, mempool.GetMemPoolChildren(it))
+            {
+                if (setInBlock.count(child) || !IsReady(child))
+                    continue;
+                vecPriority.push_back(TxCoinAgePriority(child->GetPriority(nHeight), child));
+                std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            }
+        }
+    }
+
+    // Adds transactions with their missing ancestors in order of the fee
+    // rate of the package, as kept by the pool
+    void AddPackageTxs(CTxDB& txdb, unsigned int nBlockMaxSize, unsigned int nBlockMinSize, int64_t nMinTxFee)
+    {
+        indexed_transaction_set::index<ancestor_score>::type& index = mempool.mapTx.get<ancestor_score>();
+        for (indexed_transaction_set::index<ancestor_score>::type::iterator mi = index.begin(); mi != index.end(); ++mi)
+        {
+            if (nBlockSize + 200 >= nBlockMaxSize)
+                break;
+            CTxMemPool::txiter it = mempool.mapTx.project<0>(mi);
+            if (setInBlock.count(it))
+                continue;
+
+            // The package is what is left of the entry with its ancestors
+            CTxMemPool::setEntries setAncestors;
+            string strDummy;
+            mempool.CalculateMemPoolAncestors(*it, setAncestors, -1, -1, -1, -1, strDummy);
+            vector<CTxMemPool::txiter> vPackage;
+            vPackage.push_back(it);
+            uint64_t nPackageSize = it->GetTxSize();
+            int64_t nPackageFees = it->GetFee();
+            BOOST_FOREACH(CTxMemPool::txiter ancestor, setAncestors)
+            {
+                if (setInBlock.count(ancestor))
+                    continue;
+                vPackage.push_back(ancestor);
+                nPackageSize += ancestor->GetTxSize();
+                nPackageFees += ancestor->GetFee();
+            }
+            if (nBlockSize + nPackageSize >= nBlockMaxSize)
+                continue;
+
+            // Skip free transactions if we're past the minimum block size:
+            double dFeePerKb = double(nPackageFees) / (double(nPackageSize)/1000.0);
+            if (dFeePerKb < nMinTxFee && nBlockSize + nPackageSize >= nBlockMinSize)
+                continue;
+
+            sort(vPackage.begin(), vPackage.end(), CompareByAncestorCount());
+            BOOST_FOREACH(CTxMemPool::txiter entry, vPackage)
+                if (!TestAndAdd(txdb, entry, nBlockMaxSize))
+                    break;
+        }
+    }
+
+    // Appends what entered the pool since the last update, as far as it
+    // fits and its parents are in already
+    void AddNewTxs(CTxDB& txdb, unsigned int nBlockMaxSize, unsigned int nBlockMinSize, int64_t nMinTxFee)
+    {
+        indexed_transaction_set::index<entry_sequence>::type& index = mempool.mapTx.get<entry_sequence>();
+        for (indexed_transaction_set::index<entry_sequence>::type::iterator mi = index.upper_bound(nMempoolSequence); mi != index.end(); ++mi)
         {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            CTxMemPool::txiter it = mempool.mapTx.project<0>(mi);
+            if (setInBlock.count(it) || !IsReady(it))
+                continue;
+            double dFeePerKb = double(it->GetFee()) / (double(it->GetTxSize())/1000.0);
+            if (dFeePerKb < nMinTxFee && nBlockSize + it->GetTxSize() >= nBlockMinSize)
+                continue;
+            TestAndAdd(txdb, it, nBlockMaxSize);
         }
+        nMempoolSequence = mempool.GetSequence();
     }
 };
 
+// Rebuild the cached transaction list at least this often, so that better
+// paying transactions can push out ones that got in earlier
+static const int64_t TEMPLATE_REBUILD_INTERVAL = 60;
+
+// The transaction list of the last block template, kept up to date with
+// the memory pool and the best block; guarded by cs_main and mempool.cs
+static CBlockAssembler* passemblerCache = NULL;
+static CBlockTemplateStats templateStats;
+
+void GetBlockTemplateStats(CBlockTemplateStats& stats)
+{
+    LOCK(mempool.cs);
+    stats = templateStats;
+    stats.nTx = passemblerCache ? passemblerCache->nBlockTx : 0;
+}
+
 // CreateNewBlock: create new block (without proof-of-work/proof-of-stake)
 CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64_t* pFees)
 {
@@ -180,180 +370,42 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64_t* pFees)
         LOCK2(cs_main, mempool.cs);
         CTxDB txdb("r");
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        // Reuse the last transaction list while the best block stays and
+        // nothing left the pool; new arrivals are appended to it
+        int64_t nStart = GetTimeMicros();
+        CBlockAssembler* passembler = passemblerCache;
+        if (passembler == NULL || passembler->pindexPrev != pindexPrev ||
+            passembler->nMempoolRemovals != mempool.GetRemovals() ||
+            GetTime() - passembler->nTimeBuilt > TEMPLATE_REBUILD_INTERVAL)
         {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !tx.IsFinal())
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        printf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
+            // The pool keeps fees, priorities and packages current, so this
+            // is a walk over its indexes rather than a rebuild of them
+            delete passemblerCache;
+            passemblerCache = passembler = new CBlockAssembler(pindexPrev);
+            if (nBlockPrioritySize > 0)
+                passembler->AddPriorityTxs(txdb, nBlockMaxSize, nBlockPrioritySize);
+            passembler->AddPackageTxs(txdb, nBlockMaxSize, nBlockMinSize, nMinTxFee);
+
+            templateStats.nFullBuilds++;
+            templateStats.nLastBuildMicros = GetTimeMicros() - nStart;
+            templateStats.nTotalBuildMicros += templateStats.nLastBuildMicros;
+            templateStats.nMaxBuildMicros = max(templateStats.nMaxBuildMicros, templateStats.nLastBuildMicros);
         }
-
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
+        else if (passembler->nMempoolSequence != mempool.GetSequence())
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = tx.GetLegacySigOpCount();
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Transaction fee
-            int64_t nMinFee = tx.GetMinFee(nBlockSize, GMF_BLOCK, 0, true);
-
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-                continue;
-
-            int64_t nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-            if (nTxFees < nMinFee)
-                continue;
+            passembler->AddNewTxs(txdb, nBlockMaxSize, nBlockMinSize, nMinTxFee);
 
-            nTxSigOps += tx.GetP2SHSigOpCount(mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true))
-                continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fDebug && GetBoolArg("-printpriority"))
-            {
-                printf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
+            templateStats.nDeltaUpdates++;
+            templateStats.nLastDeltaMicros = GetTimeMicros() - nStart;
+            templateStats.nTotalDeltaMicros += templateStats.nLastDeltaMicros;
         }
+        else
+            templateStats.nHits++;
+
+        pblock->vtx.insert(pblock->vtx.end(), passembler->vtx.begin(), passembler->vtx.end());
+        uint64_t nBlockTx = passembler->nBlockTx;
+        uint64_t nBlockSize = passembler->nBlockSize;
+        nFees = passembler->nFees;
 
         nLastBlockTx = nBlockTx;
         nLastBlockSize = nBlockSize;
@@ -362,7 +414,10 @@ CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake, int64_t* pFees)
             printf("CreateNewBlock(): total size %"PRI64u"\n", nBlockSize);
 
         if (!fProofOfStake)
+        {
             pblock->vtx[0].vout[0].nValue = GetProofOfWorkReward(pindexPrev->nHeight+1, nFees, pindexPrev->GetBlockHash());
+            pblock->vtx[0].InvalidateHash();
+        }
 
         if (pFees)
             *pFees = nFees;
@@ -394,6 +449,7 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
     pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+    pblock->vtx[0].InvalidateHash();
 
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
@@ -555,6 +611,9 @@ void StakeMiner(CWallet *pwallet)
         if (fTryToSync)
         {
             fTryToSync = false;
+            // ppcoin: new best blocks don't update the stake candidates
+            // during the initial download, catch up with them now
+            pwallet->UpdateStakeCandidates();
             if ((!fTestNet && vNodes.size() < 3) || nBestHeight < GetNumBlocksOfPeers())
             {
                 MilliSleep(60000);
@@ -12,6 +12,29 @@
 /* Generate a new block, without valid proof-of-work */
 CBlock* CreateNewBlock(CWallet* pwallet, bool fProofOfStake=false, int64_t* pFees = 0);
 
+/** Counters of the cached block template transaction list */
+struct CBlockTemplateStats
+{
+    uint64_t nHits;             // templates served from the cache unchanged
+    uint64_t nDeltaUpdates;     // new pool transactions appended to the cache
+    uint64_t nFullBuilds;
+    int64_t nLastBuildMicros;
+    int64_t nTotalBuildMicros;
+    int64_t nMaxBuildMicros;
+    int64_t nLastDeltaMicros;
+    int64_t nTotalDeltaMicros;
+    uint64_t nTx;               // transactions in the cached list
+
+    CBlockTemplateStats()
+    {
+        nHits = nDeltaUpdates = nFullBuilds = nTx = 0;
+        nLastBuildMicros = nTotalBuildMicros = nMaxBuildMicros = 0;
+        nLastDeltaMicros = nTotalDeltaMicros = 0;
+    }
+};
+
+void GetBlockTemplateStats(CBlockTemplateStats& stats);
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 
@@ -15,6 +15,8 @@
 
 #ifdef WIN32
 #include <string.h>
+#else
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -28,6 +30,7 @@ using namespace std;
 using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 16;
+static const int MAX_MESSAGEHANDLER_THREADS = 16;
 
 void ThreadMessageHandler2(void* parg);
 void ThreadSocketHandler2(void* parg);
@@ -65,6 +68,13 @@ CAddrMan addrman;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
+static CSocketEvents socketEvents;
+static vector<SOCKET> vSocketSendReady;
+static CCriticalSection cs_vSocketSendReady;
+static bool fNodesAdded = false;  // protected by cs_vNodes
+static CWaitableCriticalSection csMessageHandler;
+static boost::condition_variable condMessageHandler;
+static unsigned int nMessageHandlerSignal = 0;  // bumped whenever a message arrives
 map<CInv, CDataStream> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
@@ -520,7 +530,9 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, int64 nTimeout)
         {
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
+            fNodesAdded = true;
         }
+        socketEvents.Wake();
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -539,7 +551,6 @@ void CNode::CloseSocketDisconnect()
         printf("disconnecting node %s\n", addrName.c_str());
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
-        vRecv.clear();
     }
 }
 
@@ -547,6 +558,113 @@ void CNode::Cleanup()
 {
 }
 
+int CNetMessage::ReadHeader(const char* pch, unsigned int nBytes)
+{
+    // copy data to temporary parsing buffer
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
+    unsigned int nCopy = std::min(nRemaining, nBytes);
+
+    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    nHdrPos += nCopy;
+
+    // if header incomplete, exit
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
+        return nCopy;
+
+    // deserialize header
+    try {
+        hdrbuf >> hdr;
+    }
+    catch (std::exception &e) {
+        return -1;
+    }
+
+    // reject messages larger than MAX_SIZE
+    if (hdr.nMessageSize > MAX_SIZE)
+        return -1;
+
+    // switch state to reading message data
+    fInData = true;
+
+    return nCopy;
+}
+
+// Grows the payload buffer as the data arrives instead of trusting the
+// size in the header with a large allocation up front
+char* CNetMessage::GetDataBuffer(unsigned int& nSpace)
+{
+    unsigned int nRemaining = hdr.nMessageSize - nDataPos;
+    if (vRecv.size() - nDataPos < std::min(nRemaining, 0x10000u))
+        vRecv.resize(nDataPos + std::min(nRemaining, std::max(nDataPos, 0x10000u)));
+    nSpace = vRecv.size() - nDataPos;
+    return &vRecv[nDataPos];
+}
+
+int CNetMessage::ReadData(const char* pch, unsigned int nBytes)
+{
+    unsigned int nSpace = 0;
+    char* pchData = GetDataBuffer(nSpace);
+    unsigned int nCopy = std::min(nSpace, nBytes);
+
+    memcpy(pchData, pch, nCopy);
+    nDataPos += nCopy;
+
+    return nCopy;
+}
+
+bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
+{
+    while (nBytes > 0)
+    {
+        // get current incomplete message, or create a new one
+        if (vRecvMsg.empty() || vRecvMsg.back().IsComplete())
+            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+
+        CNetMessage& msg = vRecvMsg.back();
+
+        // absorb network data
+        int nHandled;
+        if (!msg.fInData)
+            nHandled = msg.ReadHeader(pch, nBytes);
+        else
+            nHandled = msg.ReadData(pch, nBytes);
+
+        if (nHandled < 0)
+            return false;
+
+        pch += nHandled;
+        nBytes -= nHandled;
+        nRecvSize += nHandled;
+    }
+
+    return true;
+}
+
+// Large payloads are read from the socket straight into their message's
+// buffer; returns NULL when the bytes should go through ReceiveMsgBytes
+char* CNode::GetRecvBuffer(unsigned int& nSpace)
+{
+    if (vRecvMsg.empty())
+        return NULL;
+    CNetMessage& msg = vRecvMsg.back();
+    if (!msg.fInData || msg.hdr.nMessageSize - msg.nDataPos < 0x10000)
+        return NULL;
+    return msg.GetDataBuffer(nSpace);
+}
+
+void CNode::ReceivedDirect(unsigned int nBytes)
+{
+    vRecvMsg.back().nDataPos += nBytes;
+    nRecvSize += nBytes;
+}
+
+void CNode::PopRecvMessage()
+{
+    const CNetMessage& msg = vRecvMsg.front();
+    nRecvSize -= msg.nHdrPos + msg.nDataPos;
+    vRecvMsg.pop_front();
+}
+
 
 void CNode::PushVersion()
 {
@@ -664,266 +782,561 @@ void ThreadSocketHandler(void* parg)
     printf("ThreadSocketHandler exited\n");
 }
 
+//
+// Socket handling
+//
+// ThreadSocketHandler sleeps in CSocketEvents::Wait() until a socket becomes
+// ready, a node queues data to send (SocketSendReady()) or a node is added.
+// Only sockets that reported something are serviced; the scan over all
+// nodes for disconnects and inactivity runs once a second.
+//
+
+void WakeMessageHandler()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(csMessageHandler);
+        nMessageHandlerSignal++;
+    }
+    condMessageHandler.notify_one();
+}
+
+// Sleeps until a message arrives after nSignalSeen was read, or nMillis pass
+static void WaitForMessages(unsigned int nSignalSeen, int64_t nMillis)
+{
+    boost::unique_lock<boost::mutex> lock(csMessageHandler);
+    boost::system_time timeout = boost::get_system_time() + boost::posix_time::milliseconds(nMillis);
+    while (nMessageHandlerSignal == nSignalSeen && !fShutdown)
+        if (!condMessageHandler.timed_wait(lock, timeout))
+            break;
+}
+
+// Sets the size and checksum in the header that starts ss
+void FinishMessageHeader(CDataStream& ss)
+{
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
+void SocketSendReady(SOCKET hSocket)
+{
+    if (hSocket == INVALID_SOCKET)
+        return;
+    {
+        LOCK(cs_vSocketSendReady);
+        vSocketSendReady.push_back(hSocket);
+    }
+    socketEvents.Wake();
+}
+
+// Reads what the socket has into the node's message queue, the caller
+// holds cs_vRecv.  fMoreRet is set if the socket may still have data.
+bool SocketRecvData(CNode* pnode, bool& fMoreRet)
+{
+    fMoreRet = false;
+    for (int nReads = 0; pnode->hSocket != INVALID_SOCKET; nReads++)
+    {
+        // Give the other sockets a turn
+        if (nReads == 16)
+        {
+            fMoreRet = true;
+            break;
+        }
+
+        if (pnode->nRecvSize > ReceiveBufferSize()) {
+            if (!pnode->fDisconnect)
+                printf("socket recv flood control disconnect (%"PRIszu" bytes)\n", pnode->nRecvSize);
+            pnode->CloseSocketDisconnect();
+            break;
+        }
+
+        // typical socket buffer is 8K-64K
+        char pchBuf[0x10000];
+        unsigned int nSpace = 0;
+        char* pchDirect = pnode->GetRecvBuffer(nSpace);
+        char* pch = pchDirect ? pchDirect : pchBuf;
+        unsigned int nSize = pchDirect ? nSpace : sizeof(pchBuf);
+        int nBytes = recv(pnode->hSocket, pch, nSize, MSG_DONTWAIT);
+        if (nBytes > 0)
+        {
+            if (pchDirect)
+                pnode->ReceivedDirect(nBytes);
+            else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            {
+                printf("socket recv invalid message header\n");
+                pnode->CloseSocketDisconnect();
+                break;
+            }
+            pnode->nLastRecv = GetTime();
+            // A short read means the socket has been drained
+            if ((unsigned int)nBytes < nSize)
+                break;
+        }
+        else if (nBytes == 0)
+        {
+            // socket closed gracefully
+            if (!pnode->fDisconnect)
+                printf("socket closed\n");
+            pnode->CloseSocketDisconnect();
+        }
+        else
+        {
+            // error
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+            {
+                if (!pnode->fDisconnect)
+                    printf("socket recv error %d\n", nErr);
+                pnode->CloseSocketDisconnect();
+            }
+            break;
+        }
+    }
+
+    // Wake a message handler for the complete messages
+    if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().IsComplete())
+        WakeMessageHandler();
+    return true;
+}
+
+// Writes queued messages to the socket, the caller holds cs_vSend.
+// Several messages go out in one sendmsg() call and sent messages are
+// dropped whole, nothing is shifted in memory.  Returns true once the
+// queue is empty.
+bool SocketSendData(CNode* pnode)
+{
+    SOCKET hSocket = pnode->hSocket;
+    while (!pnode->vSendMsg.empty() && pnode->hSocket != INVALID_SOCKET)
+    {
+        size_t nRequested = 0;
+#ifdef WIN32
+        const CSerializeData& data = pnode->vSendMsg.front();
+        nRequested = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nRequested, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Gather up to 64 messages, the first one may be partly sent
+        struct iovec iov[64];
+        int nIov = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (deque<CSerializeData>::iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end(); ++it)
+        {
+            if (nIov == 64 || nRequested >= 0x100000)
+                break;
+            iov[nIov].iov_base = &(*it)[nOffset];
+            iov[nIov].iov_len = it->size() - nOffset;
+            nRequested += iov[nIov].iov_len;
+            nIov++;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        ssize_t nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+        if (nBytes > 0)
+        {
+            pnode->nLastSend = GetTime();
+            pnode->nSendSize -= nBytes;
+
+            // Drop the messages that went out completely
+            size_t nSent = nBytes;
+            while (nSent > 0)
+            {
+                size_t nLeft = pnode->vSendMsg.front().size() - pnode->nSendOffset;
+                if (nSent < nLeft)
+                {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
+                pnode->vSendMsg.pop_front();
+                pnode->nSendOffset = 0;
+            }
+
+            // The socket buffer is full, wait until it drains
+            if ((size_t)nBytes < nRequested)
+                break;
+        }
+        else
+        {
+            if (nBytes < 0)
+            {
+                // error
+                int nErr = WSAGetLastError();
+                if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+                {
+                    printf("socket send error %d\n", nErr);
+                    pnode->CloseSocketDisconnect();
+                }
+            }
+            break;
+        }
+    }
+
+    bool fEmpty = pnode->vSendMsg.empty();
+    if (fEmpty)
+        pnode->nLastSendEmpty = GetTime();
+    if (pnode->hSocket != INVALID_SOCKET)
+        socketEvents.SetWantWrite(hSocket, !fEmpty);
+    return fEmpty;
+}
+
+// Returns false if another thread holds the node's receive queue.
+// fMoreRet is set if the socket may still have data to read.
+static bool SocketRecv(CNode* pnode, bool& fMoreRet)
+{
+    fMoreRet = false;
+    TRY_LOCK(pnode->cs_vRecv, lockRecv);
+    if (!lockRecv)
+        return false;
+    return SocketRecvData(pnode, fMoreRet);
+}
+
+// Returns false if another thread holds the node's send queue
+static bool SocketSend(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vSend, lockSend);
+    if (!lockSend)
+        return false;
+    SocketSendData(pnode);
+    return true;
+}
+
+// Returns false once there are no more connections waiting
+static bool AcceptConnection(SOCKET hListenSocket)
+{
+#ifdef USE_IPV6
+    struct sockaddr_storage sockaddr;
+#else
+    struct sockaddr sockaddr;
+#endif
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            printf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            printf("socket error accept failed: %d\n", nErr);
+        return false;
+    }
+    else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+    {
+        {
+            LOCK(cs_setservAddNodeAddresses);
+            if (!setservAddNodeAddresses.count(addr))
+                closesocket(hSocket);
+        }
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
+        closesocket(hSocket);
+    }
+    else
+    {
+        printf("accepted connection %s\n", addr.ToString().c_str());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+            fNodesAdded = true;
+        }
+    }
+    return true;
+}
+
 void ThreadSocketHandler2(void* parg)
 {
     printf("ThreadSocketHandler started\n");
     list<CNode*> vNodesDisconnected;
     unsigned int nPrevNodeCount = 0;
 
+    if (!socketEvents.Init())
+        return;
+    set<SOCKET> setListenSockets;
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (hListenSocket != INVALID_SOCKET && socketEvents.Add(hListenSocket))
+            setListenSockets.insert(hListenSocket);
+
+    // Sockets being served and the nodes they belong to.  Entries are
+    // removed when the node is taken out of vNodes.
+    map<SOCKET, CNode*> mapSocketNode;
+    map<CNode*, SOCKET> mapNodeSocket;
+
+    // Sockets that need another attempt, because their node's buffer was
+    // locked or the read was cut short
+    set<SOCKET> setRecvPending;
+    set<SOCKET> setSendPending;
+
+    int64_t nLastMaintenance = 0;
+    vector<CSocketEvents::CEvent> vEvents;
+
     while (true)
     {
-        //
-        // Disconnect nodes
-        //
+        if (GetTimeMillis() - nLastMaintenance >= 1000)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            nLastMaintenance = GetTimeMillis();
+
+            //
+            // Disconnect nodes
+            //
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecv.empty() && pnode->vSend.empty()))
+                LOCK(cs_vNodes);
+                // Disconnect unused nodes
+                vector<CNode*> vNodesCopy = vNodes;
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                    if (pnode->fDisconnect ||
+                        (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->vSendMsg.empty() && pnode->ssSend.empty()))
+                    {
+                        // remove from vNodes
+                        vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                        // release outbound grant (if any)
+                        pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
+                        // stop watching the socket; it may have been closed
+                        // already and its number reused by a newer node
+                        map<CNode*, SOCKET>::iterator mi = mapNodeSocket.find(pnode);
+                        if (mi != mapNodeSocket.end())
+                        {
+                            SOCKET hSocket = (*mi).second;
+                            if (mapSocketNode[hSocket] == pnode)
+                            {
+                                mapSocketNode.erase(hSocket);
+                                socketEvents.Remove(hSocket);
+                                setRecvPending.erase(hSocket);
+                                setSendPending.erase(hSocket);
+                            }
+                            mapNodeSocket.erase(mi);
+                        }
 
-                    // hold in disconnected pool until all refs are released
-                    pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
+                        // close socket and cleanup
+                        pnode->CloseSocketDisconnect();
+                        pnode->Cleanup();
+
+                        // free the receive buffers now; if the message handler
+                        // holds them they go when the node is deleted
+                        {
+                            TRY_LOCK(pnode->cs_vRecv, lockRecv);
+                            if (lockRecv)
+                            {
+                                pnode->vRecvMsg.clear();
+                                pnode->nRecvSize = 0;
+                            }
+                        }
+
+                        // hold in disconnected pool until all refs are released
+                        pnode->nReleaseTime = max(pnode->nReleaseTime, GetTime() + 15 * 60);
+                        if (pnode->fNetworkNode || pnode->fInbound)
+                            pnode->Release();
+                        vNodesDisconnected.push_back(pnode);
+                    }
                 }
-            }
 
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
-            {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                // Delete disconnected nodes
+                list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+                BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
                 {
-                    bool fDelete = false;
+                    // wait until threads are done using it
+                    if (pnode->GetRefCount() <= 0)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        bool fDelete = false;
                         {
-                            TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                            if (lockRecv)
+                            TRY_LOCK(pnode->cs_vSend, lockSend);
+                            if (lockSend)
                             {
-                                TRY_LOCK(pnode->cs_mapRequests, lockReq);
-                                if (lockReq)
+                                TRY_LOCK(pnode->cs_vRecv, lockRecv);
+                                if (lockRecv)
                                 {
-                                    TRY_LOCK(pnode->cs_inventory, lockInv);
-                                    if (lockInv)
-                                        fDelete = true;
+                                    TRY_LOCK(pnode->cs_mapRequests, lockReq);
+                                    if (lockReq)
+                                    {
+                                        TRY_LOCK(pnode->cs_inventory, lockInv);
+                                        if (lockInv)
+                                            fDelete = true;
+                                    }
                                 }
                             }
                         }
+                        if (fDelete)
+                        {
+                            vNodesDisconnected.remove(pnode);
+                            delete pnode;
+                        }
                     }
-                    if (fDelete)
+                }
+            }
+            if (vNodes.size() != nPrevNodeCount)
+            {
+                nPrevNodeCount = vNodes.size();
+                uiInterface.NotifyNumConnectionsChanged(vNodes.size());
+            }
+
+            //
+            // Inactivity checking
+            //
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                {
+                    if (pnode->vSendMsg.empty())
+                        pnode->nLastSendEmpty = GetTime();
+                    if (GetTime() - pnode->nTimeConnected > 60)
                     {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+                        {
+                            printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+                            pnode->fDisconnect = true;
+                        }
+                        else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
+                        {
+                            printf("socket not sending\n");
+                            pnode->fDisconnect = true;
+                        }
+                        else if (GetTime() - pnode->nLastRecv > 90*60)
+                        {
+                            printf("socket inactivity timeout\n");
+                            pnode->fDisconnect = true;
+                        }
                     }
                 }
             }
         }
-        if (vNodes.size() != nPrevNodeCount)
-        {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(vNodes.size());
-        }
 
 
         //
-        // Find which sockets have data to receive
+        // Wait for socket events
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket);
-            have_fds = true;
-        }
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetRecv);
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSend.empty())
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                }
-            }
-        }
+        int nTimeout = max((int)(nLastMaintenance + 1000 - GetTimeMillis()), 0);
+        if (!setRecvPending.empty() || !setSendPending.empty())
+            nTimeout = min(nTimeout, 10);
 
         vnThreadsRunning[THREAD_SOCKETHANDLER]--;
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        bool fWaitOk = socketEvents.Wait(nTimeout, vEvents);
         vnThreadsRunning[THREAD_SOCKETHANDLER]++;
         if (fShutdown)
             return;
-        if (nSelect == SOCKET_ERROR)
+        if (!fWaitOk)
+        {
+            printf("socket wait error %d\n", errno);
+            MilliSleep(50);
+        }
+
+        set<SOCKET> setRecv;
+        set<SOCKET> setSend;
+        setRecv.swap(setRecvPending);
+        setSend.swap(setSendPending);
+        {
+            LOCK(cs_vSocketSendReady);
+            setSend.insert(vSocketSendReady.begin(), vSocketSendReady.end());
+            vSocketSendReady.clear();
+        }
+        BOOST_FOREACH(const CSocketEvents::CEvent& event, vEvents)
         {
-            if (have_fds)
+            //
+            // Accept new connections
+            //
+            if (setListenSockets.count(event.hSocket))
             {
-                int nErr = WSAGetLastError();
-                printf("socket select error %d\n", nErr);
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+                while (AcceptConnection(event.hSocket))
+                    if (fShutdown)
+                        return;
+                continue;
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
+            if (event.nEvents & (CSocketEvents::EVENT_READ | CSocketEvents::EVENT_ERROR))
+                setRecv.insert(event.hSocket);
+            if (event.nEvents & CSocketEvents::EVENT_WRITE)
+                setSend.insert(event.hSocket);
         }
 
 
         //
-        // Accept new connections
+        // Register new nodes and collect the ones with work to do
         //
-        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+        vector<CNode*> vNodesCopy;
         {
-#ifdef USE_IPV6
-            struct sockaddr_storage sockaddr;
-#else
-            struct sockaddr sockaddr;
-#endif
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    printf("Warning: Unknown socket family\n");
-
+            LOCK(cs_vNodes);
+            if (fNodesAdded)
             {
-                LOCK(cs_vNodes);
+                fNodesAdded = false;
                 BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    printf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
-            {
                 {
-                    LOCK(cs_setservAddNodeAddresses);
-                    if (!setservAddNodeAddresses.count(addr))
-                        closesocket(hSocket);
+                    SOCKET hSocket = pnode->hSocket;
+                    if (hSocket == INVALID_SOCKET || mapNodeSocket.count(pnode))
+                        continue;
+                    if (!socketEvents.Add(hSocket))
+                    {
+                        printf("socket registration failed %d\n", WSAGetLastError());
+                        pnode->CloseSocketDisconnect();
+                        continue;
+                    }
+                    mapSocketNode[hSocket] = pnode;
+                    mapNodeSocket[pnode] = hSocket;
+                    setRecv.insert(hSocket);
+                    setSend.insert(hSocket);
                 }
             }
-            else if (CNode::IsBanned(addr))
+
+            set<CNode*> setNodes;
+            BOOST_FOREACH(SOCKET hSocket, setRecv)
             {
-                printf("connection from %s dropped (banned)\n", addr.ToString().c_str());
-                closesocket(hSocket);
+                map<SOCKET, CNode*>::iterator mi = mapSocketNode.find(hSocket);
+                if (mi != mapSocketNode.end() && (*mi).second->hSocket == hSocket)
+                    setNodes.insert((*mi).second);
             }
-            else
+            BOOST_FOREACH(SOCKET hSocket, setSend)
             {
-                printf("accepted connection %s\n", addr.ToString().c_str());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
+                map<SOCKET, CNode*>::iterator mi = mapSocketNode.find(hSocket);
+                if (mi != mapSocketNode.end() && (*mi).second->hSocket == hSocket)
+                    setNodes.insert((*mi).second);
             }
+            vNodesCopy.assign(setNodes.begin(), setNodes.end());
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
         }
 
 
         //
         // Service each socket
         //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             if (fShutdown)
                 return;
 
+            SOCKET hSocket = mapNodeSocket[pnode];
+
             //
             // Receive
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (setRecv.count(hSocket))
             {
-                TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                if (lockRecv)
-                {
-                    CDataStream& vRecv = pnode->vRecv;
-                    unsigned int nPos = vRecv.size();
-
-                    if (nPos > ReceiveBufferSize()) {
-                        if (!pnode->fDisconnect)
-                            printf("socket recv flood control disconnect (%"PRIszu" bytes)\n", vRecv.size());
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vRecv.resize(nPos + nBytes);
-                            memcpy(&vRecv[nPos], pchBuf, nBytes);
-                            pnode->nLastRecv = GetTime();
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                printf("socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    printf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                bool fMore;
+                if (!SocketRecv(pnode, fMore) || fMore)
+                    setRecvPending.insert(hSocket);
             }
 
             //
@@ -931,56 +1344,10 @@ void ThreadSocketHandler2(void* parg)
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (setSend.count(hSocket))
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                {
-                    CDataStream& vSend = pnode->vSend;
-                    if (!vSend.empty())
-                    {
-                        int nBytes = send(pnode->hSocket, &vSend[0], vSend.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            vSend.erase(vSend.begin(), vSend.begin() + nBytes);
-                            pnode->nLastSend = GetTime();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                printf("socket send error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
-
-            //
-            // Inactivity checking
-            //
-            if (pnode->vSend.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    printf("socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
-                {
-                    printf("socket not sending\n");
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastRecv > 90*60)
-                {
-                    printf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
-                }
+                if (!SocketSend(pnode))
+                    setSendPending.insert(hSocket);
             }
         }
         {
@@ -988,8 +1355,6 @@ void ThreadSocketHandler2(void* parg)
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->Release();
         }
-
-        MilliSleep(10);
     }
 }
 
@@ -1603,12 +1968,25 @@ void ThreadMessageHandler(void* parg)
     printf("ThreadMessageHandler exited\n");
 }
 
+// The first handler thread sends to every peer each pass, including the
+// trickled inventory and addresses, and waits for cs_main when it needs it.
+// The others only handle what arrives and answer the peers they served,
+// they skip peers whose next message needs cs_main while it is busy.  A
+// peer's receive queue is held by one thread at a time, so its messages
+// are still handled in order.
 void ThreadMessageHandler2(void* parg)
 {
+    bool fFirst = (parg == NULL);
     printf("ThreadMessageHandler started\n");
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (!fShutdown)
     {
+        unsigned int nSignalSeen;
+        {
+            boost::lock_guard<boost::mutex> lock(csMessageHandler);
+            nSignalSeen = nMessageHandlerSignal;
+        }
+
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
@@ -1619,20 +1997,30 @@ void ThreadMessageHandler2(void* parg)
 
         // Poll the connected nodes for messages
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (fFirst && !vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
+        bool fMore = false;
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             // Receive messages
+            bool fServed = false;
             {
                 TRY_LOCK(pnode->cs_vRecv, lockRecv);
-                if (lockRecv)
-                    ProcessMessages(pnode);
+                if (lockRecv && !pnode->vRecvMsg.empty())
+                {
+                    bool fMoreNode = false;
+                    size_t nQueued = pnode->vRecvMsg.size();
+                    if (!ProcessMessages(pnode, fFirst, fMoreNode))
+                        pnode->CloseSocketDisconnect();
+                    fServed = (pnode->vRecvMsg.size() != nQueued);
+                    fMore |= fMoreNode;
+                }
             }
             if (fShutdown)
                 return;
 
             // Send messages
+            if (fFirst || fServed)
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
@@ -1648,11 +2036,12 @@ void ThreadMessageHandler2(void* parg)
                 pnode->Release();
         }
 
-        // Wait and allow messages to bunch up.
+        // Wait for the next message, or until it is time to trickle again.
+        // Messages left behind are retried soon.
         // Reduce vnThreadsRunning so StopNode has permission to exit while
         // we're sleeping, but we must always check fShutdown after doing this.
         vnThreadsRunning[THREAD_MESSAGEHANDLER]--;
-        MilliSleep(100);
+        WaitForMessages(nSignalSeen, fMore ? 10 : 100);
         if (fRequestShutdown)
             StartShutdown();
         vnThreadsRunning[THREAD_MESSAGEHANDLER]++;
@@ -1880,13 +2269,20 @@ void StartNode(void* parg)
         printf("Error: NewThread(ThreadOpenConnections) failed\n");
 
     // Process messages
-    if (!NewThread(ThreadMessageHandler, NULL))
-        printf("Error: NewThread(ThreadMessageHandler) failed\n");
+    int nMessageHandlerThreads = GetArg("-msghandlerthreads", 4);
+    nMessageHandlerThreads = std::max(1, std::min(nMessageHandlerThreads, MAX_MESSAGEHANDLER_THREADS));
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        if (!NewThread(ThreadMessageHandler, i == 0 ? NULL : (void*)(intptr_t)i))
+            printf("Error: NewThread(ThreadMessageHandler) failed\n");
 
     // Dump network addresses
     if (!NewThread(ThreadDumpAddress, NULL))
         printf("Error; NewThread(ThreadDumpAddress) failed\n");
 
+    // Connect orphan blocks once their parents arrive
+    if (!NewThread(ThreadOrphanBlocks, NULL))
+        printf("Error: NewThread(ThreadOrphanBlocks) failed\n");
+
     // Generate coins in the background
     //GenerateBitcoins(GetBoolArg("-gen", false), pwalletMain);
 // Mine proof-of-stake blocks in the background
@@ -1902,6 +2298,8 @@ bool StopNode()
     printf("StopNode()\n");
     fShutdown = true;
     nTransactionsUpdated++;
+    socketEvents.Wake();
+    StopScriptCheck();
     int64_t nStart = GetTime();
     if (semOutbound)
         for (int i=0; i<MAX_OUTBOUND_CONNECTIONS; i++)
@@ -1930,7 +2328,10 @@ bool StopNode()
     if (vnThreadsRunning[THREAD_ADDEDCONNECTIONS] > 0) printf("ThreadOpenAddedConnections still running\n");
     if (vnThreadsRunning[THREAD_DUMPADDRESS] > 0) printf("ThreadDumpAddresses still running\n");
     if (vnThreadsRunning[THREAD_STAKE_MINER] > 0) printf("ThreadStakeMiner still running\n");
-    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0)
+    if (vnThreadsRunning[THREAD_ORPHANBLOCKS] > 0) printf("ThreadOrphanBlocks still running\n");
+    if (vnThreadsRunning[THREAD_SCRIPTCHECK] > 0) printf("ThreadScriptCheck still running\n");
+    while (vnThreadsRunning[THREAD_MESSAGEHANDLER] > 0 || vnThreadsRunning[THREAD_RPCHANDLER] > 0 ||
+           vnThreadsRunning[THREAD_ORPHANBLOCKS] > 0 || vnThreadsRunning[THREAD_SCRIPTCHECK] > 0)
         MilliSleep(20);
     MilliSleep(50);
     DumpAddresses();
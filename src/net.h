@@ -42,6 +42,11 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
 void StartNode(void* parg);
 bool StopNode();
+void SocketSendReady(SOCKET hSocket);
+void WakeMessageHandler();
+bool SocketSendData(CNode* pnode);
+bool SocketRecvData(CNode* pnode, bool& fMoreRet);
+void FinishMessageHeader(CDataStream& ss);
 
 enum
 {
@@ -73,6 +78,7 @@ enum
 {
     MSG_TX = 1,
     MSG_BLOCK,
+    MSG_CMPCT_BLOCK,
 };
 
 class CRequestTracker
@@ -108,6 +114,8 @@ enum threadId
     THREAD_DUMPADDRESS,
     THREAD_RPCHANDLER,
     THREAD_STAKE_MINER,
+    THREAD_ORPHANBLOCKS,
+    THREAD_SCRIPTCHECK,
 
     THREAD_MAX
 };
@@ -151,6 +159,47 @@ public:
 
 
 
+/** A message being received from a peer.  The header is parsed in place
+ * and the payload goes into a buffer of its own, so nothing is copied or
+ * shifted once it has arrived.
+ */
+class CNetMessage
+{
+public:
+    bool fInData;               // reading the header (false) or the payload (true)
+
+    CDataStream hdrbuf;         // partially received header
+    CMessageHeader hdr;         // complete header
+    unsigned int nHdrPos;
+
+    CDataStream vRecv;          // received payload
+    unsigned int nDataPos;
+
+    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    {
+        hdrbuf.resize(CMessageHeader::HEADER_SIZE);
+        fInData = false;
+        nHdrPos = 0;
+        nDataPos = 0;
+    }
+
+    bool IsComplete() const
+    {
+        return fInData && hdr.nMessageSize == nDataPos;
+    }
+
+    void SetVersion(int nVersionIn)
+    {
+        hdrbuf.SetVersion(nVersionIn);
+        vRecv.SetVersion(nVersionIn);
+    }
+
+    int ReadHeader(const char* pch, unsigned int nBytes);
+    int ReadData(const char* pch, unsigned int nBytes);
+    char* GetDataBuffer(unsigned int& nSpace);
+};
+
+
 /** Information about a peer */
 class CNode
 {
@@ -158,16 +207,19 @@ public:
     // socket
     uint64_t nServices;
     SOCKET hSocket;
-    CDataStream vSend;
-    CDataStream vRecv;
+    CDataStream ssSend;                     // message being built
+    std::deque<CSerializeData> vSendMsg;    // complete messages waiting to be sent
+    size_t nSendOffset;                     // bytes of vSendMsg.front() already sent
+    size_t nSendSize;                       // bytes in vSendMsg not sent yet
     CCriticalSection cs_vSend;
+    std::deque<CNetMessage> vRecvMsg;
+    size_t nRecvSize;                       // bytes held in vRecvMsg
+    int nRecvVersion;
     CCriticalSection cs_vRecv;
     int64_t nLastSend;
     int64_t nLastRecv;
     int64_t nLastSendEmpty;
     int64_t nTimeConnected;
-    int nHeaderStart;
-    unsigned int nMessageStart;
     CAddress addr;
     std::string addrName;
     CService addrLocal;
@@ -199,9 +251,19 @@ public:
     uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
 
+    // headers-first block download, protected by cs_main
+    int nBlocksInFlight;
+    int64_t nBlockStallTime;    // when the peer last delivered a block, or was first asked for one
+    int64_t nBlockStallUntil;   // not asked for blocks on the header chain before this, after a stall
+
+    // compact block relay, set by the peer's sendcmpct
+    bool fSupportsCompact;      // understands cmpctblock, getblocktxn and blocktxn
+    bool fCompactAnnounce;      // wants new blocks pushed as cmpctblock rather than announced by inv
+
     // flood relay
     std::vector<CAddress> vAddrToSend;
     std::set<CAddress> setAddrKnown;
+    CCriticalSection cs_vAddrToSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
     uint256 hashCheckpointKnown; // ppcoin: known sent sync-checkpoint
@@ -212,16 +274,18 @@ public:
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : vSend(SER_NETWORK, MIN_PROTO_VERSION), vRecv(SER_NETWORK, MIN_PROTO_VERSION)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, MIN_PROTO_VERSION)
     {
         nServices = 0;
         hSocket = hSocketIn;
+        nSendOffset = 0;
+        nSendSize = 0;
+        nRecvSize = 0;
+        nRecvVersion = MIN_PROTO_VERSION;
         nLastSend = 0;
         nLastRecv = 0;
         nLastSendEmpty = GetTime();
         nTimeConnected = GetTime();
-        nHeaderStart = -1;
-        nMessageStart = -1;
         addr = addrIn;
         addrName = addrNameIn == "" ? addr.ToStringIPPort() : addrNameIn;
         nVersion = 0;
@@ -238,6 +302,11 @@ public:
         pindexLastGetBlocksBegin = 0;
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
+        nBlocksInFlight = 0;
+        nBlockStallTime = 0;
+        nBlockStallUntil = 0;
+        fSupportsCompact = false;
+        fCompactAnnounce = false;
         fGetAddr = false;
         nMisbehavior = 0;
         hashCheckpointKnown = 0;
@@ -284,8 +353,25 @@ public:
 
 
 
+    // requires LOCK(cs_vRecv)
+    bool ReceiveMsgBytes(const char* pch, unsigned int nBytes);
+    char* GetRecvBuffer(unsigned int& nSpace);
+    void ReceivedDirect(unsigned int nBytes);
+    void PopRecvMessage();
+
+    // requires LOCK(cs_vRecv)
+    void SetRecvVersion(int nVersionIn)
+    {
+        nRecvVersion = nVersionIn;
+        BOOST_FOREACH(CNetMessage& msg, vRecvMsg)
+            msg.SetVersion(nVersionIn);
+    }
+
+
+
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         setAddrKnown.insert(addr);
     }
 
@@ -294,6 +380,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -341,22 +428,18 @@ public:
     void BeginMessage(const char* pszCommand)
     {
         ENTER_CRITICAL_SECTION(cs_vSend);
-        if (nHeaderStart != -1)
+        if (!ssSend.empty())
             AbortMessage();
-        nHeaderStart = vSend.size();
-        vSend << CMessageHeader(pszCommand, 0);
-        nMessageStart = vSend.size();
+        ssSend << CMessageHeader(pszCommand, 0);
         if (fDebug)
             printf("sending: %s ", pszCommand);
     }
 
     void AbortMessage()
     {
-        if (nHeaderStart < 0)
+        if (ssSend.empty())
             return;
-        vSend.resize(nHeaderStart);
-        nHeaderStart = -1;
-        nMessageStart = -1;
+        ssSend.clear();
         LEAVE_CRITICAL_SECTION(cs_vSend);
 
         if (fDebug)
@@ -372,34 +455,48 @@ public:
             return;
         }
 
-        if (nHeaderStart < 0)
+        if (ssSend.empty())
             return;
 
-        // Set the size
-        unsigned int nSize = vSend.size() - nMessageStart;
-        memcpy((char*)&vSend[nHeaderStart] + CMessageHeader::MESSAGE_SIZE_OFFSET, &nSize, sizeof(nSize));
-
-        // Set the checksum
-        uint256 hash = Hash(vSend.begin() + nMessageStart, vSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(nMessageStart - nHeaderStart >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&vSend[nHeaderStart] + CMessageHeader::CHECKSUM_OFFSET, &nChecksum, sizeof(nChecksum));
+        FinishMessageHeader(ssSend);
 
         if (fDebug) {
-            printf("(%d bytes)\n", nSize);
+            printf("(%"PRIszu" bytes)\n", ssSend.size() - CMessageHeader::HEADER_SIZE);
         }
 
-        nHeaderStart = -1;
-        nMessageStart = -1;
+        // Queue the message as a buffer of its own, without copying it.
+        // Only a message that starts an empty queue needs the socket
+        // handler's attention, it keeps sending until the queue is empty
+        bool fWasEmpty = vSendMsg.empty();
+        vSendMsg.push_back(CSerializeData());
+        ssSend.GetAndClear(vSendMsg.back());
+        nSendSize += vSendMsg.back().size();
         LEAVE_CRITICAL_SECTION(cs_vSend);
+        if (fWasEmpty)
+            SocketSendReady(hSocket);
+    }
+
+    // Queues a message built beforehand, header and checksum included
+    void PushPreparedMessage(const CSerializeData& vMsg)
+    {
+        bool fWasEmpty;
+        {
+            LOCK(cs_vSend);
+            if (fDebug)
+                printf("sending: prepared message (%"PRIszu" bytes)\n", vMsg.size());
+            fWasEmpty = vSendMsg.empty();
+            vSendMsg.push_back(vMsg);
+            nSendSize += vMsg.size();
+        }
+        if (fWasEmpty)
+            SocketSendReady(hSocket);
     }
 
     void EndMessageAbortIfEmpty()
     {
-        if (nHeaderStart < 0)
+        if (ssSend.empty())
             return;
-        int nSize = vSend.size() - nMessageStart;
+        int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
         if (nSize > 0)
             EndMessage();
         else
@@ -431,7 +528,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1;
+            ssSend << a1;
             EndMessage();
         }
         catch (...)
@@ -447,7 +544,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2;
+            ssSend << a1 << a2;
             EndMessage();
         }
         catch (...)
@@ -463,7 +560,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3;
+            ssSend << a1 << a2 << a3;
             EndMessage();
         }
         catch (...)
@@ -479,7 +576,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4;
+            ssSend << a1 << a2 << a3 << a4;
             EndMessage();
         }
         catch (...)
@@ -495,7 +592,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5;
+            ssSend << a1 << a2 << a3 << a4 << a5;
             EndMessage();
         }
         catch (...)
@@ -511,7 +608,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5 << a6;
+            ssSend << a1 << a2 << a3 << a4 << a5 << a6;
             EndMessage();
         }
         catch (...)
@@ -527,7 +624,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5 << a6 << a7;
+            ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7;
             EndMessage();
         }
         catch (...)
@@ -543,7 +640,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8;
+            ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8;
             EndMessage();
         }
         catch (...)
@@ -559,7 +656,7 @@ public:
         try
         {
             BeginMessage(pszCommand);
-            vSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9;
+            ssSend << a1 << a2 << a3 << a4 << a5 << a6 << a7 << a8 << a9;
             EndMessage();
         }
         catch (...)
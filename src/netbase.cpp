@@ -10,6 +10,10 @@
 
 #ifndef WIN32
 #include <sys/fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
 #endif
 
 #include "strlcpy.h"
@@ -1185,3 +1189,291 @@ void CService::SetPort(unsigned short portIn)
 {
     port = portIn;
 }
+
+CSocketEvents::CSocketEvents()
+{
+#ifdef USE_EPOLL
+    hEpoll = -1;
+#endif
+#ifndef WIN32
+    hWakePipe[0] = hWakePipe[1] = -1;
+#endif
+}
+
+CSocketEvents::~CSocketEvents()
+{
+#ifdef USE_EPOLL
+    if (hEpoll != -1)
+        close(hEpoll);
+#endif
+#ifndef WIN32
+    if (hWakePipe[0] != -1)
+    {
+        close(hWakePipe[0]);
+        close(hWakePipe[1]);
+    }
+#endif
+}
+
+bool CSocketEvents::Init()
+{
+#ifndef WIN32
+    if (hWakePipe[0] == -1)
+    {
+        if (pipe(hWakePipe) != 0)
+            return error("CSocketEvents::Init() : pipe failed: %d", errno);
+        fcntl(hWakePipe[0], F_SETFL, fcntl(hWakePipe[0], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(hWakePipe[1], F_SETFL, fcntl(hWakePipe[1], F_GETFL, 0) | O_NONBLOCK);
+    }
+#endif
+#ifdef USE_EPOLL
+    if (hEpoll == -1)
+    {
+        hEpoll = epoll_create(1024);
+        if (hEpoll == -1)
+            return error("CSocketEvents::Init() : epoll_create failed: %d", errno);
+
+        // The wake pipe is level-triggered, Wait() drains it
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = hWakePipe[0];
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hWakePipe[0], &event) != 0)
+            return error("CSocketEvents::Init() : epoll_ctl failed: %d", errno);
+    }
+#elif defined(USE_POLL)
+    if (vPollFds.empty())
+    {
+        struct pollfd pfd;
+        pfd.fd = hWakePipe[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        vPollFds.push_back(pfd);
+    }
+#endif
+    return true;
+}
+
+bool CSocketEvents::IsEdgeTriggered() const
+{
+#ifdef USE_EPOLL
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool CSocketEvents::Add(SOCKET hSocket)
+{
+#ifdef USE_EPOLL
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = hSocket;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) != 0)
+    {
+        // Already registered under a closed and reused descriptor
+        if (errno != EEXIST || epoll_ctl(hEpoll, EPOLL_CTL_MOD, hSocket, &event) != 0)
+            return false;
+    }
+    return true;
+#elif defined(USE_POLL)
+    std::map<SOCKET, size_t>::iterator mi = mapPollIndex.find(hSocket);
+    if (mi != mapPollIndex.end())
+    {
+        vPollFds[(*mi).second].events = POLLIN;
+        return true;
+    }
+    struct pollfd pfd;
+    pfd.fd = hSocket;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    mapPollIndex[hSocket] = vPollFds.size();
+    vPollFds.push_back(pfd);
+    return true;
+#else
+    mapSockets[hSocket] = false;
+    return true;
+#endif
+}
+
+void CSocketEvents::Remove(SOCKET hSocket)
+{
+#ifdef USE_EPOLL
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, &event);
+#elif defined(USE_POLL)
+    // Move the last entry into the hole
+    std::map<SOCKET, size_t>::iterator mi = mapPollIndex.find(hSocket);
+    if (mi == mapPollIndex.end())
+        return;
+    size_t nIndex = (*mi).second;
+    mapPollIndex.erase(mi);
+    if (nIndex != vPollFds.size() - 1)
+    {
+        vPollFds[nIndex] = vPollFds.back();
+        mapPollIndex[vPollFds[nIndex].fd] = nIndex;
+    }
+    vPollFds.pop_back();
+#else
+    mapSockets.erase(hSocket);
+#endif
+}
+
+void CSocketEvents::SetWantWrite(SOCKET hSocket, bool fWantWrite)
+{
+#if defined(USE_POLL)
+    std::map<SOCKET, size_t>::iterator mi = mapPollIndex.find(hSocket);
+    if (mi != mapPollIndex.end())
+        vPollFds[(*mi).second].events = fWantWrite ? (POLLIN | POLLOUT) : POLLIN;
+#elif !defined(USE_EPOLL)
+    std::map<SOCKET, bool>::iterator mi = mapSockets.find(hSocket);
+    if (mi != mapSockets.end())
+        (*mi).second = fWantWrite;
+#endif
+}
+
+bool CSocketEvents::Wait(int nTimeout, std::vector<CEvent>& vEvents)
+{
+    vEvents.clear();
+#ifdef USE_EPOLL
+    struct epoll_event events[256];
+    int nEvents = epoll_wait(hEpoll, events, 256, nTimeout);
+    if (nEvents < 0)
+        return (errno == EINTR);
+    vEvents.reserve(nEvents);
+    for (int i = 0; i < nEvents; i++)
+    {
+        if (events[i].data.fd == hWakePipe[0])
+        {
+            char buf[64];
+            while (read(hWakePipe[0], buf, sizeof(buf)) > 0) { }
+            continue;
+        }
+        CEvent event;
+        event.hSocket = events[i].data.fd;
+        event.nEvents = 0;
+        if (events[i].events & EPOLLIN)
+            event.nEvents |= EVENT_READ;
+        if (events[i].events & EPOLLOUT)
+            event.nEvents |= EVENT_WRITE;
+        if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+            event.nEvents |= EVENT_ERROR;
+        vEvents.push_back(event);
+    }
+    return true;
+#elif defined(USE_POLL)
+    int nReady = poll(&vPollFds[0], vPollFds.size(), nTimeout);
+    if (nReady < 0)
+        return (errno == EINTR);
+    if (vPollFds[0].revents & POLLIN)
+    {
+        char buf[64];
+        while (read(hWakePipe[0], buf, sizeof(buf)) > 0) { }
+        nReady--;
+    }
+    vEvents.reserve(nReady);
+    for (size_t i = 1; i < vPollFds.size() && nReady > 0; i++)
+    {
+        const struct pollfd& pfd = vPollFds[i];
+        if (pfd.revents == 0)
+            continue;
+        nReady--;
+        CEvent event;
+        event.hSocket = pfd.fd;
+        event.nEvents = 0;
+        if (pfd.revents & POLLIN)
+            event.nEvents |= EVENT_READ;
+        if (pfd.revents & POLLOUT)
+            event.nEvents |= EVENT_WRITE;
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+            event.nEvents |= EVENT_ERROR;
+        vEvents.push_back(event);
+    }
+    return true;
+#else
+#ifdef WIN32
+    // There is no wake pipe for select() on Windows
+    if (nTimeout < 0 || nTimeout > 50)
+        nTimeout = 50;
+#endif
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+#ifndef WIN32
+    FD_SET(hWakePipe[0], &fdsetRecv);
+    hSocketMax = hWakePipe[0];
+#endif
+    for (std::map<SOCKET, bool>::iterator mi = mapSockets.begin(); mi != mapSockets.end(); ++mi)
+    {
+        SOCKET hSocket = (*mi).first;
+        FD_SET(hSocket, &fdsetRecv);
+        FD_SET(hSocket, &fdsetError);
+        if ((*mi).second)
+            FD_SET(hSocket, &fdsetSend);
+        hSocketMax = std::max(hSocketMax, hSocket);
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec  = nTimeout / 1000;
+    timeout.tv_usec = (nTimeout % 1000) * 1000;
+    int nSelect = select(hSocketMax + 1, &fdsetRecv, &fdsetSend, &fdsetError, nTimeout < 0 ? NULL : &timeout);
+    if (nSelect == SOCKET_ERROR)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr == WSAEINTR)
+            return true;
+        // A socket was closed under us; report everything so the caller
+        // finds out which one
+        printf("socket select error %d\n", nErr);
+        MilliSleep(50);
+        for (std::map<SOCKET, bool>::iterator mi = mapSockets.begin(); mi != mapSockets.end(); ++mi)
+        {
+            CEvent event;
+            event.hSocket = (*mi).first;
+            event.nEvents = EVENT_READ | EVENT_ERROR;
+            vEvents.push_back(event);
+        }
+        return true;
+    }
+#ifndef WIN32
+    if (FD_ISSET(hWakePipe[0], &fdsetRecv))
+    {
+        char buf[64];
+        while (read(hWakePipe[0], buf, sizeof(buf)) > 0) { }
+    }
+#endif
+    for (std::map<SOCKET, bool>::iterator mi = mapSockets.begin(); mi != mapSockets.end(); ++mi)
+    {
+        SOCKET hSocket = (*mi).first;
+        CEvent event;
+        event.hSocket = hSocket;
+        event.nEvents = 0;
+        if (FD_ISSET(hSocket, &fdsetRecv))
+            event.nEvents |= EVENT_READ;
+        if (FD_ISSET(hSocket, &fdsetSend))
+            event.nEvents |= EVENT_WRITE;
+        if (FD_ISSET(hSocket, &fdsetError))
+            event.nEvents |= EVENT_ERROR;
+        if (event.nEvents)
+            vEvents.push_back(event);
+    }
+    return true;
+#endif
+}
+
+void CSocketEvents::Wake()
+{
+#ifndef WIN32
+    if (hWakePipe[1] != -1)
+    {
+        char c = 0;
+        if (write(hWakePipe[1], &c, 1) < 0) { }
+    }
+#endif
+}
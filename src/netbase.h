@@ -5,6 +5,7 @@
 #ifndef BITCOIN_NETBASE_H
 #define BITCOIN_NETBASE_H
 #include <stdint.h>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -13,6 +14,13 @@
 
 extern int nConnectTimeout;
 
+#ifdef __linux__
+#define USE_EPOLL 1
+#elif !defined(WIN32)
+#define USE_POLL 1
+#include <poll.h>
+#endif
+
 #ifdef WIN32
 // In MSVC, this is defined as a macro, undefine it to prevent a compile and link error
 #undef SetPort
@@ -151,4 +159,63 @@ bool LookupNumeric(const char *pszName, CService& addr, int portDefault = 0);
 bool ConnectSocket(const CService &addr, SOCKET& hSocketRet, int nTimeout = nConnectTimeout);
 bool ConnectSocketByName(CService &addr, SOCKET& hSocketRet, const char *pszDest, int portDefault = 0, int nTimeout = nConnectTimeout);
 
+/** Readiness of a set of sockets served by one thread.
+ *
+ * Sockets stay registered until Remove() is called or they are closed.  With
+ * epoll (Linux) events are edge-triggered: a socket reported readable or
+ * writable has to be read or written until it would block before it is
+ * reported again.  Elsewhere poll(), or select() on Windows, is used and
+ * events are level-triggered; writability is only reported for sockets
+ * marked with SetWantWrite().
+ *
+ * Add(), Remove(), SetWantWrite() and Wait() belong to the serving thread,
+ * Wake() may be called from any thread to end a Wait() early.
+ */
+class CSocketEvents
+{
+public:
+    enum
+    {
+        EVENT_READ  = (1U << 0),
+        EVENT_WRITE = (1U << 1),
+        EVENT_ERROR = (1U << 2),
+    };
+
+    struct CEvent
+    {
+        SOCKET hSocket;
+        unsigned int nEvents;
+    };
+
+    CSocketEvents();
+    ~CSocketEvents();
+
+    bool Init();
+    bool IsEdgeTriggered() const;
+
+    bool Add(SOCKET hSocket);
+    void Remove(SOCKET hSocket);
+    void SetWantWrite(SOCKET hSocket, bool fWantWrite);
+
+    // Waits up to nTimeout milliseconds, -1 to wait until something happens
+    bool Wait(int nTimeout, std::vector<CEvent>& vEvents);
+    void Wake();
+
+private:
+    CSocketEvents(const CSocketEvents&);
+    void operator=(const CSocketEvents&);
+
+#ifdef USE_EPOLL
+    int hEpoll;
+#elif defined(USE_POLL)
+    std::vector<struct pollfd> vPollFds;    // the wake pipe first
+    std::map<SOCKET, size_t> mapPollIndex;  // socket -> position in vPollFds
+#else
+    std::map<SOCKET, bool> mapSockets;  // socket -> want write
+#endif
+#ifndef WIN32
+    int hWakePipe[2];
+#endif
+};
+
 #endif
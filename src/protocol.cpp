@@ -17,6 +17,7 @@ static const char* ppszTypeName[] =
     "ERROR",
     "tx",
     "block",
+    "cmpctblock",
 };
 
 CMessageHeader::CMessageHeader()
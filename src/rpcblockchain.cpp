@@ -4,6 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "main.h"
+#include "txdb.h"
 #include "bitcoinrpc.h"
 
 using namespace json_spirit;
@@ -224,6 +225,98 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns the state of the transaction memory pool.");
+
+    CTxMemPoolStats stats;
+    mempool.GetStats(stats, GetMaxMempoolSize());
+
+    Object obj;
+    obj.push_back(Pair("size",           (boost::uint64_t)stats.nTx));
+    obj.push_back(Pair("bytes",          (boost::uint64_t)stats.nBytes));
+    obj.push_back(Pair("usage",          (boost::uint64_t)stats.nUsage));
+    obj.push_back(Pair("maxmempool",     (boost::uint64_t)stats.nMaxUsage));
+    obj.push_back(Pair("mempoolminfee",  ValueFromAmount(stats.nMinFeePerKb)));
+    obj.push_back(Pair("evicted",        (boost::uint64_t)stats.nEvicted));
+    return obj;
+}
+
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns usage statistics of the valid signature cache.");
+
+    CSignatureCacheStats stats;
+    GetSignatureCacheStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("hits",       (boost::uint64_t)stats.nHits));
+    obj.push_back(Pair("misses",     (boost::uint64_t)stats.nMisses));
+    obj.push_back(Pair("entries",    (boost::uint64_t)stats.nEntries));
+    obj.push_back(Pair("capacity",   (boost::uint64_t)stats.nCapacity));
+    obj.push_back(Pair("bytes",      (boost::uint64_t)stats.nBytes));
+    return obj;
+}
+
+Value gettxdbcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "gettxdbcacheinfo\n"
+            "Returns usage statistics of the transaction database cache.");
+
+    CTxDBCacheStats stats;
+    GetTxDBCacheStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("hits",           (boost::uint64_t)stats.nHits));
+    obj.push_back(Pair("misses",         (boost::uint64_t)stats.nMisses));
+    obj.push_back(Pair("entries",        (boost::uint64_t)stats.nEntries));
+    obj.push_back(Pair("bytes",          (boost::uint64_t)stats.nBytes));
+    obj.push_back(Pair("dirtyentries",   (boost::uint64_t)stats.nDirtyEntries));
+    obj.push_back(Pair("dirtybytes",     (boost::uint64_t)stats.nDirtyBytes));
+    obj.push_back(Pair("txhits",         (boost::uint64_t)stats.nTxHits));
+    obj.push_back(Pair("txmisses",       (boost::uint64_t)stats.nTxMisses));
+    obj.push_back(Pair("txentries",      (boost::uint64_t)stats.nTxEntries));
+    obj.push_back(Pair("txbytes",        (boost::uint64_t)stats.nTxBytes));
+    obj.push_back(Pair("flushes",        (boost::uint64_t)stats.nFlushes));
+    obj.push_back(Pair("lastflushms",    (boost::int64_t)stats.nLastFlushMillis));
+    obj.push_back(Pair("totalflushms",   (boost::int64_t)stats.nTotalFlushMillis));
+    return obj;
+}
+
+Value getsyncinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsyncinfo\n"
+            "Returns the state of the headers-first block download.");
+
+    CHeadersSyncStats stats;
+    GetHeadersSyncStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("headersfirst",   stats.fEnabled));
+    obj.push_back(Pair("blocks",         (int)nBestHeight));
+    obj.push_back(Pair("headers",        stats.nHeadersHeight));
+    obj.push_back(Pair("inflight",       (boost::uint64_t)stats.nBlocksInFlight));
+    obj.push_back(Pair("syncpeer",       stats.strSyncPeer));
+    obj.push_back(Pair("stalls",         (boost::uint64_t)stats.nStalls));
+    if (stats.nSyncStart != 0)
+    {
+        obj.push_back(Pair("syncstart",  (boost::int64_t)stats.nSyncStart));
+        obj.push_back(Pair("syncseconds", (boost::int64_t)((stats.nSyncDone ? stats.nSyncDone : GetTime()) - stats.nSyncStart)));
+        obj.push_back(Pair("syncdone",   stats.nSyncDone != 0));
+    }
+    return obj;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -57,6 +57,29 @@ Value getmininginfo(const Array& params, bool fHelp)
     return obj;
 }
 
+Value gettemplatecacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "gettemplatecacheinfo\n"
+            "Returns usage statistics and build times of the block template cache.");
+
+    CBlockTemplateStats stats;
+    GetBlockTemplateStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("hits",           (boost::uint64_t)stats.nHits));
+    obj.push_back(Pair("deltaupdates",   (boost::uint64_t)stats.nDeltaUpdates));
+    obj.push_back(Pair("fullbuilds",     (boost::uint64_t)stats.nFullBuilds));
+    obj.push_back(Pair("lastbuildus",    (boost::int64_t)stats.nLastBuildMicros));
+    obj.push_back(Pair("maxbuildus",     (boost::int64_t)stats.nMaxBuildMicros));
+    obj.push_back(Pair("avgbuildus",     (boost::int64_t)(stats.nFullBuilds ? stats.nTotalBuildMicros / (int64_t)stats.nFullBuilds : 0)));
+    obj.push_back(Pair("lastdeltaus",    (boost::int64_t)stats.nLastDeltaMicros));
+    obj.push_back(Pair("avgdeltaus",     (boost::int64_t)(stats.nDeltaUpdates ? stats.nTotalDeltaMicros / (int64_t)stats.nDeltaUpdates : 0)));
+    obj.push_back(Pair("templatetx",     (boost::uint64_t)stats.nTx));
+    return obj;
+}
+
 Value getstakinginfo(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -213,7 +236,10 @@ Value getworkex(const Array& params, bool fHelp)
         pblock->nNonce = pdata->nNonce;
 
         if(coinbase.size() == 0)
+        {
             pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
+            pblock->vtx[0].InvalidateHash();
+        }
         else
             CDataStream(coinbase, SER_NETWORK, PROTOCOL_VERSION) >> pblock->vtx[0]; // FIXME - HACK!
 
@@ -334,6 +360,7 @@ Value getwork(const Array& params, bool fHelp)
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
         pblock->vtx[0].vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
+        pblock->vtx[0].InvalidateHash();
         pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 
         return CheckWork(pblock, *pwalletMain, reservekey);
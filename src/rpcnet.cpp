@@ -69,6 +69,29 @@ Value getpeerinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getcompactblockinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcompactblockinfo\n"
+            "Returns counters of the compact block relay.");
+
+    CCompactBlockStats stats;
+    GetCompactBlockStats(stats);
+
+    Object obj;
+    obj.push_back(Pair("enabled",        fCompactBlocks));
+    obj.push_back(Pair("sent",           (boost::uint64_t)stats.nSent));
+    obj.push_back(Pair("received",       (boost::uint64_t)stats.nReceived));
+    obj.push_back(Pair("reconstructed",  (boost::uint64_t)stats.nReconstructed));
+    obj.push_back(Pair("roundtrips",     (boost::uint64_t)stats.nRoundTrips));
+    obj.push_back(Pair("fallbacks",      (boost::uint64_t)stats.nFallbacks));
+    obj.push_back(Pair("txprefilled",    (boost::uint64_t)stats.nTxPrefilled));
+    obj.push_back(Pair("txfrompool",     (boost::uint64_t)stats.nTxFromPool));
+    obj.push_back(Pair("txrequested",    (boost::uint64_t)stats.nTxRequested));
+    return obj;
+}
+
 
 // ppcoin: send alert.
 // There is a known deadlock situation with ThreadMessageHandler
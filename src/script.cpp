@@ -5,8 +5,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <openssl/sha.h>
 
 using namespace std;
 using namespace boost;
@@ -1202,66 +1201,148 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 }
 
 
-// Valid signature cache, to avoid doing expensive ECDSA signature checking
-// twice for every transaction (once when accepted into memory pool, and
-// again when accepted into the block chain)
+CSignatureCache::CSignatureCache()
+{
+    // Memory budget in megabytes, split evenly between the stripes.
+    // Since there are a maximum of 20,000 signature operations per block
+    // the 10MB default holds the signatures of several full blocks.
+    // -maxsigcachesize used to count entries; a configuration that
+    // still sets it gets that many slots.
+    int64_t nSlots;
+    if (mapArgs.count("-maxsigcachesize") && !mapArgs.count("-maxsigcachemb"))
+        nSlots = GetArg("-maxsigcachesize", 50000);
+    else
+        nSlots = GetArg("-maxsigcachemb", 10) * ((1 << 20) / (int64_t)sizeof(uint256));
+    Init(nSlots);
+}
 
-class CSignatureCache
+CSignatureCache::CSignatureCache(int64_t nSlots)
 {
-private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, std::vector<unsigned char> > sigdata_type;
-    std::set< sigdata_type> setValid;
-    CCriticalSection cs_sigcache;
+    Init(nSlots);
+}
 
-public:
-    bool
-    Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+void CSignatureCache::Init(int64_t nSlots)
+{
+    salt = GetRandHash();
+
+    const int64_t nMaxSlots = ((int64_t)4096 << 20) / (int64_t)sizeof(uint256);
+    nSlots = std::max((int64_t)0, std::min(nSlots, nMaxSlots));
+    nStripeSlots = (size_t)nSlots / nStripes;
+    for (unsigned int i = 0; i < nStripes; i++)
     {
-        LOCK(cs_sigcache);
+        stripes[i].nHits = 0;
+        stripes[i].nMisses = 0;
+        stripes[i].nEntries = 0;
+    }
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+uint256 CSignatureCache::ComputeEntry(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey) const
+{
+    uint256 entry;
+    unsigned int nSigSize = vchSig.size();
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, (const unsigned char*)&salt, sizeof(salt));
+    SHA256_Update(&ctx, (const unsigned char*)&hash, sizeof(hash));
+    SHA256_Update(&ctx, &nSigSize, sizeof(nSigSize));
+    if (!vchSig.empty())
+        SHA256_Update(&ctx, &vchSig[0], vchSig.size());
+    if (!pubKey.empty())
+        SHA256_Update(&ctx, &pubKey[0], pubKey.size());
+    SHA256_Final((unsigned char*)&entry, &ctx);
+    return entry;
+}
+
+CSignatureCache::CStripe& CSignatureCache::GetStripe(const uint256& entry)
+{
+    return stripes[entry.Get64(0) % nStripes];
+}
+
+bool CSignatureCache::Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+{
+    uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+    CStripe& stripe = GetStripe(entry);
+
+    LOCK(stripe.cs);
+    size_t nSlots = stripe.vSlots.size();
+    if (nSlots == 0)
+    {
+        stripe.nMisses++;
         return false;
     }
-
-    void Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+    size_t nSlot = entry.Get64(1) % nSlots;
+    for (unsigned int i = 0; i < nProbes; i++)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        LOCK(cs_sigcache);
+        if (stripe.vSlots[(nSlot + i) % nSlots] == entry)
+        {
+            stripe.nHits++;
+            return true;
+        }
+    }
+    stripe.nMisses++;
+    return false;
+}
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+void CSignatureCache::Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey)
+{
+    if (nStripeSlots == 0)
+        return;
+    uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+    CStripe& stripe = GetStripe(entry);
+
+    LOCK(stripe.cs);
+    if (stripe.vSlots.empty())
+        stripe.vSlots.resize(nStripeSlots, 0);
+    size_t nSlots = stripe.vSlots.size();
+    size_t nSlot = entry.Get64(1) % nSlots;
+    for (unsigned int i = 0; i < nProbes; i++)
+    {
+        uint256& slot = stripe.vSlots[(nSlot + i) % nSlots];
+        if (slot == entry)
+            return;
+        if (slot == 0)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            slot = entry;
+            stripe.nEntries++;
+            return;
         }
+    }
+
+    // All probed slots are taken: overwrite one of them. Which one depends
+    // on the salted digest, so would-be DoS attackers can't pre-generate
+    // signatures that keep evicting the same entries.
+    stripe.vSlots[(nSlot + entry.Get64(2) % nProbes) % nSlots] = entry;
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+void CSignatureCache::GetStats(CSignatureCacheStats& stats)
+{
+    stats = CSignatureCacheStats();
+    for (unsigned int i = 0; i < nStripes; i++)
+    {
+        LOCK(stripes[i].cs);
+        stats.nHits += stripes[i].nHits;
+        stats.nMisses += stripes[i].nMisses;
+        stats.nEntries += stripes[i].nEntries;
+        stats.nCapacity += nStripeSlots;
+        stats.nBytes += stripes[i].vSlots.size() * sizeof(uint256);
     }
-};
+}
+
+static CSignatureCache& GetSignatureCache()
+{
+    static CSignatureCache signatureCache;
+    return signatureCache;
+}
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats)
+{
+    GetSignatureCache().GetStats(stats);
+}
 
 bool CheckSig(vector<unsigned char> vchSig, vector<unsigned char> vchPubKey, CScript scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType)
 {
-    static CSignatureCache signatureCache;
+    CSignatureCache& signatureCache = GetSignatureCache();
 
     // Hash type is one byte tacked on to the end of the signature
     if (vchSig.empty())
@@ -1729,6 +1810,9 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CTransa
     assert(nIn < txTo.vin.size());
     CTxIn& txin = txTo.vin[nIn];
 
+    // txin.scriptSig is rewritten below
+    txTo.InvalidateHash();
+
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
     uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
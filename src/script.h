@@ -605,6 +605,61 @@ bool VerifyScript(const CScript& scriptSig, const CScript& scriptPubKey, const C
                   int nHashType);
 bool VerifySignature(const CTransaction& txFrom, const CTransaction& txTo, unsigned int nIn, int nHashType);
 
+/** Usage counters of the valid signature cache */
+struct CSignatureCacheStats
+{
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nEntries;
+    uint64_t nCapacity;
+    uint64_t nBytes;
+
+    CSignatureCacheStats() : nHits(0), nMisses(0), nEntries(0), nCapacity(0), nBytes(0) {}
+};
+void GetSignatureCacheStats(CSignatureCacheStats& stats);
+
+/** Valid signature cache, to avoid doing expensive ECDSA signature checking
+ * twice for every transaction (once when accepted into memory pool, and
+ * again when accepted into the block chain)
+ */
+class CSignatureCache
+{
+private:
+    // Entries are salted SHA256 digests of (signature hash, signature, public key),
+    // kept in open-addressed tables. The digest picks one of nStripes tables,
+    // each behind its own lock, so script check threads rarely contend.
+    static const unsigned int nStripes = 16;
+    // Number of consecutive slots probed for an entry before evicting one
+    static const unsigned int nProbes = 8;
+
+    struct CStripe
+    {
+        CCriticalSection cs;
+        std::vector<uint256> vSlots; // a null slot is empty, allocated by the first Set
+        uint64_t nHits;
+        uint64_t nMisses;
+        uint64_t nEntries;
+    };
+
+    CStripe stripes[nStripes];
+    size_t nStripeSlots;
+    uint256 salt;
+
+    void Init(int64_t nSlots);
+    uint256 ComputeEntry(const uint256& hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey) const;
+    CStripe& GetStripe(const uint256& entry);
+
+public:
+    // Sized by -maxsigcachemb, or by the legacy -maxsigcachesize entry count
+    CSignatureCache();
+    // Room for nSlots entries, split between the stripes
+    explicit CSignatureCache(int64_t nSlots);
+
+    bool Get(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey);
+    void Set(uint256 hash, const std::vector<unsigned char>& vchSig, const std::vector<unsigned char>& pubKey);
+    void GetStats(CSignatureCacheStats& stats);
+};
+
 // Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
 // combine them intelligently and return the result.
 CScript CombineSignatures(CScript scriptPubKey, const CTransaction& txTo, unsigned int nIn, const CScript& scriptSig1, const CScript& scriptSig2);
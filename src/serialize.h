@@ -704,6 +704,8 @@ struct ser_streamplaceholder
 
 
 
+typedef std::vector<char, zero_after_free_allocator<char> > CSerializeData;
+
 /** Double ended buffer combining vector and stream-like interfaces.
  *
  * >> and << read and write unformatted data using the above serialization templates.
@@ -892,6 +894,14 @@ public:
         nReadPos = 0;
     }
 
+    // Hand the unread data over to data without copying it
+    void GetAndClear(CSerializeData& data)
+    {
+        Compact();
+        data.clear();
+        vch.swap(data);
+    }
+
     bool Rewind(size_type n)
     {
         // Rewind by n characters if the buffer hasn't been compacted yet
@@ -1186,4 +1196,60 @@ public:
     }
 };
 
+/** Read-only stream over a range of memory that it does not own, such as
+ * a memory-mapped block file.  Reading past the end throws like CDataStream.
+ */
+class CBufferReader
+{
+protected:
+    const char* pbegin;
+    const char* pcur;
+    const char* pend;
+public:
+    int nType;
+    int nVersion;
+
+    CBufferReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn)
+    {
+        pbegin = pbeginIn;
+        pcur = pbeginIn;
+        pend = pendIn;
+        nType = nTypeIn;
+        nVersion = nVersionIn;
+    }
+
+    size_t tell() const          { return pcur - pbegin; }
+    size_t size() const          { return pend - pcur; }
+    bool empty() const           { return pcur == pend; }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+
+    CBufferReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > (size_t)(pend - pcur))
+            throw std::ios_base::failure("CBufferReader::read() : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    unsigned int GetSerializeSize(const T& obj)
+    {
+        // Tells the size of the object if serialized to this stream
+        return ::GetSerializeSize(obj, nType, nVersion);
+    }
+
+    template<typename T>
+    CBufferReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #endif
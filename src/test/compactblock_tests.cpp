@@ -0,0 +1,68 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txutil.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(compactblock_tests)
+
+BOOST_AUTO_TEST_CASE(compactblock_reconstruct)
+{
+    // A coinbase and four transactions, three of which are in our pool
+    CBlock block;
+    CTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vin[0].scriptSig = CScript() << OP_1;
+    txCoinBase.vout.resize(1);
+    block.vtx.push_back(txCoinBase);
+    for (int i = 1; i <= 4; i++)
+        block.vtx.push_back(MakeTx(uint256(i)));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CTxMemPool pool;
+    for (int i = 1; i <= 3; i++)
+        AddTx(pool, block.vtx[i]);
+    AddTx(pool, MakeTx(uint256(100)));
+
+    CCompactBlock cmpctblock(block);
+    BOOST_CHECK(cmpctblock.vPrefilled.size() == 1);
+    BOOST_CHECK(cmpctblock.vShortIds.size() == 4);
+
+    // Short ids take 6 bytes on the wire
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    BOOST_CHECK(::GetSerializeSize(cmpctblock.vShortIds, SER_NETWORK, PROTOCOL_VERSION) == 1 + 4 * 6);
+    CCompactBlock cmpctblockRecv;
+    ss >> cmpctblockRecv;
+    BOOST_CHECK(cmpctblockRecv.header.GetHash() == block.GetHash());
+    BOOST_CHECK(cmpctblockRecv.GetShortId(block.vtx[1].GetHash()) == cmpctblockRecv.vShortIds[0].Get());
+
+    CPartialBlock partial;
+    BOOST_REQUIRE(partial.Init(cmpctblockRecv, pool));
+    BOOST_CHECK(partial.nPrefilled == 1);
+    BOOST_CHECK(partial.nFromPool == 3);
+    BOOST_CHECK(!partial.IsComplete());
+
+    vector<unsigned short> vIndexes;
+    partial.GetMissing(vIndexes);
+    BOOST_REQUIRE(vIndexes.size() == 1);
+    BOOST_CHECK(vIndexes[0] == 4);
+
+    BOOST_CHECK(!partial.FillMissing(vector<CTransaction>()));
+    BOOST_CHECK(partial.FillMissing(vector<CTransaction>(1, block.vtx[4])));
+    BOOST_CHECK(partial.IsComplete());
+    BOOST_CHECK(partial.block.GetHash() == block.GetHash());
+    BOOST_CHECK(partial.block.BuildMerkleTree() == block.hashMerkleRoot);
+
+    // Prefilled transactions must land inside the block, once
+    CCompactBlock cmpctblockBad = cmpctblock;
+    cmpctblockBad.vPrefilled[0].nIndex = 5;
+    BOOST_CHECK(!CPartialBlock().Init(cmpctblockBad, pool));
+    cmpctblockBad = cmpctblock;
+    cmpctblockBad.vPrefilled.push_back(cmpctblock.vPrefilled[0]);
+    BOOST_CHECK(!CPartialBlock().Init(cmpctblockBad, pool));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,234 @@
+#include <boost/test/unit_test.hpp>
+
+#include "checkpoints.h"
+#include "main.h"
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+extern CNode* pnodeHeadersSync;
+extern void ResetHeadersSync();
+extern bool AcceptSyncHeaders(const vector<CBlock>& vHeaders, const vector<uint256>& vHash, const vector<char>& vProofOfWork, int& nDoS);
+extern void MarkBlockInFlight(CNode* pnode, const uint256& hash);
+extern void CheckBlockDownloads();
+
+BOOST_AUTO_TEST_SUITE(headerssync_tests)
+
+// The proof-of-work limit
+static const unsigned int nBitsLimit = CBigNum(~uint256(0) >> 20).GetCompact();
+
+// A block index entry to hang header chains off, above the early
+// checkpoints, which also serves as the sync-checkpoint
+struct HeadersSyncSetup
+{
+    CBlockIndex index;
+    uint256 hashBase;
+    uint256 hashSavedCheckpoint;
+
+    HeadersSyncSetup()
+    {
+        SetMockTime(GetTime());
+        hashBase = GetRandHash();
+        index.phashBlock = &mapBlockIndex.insert(make_pair(hashBase, &index)).first->first;
+        index.nHeight = 1001;
+        index.nTime = GetTime() - 1000000;
+        index.nBits = nBitsLimit;
+        hashSavedCheckpoint = Checkpoints::hashSyncCheckpoint;
+        Checkpoints::hashSyncCheckpoint = hashBase;
+    }
+
+    ~HeadersSyncSetup()
+    {
+        LOCK(cs_main);
+        ResetHeadersSync();
+        Checkpoints::hashSyncCheckpoint = hashSavedCheckpoint;
+        mapBlockIndex.erase(hashBase);
+        SetMockTime(0);
+    }
+};
+
+// Proof-of-work headers at the limit target, a minute apart
+static void MakeHeaders(uint256 hashPrev, unsigned int nTime, int nCount, vector<CBlock>& vHeaders, vector<uint256>& vHash)
+{
+    vHeaders.clear();
+    vHash.clear();
+    uint256 hash = hashPrev;
+    for (int i = 0; i < nCount; i++)
+    {
+        CBlock header;
+        header.hashPrevBlock = hash;
+        header.hashMerkleRoot = GetRandHash();
+        header.nTime = nTime + 60 * (i + 1);
+        header.nBits = nBitsLimit;
+        hash = header.GetHash();
+        vHeaders.push_back(header);
+        vHash.push_back(hash);
+    }
+}
+
+static bool Accept(const vector<CBlock>& vHeaders, const vector<uint256>& vHash, int& nDoS)
+{
+    vector<char> vProofOfWork(vHeaders.size(), true);
+    return AcceptSyncHeaders(vHeaders, vHash, vProofOfWork, nDoS);
+}
+
+static int GetHeadersHeight()
+{
+    CHeadersSyncStats stats;
+    GetHeadersSyncStats(stats);
+    return stats.nHeadersHeight;
+}
+
+BOOST_FIXTURE_TEST_CASE(headerssync_branches, HeadersSyncSetup)
+{
+    LOCK(cs_main);
+    int nDoS;
+    vector<CBlock> vChain, vHeaders;
+    vector<uint256> vChainHash, vHash;
+    MakeHeaders(hashBase, index.nTime, 10, vChain, vChainHash);
+    BOOST_CHECK(Accept(vChain, vChainHash, nDoS) && nDoS == 0);
+    BOOST_CHECK_EQUAL(GetHeadersHeight(), 1011);
+
+    // A shorter branch leaves the header chain as it was
+    MakeHeaders(vChainHash[4], vChain[4].nTime, 3, vHeaders, vHash);
+    BOOST_CHECK(Accept(vHeaders, vHash, nDoS) && nDoS == 0);
+    BOOST_CHECK_EQUAL(GetHeadersHeight(), 1011);
+    MakeHeaders(vChainHash[9], vChain[9].nTime, 1, vHeaders, vHash);
+    BOOST_CHECK(Accept(vHeaders, vHash, nDoS));
+    BOOST_CHECK_EQUAL(GetHeadersHeight(), 1012);
+
+    // A longer one replaces the headers it cuts off
+    MakeHeaders(vChainHash[4], vChain[4].nTime, 10, vChain, vChainHash);
+    BOOST_CHECK(Accept(vChain, vChainHash, nDoS) && nDoS == 0);
+    BOOST_CHECK_EQUAL(GetHeadersHeight(), 1016);
+
+    // So does a longer one off the block the chain starts from
+    MakeHeaders(hashBase, index.nTime, 20, vChain, vChainHash);
+    BOOST_CHECK(Accept(vChain, vChainHash, nDoS) && nDoS == 0);
+    BOOST_CHECK_EQUAL(GetHeadersHeight(), 1021);
+
+    // Headers off a block we don't know are ignored without penalty
+    MakeHeaders(GetRandHash(), index.nTime, 30, vHeaders, vHash);
+    BOOST_CHECK(Accept(vHeaders, vHash, nDoS) && nDoS == 0);
+    BOOST_CHECK_EQUAL(GetHeadersHeight(), 1021);
+}
+
+BOOST_FIXTURE_TEST_CASE(headerssync_rollback, HeadersSyncSetup)
+{
+    LOCK(cs_main);
+    int nDoS;
+    vector<CBlock> vChain, vHeaders;
+    vector<uint256> vChainHash, vHash;
+    MakeHeaders(hashBase, index.nTime, 10, vChain, vChainHash);
+    BOOST_CHECK(Accept(vChain, vChainHash, nDoS));
+
+    // An invalid header takes back the ones before it in the same message
+    MakeHeaders(vChainHash[9], vChain[9].nTime, 5, vHeaders, vHash);
+    vHeaders[3].nTime = index.nTime;
+    vHash[3] = vHeaders[3].GetHash();
+    vHeaders[4].hashPrevBlock = vHash[3];
+    vHash[4] = vHeaders[4].GetHash();
+    BOOST_CHECK(!Accept(vHeaders, vHash, nDoS) && nDoS > 0);
+    BOOST_CHECK_EQUAL(GetHeadersHeight(), 1011);
+
+    // Also on a branch, which leaves the chain it would have replaced
+    MakeHeaders(vChainHash[4], vChain[4].nTime, 10, vHeaders, vHash);
+    vHeaders[9].nTime = (unsigned int)(GetAdjustedTime() + 24 * 60 * 60);
+    vHash[9] = vHeaders[9].GetHash();
+    BOOST_CHECK(!Accept(vHeaders, vHash, nDoS) && nDoS > 0);
+    BOOST_CHECK_EQUAL(GetHeadersHeight(), 1011);
+    MakeHeaders(vChainHash[9], vChain[9].nTime, 1, vHeaders, vHash);
+    BOOST_CHECK(Accept(vHeaders, vHash, nDoS));
+    BOOST_CHECK_EQUAL(GetHeadersHeight(), 1012);
+
+    // Headers that don't connect to each other are refused
+    MakeHeaders(vHash[0], vHeaders[0].nTime, 4, vHeaders, vHash);
+    vHeaders[2].hashPrevBlock = GetRandHash();
+    BOOST_CHECK(!Accept(vHeaders, vHash, nDoS) && nDoS > 0);
+    BOOST_CHECK_EQUAL(GetHeadersHeight(), 1012);
+
+    // A header chain started from scratch is dropped entirely
+    ResetHeadersSync();
+    MakeHeaders(hashBase, index.nTime, 3, vHeaders, vHash);
+    vHeaders[2].nBits = 0;
+    vHash[2] = vHeaders[2].GetHash();
+    BOOST_CHECK(!Accept(vHeaders, vHash, nDoS) && nDoS > 0);
+    BOOST_CHECK_EQUAL(GetHeadersHeight(), nBestHeight);
+}
+
+BOOST_FIXTURE_TEST_CASE(headerssync_stalls, HeadersSyncSetup)
+{
+    LOCK(cs_main);
+    static const int nWindow = 1024;
+    int nDoS;
+    vector<CBlock> vHeaders;
+    vector<uint256> vHash;
+    MakeHeaders(hashBase, index.nTime, nWindow + 10, vHeaders, vHash);
+    BOOST_REQUIRE(Accept(vHeaders, vHash, nDoS));
+
+    CNode nodeSync(INVALID_SOCKET, CAddress(), "", true);
+    CNode nodeOther(INVALID_SOCKET, CAddress(), "", true);
+    {
+        LOCK(cs_vNodes);
+        vNodes.push_back(&nodeSync);
+        vNodes.push_back(&nodeOther);
+        pnodeHeadersSync = nodeSync.AddRef();
+    }
+
+    // The oldest block of a full window only waits for the orphan stage:
+    // nobody holds the window up
+    mapOrphanBlocks[vHash[0]] = NULL;
+    for (int i = 1; i < nWindow; i++)
+        MarkBlockInFlight(&nodeSync, vHash[i]);
+    CHeadersSyncStats stats;
+    GetHeadersSyncStats(stats);
+    uint64_t nStalls = stats.nStalls;
+    for (int i = 0; i < 2; i++)
+    {
+        SetMockTime(GetTime() + 11);
+        CheckBlockDownloads();
+    }
+    GetHeadersSyncStats(stats);
+    BOOST_CHECK_EQUAL(stats.nBlocksInFlight, (uint64_t)nWindow - 1);
+    BOOST_CHECK_EQUAL(stats.nStalls, nStalls);
+    BOOST_CHECK(!nodeSync.fDisconnect);
+    mapOrphanBlocks.erase(vHash[0]);
+
+    // Another peer holding it up loses its requests for a while, and the
+    // header chain stays
+    MarkBlockInFlight(&nodeOther, vHash[0]);
+    MarkBlockInFlight(&nodeOther, vHash[nWindow]);
+    SetMockTime(GetTime() + 11);
+    CheckBlockDownloads();
+    GetHeadersSyncStats(stats);
+    BOOST_CHECK_EQUAL(stats.nStalls, nStalls + 1);
+    BOOST_CHECK_EQUAL(stats.nBlocksInFlight, (uint64_t)nWindow - 1);
+    BOOST_CHECK_EQUAL(nodeOther.nBlocksInFlight, 0);
+    BOOST_CHECK(nodeOther.nBlockStallUntil > GetTime());
+    BOOST_CHECK(!nodeOther.fDisconnect);
+    BOOST_CHECK_EQUAL(GetHeadersHeight(), 1001 + nWindow + 10);
+
+    // The sync peer delivering nothing is disconnected with its headers
+    SetMockTime(GetTime() + 60);
+    CheckBlockDownloads();
+    BOOST_CHECK(nodeSync.fDisconnect);
+    BOOST_CHECK(pnodeHeadersSync == NULL);
+    BOOST_CHECK_EQUAL(GetHeadersHeight(), nBestHeight);
+
+    // Requests of disconnected peers are freed
+    SetMockTime(GetTime() + 1);
+    CheckBlockDownloads();
+    GetHeadersSyncStats(stats);
+    BOOST_CHECK_EQUAL(stats.nBlocksInFlight, 0U);
+    BOOST_CHECK_EQUAL(nodeSync.nBlocksInFlight, 0);
+    BOOST_CHECK_EQUAL(nodeSync.GetRefCount(), 0);
+
+    {
+        LOCK(cs_vNodes);
+        vNodes.erase(remove(vNodes.begin(), vNodes.end(), &nodeSync), vNodes.end());
+        vNodes.erase(remove(vNodes.begin(), vNodes.end(), &nodeOther), vNodes.end());
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,170 @@
+//
+// Unit tests for the proof-of-stake kernel
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "../kernel.h"
+#include "../util.h"
+
+using namespace std;
+
+// Size of the synthetic block index; the fork check needs at least 2000
+#define NUM_BLOCKS 10000
+
+// Synthetic main chain: one block a minute, a new stake modifier every 10 minutes
+class CSyntheticChain
+{
+public:
+    vector<CBlockIndex*> vIndex;
+    CBlockIndex* pindexBestOld;
+    int nBestHeightOld;
+
+    CSyntheticChain(int nBlocks)
+    {
+        pindexBestOld = pindexBest;
+        nBestHeightOld = nBestHeight;
+        int64_t nTimeStart = GetAdjustedTime() - (int64_t)nBlocks * 60 - 30 * 24 * 60 * 60;
+        for (int i = 0; i < nBlocks; i++)
+        {
+            CBlockIndex* pindex = new CBlockIndex();
+            pindex->nHeight = i;
+            pindex->nTime = nTimeStart + i * 60;
+            pindex->SetStakeModifier(i, i % 10 == 0);
+            if (i > 0)
+            {
+                pindex->pprev = vIndex.back();
+                vIndex.back()->pnext = pindex;
+            }
+            uint256 hash = i + 1;
+            pindex->phashBlock = &(mapBlockIndex.insert(make_pair(hash, pindex)).first->first);
+            vIndex.push_back(pindex);
+        }
+        pindexBest = vIndex.back();
+        nBestHeight = pindexBest->nHeight;
+    }
+
+    ~CSyntheticChain()
+    {
+        InvalidateKernelModifierCache(-1);
+        BOOST_FOREACH(CBlockIndex* pindex, vIndex)
+        {
+            mapBlockIndex.erase(pindex->GetBlockHash());
+            delete pindex;
+        }
+        pindexBest = pindexBestOld;
+        nBestHeight = nBestHeightOld;
+    }
+
+    // Reference lookup: walk pnext as GetKernelStakeModifier did before the cache
+    const CBlockIndex* Walk(const CBlockIndex* pindexFrom) const
+    {
+        int64_t nSelectionInterval = 0;
+        for (int nSection=0; nSection<64; nSection++)
+            nSelectionInterval += nModifierInterval * 63 / (63 + ((63 - nSection) * (MODIFIER_INTERVAL_RATIO - 1)));
+        int64_t nStakeModifierTime = pindexFrom->GetBlockTime();
+        const CBlockIndex* pindex = pindexFrom;
+        while (nStakeModifierTime < pindexFrom->GetBlockTime() + nSelectionInterval)
+        {
+            if (!pindex->pnext)
+                return NULL;
+            pindex = pindex->pnext;
+            if (pindex->GeneratedStakeModifier())
+                nStakeModifierTime = pindex->GetBlockTime();
+        }
+        return pindex;
+    }
+};
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+BOOST_AUTO_TEST_CASE(kernel_modifier_cache)
+{
+    CSyntheticChain chain(NUM_BLOCKS);
+
+    vector<const CBlockIndex*> vExpected(NUM_BLOCKS);
+    for (int i = 0; i < NUM_BLOCKS; i++)
+        vExpected[i] = chain.Walk(chain.vIndex[i]);
+
+    // first pass fills the cache, second pass must be served from it
+    for (int nPass = 0; nPass < 2; nPass++)
+    {
+        for (int i = 0; i < NUM_BLOCKS; i++)
+        {
+            uint64_t nStakeModifier = 0;
+            const CBlockIndex* pindexModifier = NULL;
+            bool fFound = GetKernelStakeModifier(chain.vIndex[i]->GetBlockHash(), nStakeModifier, pindexModifier);
+            BOOST_CHECK_EQUAL(fFound, vExpected[i] != NULL);
+            if (fFound)
+            {
+                BOOST_CHECK(pindexModifier == vExpected[i]);
+                BOOST_CHECK_EQUAL(nStakeModifier, vExpected[i]->nStakeModifier);
+            }
+        }
+    }
+
+    // disconnect the top of the chain; modifiers found beyond the fork must go
+    int nFork = NUM_BLOCKS - 1000;
+    chain.vIndex[nFork]->pnext = NULL;
+    pindexBest = chain.vIndex[nFork];
+    nBestHeight = nFork;
+    InvalidateKernelModifierCache(nFork);
+    for (int i = nFork - 1000; i <= nFork; i++)
+    {
+        uint64_t nStakeModifier = 0;
+        const CBlockIndex* pindexModifier = NULL;
+        const CBlockIndex* pindexExpected = chain.Walk(chain.vIndex[i]);
+        BOOST_CHECK_EQUAL(GetKernelStakeModifier(chain.vIndex[i]->GetBlockHash(), nStakeModifier, pindexModifier), pindexExpected != NULL);
+        if (pindexExpected)
+            BOOST_CHECK(pindexModifier == pindexExpected);
+    }
+    chain.vIndex[nFork]->pnext = chain.vIndex[nFork + 1];
+}
+
+// Reference search: one CheckStakeKernelHash per second, as the wallet did
+static bool WalkStakeKernelHash(unsigned int nBits, uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, const COutPoint& prevout, int64_t nValueIn, unsigned int nTimeTxFrom, unsigned int nCount, unsigned int& nTimeTxRet, uint256& hashProofOfStake, uint256& targetProofOfStake)
+{
+    for (unsigned int n = 0; n < nCount; n++)
+    {
+        if (CheckStakeKernelHash(nBits, nStakeModifier, nTimeBlockFrom, nTxPrevOffset, prevout, nValueIn, nTimeTxFrom - n, hashProofOfStake, targetProofOfStake))
+        {
+            nTimeTxRet = nTimeTxFrom - n;
+            return true;
+        }
+    }
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(kernel_scan)
+{
+    // Easy enough target that most windows hold a kernel, across coin ages
+    // from under the min age to past the max age
+    unsigned int nBits = 0x1e0fffff;
+    unsigned int nTimeTxFrom = 1400000000;
+    int nFound = 0;
+    for (int i = 0; i < 200; i++)
+    {
+        uint64_t nStakeModifier = GetRand(std::numeric_limits<uint64_t>::max());
+        unsigned int nTimeBlockFrom = nTimeTxFrom - nStakeMinAge + 500 - (unsigned int)GetRand(nStakeMaxAge + nStakeMinAge);
+        unsigned int nTxPrevOffset = 81 + (unsigned int)GetRand(100000);
+        COutPoint prevout(GetRandHash(), (unsigned int)GetRand(4));
+        int64_t nValueIn = (1 + GetRand(1000)) * COIN;
+        unsigned int nCount = 1 + (unsigned int)GetRand(2000);
+
+        unsigned int nTime = 0, nTimeExpected = 0;
+        uint256 hash = 0, hashExpected = 0, target = 0, targetExpected = 0;
+        bool fFound = ScanStakeKernelHash(nBits, nStakeModifier, nTimeBlockFrom, nTxPrevOffset, prevout, nValueIn, nTimeTxFrom, nCount, nTime, hash, target);
+        bool fExpected = WalkStakeKernelHash(nBits, nStakeModifier, nTimeBlockFrom, nTxPrevOffset, prevout, nValueIn, nTimeTxFrom, nCount, nTimeExpected, hashExpected, targetExpected);
+        BOOST_CHECK_EQUAL(fFound, fExpected);
+        if (fFound && fExpected)
+        {
+            BOOST_CHECK_EQUAL(nTime, nTimeExpected);
+            BOOST_CHECK(hash == hashExpected);
+            BOOST_CHECK(target == targetExpected);
+            nFound++;
+        }
+    }
+    BOOST_CHECK(nFound > 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,97 @@
+#include <boost/test/unit_test.hpp>
+
+#include <boost/foreach.hpp>
+#include <openssl/rand.h>
+#include <vector>
+
+#include "keystore.h"
+#include "script.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(keystore_tests)
+
+// Exposes the encryption calls CWallet makes around its master key
+class CTestCryptoKeyStore : public CCryptoKeyStore
+{
+public:
+    bool EncryptKeys(CKeyingMaterial& vMasterKeyIn) { return CCryptoKeyStore::EncryptKeys(vMasterKeyIn); }
+    bool Unlock(const CKeyingMaterial& vMasterKeyIn) { return CCryptoKeyStore::Unlock(vMasterKeyIn); }
+    bool IsKeyCached(const CKeyID& keyID) const { LOCK(cs_KeyStore); return mapKeyCache.count(keyID) > 0; }
+};
+
+static void MakeKeyStore(CTestCryptoKeyStore& keystore, vector<CKeyID>& vKeyIDs, unsigned int nKeys, bool fEncrypt)
+{
+    vKeyIDs.clear();
+    for (unsigned int i = 0; i < nKeys; i++)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        BOOST_REQUIRE(keystore.AddKey(key));
+        vKeyIDs.push_back(key.GetPubKey().GetID());
+    }
+    if (fEncrypt)
+    {
+        CKeyingMaterial vMasterKey(32);
+        RAND_bytes(&vMasterKey[0], 32);
+        BOOST_REQUIRE(keystore.EncryptKeys(vMasterKey));
+        BOOST_REQUIRE(keystore.Unlock(vMasterKey));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(keystore_key_cache)
+{
+    CTestCryptoKeyStore keystore;
+    vector<CKeyID> vKeyIDs;
+    MakeKeyStore(keystore, vKeyIDs, 4, true);
+    keystore.SetKeyCacheSize(2);
+
+    uint256 hash = GetRandHash();
+    BOOST_FOREACH(const CKeyID& keyID, vKeyIDs)
+    {
+        // A cached key signs the same as a freshly decrypted one
+        for (int i = 0; i < 2; i++)
+        {
+            CKey key;
+            vector<unsigned char> vchSig;
+            BOOST_REQUIRE(keystore.GetKey(keyID, key));
+            BOOST_CHECK(key.GetPubKey().GetID() == keyID);
+            BOOST_CHECK(key.Sign(hash, vchSig));
+            BOOST_CHECK(key.Verify(hash, vchSig));
+        }
+    }
+
+    // Nothing decrypted outlives the master key
+    BOOST_CHECK(keystore.Lock());
+    BOOST_FOREACH(const CKeyID& keyID, vKeyIDs)
+    {
+        CKey key;
+        BOOST_CHECK(!keystore.GetKey(keyID, key));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(keystore_key_cache_lru)
+{
+    CTestCryptoKeyStore keystore;
+    vector<CKeyID> vKeyIDs;
+    MakeKeyStore(keystore, vKeyIDs, 3, true);
+    keystore.SetKeyCacheSize(2);
+
+    // The key used again outlives the one used only before it
+    CKey key;
+    BOOST_REQUIRE(keystore.GetKey(vKeyIDs[0], key));
+    BOOST_REQUIRE(keystore.GetKey(vKeyIDs[1], key));
+    BOOST_REQUIRE(keystore.GetKey(vKeyIDs[0], key));
+    BOOST_REQUIRE(keystore.GetKey(vKeyIDs[2], key));
+    BOOST_CHECK(keystore.IsKeyCached(vKeyIDs[0]));
+    BOOST_CHECK(!keystore.IsKeyCached(vKeyIDs[1]));
+    BOOST_CHECK(keystore.IsKeyCached(vKeyIDs[2]));
+
+    // A smaller cache keeps the most recently used
+    keystore.SetKeyCacheSize(1);
+    BOOST_CHECK(!keystore.IsKeyCached(vKeyIDs[0]));
+    BOOST_CHECK(keystore.IsKeyCached(vKeyIDs[2]));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,82 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txutil.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+BOOST_AUTO_TEST_CASE(mempool_ancestor_tracking)
+{
+    CTxMemPool pool;
+    LOCK(pool.cs);
+
+    // parent -> child -> grandchild
+    CTransaction txParent = MakeTx(uint256(1), 1);
+    CTransaction txChild = MakeTx(txParent.GetHash(), 1);
+    CTransaction txGrandChild = MakeTx(txChild.GetHash(), 1);
+    AddTx(pool, txParent, 1000);
+    AddTx(pool, txChild, 2000);
+    AddTx(pool, txGrandChild, 3000);
+
+    CTxMemPool::txiter itParent = pool.mapTx.find(txParent.GetHash());
+    CTxMemPool::txiter itChild = pool.mapTx.find(txChild.GetHash());
+    CTxMemPool::txiter itGrandChild = pool.mapTx.find(txGrandChild.GetHash());
+    BOOST_CHECK(itParent->GetCountWithDescendants() == 3);
+    BOOST_CHECK(itParent->GetFeesWithDescendants() == 6000);
+    BOOST_CHECK(itGrandChild->GetCountWithAncestors() == 3);
+    BOOST_CHECK(itGrandChild->GetFeesWithAncestors() == 6000);
+
+    CTxMemPool::setEntries setAncestors;
+    string strError;
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(*itGrandChild, setAncestors, 2, -1, -1, -1, strError));
+
+    // The parent confirms, its descendants stay
+    pool.remove(txParent);
+    BOOST_CHECK(pool.mapTx.size() == 2);
+    BOOST_CHECK(itChild->GetCountWithAncestors() == 1);
+    BOOST_CHECK(itGrandChild->GetCountWithAncestors() == 2);
+    BOOST_CHECK(itGrandChild->GetFeesWithAncestors() == 5000);
+
+    // Back from a disconnected block, the parent picks its family up again
+    AddTx(pool, txParent, 1000);
+    itParent = pool.mapTx.find(txParent.GetHash());
+    BOOST_CHECK(itParent->GetCountWithDescendants() == 3);
+    BOOST_CHECK(itChild->GetCountWithAncestors() == 2);
+    BOOST_CHECK(itGrandChild->GetCountWithAncestors() == 3);
+    BOOST_CHECK(itGrandChild->GetSizeWithAncestors() == itParent->GetSizeWithDescendants());
+
+    // Conflicting spends go with their descendants
+    pool.remove(txChild, true);
+    BOOST_CHECK(pool.mapTx.size() == 1);
+    BOOST_CHECK(itParent->GetCountWithDescendants() == 1);
+    BOOST_CHECK(pool.mapNextTx.size() == 1);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim)
+{
+    CTxMemPool pool;
+    LOCK(pool.cs);
+
+    CTransaction txLow = MakeTx(uint256(1), 1);
+    CTransaction txHigh = MakeTx(uint256(2), 1);
+    CTransaction txLowChild = MakeTx(txLow.GetHash(), 1);
+    AddTx(pool, txLow, 1000);
+    AddTx(pool, txHigh, 100000);
+    AddTx(pool, txLowChild, 5000);
+    BOOST_CHECK(pool.GetMinFee(1000000) == 0);
+
+    // The cheap parent is evicted first, with the child that pays for it
+    size_t nUsage = pool.DynamicMemoryUsage();
+    pool.TrimToSize(nUsage - 1);
+    BOOST_CHECK(pool.mapTx.size() == 1);
+    BOOST_CHECK(pool.exists(txHigh.GetHash()));
+    BOOST_CHECK(pool.DynamicMemoryUsage() < nUsage);
+    BOOST_CHECK(pool.GetMinFee(1000000) >= MIN_RELAY_TX_FEE);
+
+    pool.TrimToSize(0);
+    BOOST_CHECK(pool.mapTx.empty() && pool.mapNextTx.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,103 @@
+#include <boost/test/unit_test.hpp>
+
+#include <string>
+#include <vector>
+
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(netmessage_split_reads)
+{
+    // A message arriving a byte at a time is parsed the same as one read
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader("ping", 0);
+    ss << CMessageHeader("verack", 0);
+    for (unsigned int i = 0; i < ss.size(); i++)
+        BOOST_CHECK(node.ReceiveMsgBytes(&ss[i], 1));
+
+    BOOST_CHECK(node.vRecvMsg.size() == 2);
+    BOOST_CHECK(node.nRecvSize == ss.size());
+    BOOST_CHECK(node.vRecvMsg.front().IsComplete());
+    BOOST_CHECK(node.vRecvMsg.front().hdr.GetCommand() == "ping");
+    node.PopRecvMessage();
+    BOOST_CHECK(node.vRecvMsg.front().hdr.GetCommand() == "verack");
+    node.PopRecvMessage();
+    BOOST_CHECK(node.nRecvSize == 0);
+
+    // Oversized messages are refused from their header alone
+    CDataStream ssBad(SER_NETWORK, PROTOCOL_VERSION);
+    ssBad << CMessageHeader("block", MAX_SIZE + 1);
+    BOOST_CHECK(!node.ReceiveMsgBytes(&ssBad[0], ssBad.size()));
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(net_block_loopback)
+{
+    // Blocks larger than a socket read arrive whole and intact over a
+    // loopback connection
+    static const int nBlocks = 4;
+    static const unsigned int nBlockSize = 300000;
+
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(hListen != INVALID_SOCKET);
+    struct sockaddr_in sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sockaddr);
+    BOOST_REQUIRE(bind(hListen, (struct sockaddr*)&sockaddr, len) == 0);
+    BOOST_REQUIRE(listen(hListen, 1) == 0);
+    BOOST_REQUIRE(getsockname(hListen, (struct sockaddr*)&sockaddr, &len) == 0);
+    SOCKET hConnect = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    BOOST_REQUIRE(connect(hConnect, (struct sockaddr*)&sockaddr, len) == 0);
+    SOCKET hAccept = accept(hListen, NULL, NULL);
+    BOOST_REQUIRE(hAccept != INVALID_SOCKET);
+    closesocket(hListen);
+
+    CNode nodeFrom(hConnect, CAddress(), "", true);
+    CNode nodeTo(hAccept, CAddress(), "", true);
+
+    vector<char> vBlock(nBlockSize);
+    for (unsigned int i = 0; i < nBlockSize; i++)
+        vBlock[i] = (char)(i * 7);
+
+    for (int i = 0; i < nBlocks; i++)
+        nodeFrom.PushMessage("block", vBlock);
+
+    int nReceived = 0;
+    for (int nRounds = 0; nReceived < nBlocks && nRounds < 100000; nRounds++)
+    {
+        {
+            LOCK(nodeFrom.cs_vSend);
+            SocketSendData(&nodeFrom);
+        }
+        LOCK(nodeTo.cs_vRecv);
+        bool fMore;
+        SocketRecvData(&nodeTo, fMore);
+        while (!nodeTo.vRecvMsg.empty() && nodeTo.vRecvMsg.front().IsComplete())
+        {
+            CNetMessage& msg = nodeTo.vRecvMsg.front();
+            BOOST_CHECK(msg.hdr.IsValid());
+            BOOST_CHECK(msg.hdr.GetCommand() == "block");
+            uint256 hash = Hash(msg.vRecv.begin(), msg.vRecv.end());
+            BOOST_CHECK(memcmp(&hash, &msg.hdr.nChecksum, sizeof(msg.hdr.nChecksum)) == 0);
+            vector<char> vRecvBlock;
+            msg.vRecv >> vRecvBlock;
+            BOOST_CHECK(vRecvBlock == vBlock);
+            nodeTo.PopRecvMessage();
+            nReceived++;
+        }
+    }
+
+    BOOST_CHECK(nReceived == nBlocks);
+    BOOST_CHECK(nodeFrom.vSendMsg.empty() && nodeFrom.nSendSize == 0);
+    BOOST_CHECK(nodeTo.nRecvSize == 0);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -99,4 +99,37 @@ BOOST_AUTO_TEST_CASE(onioncat_test)
     BOOST_CHECK(addr1.IsRoutable());
 }
 
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(socketevents_readiness)
+{
+    CSocketEvents events;
+    BOOST_CHECK(events.Init());
+
+    int fds[2];
+    BOOST_CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    BOOST_CHECK(events.Add(fds[0]));
+
+    // Drain the initial writability report
+    vector<CSocketEvents::CEvent> vEvents;
+    BOOST_CHECK(events.Wait(0, vEvents));
+
+    BOOST_CHECK(send(fds[1], "x", 1, 0) == 1);
+    BOOST_CHECK(events.Wait(1000, vEvents));
+    BOOST_CHECK(vEvents.size() == 1);
+    BOOST_CHECK(vEvents[0].hSocket == (SOCKET)fds[0]);
+    BOOST_CHECK(vEvents[0].nEvents & CSocketEvents::EVENT_READ);
+
+    // A wake-up ends even a wait without a timeout, reporting no socket
+    char c;
+    BOOST_CHECK(recv(fds[0], &c, 1, 0) == 1);
+    events.Wake();
+    BOOST_CHECK(events.Wait(-1, vEvents));
+    BOOST_CHECK(vEvents.empty());
+
+    events.Remove(fds[0]);
+    close(fds[0]);
+    close(fds[1]);
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
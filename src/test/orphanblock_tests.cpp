@@ -0,0 +1,158 @@
+#include <boost/test/unit_test.hpp>
+
+#include "key.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+extern multimap<uint256, COrphanBlock*> mapOrphanBlocksByPrev;
+extern set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
+extern void LimitOrphanBlocks(uint64_t nMaxBytes);
+extern void QueueOrphanChildren(const uint256& hash);
+extern void ConnectOrphanBlocks();
+
+BOOST_AUTO_TEST_SUITE(orphanblock_tests)
+
+// A signed proof-of-stake block off hashPrev, staking a made-up output
+static CBlock MakeStakeBlock(const uint256& hashPrev, CKey& key)
+{
+    CBlock block;
+    block.nVersion = 6;
+    block.hashPrevBlock = hashPrev;
+    block.nTime = GetAdjustedTime() - 60;
+    block.nBits = CBigNum(~uint256(0) >> 20).GetCompact();
+
+    CTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vin[0].scriptSig = CScript() << OP_0 << OP_0;
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].SetEmpty();
+    block.vtx.push_back(txCoinBase);
+
+    CTransaction txCoinStake;
+    txCoinStake.vin.resize(1);
+    txCoinStake.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txCoinStake.vout.resize(2);
+    txCoinStake.vout[0].SetEmpty();
+    txCoinStake.vout[1].nValue = COIN;
+    txCoinStake.vout[1].scriptPubKey = CScript() << key.GetPubKey() << OP_CHECKSIG;
+    block.vtx.push_back(txCoinStake);
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    BOOST_REQUIRE(key.Sign(block.GetHash(), block.vchBlockSig));
+    return block;
+}
+
+// The bytes the orphan pool holds
+static uint64_t GetOrphanBytes()
+{
+    uint64_t nBytes = 0;
+    for (map<uint256, COrphanBlock*>::iterator mi = mapOrphanBlocks.begin(); mi != mapOrphanBlocks.end(); ++mi)
+        nBytes += (*mi).second->nBytes;
+    return nBytes;
+}
+
+BOOST_AUTO_TEST_CASE(orphanblock_merkle_root)
+{
+    LOCK(cs_main);
+    CKey key;
+    key.MakeNewKey(true);
+    CBlock block = MakeStakeBlock(GetRandHash(), key);
+    uint256 hash = block.GetHash();
+
+    // The same signed header over other transactions is not pooled...
+    CBlock blockFake = block;
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    blockFake.vtx.push_back(tx);
+    BOOST_CHECK(blockFake.GetHash() == hash);
+    BOOST_CHECK(!ProcessBlock(NULL, &blockFake));
+    BOOST_CHECK(!mapOrphanBlocks.count(hash));
+
+    // ...so it doesn't keep the real block out
+    BOOST_CHECK(ProcessBlock(NULL, &block));
+    BOOST_CHECK(mapOrphanBlocks.count(hash));
+
+    LimitOrphanBlocks(0);
+    BOOST_CHECK(mapOrphanBlocks.empty());
+}
+
+BOOST_AUTO_TEST_CASE(orphanblock_eviction)
+{
+    LOCK(cs_main);
+    CKey key;
+    key.MakeNewKey(true);
+    vector<uint256> vHash;
+    for (int i = 0; i < 4; i++)
+    {
+        CBlock block = MakeStakeBlock(GetRandHash(), key);
+        vHash.push_back(block.GetHash());
+        BOOST_REQUIRE(ProcessBlock(NULL, &block));
+    }
+
+    // Requested and old, unrequested and new, unrequested and old, and
+    // oldest of all but taken by the orphan stage
+    mapOrphanBlocks[vHash[0]]->nTimeReceived = 100;
+    mapOrphanBlocks[vHash[1]]->fRequested = false;
+    mapOrphanBlocks[vHash[1]]->nTimeReceived = 300;
+    mapOrphanBlocks[vHash[2]]->fRequested = false;
+    mapOrphanBlocks[vHash[2]]->nTimeReceived = 200;
+    mapOrphanBlocks[vHash[3]]->nTimeReceived = 50;
+    mapOrphanBlocks[vHash[3]]->fConnecting = true;
+
+    LimitOrphanBlocks(GetOrphanBytes());
+    BOOST_CHECK_EQUAL(mapOrphanBlocks.size(), 4U);
+    LimitOrphanBlocks(GetOrphanBytes() - 1);
+    BOOST_CHECK_EQUAL(mapOrphanBlocks.size(), 3U);
+    BOOST_CHECK(!mapOrphanBlocks.count(vHash[2]));
+    LimitOrphanBlocks(GetOrphanBytes() - 1);
+    BOOST_CHECK_EQUAL(mapOrphanBlocks.size(), 2U);
+    BOOST_CHECK(!mapOrphanBlocks.count(vHash[1]));
+    LimitOrphanBlocks(0);
+    BOOST_CHECK_EQUAL(mapOrphanBlocks.size(), 1U);
+    BOOST_CHECK(mapOrphanBlocks.count(vHash[3]));
+
+    // The stake of an evicted orphan may be offered again
+    BOOST_CHECK_EQUAL(setStakeSeenOrphan.size(), 1U);
+
+    mapOrphanBlocks[vHash[3]]->fConnecting = false;
+    LimitOrphanBlocks(0);
+    BOOST_CHECK(mapOrphanBlocks.empty());
+    BOOST_CHECK(mapOrphanBlocksByPrev.empty());
+}
+
+BOOST_AUTO_TEST_CASE(orphanblock_stage)
+{
+    LOCK(cs_main);
+    CKey key;
+    key.MakeNewKey(true);
+    uint256 hashRejected = GetRandHash();
+    CBlock block = MakeStakeBlock(hashRejected, key);
+    uint256 hash = block.GetHash();
+    CBlock blockChild = MakeStakeBlock(hash, key);
+    uint256 hashChild = blockChild.GetHash();
+    BOOST_REQUIRE(ProcessBlock(NULL, &blockChild));
+    BOOST_REQUIRE(ProcessBlock(NULL, &block));
+
+    // Orphans queued behind a parent that never made it into the block
+    // index stay orphans, and can be taken again
+    QueueOrphanChildren(hashRejected);
+    ConnectOrphanBlocks();
+    BOOST_CHECK(mapOrphanBlocks.count(hash) && !mapOrphanBlocks[hash]->fConnecting);
+    BOOST_CHECK(mapOrphanBlocks.count(hashChild) && !mapOrphanBlocks[hashChild]->fConnecting);
+
+    // Nothing queued, nothing taken
+    ConnectOrphanBlocks();
+    BOOST_CHECK_EQUAL(mapOrphanBlocks.size(), 2U);
+
+    LimitOrphanBlocks(0);
+    BOOST_CHECK(mapOrphanBlocks.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,12 +1,23 @@
 #include <boost/test/unit_test.hpp>
 #include <boost/foreach.hpp>
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
 
 #include "base58.h"
 #include "util.h"
 #include "bitcoinrpc.h"
+#include "init.h"
+#include "main.h"
+#include "net.h"
+#include "wallet.h"
 
 using namespace std;
 using namespace json_spirit;
+using boost::asio::ip::tcp;
+
+extern void ThreadRPCServer2(void* parg);
+extern string HTTPPost(const string& strMsg, const map<string,string>& mapRequestHeaders);
+extern int ReadHTTP(std::basic_istream<char>& stream, map<string, string>& mapHeadersRet, string& strMessageRet);
 
 BOOST_AUTO_TEST_SUITE(rpc_tests)
 
@@ -66,4 +77,130 @@ BOOST_FIXTURE_TEST_CASE(rpc_addmultisig, TestNetFixture)
     BOOST_CHECK_THROW(addmultisig(createArgs(2, short2.c_str()), false), runtime_error);
 }
 
+static const char* RPC_TEST_PORT = "22991";
+
+// An RPC server on loopback with one worker and room for one queued request
+struct RPCServerSetup
+{
+    map<string, string> mapArgsSaved;
+    boost::thread* pthreadServer;
+
+    RPCServerSetup()
+    {
+        mapArgsSaved = mapArgs;
+        mapArgs["-rpcuser"] = "rpctest";
+        mapArgs["-rpcpassword"] = "rpctest-password-not-short";
+        mapArgs["-rpcport"] = RPC_TEST_PORT;
+        mapArgs["-rpcthreads"] = "1";
+        mapArgs["-rpcworkqueue"] = "1";
+        pthreadServer = new boost::thread(boost::bind(&ThreadRPCServer2, (void*)NULL));
+        for (int i = 0; i < 100; i++)
+        {
+            tcp::iostream stream("127.0.0.1", RPC_TEST_PORT);
+            if (stream)
+                break;
+            MilliSleep(50);
+        }
+    }
+
+    ~RPCServerSetup()
+    {
+        fShutdown = true;
+        pthreadServer->join();
+        delete pthreadServer;
+        while (vnThreadsRunning[THREAD_RPCHANDLER] > 0)
+            MilliSleep(20);
+        fShutdown = false;
+        mapArgs = mapArgsSaved;
+    }
+};
+
+static void SendRequest(tcp::iostream& stream, const string& strUserPass)
+{
+    map<string, string> mapRequestHeaders;
+    if (!strUserPass.empty())
+        mapRequestHeaders["Authorization"] = string("Basic ") + EncodeBase64(strUserPass);
+    stream.connect("127.0.0.1", RPC_TEST_PORT);
+    stream << HTTPPost("{\"method\":\"getblockcount\",\"params\":[],\"id\":1}", mapRequestHeaders) << std::flush;
+}
+
+static int ReadStatus(tcp::iostream& stream)
+{
+    map<string, string> mapHeaders;
+    string strReply;
+    return ReadHTTP(stream, mapHeaders, strReply);
+}
+
+static int GetRPCInfo(const string& strKey)
+{
+    return find_value(getrpcinfo(Array(), false).get_obj(), strKey).get_int();
+}
+
+static void WaitForRPCInfo(const string& strKey, int nValue)
+{
+    for (int i = 0; i < 500 && GetRPCInfo(strKey) != nValue; i++)
+        MilliSleep(10);
+    BOOST_REQUIRE_EQUAL(GetRPCInfo(strKey), nValue);
+}
+
+BOOST_FIXTURE_TEST_CASE(rpc_workqueue_full, RPCServerSetup)
+{
+    const string strUserPass = mapArgs["-rpcuser"] + ":" + mapArgs["-rpcpassword"];
+    tcp::iostream streamActive, streamQueued, streamRejected;
+    int nRejected = GetRPCInfo("rejected");
+    {
+        // The worker waits for cs_main with the first request, the second
+        // fills the queue and the third is turned away
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        SendRequest(streamActive, strUserPass);
+        WaitForRPCInfo("active", 1);
+        SendRequest(streamQueued, strUserPass);
+        WaitForRPCInfo("queued", 1);
+        SendRequest(streamRejected, strUserPass);
+        BOOST_CHECK_EQUAL(ReadStatus(streamRejected), HTTP_SERVICE_UNAVAILABLE);
+        BOOST_CHECK_EQUAL(GetRPCInfo("rejected"), nRejected + 1);
+    }
+    BOOST_CHECK_EQUAL(ReadStatus(streamActive), HTTP_OK);
+    BOOST_CHECK_EQUAL(ReadStatus(streamQueued), HTTP_OK);
+}
+
+BOOST_FIXTURE_TEST_CASE(rpc_auth_before_queue, RPCServerSetup)
+{
+    const string strUserPass = mapArgs["-rpcuser"] + ":" + mapArgs["-rpcpassword"];
+    tcp::iostream streamActive, streamQueued, streamNoAuth, streamBadAuth;
+    int nRejected = GetRPCInfo("rejected");
+    {
+        // With the queue full, requests without the password are refused
+        // as such rather than taking or being denied a place in it
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        SendRequest(streamActive, strUserPass);
+        WaitForRPCInfo("active", 1);
+        SendRequest(streamQueued, strUserPass);
+        WaitForRPCInfo("queued", 1);
+        SendRequest(streamNoAuth, "");
+        BOOST_CHECK_EQUAL(ReadStatus(streamNoAuth), HTTP_UNAUTHORIZED);
+        SendRequest(streamBadAuth, mapArgs["-rpcuser"] + ":wrong-password-not-short");
+        BOOST_CHECK_EQUAL(ReadStatus(streamBadAuth), HTTP_UNAUTHORIZED);
+        BOOST_CHECK_EQUAL(GetRPCInfo("rejected"), nRejected);
+        BOOST_CHECK_EQUAL(GetRPCInfo("queued"), 1);
+    }
+    BOOST_CHECK_EQUAL(ReadStatus(streamActive), HTTP_OK);
+    BOOST_CHECK_EQUAL(ReadStatus(streamQueued), HTTP_OK);
+}
+
+BOOST_FIXTURE_TEST_CASE(rpc_shutdown_reply, RPCServerSetup)
+{
+    const string strUserPass = mapArgs["-rpcuser"] + ":" + mapArgs["-rpcpassword"];
+    tcp::iostream stream;
+    {
+        // A request still running when shutdown starts, as "stop" is,
+        // gets its reply written
+        LOCK2(cs_main, pwalletMain->cs_wallet);
+        SendRequest(stream, strUserPass);
+        WaitForRPCInfo("active", 1);
+        fShutdown = true;
+    }
+    BOOST_CHECK_EQUAL(ReadStatus(stream), HTTP_OK);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
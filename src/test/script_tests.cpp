@@ -442,4 +442,51 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+BOOST_AUTO_TEST_CASE(script_signatureCache)
+{
+    vector<unsigned char> vchSig(72, 0x30), vchPubKey(33, 0x02);
+    CSignatureCacheStats stats;
+
+    // Hit and miss
+    CSignatureCache cache(1000);
+    uint256 hash = GetRandHash();
+    BOOST_CHECK(!cache.Get(hash, vchSig, vchPubKey));
+    cache.Set(hash, vchSig, vchPubKey);
+    BOOST_CHECK(cache.Get(hash, vchSig, vchPubKey));
+    BOOST_CHECK(!cache.Get(GetRandHash(), vchSig, vchPubKey));
+    BOOST_CHECK(!cache.Get(hash, vector<unsigned char>(72, 0x31), vchPubKey));
+    BOOST_CHECK(!cache.Get(hash, vchSig, vector<unsigned char>(33, 0x03)));
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nHits, 1U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 4U);
+    BOOST_CHECK_EQUAL(stats.nEntries, 1U);
+
+    // No room: nothing is kept
+    CSignatureCache cacheEmpty(0);
+    cacheEmpty.Set(hash, vchSig, vchPubKey);
+    BOOST_CHECK(!cacheEmpty.Get(hash, vchSig, vchPubKey));
+
+    // 8 slots per stripe, every one of them probed: once a stripe is full
+    // each new entry evicts an old one, and the newest is always found
+    CSignatureCache cacheSmall(128);
+    vector<uint256> vHashes;
+    for (int i = 0; i < 1000; i++)
+    {
+        vHashes.push_back(GetRandHash());
+        cacheSmall.Set(vHashes.back(), vchSig, vchPubKey);
+        BOOST_CHECK(cacheSmall.Get(vHashes.back(), vchSig, vchPubKey));
+    }
+    cacheSmall.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nCapacity, 128U);
+    BOOST_CHECK(stats.nEntries <= stats.nCapacity);
+    uint64_t nHitsBefore = stats.nHits;
+    unsigned int nFound = 0;
+    BOOST_FOREACH(const uint256& hashSet, vHashes)
+        nFound += cacheSmall.Get(hashSet, vchSig, vchPubKey);
+    BOOST_CHECK_EQUAL(nFound, stats.nEntries);
+    BOOST_CHECK(nFound < vHashes.size());
+    cacheSmall.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nHits - nHitsBefore, nFound);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -117,4 +117,50 @@ BOOST_AUTO_TEST_CASE(test_GetThrow)
     BOOST_CHECK_THROW(t1.GetValueIn(missingInputs), runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE(test_HashCache)
+{
+    CTransaction t;
+    t.vin.resize(1);
+    t.vout.resize(1);
+    t.vout[0].nValue = 1*CENT;
+    uint256 hash = t.GetHash();
+    BOOST_CHECK(hash == SerializeHash(t));
+
+    // A transaction being built follows direct writes
+    t.vout[0].nValue = 2*CENT;
+    BOOST_CHECK(t.GetHash() != hash);
+    BOOST_CHECK(t.GetHash() == SerializeHash(t));
+
+    // Deserializing keeps the hash; invalidating drops it after a change
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    CTransaction t2;
+    ss << t;
+    ss >> t2;
+    BOOST_CHECK(t2.fHashCached);
+    BOOST_CHECK(t2.GetHash() == t.GetHash());
+    t2.vout[0].nValue = 3*CENT;
+    t2.InvalidateHash();
+    BOOST_CHECK(t2.GetHash() == SerializeHash(t2));
+    t2.UpdateHash();
+    t2.SetNull();
+    BOOST_CHECK(t2.GetHash() == SerializeHash(t2));
+
+    // Block hashes follow in-place header changes
+    CBlock block;
+    block.nBits = 1;
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+    ssBlock >> block;
+    uint256 hashBlock = block.GetHash();
+    block.nNonce++;
+    BOOST_CHECK(block.GetHash() != hashBlock);
+    BOOST_CHECK(block.GetHash() == Hash(BEGIN(block.nVersion), END(block.nNonce)));
+
+    // and SetNull drops the kept hash
+    block.nNonce--;
+    BOOST_CHECK(block.GetHash() == hashBlock);
+    block.SetNull();
+    BOOST_CHECK(block.GetHash() == Hash(BEGIN(block.nVersion), END(block.nNonce)));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,35 @@
+#ifndef NETCOIN_TEST_TXUTIL_H
+#define NETCOIN_TEST_TXUTIL_H
+
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+
+// Transaction spending output 0 of hashPrev into nOut outputs of 1 coin
+inline CTransaction MakeTx(const uint256& hashPrev, unsigned int nOut = 1)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, 0);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(nOut);
+    for (unsigned int i = 0; i < nOut; i++)
+    {
+        tx.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[i].nValue = COIN;
+    }
+    return tx;
+}
+
+// Adds tx to pool with its in-pool ancestors, skipping the acceptance checks
+inline void AddTx(CTxMemPool& pool, const CTransaction& tx, int64_t nFee = 1000)
+{
+    LOCK(pool.cs);
+    CTxMemPoolEntry entry(tx, nFee, GetTime(), 0, 0, 0);
+    CTxMemPool::setEntries setAncestors;
+    std::string strError;
+    BOOST_REQUIRE(pool.CalculateMemPoolAncestors(entry, setAncestors, -1, -1, -1, -1, strError));
+    pool.addUnchecked(tx.GetHash(), entry, setAncestors);
+}
+
+#endif
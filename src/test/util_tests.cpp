@@ -259,4 +259,13 @@ BOOST_AUTO_TEST_CASE(util_IsHex)
     BOOST_CHECK(!IsHex("0x0000"));
 }
 
+BOOST_AUTO_TEST_CASE(util_SipHashUint256)
+{
+    // Reference vector: key 00..0f, message 00..1f
+    uint256 val;
+    for (int i = 0; i < 32; i++)
+        val.begin()[i] = i;
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, val), 0x7127512f72f27cceULL);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,8 +3,11 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file license.txt or http://www.opensource.org/licenses/mit-license.php.
 
+#include <list>
 #include <map>
 
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
 #include <boost/version.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -17,95 +20,133 @@
 
 using namespace std;
 using namespace boost;
-/*
-leveldb::DB *txdb; // global pointer for LevelDB object instance
 
-static leveldb::Options GetOptions() {
+#ifdef USE_LEVELDB
+#include <leveldb/write_batch.h>
+#include <leveldb/env.h>
+#include <leveldb/cache.h>
+#include <leveldb/filter_policy.h>
+
+static leveldb::DB *txdb; // global pointer for LevelDB object instance
+static leveldb::Options txdbOptions;
+
+static leveldb::Options GetOptions()
+{
     leveldb::Options options;
     int nCacheSizeMB = GetArg("-dbcache", 25);
     options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+    options.create_if_missing = true;
     return options;
 }
 
-void init_blockindex(leveldb::Options& options, bool fRemoveOld = false) {
-    // First time init.
-    filesystem::path directory = GetDataDir() / "txleveldb";
+/** Read-only view of the Berkeley DB blkindex.dat, used once to migrate its
+ * records into LevelDB.  Keys and values are serialized the same way in
+ * both databases, so records are copied as raw bytes.
+ */
+class CBlkIndexMigrator : public CDB
+{
+public:
+    CBlkIndexMigrator() : CDB("blkindex.dat", "r") { }
 
-    if (fRemoveOld) {
-        filesystem::remove_all(directory); // remove directory
-        unsigned int nFile = 1;
+    bool CopyTo(leveldb::DB* pdbDest, unsigned int& nRecordsRet)
+    {
+        nRecordsRet = 0;
+        Dbc* pcursor = GetCursor();
+        if (!pcursor)
+            return false;
 
+        leveldb::WriteBatch batch;
         while (true)
         {
-            filesystem::path strBlockFile = GetDataDir() / strprintf("blk%04u.dat", nFile);
-
-            // Break if no such file
-            if( !filesystem::exists( strBlockFile ) )
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
+            if (ret == DB_NOTFOUND)
                 break;
+            if (ret != 0)
+            {
+                pcursor->close();
+                return false;
+            }
 
-            filesystem::remove(strBlockFile);
+            // The BDB "version" record holds the client version; the
+            // LevelDB one is written separately once migration succeeded
+            string strType;
+            CDataStream ssKeyType(ssKey);
+            ssKeyType >> strType;
+            if (strType == "version")
+                continue;
 
-            nFile++;
+            batch.Put(ssKey.str(), ssValue.str());
+            if (++nRecordsRet % 10000 == 0)
+            {
+                if (!pdbDest->Write(leveldb::WriteOptions(), &batch).ok())
+                {
+                    pcursor->close();
+                    return false;
+                }
+                batch.Clear();
+            }
         }
+        pcursor->close();
+
+        leveldb::WriteOptions syncOptions;
+        syncOptions.sync = true;
+        return pdbDest->Write(syncOptions, &batch).ok();
     }
+};
 
-    filesystem::create_directory(directory);
-    printf("Opening LevelDB in %s\n", directory.string().c_str());
-    leveldb::Status status = leveldb::DB::Open(options, directory.string(), &txdb);
-    if (!status.ok()) {
-        throw runtime_error(strprintf("init_blockindex(): error opening database environment %s", status.ToString().c_str()));
+static void MigrateFromBlkIndex(leveldb::DB* pdbDest)
+{
+    if (!filesystem::exists(GetDataDir() / "blkindex.dat"))
+        return;
+
+    printf("Migrating blkindex.dat to LevelDB...\n");
+    int64_t nStart = GetTimeMillis();
+    unsigned int nRecords = 0;
+    bool fOk;
+    {
+        CBlkIndexMigrator blkindex;
+        fOk = blkindex.CopyTo(pdbDest, nRecords);
     }
+    bitdb.CloseDb("blkindex.dat");
+    if (!fOk)
+        throw runtime_error("CTxDB() : migrating blkindex.dat to LevelDB failed");
+    printf("Migrated %u records from blkindex.dat in %"PRI64d"ms, blkindex.dat is no longer used\n", nRecords, GetTimeMillis() - nStart);
 }
 
-// CDB subclasses are created and destroyed VERY OFTEN. That's why
-// we shouldn't treat this as a free operations.
 CTxDB::CTxDB(const char* pszMode)
 {
     assert(pszMode);
     activeBatch = NULL;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
 
-    if (txdb) {
+    if (txdb)
+    {
         pdb = txdb;
         return;
     }
 
-    bool fCreate = strchr(pszMode, 'c');
-
-    options = GetOptions();
-    options.create_if_missing = fCreate;
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-
-    init_blockindex(options); // Init directory
+    // First use: open the database shared by all CTxDB objects
+    filesystem::path directory = GetDataDir() / "txleveldb";
+    filesystem::create_directory(directory);
+    printf("Opening LevelDB in %s\n", directory.string().c_str());
+    txdbOptions = GetOptions();
+    leveldb::Status status = leveldb::DB::Open(txdbOptions, directory.string(), &txdb);
+    if (!status.ok())
+        throw runtime_error(strprintf("CTxDB() : error opening database environment %s", status.ToString().c_str()));
     pdb = txdb;
 
-    if (Exists(string("version")))
+    int nVersion;
+    if (ReadVersion(nVersion))
     {
-        ReadVersion(nVersion);
         printf("Transaction index version is %d\n", nVersion);
-
-        if (nVersion < DATABASE_VERSION)
-        {
-            printf("Required index version is %d, removing old database\n", DATABASE_VERSION);
-
-            // Leveldb instance destruction
-            delete txdb;
-            txdb = pdb = NULL;
-            delete activeBatch;
-            activeBatch = NULL;
-
-            init_blockindex(options, true); // Remove directory and create new database
-            pdb = txdb;
-
-            bool fTmp = fReadOnly;
-            fReadOnly = false;
-            WriteVersion(DATABASE_VERSION); // Save transaction index version
-            fReadOnly = fTmp;
-        }
     }
-    else if (fCreate)
+    else
     {
+        MigrateFromBlkIndex(pdb);
+
         bool fTmp = fReadOnly;
         fReadOnly = false;
         WriteVersion(DATABASE_VERSION);
@@ -115,170 +156,416 @@ CTxDB::CTxDB(const char* pszMode)
     printf("Opened LevelDB successfully\n");
 }
 
-void CTxDB::Close()
+void CTxDB::CloseDatabase()
 {
     delete txdb;
-    txdb = pdb = NULL;
-    delete options.filter_policy;
-    options.filter_policy = NULL;
-    delete options.block_cache;
-    options.block_cache = NULL;
-    delete activeBatch;
-    activeBatch = NULL;
+    txdb = NULL;
+    delete txdbOptions.filter_policy;
+    txdbOptions.filter_policy = NULL;
+    delete txdbOptions.block_cache;
+    txdbOptions.block_cache = NULL;
 }
 
-bool CTxDB::TxnBegin()
+bool CTxDB::ReadRaw(const string& strKey, string& strValue)
 {
-    assert(!activeBatch);
-    activeBatch = new leveldb::WriteBatch();
+    leveldb::Status status = pdb->Get(leveldb::ReadOptions(), strKey, &strValue);
+    if (!status.ok())
+    {
+        if (!status.IsNotFound())
+            printf("LevelDB read failure: %s\n", status.ToString().c_str());
+        return false;
+    }
     return true;
 }
 
-bool CTxDB::TxnCommit()
+bool CTxDB::WriteBatchRaw(const CTxDBBatch& batchIn, bool fSync)
 {
-    assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
-    delete activeBatch;
-    activeBatch = NULL;
-    if (!status.ok()) {
+    leveldb::WriteBatch batch;
+    BOOST_FOREACH(const CTxDBBatch::map_type::value_type& item, batchIn.mapWrites)
+    {
+        if (item.second.first)
+            batch.Delete(item.first);
+        else
+            batch.Put(item.first, item.second.second);
+    }
+
+    leveldb::WriteOptions options;
+    options.sync = fSync;
+    leveldb::Status status = pdb->Write(options, &batch);
+    if (!status.ok())
+    {
         printf("LevelDB batch commit failure: %s\n", status.ToString().c_str());
         return false;
     }
     return true;
 }
+#else // USE_LEVELDB
 
-class CBatchScanner : public leveldb::WriteBatch::Handler {
-public:
-    std::string needle;
-    bool *deleted;
-    std::string *foundValue;
-    bool foundEntry;
-
-    CBatchScanner() : foundEntry(false) {}
-
-    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = false;
-            *foundValue = value.ToString();
+//
+// The Berkeley DB backend writes a batch inside its own DbTxn, in key order.
+//
+
+bool CTxDB::ReadRaw(const string& strKey, string& strValue)
+{
+    if (!pdb)
+        return false;
+
+    Dbt datKey((void*)strKey.data(), strKey.size());
+    Dbt datValue;
+    datValue.set_flags(DB_DBT_MALLOC);
+    int ret = pdb->get(NULL, &datKey, &datValue, 0);
+    if (datValue.get_data() == NULL)
+        return false;
+    strValue.assign((const char*)datValue.get_data(), datValue.get_size());
+    free(datValue.get_data());
+    return (ret == 0);
+}
+
+bool CTxDB::WriteBatchRaw(const CTxDBBatch& batch, bool fSync)
+{
+    if (!pdb)
+        return false;
+    DbTxn* ptxn = bitdb.TxnBegin();
+    if (!ptxn)
+        return false;
+
+    BOOST_FOREACH(const CTxDBBatch::map_type::value_type& item, batch.mapWrites)
+    {
+        Dbt datKey((void*)item.first.data(), item.first.size());
+        int ret;
+        if (item.second.first)
+        {
+            ret = pdb->del(ptxn, &datKey, 0);
+            if (ret == DB_NOTFOUND)
+                ret = 0;
+        }
+        else
+        {
+            Dbt datValue((void*)item.second.second.data(), item.second.second.size());
+            ret = pdb->put(ptxn, &datKey, &datValue, 0);
         }
+        if (ret != 0)
+        {
+            ptxn->abort();
+            return false;
+        }
+    }
+
+    return (ptxn->commit(fSync ? DB_TXN_SYNC : 0) == 0);
+}
+#endif // USE_LEVELDB
+
+//
+// Record cache
+//
+// Index records read or written through any CTxDB are kept in one
+// process-wide cache.  Committed writes stay in memory as dirty entries and
+// reach the database in a single batch at block sync points (see
+// IsBlockSyncPoint()), when the dirty set outgrows half of the -dbcache
+// budget, or at shutdown.  A flush always writes every dirty entry at once,
+// so the database only ever moves from one committed state to the next.
+//
+// Recently used transactions are cached as well, so connecting a block
+// does not go back to the block files for inputs spent shortly after they
+// were confirmed.
+//
+
+class CTxDBCache
+{
+private:
+    struct CEntry
+    {
+        string strValue;
+        bool fErased;  // no such record (if clean) or erase pending (if dirty)
+        bool fDirty;   // not written to the database yet
+        list<string>::iterator itLRU;  // listLRU.end() while dirty
+    };
+    typedef map<string, CEntry> map_type;
+    typedef map<uint256, pair<CTransaction, list<uint256>::iterator> > maptx_type;
+
+    map_type mapEntries;
+    list<string> listLRU;  // clean entries, most recently used first
+    maptx_type mapTx;
+    list<uint256> listTxLRU;
+
+    int64 nMaxBytes;
+    int64 nMaxTxBytes;
+    int64 nBytes;
+    int64 nDirtyBytes;
+    int64 nTxBytes;
+    unsigned int nDirtyEntries;
+    unsigned int nGeneration;  // bumped by every flush
+    CTxDBCacheStats stats;
+
+    static int64 EntrySize(const string& strKey, const string& strValue)
+    {
+        return strKey.size() + strValue.size() + 128;
+    }
+
+    static int64 TxSize(const CTransaction& tx)
+    {
+        return ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION) * 2 + 128;
+    }
+
+    void SetBudget()
+    {
+        if (nMaxBytes >= 0)
+            return;
+        int64 nCacheBytes = max((int64)GetArg("-dbcache", 25), (int64)1) << 20;
+        nMaxTxBytes = nCacheBytes / 4;
+        nMaxBytes = nCacheBytes - nMaxTxBytes;
     }
 
-    virtual void Delete(const leveldb::Slice& key) {
-        if (key.ToString() == needle) {
-            foundEntry = true;
-            *deleted = true;
+    void Evict()
+    {
+        while (nBytes > nMaxBytes && !listLRU.empty())
+        {
+            map_type::iterator mi = mapEntries.find(listLRU.back());
+            listLRU.pop_back();
+            nBytes -= EntrySize((*mi).first, (*mi).second.strValue);
+            mapEntries.erase(mi);
         }
     }
-};
 
-// When performing a read, if we have an active batch we need to check it first
-// before reading from the database, as the rest of the code assumes that once
-// a database transaction begins reads are consistent with it. It would be good
-// to change that assumption in future and avoid the performance hit, though in
-// practice it does not appear to be large.
-bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) const {
-    assert(activeBatch);
-    *deleted = false;
-    CBatchScanner scanner;
-    scanner.needle = key.str();
-    scanner.deleted = deleted;
-    scanner.foundValue = value;
-    leveldb::Status status = activeBatch->Iterate(&scanner);
-    if (!status.ok()) {
-        throw runtime_error(status.ToString());
+    void EvictTx()
+    {
+        while (nTxBytes > nMaxTxBytes && !listTxLRU.empty())
+        {
+            maptx_type::iterator mi = mapTx.find(listTxLRU.back());
+            listTxLRU.pop_back();
+            nTxBytes -= TxSize((*mi).second.first);
+            mapTx.erase(mi);
+        }
     }
-    return scanner.foundEntry;
-}
 
-bool CTxDB::ReadTxIndex(uint256 hash, CTxIndex& txindex)
-{
-    assert(!fClient);
-    txindex.SetNull();
-    return Read(make_pair(string("tx"), hash), txindex);
-}
+public:
+    mutable CCriticalSection cs;
 
-bool CTxDB::UpdateTxIndex(uint256 hash, const CTxIndex& txindex)
-{
-    assert(!fClient);
-    return Write(make_pair(string("tx"), hash), txindex);
-}
+    CTxDBCache() : nMaxBytes(-1), nMaxTxBytes(0), nBytes(0), nDirtyBytes(0), nTxBytes(0), nDirtyEntries(0), nGeneration(0)
+    {
+        memset(&stats, 0, sizeof(stats));
+    }
 
-bool CTxDB::AddTxIndex(const CTransaction& tx, const CDiskTxPos& pos, int nHeight)
-{
-    assert(!fClient);
+    // Returns true if the cache knows about strKey; fFoundRet tells whether
+    // the record exists.  nGenerationRet is passed back to AddClean after a
+    // database read.
+    bool Lookup(const string& strKey, string& strValue, bool& fFoundRet, unsigned int& nGenerationRet)
+    {
+        LOCK(cs);
+        nGenerationRet = nGeneration;
+        map_type::iterator mi = mapEntries.find(strKey);
+        if (mi == mapEntries.end())
+        {
+            stats.nMisses++;
+            return false;
+        }
+        stats.nHits++;
+        CEntry& entry = (*mi).second;
+        if (!entry.fDirty)
+            listLRU.splice(listLRU.begin(), listLRU, entry.itLRU);
+        fFoundRet = !entry.fErased;
+        if (fFoundRet)
+            strValue = entry.strValue;
+        return true;
+    }
 
-    // Add to tx index
-    uint256 hash = tx.GetHash();
-    CTxIndex txindex(pos, tx.vout.size());
-    return Write(make_pair(string("tx"), hash), txindex);
-}
+    // Remembers the result of a database read.  Skipped if the record was
+    // written, or the database flushed, since the read began.
+    void AddClean(const string& strKey, const string& strValue, bool fErased, unsigned int nGenerationRead)
+    {
+        LOCK(cs);
+        SetBudget();
+        if (nGenerationRead != nGeneration || mapEntries.count(strKey))
+            return;
+        CEntry& entry = mapEntries[strKey];
+        entry.strValue = strValue;
+        entry.fErased = fErased;
+        entry.fDirty = false;
+        entry.itLRU = listLRU.insert(listLRU.begin(), strKey);
+        nBytes += EntrySize(strKey, strValue);
+        Evict();
+    }
 
-bool CTxDB::EraseTxIndex(const CTransaction& tx)
-{
-    assert(!fClient);
-    uint256 hash = tx.GetHash();
+    void AddDirty(const CTxDBBatch& batch)
+    {
+        LOCK(cs);
+        SetBudget();
+        BOOST_FOREACH(const CTxDBBatch::map_type::value_type& item, batch.mapWrites)
+        {
+            const string& strValue = item.second.second;
+            map_type::iterator mi = mapEntries.find(item.first);
+            if (mi == mapEntries.end())
+            {
+                mi = mapEntries.insert(make_pair(item.first, CEntry())).first;
+                (*mi).second.itLRU = listLRU.end();
+            }
+            else
+            {
+                CEntry& entry = (*mi).second;
+                nBytes -= EntrySize(item.first, entry.strValue);
+                if (entry.fDirty)
+                {
+                    nDirtyBytes -= EntrySize(item.first, entry.strValue);
+                    nDirtyEntries--;
+                }
+                else
+                    listLRU.erase(entry.itLRU);
+                entry.itLRU = listLRU.end();
+            }
+            CEntry& entry = (*mi).second;
+            entry.strValue = strValue;
+            entry.fErased = item.second.first;
+            entry.fDirty = true;
+            nBytes += EntrySize(item.first, strValue);
+            nDirtyBytes += EntrySize(item.first, strValue);
+            nDirtyEntries++;
+        }
+        Evict();
+    }
 
-    return Erase(make_pair(string("tx"), hash));
-}
+    bool NeedFlush(bool fSync)
+    {
+        LOCK(cs);
+        if (nDirtyEntries == 0)
+            return false;
+        return (fSync && IsBlockSyncPoint()) || nDirtyBytes > nMaxBytes / 2;
+    }
 
-bool CTxDB::ContainsTx(uint256 hash)
-{
-    assert(!fClient);
-    return Exists(make_pair(string("tx"), hash));
-}
+    void GetDirty(CTxDBBatch& batch)
+    {
+        LOCK(cs);
+        BOOST_FOREACH(const map_type::value_type& item, mapEntries)
+            if (item.second.fDirty)
+                batch.mapWrites[item.first] = make_pair(item.second.fErased, item.second.strValue);
+    }
 
-bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx, CTxIndex& txindex)
-{
-    assert(!fClient);
-    tx.SetNull();
-    if (!ReadTxIndex(hash, txindex))
-        return false;
-    return (tx.ReadFromDisk(txindex.pos));
-}
+    // Called with cs held after the dirty entries were written
+    void MarkClean(int64 nMillis)
+    {
+        nGeneration++;
+        for (map_type::iterator mi = mapEntries.begin(); mi != mapEntries.end(); ++mi)
+        {
+            CEntry& entry = (*mi).second;
+            if (entry.fDirty)
+            {
+                entry.fDirty = false;
+                entry.itLRU = listLRU.insert(listLRU.begin(), (*mi).first);
+            }
+        }
+        nDirtyBytes = 0;
+        nDirtyEntries = 0;
+        stats.nFlushes++;
+        stats.nLastFlushMillis = nMillis;
+        stats.nTotalFlushMillis += nMillis;
+        Evict();
+    }
 
-bool CTxDB::ReadDiskTx(uint256 hash, CTransaction& tx)
-{
-    CTxIndex txindex;
-    return ReadDiskTx(hash, tx, txindex);
-}
+    bool GetTransaction(const uint256& hash, CTransaction& tx)
+    {
+        LOCK(cs);
+        maptx_type::iterator mi = mapTx.find(hash);
+        if (mi == mapTx.end())
+        {
+            stats.nTxMisses++;
+            return false;
+        }
+        stats.nTxHits++;
+        listTxLRU.splice(listTxLRU.begin(), listTxLRU, (*mi).second.second);
+        tx = (*mi).second.first;
+        return true;
+    }
 
-bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx, CTxIndex& txindex)
-{
-    return ReadDiskTx(outpoint.hash, tx, txindex);
-}
+    void AddTransaction(const CTransaction& tx)
+    {
+        uint256 hash = tx.GetHash();
+        LOCK(cs);
+        SetBudget();
+        if (mapTx.count(hash))
+            return;
+        listTxLRU.push_front(hash);
+        mapTx.insert(make_pair(hash, make_pair(tx, listTxLRU.begin())));
+        nTxBytes += TxSize(tx);
+        EvictTx();
+    }
 
-bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
+    void GetStats(CTxDBCacheStats& statsRet)
+    {
+        LOCK(cs);
+        statsRet = stats;
+        statsRet.nEntries = mapEntries.size();
+        statsRet.nBytes = nBytes;
+        statsRet.nDirtyEntries = nDirtyEntries;
+        statsRet.nDirtyBytes = nDirtyBytes;
+        statsRet.nTxEntries = mapTx.size();
+        statsRet.nTxBytes = nTxBytes;
+    }
+};
+
+static CTxDBCache txdbcache;
+
+bool CTxDB::ReadRecord(const string& strKey, string& strValue)
 {
-    CTxIndex txindex;
-    return ReadDiskTx(outpoint.hash, tx, txindex);
+    if (activeBatch)
+    {
+        const pair<bool, string>* pending = activeBatch->Find(strKey);
+        if (pending)
+        {
+            if (pending->first)
+                return false;
+            strValue = pending->second;
+            return true;
+        }
+    }
+
+    bool fFound;
+    unsigned int nGeneration;
+    if (txdbcache.Lookup(strKey, strValue, fFound, nGeneration))
+        return fFound;
+
+    fFound = ReadRaw(strKey, strValue);
+    txdbcache.AddClean(strKey, fFound ? strValue : string(), !fFound, nGeneration);
+    return fFound;
 }
 
-bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
+bool CTxDB::CommitBatch(const CTxDBBatch& batch, bool fSync)
 {
-    return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
+    txdbcache.AddDirty(batch);
+    if (!txdbcache.NeedFlush(fSync))
+        return true;
+    return FlushCache(fSync);
 }
 
-bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
+bool CTxDB::FlushCache(bool fSync)
 {
-    return Read(string("hashBestChain"), hashBestChain);
+    LOCK(txdbcache.cs);
+    CTxDBBatch batch;
+    txdbcache.GetDirty(batch);
+    if (batch.mapWrites.empty())
+        return true;
+
+    int64 nStart = GetTimeMillis();
+    if (!WriteBatchRaw(batch, fSync))
+        return error("CTxDB::FlushCache() : writing %"PRIszu" records failed", batch.mapWrites.size());
+    txdbcache.MarkClean(GetTimeMillis() - nStart);
+    if (fDebug)
+        printf("CTxDB::FlushCache() : wrote %"PRIszu" records in %"PRI64d"ms\n", batch.mapWrites.size(), GetTimeMillis() - nStart);
+    return true;
 }
 
-bool CTxDB::WriteHashBestChain(uint256 hashBestChain)
+bool GetCachedTransaction(const uint256& hash, CTransaction& tx)
 {
-    return Write(string("hashBestChain"), hashBestChain);
+    return txdbcache.GetTransaction(hash, tx);
 }
 
-bool CTxDB::ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust)
+void CacheTransaction(const CTransaction& tx)
 {
-    return Read(string("bnBestInvalidTrust"), bnBestInvalidTrust);
+    txdbcache.AddTransaction(tx);
 }
 
-bool CTxDB::WriteBestInvalidTrust(CBigNum bnBestInvalidTrust)
+void GetTxDBCacheStats(CTxDBCacheStats& stats)
 {
-    return Write(string("bnBestInvalidTrust"), bnBestInvalidTrust);
+    txdbcache.GetStats(stats);
 }
-*/
 
 bool CTxDB::ReadSyncCheckpoint(uint256& hashCheckpoint)
 {
@@ -300,276 +587,6 @@ bool CTxDB::WriteCheckpointPubKey(const string& strPubKey)
     return Write(string("strCheckpointPubKey"), strPubKey);
 }
 
-/*
-static CBlockIndex *InsertBlockIndex(uint256 hash)
-{
-    if (hash == 0)
-        return NULL;
-
-    // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
-    if (mi != mapBlockIndex.end())
-        return (*mi).second;
-
-    // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
-    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
-
-    return pindexNew;
-}
-
-bool CTxDB::LoadBlockIndex()
-{
-    if (mapBlockIndex.size() > 0) {
-        // Already loaded once in this session. It can happen during migration
-        // from BDB.
-        return true;
-    }
-    // The block index is an in-memory structure that maps hashes to on-disk
-    // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
-    {
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (fRequestShutdown || strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProof      = diskindex.hashProof;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == (!fTestNet ? hashGenesisBlock : hashGenesisBlockTestNet))
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
-        }
-
-        // NovaCoin: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
-        iterator->Next();
-    }
-    delete iterator;
-
-    if (fRequestShutdown)
-        return true;
-
-    // Calculate nChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
-        // NovaCoin: calculate stake modifier checksum
-        pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
-        if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
-            return error("CTxDB::LoadBlockIndex() : Failed stake modifier checkpoint height=%d, modifier=0x%016"PRI64x, pindex->nHeight, pindex->nStakeModifier);
-    }
-
-    // Load hashBestChain pointer to end of best chain
-    if (!ReadHashBestChain(hashBestChain))
-    {
-        if (pindexGenesisBlock == NULL)
-            return true;
-        return error("CTxDB::LoadBlockIndex() : hashBestChain not loaded");
-    }
-    if (!mapBlockIndex.count(hashBestChain))
-        return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
-    pindexBest = mapBlockIndex[hashBestChain];
-    nBestHeight = pindexBest->nHeight;
-    nBestChainTrust = pindexBest->nChainTrust;
-
-    printf("LoadBlockIndex(): hashBestChain=%s  height=%d  trust=%s  date=%s\n",
-      hashBestChain.ToString().substr(0,20).c_str(), nBestHeight, CBigNum(nBestChainTrust).ToString().c_str(),
-      DateTimeStrFormat("%x %H:%M:%S", pindexBest->GetBlockTime()).c_str());
-
-    // NovaCoin: load hashSyncCheckpoint
-    if (!ReadSyncCheckpoint(Checkpoints::hashSyncCheckpoint))
-        return error("CTxDB::LoadBlockIndex() : hashSyncCheckpoint not loaded");
-    printf("LoadBlockIndex(): synchronized checkpoint %s\n", Checkpoints::hashSyncCheckpoint.ToString().c_str());
-
-    // Load bnBestInvalidTrust, OK if it doesn't exist
-    CBigNum bnBestInvalidTrust;
-    ReadBestInvalidTrust(bnBestInvalidTrust);
-    nBestInvalidTrust = bnBestInvalidTrust.getuint256();
-
-    // Verify blocks in the best chain
-    int nCheckLevel = GetArg("-checklevel", 1);
-    int nCheckDepth = GetArg( "-checkblocks", 2500);
-    if (nCheckDepth == 0)
-        nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > nBestHeight)
-        nCheckDepth = nBestHeight;
-    printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CBlockIndex* pindexFork = NULL;
-    map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
-    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
-    {
-        if (fRequestShutdown || pindex->nHeight < nBestHeight-nCheckDepth)
-            break;
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        // check level 1: verify block validity
-        // check level 7: verify block signature too
-        if (nCheckLevel>0 && !block.CheckBlock(true, true, (nCheckLevel>6)))
-        {
-            printf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-            pindexFork = pindex->pprev;
-        }
-        // check level 2: verify transaction index validity
-        if (nCheckLevel>1)
-        {
-            pair<unsigned int, unsigned int> pos = make_pair(pindex->nFile, pindex->nBlockPos);
-            mapBlockPos[pos] = pindex;
-            BOOST_FOREACH(const CTransaction &tx, block.vtx)
-            {
-                uint256 hashTx = tx.GetHash();
-                CTxIndex txindex;
-                if (ReadTxIndex(hashTx, txindex))
-                {
-                    // check level 3: checker transaction hashes
-                    if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
-                    {
-                        // either an error or a duplicate transaction
-                        CTransaction txFound;
-                        if (!txFound.ReadFromDisk(txindex.pos))
-                        {
-                            printf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString().c_str());
-                            pindexFork = pindex->pprev;
-                        }
-                        else
-                            if (txFound.GetHash() != hashTx) // not a duplicate tx
-                            {
-                                printf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString().c_str());
-                                pindexFork = pindex->pprev;
-                            }
-                    }
-                    // check level 4: check whether spent txouts were spent within the main chain
-                    unsigned int nOutput = 0;
-                    if (nCheckLevel>3)
-                    {
-                        BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
-                        {
-                            if (!txpos.IsNull())
-                            {
-                                pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
-                                if (!mapBlockPos.count(posFind))
-                                {
-                                    printf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str(), hashTx.ToString().c_str());
-                                    pindexFork = pindex->pprev;
-                                }
-                                // check level 6: check whether spent txouts were spent by a valid transaction that consume them
-                                if (nCheckLevel>5)
-                                {
-                                    CTransaction txSpend;
-                                    if (!txSpend.ReadFromDisk(txpos))
-                                    {
-                                        printf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString().c_str(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else if (!txSpend.CheckTransaction())
-                                    {
-                                        printf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString().c_str(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else
-                                    {
-                                        bool fFound = false;
-                                        BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
-                                            if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
-                                                fFound = true;
-                                        if (!fFound)
-                                        {
-                                            printf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString().c_str(), nOutput);
-                                            pindexFork = pindex->pprev;
-                                        }
-                                    }
-                                }
-                            }
-                            nOutput++;
-                        }
-                    }
-                }
-                // check level 5: check whether all prevouts are marked spent
-                if (nCheckLevel>4)
-                {
-                     BOOST_FOREACH(const CTxIn &txin, tx.vin)
-                     {
-                          CTxIndex txindex;
-                          if (ReadTxIndex(txin.prevout.hash, txindex))
-                              if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
-                              {
-                                  printf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString().c_str(), txin.prevout.n, hashTx.ToString().c_str());
-                                  pindexFork = pindex->pprev;
-                              }
-                     }
-                }
-            }
-        }
-    }
-    if (pindexFork && !fRequestShutdown)
-    {
-        // Reorg back to the fork
-        printf("LoadBlockIndex() : *** moving best chain pointer back to block %d\n", pindexFork->nHeight);
-        CBlock block;
-        if (!block.ReadFromDisk(pindexFork))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        CTxDB txdb;
-        block.SetBestChain(txdb, pindexFork);
-    }
-
-    return true;
-}
-*/
-
 // //////////////////////  NETCOIN 1.2 Block Chain Reader Code
 //
 //
@@ -670,7 +687,7 @@ CBlockIndex static * InsertBlockIndex(uint256 hash)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
@@ -684,10 +701,161 @@ CBlockIndex static * InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+//
+// Startup work on the block index is spread over as many threads as script
+// verification uses (-par); the calling thread takes part as well.
+//
+
+/** Block index records collected from the database cursor.  Records are
+ * decoded and hashed in parallel, then linked into mapBlockIndex in the
+ * order they were read.
+ */
+class CBlockIndexLoader
+{
+private:
+    static const unsigned int nChunkSize = 20000;
+
+    vector<string> vRecords;
+    vector<CDiskBlockIndex> vIndex;
+    vector<uint256> vHash;
+    vector<char> vOk;
+
+    void Decode(unsigned int i)
+    {
+        try {
+            CDataStream ssValue(vRecords[i].data(), vRecords[i].data() + vRecords[i].size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> vIndex[i];
+            vHash[i] = vIndex[i].GetBlockHash();
+            vOk[i] = true;
+        }
+        catch (std::exception &e) {
+            vOk[i] = false;
+        }
+    }
+
+public:
+    unsigned int nRecords;
+    int64 nDecodeMillis;
+    int64 nLinkMillis;
+
+    CBlockIndexLoader() : nRecords(0), nDecodeMillis(0), nLinkMillis(0)
+    {
+        vRecords.reserve(nChunkSize);
+    }
+
+    bool Add(const char* pbegin, const char* pend)
+    {
+        vRecords.push_back(string(pbegin, pend));
+        if (vRecords.size() >= nChunkSize)
+            return Flush();
+        return true;
+    }
+
+    bool Flush();
+};
+
+static bool LoadDiskBlockIndex(const CDiskBlockIndex& diskindex, const uint256& hash)
+{
+    // Construct block index object
+    CBlockIndex* pindexNew = InsertBlockIndex(hash);
+    pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+    pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+    pindexNew->nFile          = diskindex.nFile;
+    pindexNew->nBlockPos      = diskindex.nBlockPos;
+    pindexNew->nHeight        = diskindex.nHeight;
+    pindexNew->nMint          = diskindex.nMint;
+    pindexNew->nMoneySupply   = diskindex.nMoneySupply;
+    pindexNew->nFlags         = diskindex.nFlags;
+    pindexNew->nStakeModifier = diskindex.nStakeModifier;
+    pindexNew->prevoutStake   = diskindex.prevoutStake;
+    pindexNew->nStakeTime     = diskindex.nStakeTime;
+    pindexNew->hashProof      = diskindex.hashProof;
+    pindexNew->nVersion       = diskindex.nVersion;
+    pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+    pindexNew->nTime          = diskindex.nTime;
+    pindexNew->nBits          = diskindex.nBits;
+    pindexNew->nNonce         = diskindex.nNonce;
+
+    // Watch for genesis block
+    if (pindexGenesisBlock == NULL && hash == hashGenesisBlock)
+        pindexGenesisBlock = pindexNew;
+
+    if (!pindexNew->CheckIndex())
+        return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+
+    return true;
+}
+
+bool CBlockIndexLoader::Flush()
+{
+    unsigned int n = vRecords.size();
+    if (n == 0)
+        return true;
+
+    int64 nStart = GetTimeMillis();
+    vIndex.assign(n, CDiskBlockIndex());
+    vHash.resize(n);
+    vOk.assign(n, false);
+    ParallelFor(n, boost::bind(&CBlockIndexLoader::Decode, this, _1));
+    int64 nDecoded = GetTimeMillis();
+    nDecodeMillis += nDecoded - nStart;
+
+    for (unsigned int i = 0; i < n; i++)
+    {
+        if (!vOk[i])
+            return error("CBlockIndexLoader::Flush() : deserialize error");
+        if (!LoadDiskBlockIndex(vIndex[i], vHash[i]))
+            return false;
+    }
+    nLinkMillis += GetTimeMillis() - nDecoded;
+    nRecords += n;
+
+    vRecords.clear();
+    return true;
+}
+
+/** Blocks of the best chain read back and checked at startup.  Reading and
+ * CheckBlock() run in parallel over a window of blocks ahead of the
+ * checks that need the transaction index, which stay in chain order.
+ */
+struct CBlockCheckWindow
+{
+    vector<CBlockIndex*> vIndex;
+    vector<CBlock> vBlock;
+    vector<char> vRead;
+    vector<char> vValid;
+    bool fCheckBlock;
+
+    void Process(unsigned int i)
+    {
+        vRead[i] = vBlock[i].ReadFromDisk(vIndex[i]);
+        vValid[i] = vRead[i] && (!fCheckBlock || vBlock[i].CheckBlock());
+    }
+};
+
 bool CTxDB::LoadBlockIndex()
 {
-    if (!LoadBlockIndexGuts())
+    // The block index is read with a cursor, which bypasses the record cache
+    if (!FlushCache())
+        return false;
+
+    // The height of the best block is a close estimate of the number of
+    // entries, so mapBlockIndex can be sized before anything is inserted
+    int64 nStart = GetTimeMillis();
+    {
+        uint256 hashBest;
+        CDiskBlockIndex diskindexBest;
+        if (ReadHashBestChain(hashBest) && Read(make_pair(string("blockindex"), hashBest), diskindexBest))
+            mapBlockIndex.rehash(diskindexBest.nHeight + diskindexBest.nHeight / 16 + 1024);
+    }
+
+    CBlockIndexLoader loader;
+    if (!LoadBlockIndexGuts(loader) || !loader.Flush())
         return false;
+    int64 nLoaded = GetTimeMillis();
+    printf("LoadBlockIndex(): loaded %u entries in %"PRI64d"ms (read %"PRI64d"ms, decode %"PRI64d"ms, link %"PRI64d"ms)\n",
+      loader.nRecords, nLoaded - nStart, nLoaded - nStart - loader.nDecodeMillis - loader.nLinkMillis,
+      loader.nDecodeMillis, loader.nLinkMillis);
 
     if (fRequestShutdown)
         return true;
@@ -701,11 +869,21 @@ bool CTxDB::LoadBlockIndex()
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    // Block trust only depends on nBits, which changes far less often than
+    // once per block, so each distinct target is only converted once
+    map<unsigned int, uint256> mapTrustByBits;
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        map<unsigned int, uint256>::iterator mi = mapTrustByBits.find(pindex->nBits);
+        if (mi == mapTrustByBits.end())
+            mi = mapTrustByBits.insert(make_pair(pindex->nBits, pindex->GetBlockTrust())).first;
+        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + (*mi).second;
     }
+    int64 nTrusted = GetTimeMillis();
+    printf("LoadBlockIndex(): computed chain trust in %"PRI64d"ms (%"PRIszu" distinct targets)\n",
+      nTrusted - nLoaded, mapTrustByBits.size());
 
     // Load hashBestChain pointer to end of best chain
     if (!ReadHashBestChain(hashBestChain))
@@ -734,112 +912,130 @@ bool CTxDB::LoadBlockIndex()
     if (nCheckDepth > nBestHeight)
         nCheckDepth = nBestHeight;
     printf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+    int64 nVerifyStart = GetTimeMillis();
     CBlockIndex* pindexFork = NULL;
     map<pair<unsigned int, unsigned int>, CBlockIndex*> mapBlockPos;
-    for (CBlockIndex* pindex = pindexBest; pindex && pindex->pprev; pindex = pindex->pprev)
+    CBlockIndex* pindexNext = pindexBest;
+    const unsigned int nWindowSize = 32 * max(nScriptCheckThreads, 1);
+    while (pindexNext && pindexNext->pprev && !fRequestShutdown && pindexNext->nHeight >= nBestHeight-nCheckDepth)
     {
-        if (fRequestShutdown || pindex->nHeight < nBestHeight-nCheckDepth)
-            break;
-        CBlock block;
-        if (!block.ReadFromDisk(pindex))
-            return error("LoadBlockIndex() : block.ReadFromDisk failed");
-        // check level 1: verify block validity
-        if (nCheckLevel>0 && !block.CheckBlock())
-        {
-            printf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-            pindexFork = pindex->pprev;
-        }
-        // check level 2: verify transaction index validity
-        if (nCheckLevel>1)
+        CBlockCheckWindow window;
+        window.fCheckBlock = (nCheckLevel > 0);
+        for (; pindexNext && pindexNext->pprev && pindexNext->nHeight >= nBestHeight-nCheckDepth && window.vIndex.size() < nWindowSize; pindexNext = pindexNext->pprev)
+            window.vIndex.push_back(pindexNext);
+        unsigned int nBlocks = window.vIndex.size();
+        window.vBlock.resize(nBlocks);
+        window.vRead.assign(nBlocks, false);
+        window.vValid.assign(nBlocks, false);
+        ParallelFor(nBlocks, boost::bind(&CBlockCheckWindow::Process, &window, _1));
+
+        for (unsigned int nBlock = 0; nBlock < nBlocks; nBlock++)
         {
-            pair<unsigned int, unsigned int> pos = make_pair(pindex->nFile, pindex->nBlockPos);
-            mapBlockPos[pos] = pindex;
-            BOOST_FOREACH(const CTransaction &tx, block.vtx)
+            CBlockIndex* pindex = window.vIndex[nBlock];
+            if (fRequestShutdown)
+                break;
+            const CBlock& block = window.vBlock[nBlock];
+            if (!window.vRead[nBlock])
+                return error("LoadBlockIndex() : block.ReadFromDisk failed");
+            // check level 1: verify block validity
+            if (nCheckLevel>0 && !window.vValid[nBlock])
             {
-                uint256 hashTx = tx.GetHash();
-                CTxIndex txindex;
-                if (ReadTxIndex(hashTx, txindex))
+                printf("LoadBlockIndex() : *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+                pindexFork = pindex->pprev;
+            }
+            // check level 2: verify transaction index validity
+            if (nCheckLevel>1)
+            {
+                pair<unsigned int, unsigned int> pos = make_pair(pindex->nFile, pindex->nBlockPos);
+                mapBlockPos[pos] = pindex;
+                BOOST_FOREACH(const CTransaction &tx, block.vtx)
                 {
-                    // check level 3: checker transaction hashes
-                    if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
+                    uint256 hashTx = tx.GetHash();
+                    CTxIndex txindex;
+                    if (ReadTxIndex(hashTx, txindex))
                     {
-                        // either an error or a duplicate transaction
-                        CTransaction txFound;
-                        if (!txFound.ReadFromDisk(txindex.pos))
+                        // check level 3: checker transaction hashes
+                        if (nCheckLevel>2 || pindex->nFile != txindex.pos.nFile || pindex->nBlockPos != txindex.pos.nBlockPos)
                         {
-                            printf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString().c_str());
-                            pindexFork = pindex->pprev;
-                        }
-                        else
-                            if (txFound.GetHash() != hashTx) // not a duplicate tx
+                            // either an error or a duplicate transaction
+                            CTransaction txFound;
+                            if (!txFound.ReadFromDisk(txindex.pos))
                             {
-                                printf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString().c_str());
+                                printf("LoadBlockIndex() : *** cannot read mislocated transaction %s\n", hashTx.ToString().c_str());
                                 pindexFork = pindex->pprev;
                             }
-                    }
-                    // check level 4: check whether spent txouts were spent within the main chain
-                    unsigned int nOutput = 0;
-                    if (nCheckLevel>3)
-                    {
-                        BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
-                        {
-                            if (!txpos.IsNull())
-                            {
-                                pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
-                                if (!mapBlockPos.count(posFind))
+                            else
+                                if (txFound.GetHash() != hashTx) // not a duplicate tx
                                 {
-                                    printf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str(), hashTx.ToString().c_str());
+                                    printf("LoadBlockIndex(): *** invalid tx position for %s\n", hashTx.ToString().c_str());
                                     pindexFork = pindex->pprev;
                                 }
-                                // check level 6: check whether spent txouts were spent by a valid transaction that consume them
-                                if (nCheckLevel>5)
+                        }
+                        // check level 4: check whether spent txouts were spent within the main chain
+                        unsigned int nOutput = 0;
+                        if (nCheckLevel>3)
+                        {
+                            BOOST_FOREACH(const CDiskTxPos &txpos, txindex.vSpent)
+                            {
+                                if (!txpos.IsNull())
                                 {
-                                    CTransaction txSpend;
-                                    if (!txSpend.ReadFromDisk(txpos))
+                                    pair<unsigned int, unsigned int> posFind = make_pair(txpos.nFile, txpos.nBlockPos);
+                                    if (!mapBlockPos.count(posFind))
                                     {
-                                        printf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString().c_str(), nOutput);
+                                        printf("LoadBlockIndex(): *** found bad spend at %d, hashBlock=%s, hashTx=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString().c_str(), hashTx.ToString().c_str());
                                         pindexFork = pindex->pprev;
                                     }
-                                    else if (!txSpend.CheckTransaction())
+                                    // check level 6: check whether spent txouts were spent by a valid transaction that consume them
+                                    if (nCheckLevel>5)
                                     {
-                                        printf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString().c_str(), nOutput);
-                                        pindexFork = pindex->pprev;
-                                    }
-                                    else
-                                    {
-                                        bool fFound = false;
-                                        BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
-                                            if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
-                                                fFound = true;
-                                        if (!fFound)
+                                        CTransaction txSpend;
+                                        if (!txSpend.ReadFromDisk(txpos))
                                         {
-                                            printf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString().c_str(), nOutput);
+                                            printf("LoadBlockIndex(): *** cannot read spending transaction of %s:%i from disk\n", hashTx.ToString().c_str(), nOutput);
                                             pindexFork = pindex->pprev;
                                         }
+                                        else if (!txSpend.CheckTransaction())
+                                        {
+                                            printf("LoadBlockIndex(): *** spending transaction of %s:%i is invalid\n", hashTx.ToString().c_str(), nOutput);
+                                            pindexFork = pindex->pprev;
+                                        }
+                                        else
+                                        {
+                                            bool fFound = false;
+                                            BOOST_FOREACH(const CTxIn &txin, txSpend.vin)
+                                                if (txin.prevout.hash == hashTx && txin.prevout.n == nOutput)
+                                                    fFound = true;
+                                            if (!fFound)
+                                            {
+                                                printf("LoadBlockIndex(): *** spending transaction of %s:%i does not spend it\n", hashTx.ToString().c_str(), nOutput);
+                                                pindexFork = pindex->pprev;
+                                            }
+                                        }
                                     }
                                 }
+                                nOutput++;
                             }
-                            nOutput++;
                         }
                     }
-                }
-                // check level 5: check whether all prevouts are marked spent
-                if (nCheckLevel>4)
-                {
-                     BOOST_FOREACH(const CTxIn &txin, tx.vin)
-                     {
-                          CTxIndex txindex;
-                          if (ReadTxIndex(txin.prevout.hash, txindex))
-                              if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
-                              {
-                                  printf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString().c_str(), txin.prevout.n, hashTx.ToString().c_str());
-                                  pindexFork = pindex->pprev;
-                              }
-                     }
+                    // check level 5: check whether all prevouts are marked spent
+                    if (nCheckLevel>4)
+                    {
+                         BOOST_FOREACH(const CTxIn &txin, tx.vin)
+                         {
+                              CTxIndex txindex;
+                              if (ReadTxIndex(txin.prevout.hash, txindex))
+                                  if (txindex.vSpent.size()-1 < txin.prevout.n || txindex.vSpent[txin.prevout.n].IsNull())
+                                  {
+                                      printf("LoadBlockIndex(): *** found unspent prevout %s:%i in %s\n", txin.prevout.hash.ToString().c_str(), txin.prevout.n, hashTx.ToString().c_str());
+                                      pindexFork = pindex->pprev;
+                                  }
+                         }
+                    }
                 }
             }
         }
     }
+    printf("LoadBlockIndex(): verified %i blocks in %"PRI64d"ms\n", nCheckDepth, GetTimeMillis() - nVerifyStart);
     if (pindexFork && !fRequestShutdown)
     {
         // Reorg back to the fork
@@ -856,14 +1052,50 @@ bool CTxDB::LoadBlockIndex()
 
 
 
-bool CTxDB::LoadBlockIndexGuts()
+#ifdef USE_LEVELDB
+bool CTxDB::LoadBlockIndexGuts(CBlockIndexLoader& loader)
+{
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+
+    // Seek to start key
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("blockindex"), uint256(0));
+    iterator->Seek(ssStartKey.str());
+
+    // Collect the block index records
+    for (; iterator->Valid(); iterator->Next())
+    {
+        try {
+        CDataStream ssKey(iterator->key().data(), iterator->key().data() + iterator->key().size(), SER_DISK, CLIENT_VERSION);
+        string strType;
+        ssKey >> strType;
+        if (strType != "blockindex" || fRequestShutdown)
+            break; // if shutdown requested or finished loading block index
+
+        if (!loader.Add(iterator->value().data(), iterator->value().data() + iterator->value().size()))
+        {
+            delete iterator;
+            return false;
+        }
+        }    // try
+        catch (std::exception &e) {
+            delete iterator;
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+    }
+    delete iterator;
+
+    return true;
+}
+#else
+bool CTxDB::LoadBlockIndexGuts(CBlockIndexLoader& loader)
 {
     // Get database cursor
     Dbc* pcursor = GetCursor();
     if (!pcursor)
         return false;
 
-    // Load mapBlockIndex
+    // Collect the block index records
     unsigned int fFlags = DB_SET_RANGE;
     while(true)
     {
@@ -877,7 +1109,10 @@ bool CTxDB::LoadBlockIndexGuts()
         if (ret == DB_NOTFOUND)
             break;
         else if (ret != 0)
+        {
+            pcursor->close();
             return false;
+        }
 
         // Unserialize
 
@@ -886,35 +1121,12 @@ bool CTxDB::LoadBlockIndexGuts()
         ssKey >> strType;
         if (strType == "blockindex" && !fRequestShutdown)
         {
-            CDiskBlockIndex diskindex;
-            ssValue >> diskindex;
-
-            // Construct block index object
-            CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-            pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-            pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-            pindexNew->nFile          = diskindex.nFile;
-            pindexNew->nBlockPos      = diskindex.nBlockPos;
-            pindexNew->nHeight        = diskindex.nHeight;
-            pindexNew->nMint          = diskindex.nMint;
-            pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-            pindexNew->nFlags         = diskindex.nFlags;
-            pindexNew->nStakeModifier = diskindex.nStakeModifier;
-            pindexNew->prevoutStake   = diskindex.prevoutStake;
-            pindexNew->nStakeTime     = diskindex.nStakeTime;
-            pindexNew->hashProof      = diskindex.hashProof;
-            pindexNew->nVersion       = diskindex.nVersion;
-            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-            pindexNew->nTime          = diskindex.nTime;
-            pindexNew->nBits          = diskindex.nBits;
-            pindexNew->nNonce         = diskindex.nNonce;
-
-            // Watch for genesis block
-            if (pindexGenesisBlock == NULL && diskindex.GetBlockHash() == hashGenesisBlock)
-                pindexGenesisBlock = pindexNew;
-
-            if (!pindexNew->CheckIndex())
-                return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+            string strValue = ssValue.str();
+            if (!loader.Add(strValue.data(), strValue.data() + strValue.size()))
+            {
+                pcursor->close();
+                return false;
+            }
         }
         else
         {
@@ -929,6 +1141,7 @@ bool CTxDB::LoadBlockIndexGuts()
 
     return true;
 }
+#endif
 
 
 
@@ -10,15 +10,257 @@
 #endif  // BITCOIN_TXDB_H
 #include "db.h"
 #include <stdint.h>
-/** Access to the transaction database (blkindex.dat) */
 
+#include <map>
+#include <string>
+
+#ifdef USE_LEVELDB
+#include <leveldb/db.h>
+#endif
+
+class CBlockIndexLoader;
+
+/** Writes made inside a CTxDB transaction.  They are kept in key order and
+ * are visible to reads through the same CTxDB; TxnCommit() hands them to
+ * the record cache as a unit, so connecting a block is one commit no matter
+ * how many index records it touches.
+ */
+class CTxDBBatch
+{
+public:
+    // serialized key -> (erased, serialized value)
+    typedef std::map<std::string, std::pair<bool, std::string> > map_type;
+    map_type mapWrites;
+
+    void Write(const std::string& strKey, const std::string& strValue)
+    {
+        mapWrites[strKey] = std::make_pair(false, strValue);
+    }
+
+    void Erase(const std::string& strKey)
+    {
+        mapWrites[strKey] = std::make_pair(true, std::string());
+    }
+
+    // The pending entry for strKey, or NULL if this batch does not touch it
+    const std::pair<bool, std::string>* Find(const std::string& strKey) const
+    {
+        map_type::const_iterator mi = mapWrites.find(strKey);
+        if (mi == mapWrites.end())
+            return NULL;
+        return &(*mi).second;
+    }
+};
+
+/** Counters of the CTxDB record and transaction cache */
+struct CTxDBCacheStats
+{
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nTxHits;
+    uint64_t nTxMisses;
+    uint64_t nEntries;
+    uint64_t nBytes;
+    uint64_t nDirtyEntries;
+    uint64_t nDirtyBytes;
+    uint64_t nTxEntries;
+    uint64_t nTxBytes;
+    uint64_t nFlushes;
+    int64_t nLastFlushMillis;
+    int64_t nTotalFlushMillis;
+};
+
+void GetTxDBCacheStats(CTxDBCacheStats& stats);
+
+/** Recently read or connected transactions, looked up by hash */
+bool GetCachedTransaction(const uint256& hash, CTransaction& tx);
+void CacheTransaction(const CTransaction& tx);
+
+#ifdef USE_LEVELDB
+/** Access to the transaction database (txleveldb), built with USE_LEVELDB=1.
+ * All CTxDB objects share one LevelDB instance.
+ */
+class CTxDB
+{
+public:
+    CTxDB(const char* pszMode="r+");
+    ~CTxDB()
+    {
+        // Unlike CloseDatabase() this only drops state scoped to this object
+        delete activeBatch;
+    }
+
+    // Matches CDB::Close(): releases this handle, the database stays open
+    void Close()
+    {
+        delete activeBatch;
+        activeBatch = NULL;
+    }
+
+    // Closes the shared LevelDB instance at shutdown
+    static void CloseDatabase();
+
+private:
+    CTxDB(const CTxDB&);
+    void operator=(const CTxDB&);
+
+    leveldb::DB *pdb;  // points to the global instance
+    bool fReadOnly;
+
+public:
+    bool ReadVersion(int& nVersion)
+    {
+        nVersion = 0;
+        return Read(std::string("version"), nVersion);
+    }
+
+    bool WriteVersion(int nVersion)
+    {
+        return Write(std::string("version"), nVersion);
+    }
+
+#else
+
+/** Access to the transaction database (blkindex.dat) */
 class CTxDB : public CDB
 {
 public:
-    CTxDB(const char* pszMode="r+") : CDB("blkindex.dat", pszMode) { }
+    CTxDB(const char* pszMode="r+") : CDB("blkindex.dat", pszMode), activeBatch(NULL) { }
+    ~CTxDB()
+    {
+        delete activeBatch;
+    }
+
+    void Close()
+    {
+        delete activeBatch;
+        activeBatch = NULL;
+        CDB::Close();
+    }
 private:
     CTxDB(const CTxDB&);
     void operator=(const CTxDB&);
+#endif
+
+private:
+    CTxDBBatch *activeBatch;
+
+    // Reads through activeBatch and the shared record cache
+    bool ReadRecord(const std::string& strKey, std::string& strValue);
+    // Hands committed writes to the shared record cache, which writes them
+    // to the database when it is flushed
+    bool CommitBatch(const CTxDBBatch& batch, bool fSync);
+
+    // Backend access to already serialized records
+    bool ReadRaw(const std::string& strKey, std::string& strValue);
+    bool WriteBatchRaw(const CTxDBBatch& batch, bool fSync);
+
+protected:
+    template<typename K, typename T>
+    bool Read(const K& key, T& value)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(1000);
+        ssKey << key;
+
+        std::string strValue;
+        if (!ReadRecord(ssKey.str(), strValue))
+            return false;
+
+        // Unserialize value
+        try {
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> value;
+        }
+        catch (std::exception &e) {
+            return false;
+        }
+        return true;
+    }
+
+    template<typename K, typename T>
+    bool Write(const K& key, const T& value)
+    {
+        if (fReadOnly)
+            assert(!"Write called on database in read-only mode");
+
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(1000);
+        ssKey << key;
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.reserve(10000);
+        ssValue << value;
+
+        if (activeBatch)
+        {
+            activeBatch->Write(ssKey.str(), ssValue.str());
+            return true;
+        }
+        CTxDBBatch batch;
+        batch.Write(ssKey.str(), ssValue.str());
+        return CommitBatch(batch, false);
+    }
+
+    template<typename K>
+    bool Erase(const K& key)
+    {
+        if (fReadOnly)
+            assert(!"Erase called on database in read-only mode");
+
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(1000);
+        ssKey << key;
+
+        if (activeBatch)
+        {
+            activeBatch->Erase(ssKey.str());
+            return true;
+        }
+        CTxDBBatch batch;
+        batch.Erase(ssKey.str());
+        return CommitBatch(batch, false);
+    }
+
+    template<typename K>
+    bool Exists(const K& key)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(1000);
+        ssKey << key;
+
+        std::string strValue;
+        return ReadRecord(ssKey.str(), strValue);
+    }
+
+public:
+    bool TxnBegin()
+    {
+        if (activeBatch)
+            return false;
+        activeBatch = new CTxDBBatch();
+        return true;
+    }
+
+    bool TxnCommit(bool fSync=true)
+    {
+        if (!activeBatch)
+            return false;
+        bool fOk = CommitBatch(*activeBatch, fSync);
+        delete activeBatch;
+        activeBatch = NULL;
+        return fOk;
+    }
+
+    bool TxnAbort()
+    {
+        delete activeBatch;
+        activeBatch = NULL;
+        return true;
+    }
+
+    // Writes everything the record cache holds back to the database
+    bool FlushCache(bool fSync=true);
+
 public:
     bool ReadTxIndex(uint256 hash, CTxIndex& txindex);
     bool UpdateTxIndex(uint256 hash, const CTxIndex& txindex);
@@ -56,5 +298,5 @@ public:
 
     bool LoadBlockIndex();
 private:
-    bool LoadBlockIndexGuts();
+    bool LoadBlockIndexGuts(CBlockIndexLoader& loader);
 };
@@ -369,6 +369,12 @@ inline int64_t GetTimeMillis()
             boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_milliseconds();
 }
 
+inline int64_t GetTimeMicros()
+{
+    return (boost::posix_time::ptime(boost::posix_time::microsec_clock::universal_time()) -
+            boost::posix_time::ptime(boost::gregorian::date(1970,1,1))).total_microseconds();
+}
+
 inline std::string DateTimeStrFormat(const char* pszFormat, int64_t nTime)
 {
     time_t n = nTime;
@@ -570,6 +576,10 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
     return hash2;
 }
 
+/** SipHash-2-4 of a 256-bit value under the key (k0, k1).  Not a
+ * cryptographic digest, but cheap enough to hash a whole memory pool. */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 /**
  * Timing-attack-resistant comparison.
  * Takes time proportional to length
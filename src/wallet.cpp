@@ -18,6 +18,7 @@
 #include "init.h"
 #include "coincontrol.h"
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 
 #include "main.h"
 
@@ -386,6 +387,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
             if (mi != mapWallet.end())
             {
                 CWalletTx& wtx = (*mi).second;
+                mapStakeCandidates.erase(txin.prevout);
                 if (txin.prevout.n >= wtx.vout.size())
                     printf("WalletUpdateSpent: bad wtx %s\n", wtx.GetHash().ToString().c_str());
                 else if (!wtx.IsSpent(txin.prevout.n) && IsMine(wtx.vout[txin.prevout.n]))
@@ -393,6 +395,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                     printf("WalletUpdateSpent found spent coin %s NET %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkSpent(txin.prevout.n);
                     wtx.WriteToDisk();
+                    WalletTxChanged(txin.prevout.hash);
                     NotifyTransactionChanged(this, txin.prevout.hash, CT_UPDATED);
                 }
             }
@@ -410,6 +413,7 @@ void CWallet::WalletUpdateSpent(const CTransaction &tx, bool fBlock)
                 {
                     wtx.MarkUnspent(&txout - &tx.vout[0]);
                     wtx.WriteToDisk();
+                    WalletTxChanged(hash);
                     NotifyTransactionChanged(this, hash, CT_UPDATED);
                 }
             }
@@ -424,6 +428,8 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        fBalanceDirty = true;
+        fUnspentDirty = true;
     }
 }
 
@@ -439,6 +445,10 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         bool fInsertedNew = ret.second;
         if (fInsertedNew)
         {
+            if (!wtx.fHashCached)
+                wtx.UpdateHash();
+            if (wtx.hashBlock != 0)
+                setStakeCandidatesPending.insert(hash);
             wtx.nTimeReceived = GetAdjustedTime();
             wtx.nOrderPos = IncOrderPosNext();
 
@@ -496,6 +506,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
             if (wtxIn.hashBlock != 0 && wtxIn.hashBlock != wtx.hashBlock)
             {
                 wtx.hashBlock = wtxIn.hashBlock;
+                EraseStakeCandidates(hash);
+                setStakeCandidatesPending.insert(hash);
                 fUpdated = true;
             }
             if (wtxIn.nIndex != -1 && (wtxIn.vMerkleBranch != wtx.vMerkleBranch || wtxIn.nIndex != wtx.nIndex))
@@ -519,6 +531,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn)
         if (fInsertedNew || fUpdated)
             if (!wtx.WriteToDisk())
                 return false;
+        WalletTxChanged(hash);
 #ifndef QT_GUI
         // If default receiving address gets used, replace it with a new one
         if (vchDefaultKey.IsValid()) {
@@ -587,8 +600,11 @@ bool CWallet::EraseFromWallet(uint256 hash)
         return false;
     {
         LOCK(cs_wallet);
+        EraseStakeCandidates(hash);
+        setStakeCandidatesPending.erase(hash);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
+        WalletTxChanged(hash);
     }
     return true;
 }
@@ -848,35 +864,194 @@ bool CWalletTx::WriteToDisk()
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
-// Scan the block chain (starting in pindexStart) for transactions
-// from or to us. If fUpdate is true, found transactions that already
-// exist in the wallet will be updated.
-int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+// The scripts our keys and redeem scripts are paid to, for matching
+// outputs during a rescan without a Solver call per output
+void CWallet::GetScanScripts(set<CScript>& setScriptsRet) const
 {
-    int ret = 0;
+    setScriptsRet.clear();
 
-    CBlockIndex* pindex = pindexStart;
+    set<CKeyID> setKeyIDs;
+    GetKeys(setKeyIDs);
+    BOOST_FOREACH(const CKeyID& keyID, setKeyIDs)
     {
-        LOCK(cs_wallet);
-        while (pindex)
+        CPubKey pubkey;
+        if (!GetPubKey(keyID, pubkey))
+            continue;
+        CScript script;
+        script.SetDestination(keyID);
+        setScriptsRet.insert(script);
+        script.clear();
+        script << pubkey << OP_CHECKSIG;
+        setScriptsRet.insert(script);
+    }
+
+    LOCK(cs_KeyStore);
+    BOOST_FOREACH(const PAIRTYPE(const CScriptID, CScript)& item, mapScripts)
+    {
+        if (!::IsMine(*this, item.second))
+            continue;
+        CScript script;
+        script.SetDestination(item.first);
+        setScriptsRet.insert(script);
+    }
+}
+
+// Whether a script pays to us.  Pay-to-pubkey-hash, pay-to-pubkey and
+// pay-to-script-hash outputs are ours exactly when they are in the scan
+// scripts; anything else, such as bare multisig, asks the key store.
+static bool IsScanMatch(const CKeyStore& keystore, const set<CScript>& setScripts, const CScript& script)
+{
+    if (setScripts.count(script))
+        return true;
+
+    unsigned int nSize = script.size();
+    bool fPubKeyHash = (nSize == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+                        script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG);
+    bool fPubKey = ((nSize == 35 && script[0] == 33) || (nSize == 67 && script[0] == 65)) && script[nSize - 1] == OP_CHECKSIG;
+    if (fPubKeyHash || fPubKey || script.IsPayToScriptHash())
+        return false;
+    return IsMine(keystore, script);
+}
+
+// A run of blocks being rescanned: blocks are read and their outputs
+// matched on as many threads as script verification uses
+struct CWalletScanWindow
+{
+    const CKeyStore* pkeystore;
+    const set<CScript>* psetScripts;
+    vector<CBlockIndex*> vIndex;
+    vector<CBlock> vBlock;
+    vector<char> vRead;
+    vector<vector<uint256> > vHash;
+    vector<vector<char> > vMatch; // per transaction, whether it pays to us
+
+    // Take up to nSize blocks from pindex on, skipping blocks from before
+    // the wallet birthday; returns where the next window starts
+    CBlockIndex* Fill(CBlockIndex* pindex, unsigned int nSize, int64_t nTimeFirstKey)
+    {
+        vIndex.clear();
+        for (; pindex && vIndex.size() < nSize; pindex = pindex->pnext)
         {
             // no need to read and scan block, if block was created before
             // our wallet birthday (as adjusted for block time variability)
-            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200))) {
-                pindex = pindex->pnext;
+            if (nTimeFirstKey && (pindex->nTime < (nTimeFirstKey - 7200)))
                 continue;
+            vIndex.push_back(pindex);
+        }
+        unsigned int nBlocks = vIndex.size();
+        vBlock.clear();
+        vBlock.resize(nBlocks);
+        vRead.assign(nBlocks, false);
+        vHash.assign(nBlocks, vector<uint256>());
+        vMatch.assign(nBlocks, vector<char>());
+        return pindex;
+    }
+
+    void Process(unsigned int i)
+    {
+        vRead[i] = vBlock[i].ReadFromDisk(vIndex[i], true);
+        const vector<CTransaction>& vtx = vBlock[i].vtx;
+        vHash[i].resize(vtx.size());
+        vMatch[i].assign(vtx.size(), false);
+        for (unsigned int j = 0; j < vtx.size(); j++)
+        {
+            vHash[i][j] = vtx[j].GetHash();
+            BOOST_FOREACH(const CTxOut& txout, vtx[j].vout)
+            {
+                if (IsScanMatch(*pkeystore, *psetScripts, txout.scriptPubKey))
+                {
+                    vMatch[i][j] = true;
+                    break;
+                }
             }
+        }
+    }
+
+    void ProcessAll()
+    {
+        ParallelFor(vIndex.size(), boost::bind(&CWalletScanWindow::Process, this, _1));
+    }
+};
+
+// Scan the block chain (starting in pindexStart) for transactions
+// from or to us. If fUpdate is true, found transactions that already
+// exist in the wallet will be updated.
+// Blocks are read and matched a window at a time, the next window while
+// the current one is added to the wallet, and cs_wallet is only held for
+// adding.  A transaction is handed to AddToWalletIfInvolvingMe if it pays
+// to one of our scripts, is already in the wallet or spends from it; that
+// makes the final decision as before.
+int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
+{
+    int ret = 0;
+    if (!pindexStart)
+        return ret;
+
+    int64_t nStart = GetTimeMillis();
+    int64_t nLastProgress = nStart;
+    int nStartHeight = pindexStart->nHeight;
+    int nEndHeight = max(nBestHeight, nStartHeight);
+    unsigned int nScanned = 0;
+
+    set<CScript> setScripts;
+    GetScanScripts(setScripts);
+
+    const unsigned int nWindowSize = 32 * max(nScriptCheckThreads, 1);
+    CWalletScanWindow window[2];
+    for (int i = 0; i < 2; i++)
+    {
+        window[i].pkeystore = this;
+        window[i].psetScripts = &setScripts;
+    }
+    int nCur = 0;
+    CBlockIndex* pindex = window[nCur].Fill(pindexStart, nWindowSize, nTimeFirstKey);
+    window[nCur].ProcessAll();
+
+    while (!window[nCur].vIndex.empty())
+    {
+        // Read ahead while this window is added
+        CWalletScanWindow& windowNext = window[!nCur];
+        pindex = windowNext.Fill(pindex, nWindowSize, nTimeFirstKey);
+        boost::thread threadPrefetch(boost::bind(&CWalletScanWindow::ProcessAll, &windowNext));
 
-            CBlock block;
-            block.ReadFromDisk(pindex, true);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+        CWalletScanWindow& windowCur = window[nCur];
+        {
+            LOCK(cs_wallet);
+            for (unsigned int i = 0; i < windowCur.vIndex.size(); i++)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                if (!windowCur.vRead[i])
+                    printf("ScanForWalletTransactions() : block.ReadFromDisk failed at height %d\n", windowCur.vIndex[i]->nHeight);
+                const CBlock& block = windowCur.vBlock[i];
+                for (unsigned int j = 0; j < block.vtx.size(); j++)
+                {
+                    const CTransaction& tx = block.vtx[j];
+                    bool fInvolved = windowCur.vMatch[i][j] || mapWallet.count(windowCur.vHash[i][j]);
+                    for (unsigned int k = 0; k < tx.vin.size() && !fInvolved; k++)
+                        fInvolved = mapWallet.count(tx.vin[k].prevout.hash);
+                    if (fInvolved && AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                        ret++;
+                }
             }
-            pindex = pindex->pnext;
+        }
+        nScanned += windowCur.vIndex.size();
+        int nHeight = windowCur.vIndex.back()->nHeight;
+
+        threadPrefetch.join();
+        nCur = !nCur;
+
+        int64_t nNow = GetTimeMillis();
+        if (nNow - nLastProgress >= 10000)
+        {
+            nLastProgress = nNow;
+            printf("ScanForWalletTransactions() : at height %d, %d%% done, %"PRI64d" blocks/s\n", nHeight,
+                   (int)((int64_t)(nHeight - nStartHeight) * 100 / max(nEndHeight - nStartHeight, 1)),
+                   (int64_t)nScanned * 1000 / max(nNow - nStart, (int64_t)1));
         }
     }
+
+    int64_t nElapsed = max(GetTimeMillis() - nStart, (int64_t)1);
+    printf("ScanForWalletTransactions() : scanned %u blocks from height %d in %"PRI64d"ms (%"PRI64d" blocks/s), %d transactions found\n",
+           nScanned, nStartHeight, nElapsed, (int64_t)nScanned * 1000 / nElapsed, ret);
     return ret;
 }
 
@@ -930,6 +1105,7 @@ void CWallet::ReacceptWalletTransactions()
                     printf("ReacceptWalletTransactions found spent coin %s NET %s\n", FormatMoney(wtx.GetCredit()).c_str(), wtx.GetHash().ToString().c_str());
                     wtx.MarkDirty();
                     wtx.WriteToDisk();
+                    WalletTxChanged(item.first);
                 }
             }
             else
@@ -941,9 +1117,20 @@ void CWallet::ReacceptWalletTransactions()
         }
         if (!vMissingTx.empty())
         {
-            // TODO: optimize this to scan just part of the block chain?
-            if (ScanForWalletTransactions(pindexGenesisBlock))
-                fRepeat = true;  // Found missing transactions: re-do re-accept.
+            // The tx index says which blocks the spends are in, so read
+            // just those instead of scanning the whole chain
+            set<pair<unsigned int, unsigned int> > setBlockPos;
+            BOOST_FOREACH(const CDiskTxPos& pos, vMissingTx)
+                setBlockPos.insert(make_pair(pos.nFile, pos.nBlockPos));
+            BOOST_FOREACH(const PAIRTYPE(unsigned int, unsigned int)& pos, setBlockPos)
+            {
+                CBlock block;
+                if (!block.ReadFromDisk(pos.first, pos.second))
+                    continue;
+                BOOST_FOREACH(const CTransaction& tx, block.vtx)
+                    if (AddToWalletIfInvolvingMe(tx, &block))
+                        fRepeat = true;  // Found missing transactions: re-do re-accept.
+            }
         }
     }
 }
@@ -1034,54 +1221,174 @@ void CWallet::ResendWalletTransactions(bool fForce)
 //
 
 
-int64_t CWallet::GetBalance() const
+// Work out what a transaction adds to each balance total at the current tip.
+// Returns true if that can change as the chain grows: the transaction is
+// not final, not confirmed or not mature yet.
+static bool GetBalanceAmounts(const CWallet* pwallet, const CWalletTx& wtx, int64_t vAmount[BALANCE_TYPES])
 {
-    int64_t nTotal = 0;
+    for (int i = 0; i < BALANCE_TYPES; i++)
+        vAmount[i] = 0;
+
+    bool fFinal = wtx.IsFinal();
+    int nDepth = wtx.GetDepthInMainChain();
+    bool fTrusted = wtx.IsTrusted();
+    if (fTrusted)
+        vAmount[BALANCE_TRUSTED] = wtx.GetAvailableCredit();
+    if (!fFinal || (!fTrusted && nDepth == 0))
+        vAmount[BALANCE_UNCONFIRMED] = wtx.GetAvailableCredit();
+
+    bool fImmature = (wtx.IsCoinBase() || wtx.IsCoinStake()) && wtx.GetBlocksToMaturity() > 0;
+    if (fImmature && nDepth > 0)
+        vAmount[wtx.IsCoinStake() ? BALANCE_STAKE : BALANCE_IMMATURE] = pwallet->GetCredit(wtx);
+
+    return !fFinal || nDepth <= 0 || fImmature;
+}
+
+// Move a transaction's contribution to the balance totals to what it is now,
+// after it was added, erased or had outputs spent.  Requires cs_wallet.
+void CWallet::UpdateBalance(const uint256& hash) const
+{
+    // Everything gets counted again on the next query
+    if (fBalanceDirty)
+        return;
+
+    CBalanceEntry entry;
+    bool fPending = false;
+    bool fEmpty = true;
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi != mapWallet.end())
+        fPending = GetBalanceAmounts(this, (*mi).second, entry.vAmount);
+    else
+        for (int i = 0; i < BALANCE_TYPES; i++)
+            entry.vAmount[i] = 0;
+
+    map<uint256, CBalanceEntry>::iterator it = mapBalanceEntries.find(hash);
+    for (int i = 0; i < BALANCE_TYPES; i++)
     {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
-        }
+        if (it != mapBalanceEntries.end())
+            vBalanceTotal[i] -= (*it).second.vAmount[i];
+        vBalanceTotal[i] += entry.vAmount[i];
+        if (entry.vAmount[i] != 0)
+            fEmpty = false;
+    }
+
+    if (fEmpty)
+    {
+        if (it != mapBalanceEntries.end())
+            mapBalanceEntries.erase(it);
     }
+    else
+        mapBalanceEntries[hash] = entry;
 
-    return nTotal;
+    if (fPending)
+        setBalancePending.insert(hash);
+    else
+        setBalancePending.erase(hash);
 }
 
-int64_t CWallet::GetUnconfirmedBalance() const
+// Bring the balance totals up to the current tip.  Only transactions that
+// were still waiting on the chain can change buckets when blocks connect; a
+// reorg or a wallet-wide change counts every transaction again.
+// Requires cs_wallet.
+void CWallet::SyncBalances() const
 {
-    int64_t nTotal = 0;
+    const CBlockIndex* pindexTip = pindexBest;
+    if (!fBalanceDirty && pindexBalanceTip == pindexTip)
+        return;
+
+    if (fBalanceDirty || pindexBalanceTip == NULL || !pindexBalanceTip->IsInMainChain())
     {
-        LOCK(cs_wallet);
+        mapBalanceEntries.clear();
+        setBalancePending.clear();
+        for (int i = 0; i < BALANCE_TYPES; i++)
+            vBalanceTotal[i] = 0;
+        fBalanceDirty = false;
+
         for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsFinal() || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
+            UpdateBalance((*it).first);
+    }
+    else
+    {
+        vector<uint256> vPending(setBalancePending.begin(), setBalancePending.end());
+        BOOST_FOREACH(const uint256& hash, vPending)
+            UpdateBalance(hash);
     }
-    return nTotal;
+    pindexBalanceTip = pindexTip;
+}
+
+int64_t CWallet::GetBalance() const
+{
+    LOCK(cs_wallet);
+    SyncBalances();
+    return vBalanceTotal[BALANCE_TRUSTED];
+}
+
+int64_t CWallet::GetUnconfirmedBalance() const
+{
+    LOCK(cs_wallet);
+    SyncBalances();
+    return vBalanceTotal[BALANCE_UNCONFIRMED];
 }
 
 int64_t CWallet::GetImmatureBalance() const
 {
-    int64_t nTotal = 0;
-    {
-        LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx& pcoin = (*it).second;
-            if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
-                nTotal += GetCredit(pcoin);
-        }
-    }
-    return nTotal;
+    LOCK(cs_wallet);
+    SyncBalances();
+    return vBalanceTotal[BALANCE_IMMATURE];
 }
 
 
 
+// Move a transaction's outputs in the unspent index to what they are now.
+// Requires cs_wallet.
+void CWallet::UpdateUnspent(const uint256& hash) const
+{
+    // Everything gets indexed again on the next query
+    if (fUnspentDirty)
+        return;
+
+    set<COutPoint>::iterator it = setWalletUnspent.lower_bound(COutPoint(hash, 0));
+    while (it != setWalletUnspent.end() && (*it).hash == hash)
+        setWalletUnspent.erase(it++);
+
+    map<uint256, CWalletTx>::const_iterator mi = mapWallet.find(hash);
+    if (mi == mapWallet.end())
+        return;
+    const CWalletTx& wtx = (*mi).second;
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        if (!wtx.IsSpent(i) && IsMine(wtx.vout[i]))
+            setWalletUnspent.insert(COutPoint(hash, i));
+}
+
+// Index every transaction again after a wallet-wide change, such as new
+// keys making more outputs ours.  Requires cs_wallet.
+void CWallet::SyncUnspent() const
+{
+    if (!fUnspentDirty)
+        return;
+
+    setWalletUnspent.clear();
+    fUnspentDirty = false;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateUnspent((*it).first);
+}
+
+// Whether the outputs of pcoin can be chosen, with at least nConf confirmations
+bool CWallet::IsAvailable(const CWalletTx* pcoin, bool fOnlyConfirmed, bool fOnlyMature, int nConf, int& nDepthRet) const
+{
+    if (!pcoin->IsFinal())
+        return false;
+
+    if (fOnlyConfirmed && !pcoin->IsTrusted())
+        return false;
+
+    if (fOnlyMature && (pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
+        return false;
+
+    nDepthRet = pcoin->GetDepthInMainChain();
+    return nDepthRet >= 0 && nDepthRet >= nConf;
+}
+
 // populate vCoins with vector of spendable COutputs
 void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl) const
 {
@@ -1089,33 +1396,30 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!pcoin->IsFinal())
-                continue;
-
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
-
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
-
-            if(pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+        SyncUnspent();
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
+        // The index is ordered by outpoint, so a transaction's outputs come
+        // together and it is checked once
+        const CWalletTx* pcoin = NULL;
+        uint256 hashLast = 0;
+        bool fAvailable = false;
+        int nDepth = 0;
+        BOOST_FOREACH(const COutPoint& outpoint, setWalletUnspent)
+        {
+            if (pcoin == NULL || outpoint.hash != hashLast)
+            {
+                hashLast = outpoint.hash;
+                pcoin = &(*mapWallet.find(outpoint.hash)).second;
+                fAvailable = IsAvailable(pcoin, fOnlyConfirmed, true, 0, nDepth);
+            }
+            if (!fAvailable)
                 continue;
 
             // If output is less than minimum value, then don't include transaction.
             // This is to help deal with dust spam clogging up create transactions.
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue &&
-                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                    vCoins.push_back(COutput(pcoin, i, nDepth));
-
+            if (pcoin->vout[outpoint.n].nValue >= nMinimumInputValue &&
+                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(outpoint.hash, outpoint.n)))
+                vCoins.push_back(COutput(pcoin, outpoint.n, nDepth));
         }
     }
 }
@@ -1126,19 +1430,22 @@ void CWallet::AvailableCoinsMinConf(vector<COutput>& vCoins, int nConf) const
 
     {
         LOCK(cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!pcoin->IsFinal())
-                continue;
-
-            if(pcoin->GetDepthInMainChain() < nConf)
-                continue;
+        SyncUnspent();
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue)
-                    vCoins.push_back(COutput(pcoin, i, pcoin->GetDepthInMainChain()));
+        const CWalletTx* pcoin = NULL;
+        uint256 hashLast = 0;
+        bool fAvailable = false;
+        int nDepth = 0;
+        BOOST_FOREACH(const COutPoint& outpoint, setWalletUnspent)
+        {
+            if (pcoin == NULL || outpoint.hash != hashLast)
+            {
+                hashLast = outpoint.hash;
+                pcoin = &(*mapWallet.find(outpoint.hash)).second;
+                fAvailable = IsAvailable(pcoin, false, false, nConf, nDepth);
+            }
+            if (fAvailable && pcoin->vout[outpoint.n].nValue >= nMinimumInputValue)
+                vCoins.push_back(COutput(pcoin, outpoint.n, nDepth));
         }
     }
 }
@@ -1184,28 +1491,16 @@ static void ApproximateBestSubset(vector<pair<int64_t, pair<const CWalletTx*,uns
 // ppcoin: total coins staked (non-spendable until maturity)
 int64_t CWallet::GetStake() const
 {
-    int64_t nTotal = 0;
     LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    SyncBalances();
+    return vBalanceTotal[BALANCE_STAKE];
 }
 
 int64_t CWallet::GetNewMint() const
 {
-    int64_t nTotal = 0;
     LOCK(cs_wallet);
-    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-    {
-        const CWalletTx* pcoin = &(*it).second;
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
-            nTotal += CWallet::GetCredit(*pcoin);
-    }
-    return nTotal;
+    SyncBalances();
+    return vBalanceTotal[BALANCE_IMMATURE];
 }
 
 
@@ -1585,18 +1880,11 @@ bool CWallet::GetStakeWeight(const CKeyStore& keystore, uint64_t& nMinWeight, ui
     CTxDB txdb("r");
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
     {
-        CTxIndex txindex;
-        {
-            LOCK2(cs_main, cs_wallet);
-            if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-                continue;
-        }
-
-        CBlock blockTmp;
-        if (!blockTmp.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos))
+        CStakeKernelCandidate candidate;
+        if (!GetStakeCandidate(txdb, pcoin.first, pcoin.second, candidate))
             continue;
 
-        int64_t nTimeWeight = GetWeight((int64_t)blockTmp.nTime, (int64_t)GetTime());
+        int64_t nTimeWeight = GetWeight((int64_t)candidate.nBlockTime, (int64_t)GetTime());
         CBigNum bnCoinDayWeight = CBigNum(pcoin.first->vout[pcoin.second].nValue) * nTimeWeight / COIN / (24 * 60 * 60);
 
         // Weight is greater than zero
@@ -1621,6 +1909,94 @@ bool CWallet::GetStakeWeight(const CKeyStore& keystore, uint64_t& nMinWeight, ui
     return true;
 }
 
+// ppcoin: read the kernel data of one of our outputs from the transaction
+// index and block header; cs_main and cs_wallet are held by the caller
+bool CWallet::ReadStakeCandidate(CTxDB& txdb, const CWalletTx* pcoin, unsigned int nOut, CStakeKernelCandidate& candidateRet)
+{
+    CTxIndex txindex;
+    CBlock block;
+    if (!txdb.ReadTxIndex(pcoin->GetHash(), txindex))
+        return false;
+    if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
+        return false;
+
+    candidateRet.nValue = pcoin->vout[nOut].nValue;
+    candidateRet.hashBlock = block.GetHash();
+    candidateRet.nBlockTime = block.nTime;
+    candidateRet.nTxOffset = txindex.pos.nTxPos - txindex.pos.nBlockPos;
+    if (!GetKernelStakeModifier(candidateRet.hashBlock, candidateRet.nStakeModifier, candidateRet.pindexModifier))
+        candidateRet.pindexModifier = NULL;
+    return true;
+}
+
+// ppcoin: get the kernel data of one of our outputs from the candidate table;
+// an output the table doesn't have yet, such as one confirmed during the
+// initial download, is read from disk once and added
+bool CWallet::GetStakeCandidate(CTxDB& txdb, const CWalletTx* pcoin, unsigned int nOut, CStakeKernelCandidate& candidateRet)
+{
+    LOCK2(cs_main, cs_wallet);
+    COutPoint prevout(pcoin->GetHash(), nOut);
+    map<COutPoint, CStakeKernelCandidate>::iterator mi = mapStakeCandidates.find(prevout);
+    if (mi != mapStakeCandidates.end() && (*mi).second.hashBlock == pcoin->hashBlock)
+    {
+        candidateRet = (*mi).second;
+        return true;
+    }
+
+    if (!ReadStakeCandidate(txdb, pcoin, nOut, candidateRet))
+        return false;
+    mapStakeCandidates[prevout] = candidateRet;
+    return true;
+}
+
+// ppcoin: bring the candidate table up to date with a new best block: add
+// the outputs of transactions confirmed since, and resolve the stake
+// modifiers that were not available yet or whose block was disconnected
+void CWallet::UpdateStakeCandidates()
+{
+    LOCK2(cs_main, cs_wallet);
+    for (map<COutPoint, CStakeKernelCandidate>::iterator mi = mapStakeCandidates.begin(); mi != mapStakeCandidates.end(); ++mi)
+    {
+        CStakeKernelCandidate& candidate = (*mi).second;
+        if (candidate.pindexModifier && !candidate.pindexModifier->IsInMainChain())
+            candidate.pindexModifier = NULL;
+        if (!candidate.pindexModifier && !GetKernelStakeModifier(candidate.hashBlock, candidate.nStakeModifier, candidate.pindexModifier))
+            candidate.pindexModifier = NULL;
+    }
+
+    if (setStakeCandidatesPending.empty())
+        return;
+    CTxDB txdb("r");
+    set<uint256> setRetry;
+    BOOST_FOREACH(const uint256& hash, setStakeCandidatesPending)
+    {
+        map<uint256, CWalletTx>::iterator mi = mapWallet.find(hash);
+        if (mi == mapWallet.end() || (*mi).second.hashBlock == 0)
+            continue;
+        const CWalletTx& wtx = (*mi).second;
+        for (unsigned int i = 0; i < wtx.vout.size(); i++)
+        {
+            COutPoint prevout(hash, i);
+            if (wtx.IsSpent(i) || !IsMine(wtx.vout[i]) || mapStakeCandidates.count(prevout))
+                continue;
+            CStakeKernelCandidate candidate;
+            if (ReadStakeCandidate(txdb, &wtx, i, candidate))
+                mapStakeCandidates[prevout] = candidate;
+            else
+                setRetry.insert(hash);
+        }
+    }
+    setStakeCandidatesPending.swap(setRetry);
+}
+
+void CWallet::EraseStakeCandidates(const uint256& hashTx)
+{
+    LOCK(cs_wallet);
+    map<COutPoint, CStakeKernelCandidate>::iterator mi = mapStakeCandidates.lower_bound(COutPoint(hashTx, 0));
+    while (mi != mapStakeCandidates.end() && (*mi).first.hash == hashTx)
+        mapStakeCandidates.erase(mi++);
+}
+
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CTransaction& txNew, unsigned int& nTxTime, CKey& key)
 {
     CBlockIndex* pindexPrev = pindexBest;
@@ -1658,103 +2034,93 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     CTxDB txdb("r");
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
     {
-        CTxIndex txindex;
-        {
-            LOCK2(cs_main, cs_wallet);
-            if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-                continue;
-        }
-
-        // Read block header
-        CBlock block;
-        {
-            LOCK2(cs_main, cs_wallet);
-            if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
-                continue;
-        }
+        // Block time, tx offset and stake modifier come from the candidate table,
+        // only coins seen for the first time are read from disk
+        CStakeKernelCandidate candidate;
+        if (!GetStakeCandidate(txdb, pcoin.first, pcoin.second, candidate))
+            continue;
 
         static int nMaxStakeSearchInterval = 60;
-        if (block.GetBlockTime() + nStakeMinAge > nTxTime - nMaxStakeSearchInterval)
+        if (candidate.nBlockTime + nStakeMinAge > nTxTime - nMaxStakeSearchInterval)
             continue; // only count coins meeting min age requirement
 
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && !fShutdown && pindexPrev == pindexBest; n++)
-        {
-            // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            uint256 hashProofOfStake = 0, targetProofOfStake = 0;
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            if (CheckStakeKernelHash(nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, *pcoin.first, prevoutStake, nTxTime - n, hashProofOfStake, targetProofOfStake))
+        if (!candidate.pindexModifier)
+            continue; // stake modifier not yet available for this coin
+
+        // Search backward in time from the given txNew timestamp
+        // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+        int64_t nSearch = min(nSearchInterval, (int64_t)nMaxStakeSearchInterval);
+        uint256 hashProofOfStake = 0, targetProofOfStake = 0;
+        unsigned int nTimeKernel = 0;
+        COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
+        if (nSearch > 0 && !fShutdown && pindexPrev == pindexBest &&
+            ScanStakeKernelHash(nBits, candidate.nStakeModifier, candidate.nBlockTime, candidate.nTxOffset, prevoutStake, candidate.nValue, nTxTime, (unsigned int)nSearch, nTimeKernel, hashProofOfStake, targetProofOfStake))
+        {
+            // Found a kernel
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : kernel found\n");
+            vector<valtype> vSolutions;
+            txnouttype whichType;
+            CScript scriptPubKeyOut;
+            scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
+            if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
             {
-                // Found a kernel
                 if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
+                    printf("CreateCoinStake : failed to parse kernel\n");
+                continue;
+            }
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
+            if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+            {
                 if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+                    printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
+                continue;  // only support pay to public key and pay to address
+            }
+            if (whichType == TX_PUBKEYHASH) // pay to address type
+            {
+                // convert to pay to public key type
+                if (!keystore.GetKey(uint160(vSolutions[0]), key))
                 {
                     if (fDebug && GetBoolArg("-printcoinstake"))
-                        printf("CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
+                        printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                    continue;  // unable to find corresponding public key
                 }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
+                scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+            }
+            if (whichType == TX_PUBKEY)
+            {
+                valtype& vchPubKey = vSolutions[0];
+                if (!keystore.GetKey(Hash160(vchPubKey), key))
                 {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake"))
-                            printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+                    if (fDebug && GetBoolArg("-printcoinstake"))
+                        printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                    continue;  // unable to find corresponding public key
                 }
-                if (whichType == TX_PUBKEY)
-                {
-                    valtype& vchPubKey = vSolutions[0];
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
-                    {
-                        if (fDebug && GetBoolArg("-printcoinstake"))
-                            printf("CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-
                 if (key.GetPubKey() != vchPubKey)
                 {
                     if (fDebug && GetBoolArg("-printcoinstake"))
                         printf("CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
-
-                    scriptPubKeyOut = scriptPubKeyKernel;
+                    continue; // keys mismatch
                 }
+                scriptPubKeyOut = scriptPubKeyKernel;
+            }
 
-                nTxTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+            nTxTime = nTimeKernel;
+            txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
+            nCredit += pcoin.first->vout[pcoin.second].nValue;
+            vwtxPrev.push_back(pcoin.first);
+            txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
 
-                if (GetWeight(block.GetBlockTime(), (int64_t)nTxTime) < nStakeSplitAge)
-                    txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
-                if (fDebug && GetBoolArg("-printcoinstake"))
-                    printf("CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
-            }
+            if (GetWeight((int64_t)candidate.nBlockTime, (int64_t)nTxTime) < nStakeSplitAge)
+                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut)); //split stake
+            if (fDebug && GetBoolArg("-printcoinstake"))
+                printf("CreateCoinStake : added kernel type=%d\n", whichType);
+            break; // if kernel is found stop searching
         }
 
-        if (fKernelFound || fShutdown)
-            break; // if kernel is found stop searching
+        if (fShutdown)
+            break;
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
@@ -1767,18 +2133,11 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
         if (txNew.vout.size() == 2 && ((pcoin.first->vout[pcoin.second].scriptPubKey == scriptPubKeyKernel || pcoin.first->vout[pcoin.second].scriptPubKey == txNew.vout[1].scriptPubKey))
             && pcoin.first->GetHash() != txNew.vin[0].prevout.hash)
         {
-            CTxIndex txindex;
-            {
-                LOCK2(cs_main, cs_wallet);
-                if (!txdb.ReadTxIndex(pcoin.first->GetHash(), txindex))
-                    continue;
-            }
-
-            CBlock blockTmp;
-            if (!blockTmp.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos))
+            CStakeKernelCandidate candidate;
+            if (!GetStakeCandidate(txdb, pcoin.first, pcoin.second, candidate))
                 continue;
 
-            int64_t nTimeWeight = GetWeight((int64_t)blockTmp.nTime, (int64_t)nTxTime);
+            int64_t nTimeWeight = GetWeight((int64_t)candidate.nBlockTime, (int64_t)nTxTime);
 
             // Stop adding more inputs if already too many inputs
             if (txNew.vin.size() >= 100)
@@ -1871,6 +2230,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 coin.BindWallet(this);
                 coin.MarkSpent(txin.prevout.n);
                 coin.WriteToDisk();
+                WalletTxChanged(txin.prevout.hash);
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
@@ -2365,6 +2725,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkUnspent(n);
                     pcoin->WriteToDisk();
+                    WalletTxChanged(pcoin->GetHash());
                 }
             }
             else if (IsMine(pcoin->vout[n]) && !pcoin->IsSpent(n) && (txindex.vSpent.size() > n && !txindex.vSpent[n].IsNull()))
@@ -2377,6 +2738,7 @@ void CWallet::FixSpentCoins(int& nMismatchFound, int64_t& nBalanceInQuestion, bo
                 {
                     pcoin->MarkSpent(n);
                     pcoin->WriteToDisk();
+                    WalletTxChanged(pcoin->GetHash());
                 }
             }
         }
@@ -2400,6 +2762,7 @@ void CWallet::DisableTransaction(const CTransaction &tx)
             {
                 prev.MarkUnspent(txin.prevout.n);
                 prev.WriteToDisk();
+                WalletTxChanged(txin.prevout.hash);
             }
         }
     }
@@ -2501,7 +2864,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;
@@ -75,6 +75,40 @@ public:
     )
 };
 
+/** Everything CreateCoinStake needs to hash a kernel for one of our outputs,
+ * resolved once from the block files and the block index.
+ */
+class CStakeKernelCandidate
+{
+public:
+    int64_t nValue;
+    uint256 hashBlock;
+    unsigned int nBlockTime;
+    unsigned int nTxOffset;
+    uint64_t nStakeModifier;
+    const CBlockIndex* pindexModifier; // NULL until the modifier is known
+
+    CStakeKernelCandidate()
+    {
+        nValue = 0;
+        hashBlock = 0;
+        nBlockTime = 0;
+        nTxOffset = 0;
+        nStakeModifier = 0;
+        pindexModifier = NULL;
+    }
+};
+
+/** Balance totals a wallet keeps, see CWallet::UpdateBalance */
+enum WalletBalanceType
+{
+    BALANCE_TRUSTED,        // spendable credit of trusted transactions
+    BALANCE_UNCONFIRMED,    // credit of unconfirmed or non-final transactions
+    BALANCE_IMMATURE,       // immature coinbase credit
+    BALANCE_STAKE,          // immature coinstake credit
+    BALANCE_TYPES
+};
+
 /** A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
  */
@@ -86,6 +120,50 @@ private:
 
     CWalletDB *pwalletdbEncryption;
 
+    // ppcoin: stake kernel candidates by outpoint, kept up to date by
+    // AddToWallet and UpdateStakeCandidates; protected by cs_wallet, and
+    // their block index pointers by cs_main
+    std::map<COutPoint, CStakeKernelCandidate> mapStakeCandidates;
+    std::set<uint256> setStakeCandidatesPending;    // confirmed transactions not in the table yet
+    bool ReadStakeCandidate(CTxDB& txdb, const CWalletTx* pcoin, unsigned int nOut, CStakeKernelCandidate& candidateRet);
+    bool GetStakeCandidate(CTxDB& txdb, const CWalletTx* pcoin, unsigned int nOut, CStakeKernelCandidate& candidateRet);
+    void EraseStakeCandidates(const uint256& hashTx);
+
+    // What each transaction adds to the balance totals, so that balance
+    // queries need not walk mapWallet; protected by cs_wallet
+    struct CBalanceEntry
+    {
+        int64_t vAmount[BALANCE_TYPES];
+    };
+    mutable std::map<uint256, CBalanceEntry> mapBalanceEntries;
+    // transactions whose bucket can change as the chain grows
+    mutable std::set<uint256> setBalancePending;
+    mutable int64_t vBalanceTotal[BALANCE_TYPES];
+    // tip the pending transactions were last evaluated at
+    mutable const CBlockIndex* pindexBalanceTip;
+    mutable bool fBalanceDirty;
+    void UpdateBalance(const uint256& hash) const;
+    void SyncBalances() const;
+
+    // Our unspent outputs, so that AvailableCoins need not walk every
+    // output of every transaction testing IsSpent and IsMine; protected by
+    // cs_wallet
+    mutable std::set<COutPoint> setWalletUnspent;
+    mutable bool fUnspentDirty;
+    void UpdateUnspent(const uint256& hash) const;
+    void SyncUnspent() const;
+    bool IsAvailable(const CWalletTx* pcoin, bool fOnlyConfirmed, bool fOnlyMature, int nConf, int& nDepthRet) const;
+
+    void GetScanScripts(std::set<CScript>& setScriptsRet) const;
+
+    // Bring the balance totals and the unspent outputs up to date after a
+    // transaction was added, erased or had outputs spent
+    void WalletTxChanged(const uint256& hash)
+    {
+        UpdateBalance(hash);
+        UpdateUnspent(hash);
+    }
+
     // the current wallet version: clients below this version are not able to load the wallet
     int nWalletVersion;
 
@@ -124,6 +202,7 @@ public:
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
         nOrderPosNext = 0;
+        InitBalances();
     }
     CWallet(std::string strWalletFileIn)
     {
@@ -142,6 +221,16 @@ public:
         strStakeForCharityAddress = "";
         strStakeForCharityChangeAddress = "";
         nReserveBalance = 0;
+        InitBalances();
+    }
+
+    void InitBalances()
+    {
+        for (int i = 0; i < BALANCE_TYPES; i++)
+            vBalanceTotal[i] = 0;
+        pindexBalanceTip = NULL;
+        fBalanceDirty = true;
+        fUnspentDirty = true;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -307,6 +396,7 @@ public:
         return nChange;
     }
     void SetBestChain(const CBlockLocator& loc);
+    void UpdateStakeCandidates();
 
     DBErrors LoadWallet(bool& fFirstRunRet);
 